@@ -5,6 +5,7 @@
 #include <bench/bench.h>
 
 #include <crypto/sha256.h>
+#include <crypto/x13sm3.h>
 #include <key.h>
 #include <random.h>
 #include <util/system.h>
@@ -65,6 +66,7 @@ int main(int argc, char** argv)
     const fs::path bench_datadir{SetDataDir()};
 
     SHA256AutoDetect();
+    X13SM3AutoDetect();
     RandomInit();
     ECC_Start();
     SetupEnvironment();
@@ -4,53 +4,333 @@
 
 #include <bench/bench.h>
 
+#include <blockpipeline.h>
 #include <chainparams.h>
-#include <validation.h>
-#include <streams.h>
+#include <coins.h>
+#include <consensus/merkle.h>
 #include <consensus/validation.h>
+#include <pow.h>
+#include <scheduler.h>
+#include <script/script.h>
+#include <streams.h>
+#include <txdb.h>
+#include <validation.h>
+#include <validationinterface.h>
+
+#include <boost/thread.hpp>
+
+#include <vector>
+
+// These are the major time-sinks which happen after we have fully received
+// a block off the wire, before we can relay it on to peers using compact
+// block relay, and when it is finally connected to the chain.
+//
+// The corpus consists of post-fork blocks: an X13-SM3 header with the
+// VERSIONBITS_FORK_BCD bit and version 12 transactions committing to a
+// preBlockHash. Blocks are built on top of the regtest tip and spend a
+// synthetic UTXO set that is added directly to the coins cache.
+//
+// The sync benches replay a recorded chain of such blocks on a fresh
+// chainstate, served the way a peer would during initial block download.
 
 namespace block_bench {
-#include <bench/data/block413567.raw.h>
-} // namespace block_bench
 
-// These are the two major time-sinks which happen after we have fully received
-// a block off the wire, but before we can relay the block on to peers using
-// compact block relay.
+/** Number of transactions in each corpus block, small to close to full. */
+static const size_t CORPUS_BLOCK_TXS[] = {10, 500, 3000};
 
-static void DeserializeBlockTest(benchmark::State& state)
+/** Length of the recorded chain, and transactions in each of its blocks. */
+static const size_t SYNC_CHAIN_BLOCKS = 64;
+static const size_t SYNC_BLOCK_TXS = 250;
+/** Blocks arrive in windows of this many, last block first, as parallel download delivers them out of order. */
+static const size_t SYNC_WINDOW = 16;
+
+/** Dummy signature pushed by every input, so inputs are as large as a real P2WSH spend. */
+static const std::vector<unsigned char> DUMMY_SIG(72, 0x30);
+
+static CScript WitnessScript()
+{
+    return CScript() << OP_DROP << OP_TRUE;
+}
+
+static CScript ScriptPubKey()
+{
+    const CScript witness_script = WitnessScript();
+    uint256 program;
+    CSHA256().Write(witness_script.data(), witness_script.size()).Finalize(program.begin());
+    return CScript() << OP_0 << std::vector<unsigned char>(program.begin(), program.end());
+}
+
+/** Runs validation interface callbacks in the background while in scope. */
+class BackgroundCallbacks
+{
+public:
+    BackgroundCallbacks()
+    {
+        thread_group.create_thread(boost::bind(&CScheduler::serviceQueue, &scheduler));
+        GetMainSignals().RegisterBackgroundSignalScheduler(scheduler);
+    }
+
+    ~BackgroundCallbacks()
+    {
+        thread_group.interrupt_all();
+        thread_group.join_all();
+        GetMainSignals().FlushBackgroundCallbacks();
+        GetMainSignals().UnregisterBackgroundSignalScheduler();
+    }
+
+private:
+    boost::thread_group thread_group;
+    CScheduler scheduler;
+};
+
+/** Replace the chainstate by a fresh regtest one holding only the genesis block. */
+static void SetupChainState()
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    InitScriptExecutionCache();
+
+    {
+        LOCK(cs_main);
+        UnloadBlockIndex();
+        ::pblocktree.reset(new CBlockTreeDB(1 << 20, true));
+        ::pcoinsdbview.reset(new CCoinsViewDB(1 << 23, true));
+        ::pcoinsTip.reset(new CCoinsViewCache(pcoinsdbview.get()));
+    }
+    {
+        BackgroundCallbacks callbacks;
+        const CChainParams& chainparams = Params();
+        assert(LoadGenesisBlock(chainparams));
+        CValidationState state;
+        assert(ActivateBestChain(state, chainparams));
+        assert(::chainActive.Tip() != nullptr);
+    }
+}
+
+/**
+ * Create a BCD block on top of the current tip with num_txs transactions, adding the coins they spend to pcoinsTip.
+ * If coins is set, these coins are also appended to it.
+ */
+static CBlock CreateBlock(size_t num_txs, uint32_t salt, std::vector<std::pair<COutPoint, Coin>>* coins = nullptr)
+{
+    LOCK(cs_main);
+    const Consensus::Params& params = Params().GetConsensus();
+    const CBlockIndex* tip = ::chainActive.Tip();
+    const int height = tip->nHeight + 1;
+    assert(height >= params.BCDHeight);
+    const CScript script_pub_key = ScriptPubKey();
+    const CScript witness_script = WitnessScript();
+
+    CBlock block;
+    block.nVersion = ComputeBlockVersion(tip, params);
+    block.hashPrevBlock = tip->GetBlockHash();
+    block.nTime = tip->GetMedianTimePast() + 1;
+    block.nBits = GetNextWorkRequired(tip, &block, params);
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vin[0].scriptSig = CScript() << height << salt;
+    coinbase.vout.emplace_back(GetBlockSubsidy(height, params), script_pub_key);
+    block.vtx.push_back(MakeTransactionRef(std::move(coinbase)));
+
+    for (size_t i = 1; i < num_txs; ++i) {
+        CMutableTransaction tx;
+        tx.nVersion = CTransaction::CURRENT_VERSION_FORK;
+        tx.preBlockHash = tip->GetBlockHash();
+        // Mix one to three inputs per transaction, each spending a fresh synthetic coin.
+        for (size_t j = 0; j < 1 + i % 3; ++j) {
+            CHashWriter ss(SER_GETHASH, 0);
+            ss << salt << (uint64_t)i << (uint64_t)j;
+            const COutPoint prevout(ss.GetHash(), j);
+            const Coin coin(CTxOut(2 * COIN, script_pub_key), tip->nHeight, false);
+            if (coins) coins->emplace_back(prevout, coin);
+            ::pcoinsTip->AddCoin(prevout, Coin(coin), false);
+            tx.vin.emplace_back(prevout);
+            tx.vin.back().scriptWitness.stack.push_back(DUMMY_SIG);
+            tx.vin.back().scriptWitness.stack.emplace_back(witness_script.begin(), witness_script.end());
+        }
+        tx.vout.emplace_back(COIN, script_pub_key);
+        tx.vout.emplace_back(tx.vin.size() * 2 * COIN - COIN - 1000, script_pub_key);
+        block.vtx.push_back(MakeTransactionRef(std::move(tx)));
+    }
+
+    GenerateCoinbaseCommitment(block, tip, params);
+    block.hashMerkleRoot = BlockMerkleRoot(block);
+    while (!CheckProofOfWork(block.GetPoWHash(true), block.nBits, params)) {
+        ++block.nNonce;
+    }
+    return block;
+}
+
+/** Build the corpus once per benchmark on a fresh chainstate. */
+static std::vector<CBlock> CreateCorpus()
+{
+    SetupChainState();
+    std::vector<CBlock> corpus;
+    for (size_t num_txs : CORPUS_BLOCK_TXS) {
+        corpus.push_back(CreateBlock(num_txs, corpus.size()));
+    }
+    return corpus;
+}
+
+static uint256 TipHash()
+{
+    LOCK(cs_main);
+    return ::chainActive.Tip()->GetBlockHash();
+}
+
+/** A chain of blocks as served by a peer, and the synthetic coins they spend. */
+struct RecordedChain {
+    std::vector<CBlockHeader> headers;
+    std::vector<std::vector<unsigned char>> blocks;
+    std::vector<std::pair<COutPoint, Coin>> coins;
+};
+
+/** Mine and connect SYNC_CHAIN_BLOCKS blocks on a fresh chainstate, recording them. */
+static RecordedChain RecordChain()
+{
+    SetupChainState();
+    BackgroundCallbacks callbacks;
+    RecordedChain chain;
+    for (size_t i = 0; i < SYNC_CHAIN_BLOCKS; ++i) {
+        std::shared_ptr<const CBlock> block = std::make_shared<const CBlock>(CreateBlock(SYNC_BLOCK_TXS, i, &chain.coins));
+        assert(ProcessNewBlock(Params(), block, true, nullptr));
+        assert(TipHash() == block->GetHash());
+        chain.headers.push_back(block->GetBlockHeader());
+        chain.blocks.emplace_back();
+        CVectorWriter(SER_NETWORK, PROTOCOL_VERSION, chain.blocks.back(), 0) << *block;
+    }
+    return chain;
+}
+
+/**
+ * Sync a recorded chain on a fresh chainstate holding its coins. Like a peer
+ * during initial block download, the chain is served headers first, then in
+ * windows of blocks that arrive out of order.
+ */
+static void SyncChain(const RecordedChain& chain, bool pipelined)
+{
+    SetupChainState();
+    {
+        LOCK(cs_main);
+        for (const auto& coin : chain.coins) {
+            ::pcoinsTip->AddCoin(coin.first, Coin(coin.second), false);
+        }
+    }
+    if (pipelined) {
+        g_block_writer.Start();
+        g_block_prefetcher.Start();
+    }
+
+    {
+        BackgroundCallbacks callbacks;
+        CValidationState state;
+        assert(ProcessNewBlockHeaders(chain.headers, state, Params()));
+        for (size_t start = 0; start < chain.blocks.size(); start += SYNC_WINDOW) {
+            for (size_t i = std::min(start + SYNC_WINDOW, chain.blocks.size()); i-- > start;) {
+                std::shared_ptr<CBlock> block = std::make_shared<CBlock>();
+                CDataStream(chain.blocks[i], SER_NETWORK, PROTOCOL_VERSION) >> *block;
+                assert(ProcessNewBlock(Params(), block, true, nullptr));
+            }
+        }
+        assert(TipHash() == chain.headers.back().GetHash());
+    }
+
+    if (pipelined) {
+        g_block_prefetcher.Stop();
+        g_block_writer.Stop();
+    }
+}
+
+static CDataStream SerializeCorpus(const std::vector<CBlock>& corpus)
 {
-    CDataStream stream((const char*)block_bench::block413567,
-            (const char*)&block_bench::block413567[sizeof(block_bench::block413567)],
-            SER_NETWORK, PROTOCOL_VERSION);
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    for (const CBlock& block : corpus) {
+        stream << block;
+    }
     char a = '\0';
     stream.write(&a, 1); // Prevent compaction
+    return stream;
+}
+
+} // namespace block_bench
+
+static void DeserializeBlockTest(benchmark::State& state)
+{
+    const std::vector<CBlock> corpus = block_bench::CreateCorpus();
+    CDataStream stream = block_bench::SerializeCorpus(corpus);
+    const size_t corpus_size = stream.size() - 1;
 
     while (state.KeepRunning()) {
-        CBlock block;
-        stream >> block;
-        assert(stream.Rewind(sizeof(block_bench::block413567)));
+        for (size_t i = 0; i < corpus.size(); ++i) {
+            CBlock block;
+            stream >> block;
+        }
+        assert(stream.Rewind(corpus_size));
     }
 }
 
 static void DeserializeAndCheckBlockTest(benchmark::State& state)
 {
-    CDataStream stream((const char*)block_bench::block413567,
-            (const char*)&block_bench::block413567[sizeof(block_bench::block413567)],
-            SER_NETWORK, PROTOCOL_VERSION);
-    char a = '\0';
-    stream.write(&a, 1); // Prevent compaction
+    const std::vector<CBlock> corpus = block_bench::CreateCorpus();
+    CDataStream stream = block_bench::SerializeCorpus(corpus);
+    const size_t corpus_size = stream.size() - 1;
+    const Consensus::Params& params = Params().GetConsensus();
 
-    const auto chainParams = CreateChainParams(CBaseChainParams::MAIN);
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < corpus.size(); ++i) {
+            CBlock block; // Note that CBlock caches its checked state, so we need to recreate it here
+            stream >> block;
+
+            CValidationState validationState;
+            assert(CheckBlock(block, validationState, params));
+        }
+        assert(stream.Rewind(corpus_size));
+    }
+}
+
+static void CheckBlockProofOfWorkTest(benchmark::State& state)
+{
+    const std::vector<CBlock> corpus = block_bench::CreateCorpus();
+    const Consensus::Params& params = Params().GetConsensus();
 
     while (state.KeepRunning()) {
-        CBlock block; // Note that CBlock caches its checked state, so we need to recreate it here
-        stream >> block;
-        assert(stream.Rewind(sizeof(block_bench::block413567)));
+        for (const CBlock& block : corpus) {
+            assert(CheckProofOfWork(block.GetPoWHash(true), block.nBits, params));
+        }
+    }
+}
 
-        CValidationState validationState;
-        assert(CheckBlock(block, validationState, chainParams->GetConsensus()));
+static void ConnectBlockTest(benchmark::State& state)
+{
+    const std::vector<CBlock> corpus = block_bench::CreateCorpus();
+
+    LOCK(cs_main);
+    while (state.KeepRunning()) {
+        for (const CBlock& block : corpus) {
+            // Connects against a throwaway view on top of pcoinsTip, so the
+            // synthetic coins stay unspent for the next iteration.
+            CValidationState validationState;
+            assert(TestBlockValidity(validationState, Params(), block, ::chainActive.Tip()));
+        }
+    }
+}
+
+static void BlockSync(benchmark::State& state, bool pipelined)
+{
+    const block_bench::RecordedChain chain = block_bench::RecordChain();
+
+    while (state.KeepRunning()) {
+        block_bench::SyncChain(chain, pipelined);
     }
 }
 
-BENCHMARK(DeserializeBlockTest, 130);
-BENCHMARK(DeserializeAndCheckBlockTest, 160);
+static void BlockSyncTest(benchmark::State& state) { BlockSync(state, false); }
+static void BlockSyncPipelinedTest(benchmark::State& state) { BlockSync(state, true); }
+
+BENCHMARK(DeserializeBlockTest, 60);
+BENCHMARK(DeserializeAndCheckBlockTest, 40);
+BENCHMARK(CheckBlockProofOfWorkTest, 30000);
+BENCHMARK(ConnectBlockTest, 10);
+BENCHMARK(BlockSyncTest, 1);
+BENCHMARK(BlockSyncPipelinedTest, 1);
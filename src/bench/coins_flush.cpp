@@ -0,0 +1,79 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+
+#include <arith_uint256.h>
+#include <chainparams.h>
+#include <coins.h>
+#include <txdb.h>
+
+// Connecting blocks on a coins cache that is written to the database every
+// few blocks. Each block spends coins created a few flushes earlier, which a
+// cache that is emptied by every flush has to read back from the database,
+// and some old coins that are only in the database.
+
+static const int FLUSH_INITIAL_COINS = 100000;
+static const int FLUSH_BLOCK_COINS = 1000;
+static const int FLUSH_BLOCK_OLD_COINS = 100;
+static const int FLUSH_INTERVAL = 10;
+static const int FLUSH_SPEND_DEPTH = 25;
+static const size_t FLUSH_CACHE_USAGE = 4 << 20;
+
+static COutPoint FlushOutPoint(uint32_t id)
+{
+    return COutPoint(ArithToUint256(arith_uint256(id)), 0);
+}
+
+static Coin FlushCoin()
+{
+    CTxOut out(10 * COIN, CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 0x42) << OP_EQUALVERIFY << OP_CHECKSIG);
+    return Coin(std::move(out), 1, false);
+}
+
+static void CoinsCacheFlush(benchmark::State& state, bool sync)
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    CCoinsViewDB db(1 << 23, true);
+    CCoinsViewCache tip(&db);
+    for (int id = 0; id < FLUSH_INITIAL_COINS; ++id) {
+        tip.AddCoin(FlushOutPoint(id), FlushCoin(), false);
+    }
+    tip.SetBestBlock(ArithToUint256(arith_uint256(1)));
+    assert(tip.Flush());
+
+    int block = 0;
+    while (state.KeepRunning()) {
+        CCoinsViewCache view(&tip);
+        for (int i = 0; i < FLUSH_BLOCK_OLD_COINS; ++i) {
+            assert(view.SpendCoin(FlushOutPoint(block * FLUSH_BLOCK_OLD_COINS + i)));
+        }
+        if (block >= FLUSH_SPEND_DEPTH) {
+            for (int i = 0; i < FLUSH_BLOCK_COINS; ++i) {
+                assert(view.SpendCoin(FlushOutPoint(FLUSH_INITIAL_COINS + (block - FLUSH_SPEND_DEPTH) * FLUSH_BLOCK_COINS + i)));
+            }
+        }
+        for (int i = 0; i < FLUSH_BLOCK_COINS; ++i) {
+            view.AddCoin(FlushOutPoint(FLUSH_INITIAL_COINS + block * FLUSH_BLOCK_COINS + i), FlushCoin(), false);
+        }
+        ++block;
+        view.SetBestBlock(ArithToUint256(arith_uint256(block + 1)));
+        assert(view.Flush());
+
+        if (block % FLUSH_INTERVAL == 0) {
+            if (sync) {
+                assert(tip.Sync());
+                tip.Trim(FLUSH_CACHE_USAGE);
+            } else {
+                assert(tip.Flush());
+            }
+        }
+    }
+}
+
+static void CoinsCacheFlushClear(benchmark::State& state) { CoinsCacheFlush(state, false); }
+static void CoinsCacheFlushSync(benchmark::State& state) { CoinsCacheFlush(state, true); }
+
+BENCHMARK(CoinsCacheFlushClear, 100);
+BENCHMARK(CoinsCacheFlushSync, 100);
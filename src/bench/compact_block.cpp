@@ -0,0 +1,111 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+
+#include <blockencodings.h>
+#include <chainparams.h>
+#include <consensus/merkle.h>
+#include <net.h>
+#include <netmessagemaker.h>
+#include <policy/policy.h>
+#include <primitives/block.h>
+#include <txmempool.h>
+
+#include <memory>
+#include <vector>
+
+// Latency of reconstructing a compact block from a large mempool, the work
+// done between receiving a cmpctblock message and being able to validate
+// and relay the block. The block holds the transactions a miner would pick
+// from the same mempool, optionally with one we have never seen.
+
+static const int RECONSTRUCT_MEMPOOL_TXS = 50000;
+static const int RECONSTRUCT_BLOCK_TXS = 2500;
+
+static CTransactionRef MakeTx(uint32_t n)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.n = n;
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    tx.vout[0].nValue = 10 * COIN;
+    return MakeTransactionRef(tx);
+}
+
+static void CompactBlockReconstruct(benchmark::State& state, bool missing_tx)
+{
+    CTxMemPool pool;
+    CBlock block;
+    block.nBits = 0x207fffff;
+    block.vtx.push_back(MakeTx(RECONSTRUCT_MEMPOOL_TXS));
+    {
+        LOCK(pool.cs);
+        for (int i = 0; i < RECONSTRUCT_MEMPOOL_TXS; ++i) {
+            CTransactionRef tx = MakeTx(i);
+            LockPoints lp;
+            pool.addUnchecked(tx->GetHash(), CTxMemPoolEntry(tx, 1000 + (i * 7919) % 100000, 0, 1, false, 4, lp));
+        }
+        for (auto it = pool.mapTx.get<ancestor_score>().begin(); block.vtx.size() < RECONSTRUCT_BLOCK_TXS; ++it) {
+            block.vtx.push_back(it->GetSharedTx());
+        }
+    }
+    if (missing_tx) {
+        block.vtx.back() = MakeTx(RECONSTRUCT_MEMPOOL_TXS + 1);
+    }
+    block.hashMerkleRoot = BlockMerkleRoot(block);
+
+    const CBlockHeaderAndShortTxIDs cmpctblock(block, true);
+    const std::vector<std::pair<uint256, CTransactionRef>> extra_txn;
+    while (state.KeepRunning()) {
+        PartiallyDownloadedBlock partial_block(&pool);
+        assert(partial_block.InitData(cmpctblock, extra_txn) == READ_STATUS_OK);
+        assert(partial_block.IsTxAvailable(1));
+        assert(partial_block.IsTxAvailable(RECONSTRUCT_BLOCK_TXS - 1) != missing_tx);
+    }
+}
+
+static void CompactBlockReconstructFromMempool(benchmark::State& state) { CompactBlockReconstruct(state, false); }
+static void CompactBlockReconstructMissingTx(benchmark::State& state) { CompactBlockReconstruct(state, true); }
+
+// Announcing a new block to 100 high-bandwidth peers: the cmpctblock message
+// is serialized once and the same buffer is queued at every peer.
+
+static const int ANNOUNCE_PEERS = 100;
+
+static void CompactBlockAnnounce(benchmark::State& state)
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    CBlock block;
+    for (int i = 0; i < RECONSTRUCT_BLOCK_TXS; ++i) {
+        block.vtx.push_back(MakeTx(i));
+    }
+    block.hashMerkleRoot = BlockMerkleRoot(block);
+
+    CConnman connman(0x1337, 0x1337);
+    std::vector<std::unique_ptr<CNode>> nodes;
+    for (int i = 0; i < ANNOUNCE_PEERS; ++i) {
+        nodes.emplace_back(new CNode(i, NODE_NETWORK, 0, INVALID_SOCKET, CAddress(), 0, 0, CAddress(), "", false));
+    }
+
+    while (state.KeepRunning()) {
+        const CBlockHeaderAndShortTxIDs cmpctblock(block, true);
+        const CSharedNetMsg msg = CConnman::MakeSharedMessage(CNetMsgMaker(PROTOCOL_VERSION).Make(NetMsgType::CMPCTBLOCK, cmpctblock));
+        for (const auto& node : nodes) {
+            connman.PushMessage(node.get(), msg);
+        }
+        for (const auto& node : nodes) {
+            LOCK(node->cs_vSend);
+            assert(node->vSendMsg.size() == 1);
+            node->vSendMsg.clear();
+            node->nSendSize = 0;
+        }
+    }
+}
+
+BENCHMARK(CompactBlockReconstructFromMempool, 500);
+BENCHMARK(CompactBlockReconstructMissingTx, 100);
+BENCHMARK(CompactBlockAnnounce, 500);
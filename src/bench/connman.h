@@ -0,0 +1,160 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BENCH_CONNMAN_H
+#define BITCOIN_BENCH_CONNMAN_H
+
+#include <chainparams.h>
+#include <hash.h>
+#include <net.h>
+#include <protocol.h>
+#include <streams.h>
+
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+/** A CConnman whose peers are added by the benchmark rather than connected. */
+struct CConnmanBench {
+    CConnman connman;
+    std::vector<CNode*> nodes;
+    std::vector<int> remotes;
+
+    CConnmanBench() : connman(0x1337, 0x1337)
+    {
+        connman.nReceiveFloodSize = 1000 * DEFAULT_MAXRECEIVEBUFFER;
+        connman.nSendBufferMaxSize = 1000 * DEFAULT_MAXSENDBUFFER;
+    }
+
+    ~CConnmanBench()
+    {
+        {
+            LOCK(connman.cs_vNodes);
+            connman.vNodes.clear();
+        }
+        for (CNode* node : nodes) delete node;
+#ifndef WIN32
+        for (int fd : remotes) close(fd);
+#endif
+    }
+
+    /** Add an inbound peer without a socket: whatever is sent to it stays queued. */
+    CNode* AddNode()
+    {
+        return AddNodeWithSocket(INVALID_SOCKET);
+    }
+
+    /** A message as sent on the wire. */
+    static std::vector<unsigned char> MessageBytes(const CSerializedNetMsg& msg)
+    {
+        CMessageHeader hdr(Params().MessageStart(), msg.command.c_str(), msg.data.size());
+        uint256 hash = Hash(msg.data.data(), msg.data.data() + msg.data.size());
+        memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+
+        std::vector<unsigned char> bytes;
+        CVectorWriter(SER_NETWORK, INIT_PROTO_VERSION, bytes, 0) << hdr;
+        bytes.insert(bytes.end(), msg.data.begin(), msg.data.end());
+        return bytes;
+    }
+
+    /** Queue a message at a peer and wake its message handler, as the socket handler does. */
+    void ReceiveMessage(CNode* node, const std::vector<unsigned char>& bytes)
+    {
+        bool complete = false;
+        bool fValid = node->ReceiveMsgBytes((const char*)bytes.data(), bytes.size(), complete);
+        assert(fValid && complete);
+        {
+            LOCK(node->cs_vProcessMsg);
+            node->nProcessQueueSize += node->vRecvMsg.back().vRecv.size() + CMessageHeader::HEADER_SIZE;
+            node->vProcessMsg.splice(node->vProcessMsg.end(), node->vRecvMsg);
+        }
+        connman.WakeMessageHandler(node);
+    }
+
+    /** Whether bytes of command messages were queued for node. If so, drop its send queue. */
+    static bool TakeSent(CNode* node, const std::string& command, size_t bytes)
+    {
+        LOCK(node->cs_vSend);
+        uint64_t& sent = node->mapSendBytesPerMsgCmd[command];
+        if (sent < bytes) return false;
+        assert(sent == bytes);
+        sent = 0;
+        node->vSendMsg.clear();
+        node->nSendSize = 0;
+        return true;
+    }
+
+    /** Process the peers' messages on nThreads message handler threads, as CConnman::Start does. */
+    void StartMessageHandlers(NetEventsInterface* msgproc, int nThreads)
+    {
+        connman.m_msgproc = msgproc;
+        connman.nMessageHandlerThreads = nThreads;
+        connman.flagInterruptMsgProc = false;
+        {
+            std::unique_lock<std::mutex> lock(connman.mutexMsgProc);
+            connman.vMessageHandlers.clear();
+            for (int i = 0; i < nThreads; i++) {
+                connman.vMessageHandlers.emplace_back(new CConnman::MessageHandlerWorker());
+            }
+        }
+        for (int i = 0; i < nThreads; i++) {
+            connman.vMessageHandlers[i]->thread = std::thread(&CConnman::ThreadMessageHandler, &connman, i);
+        }
+    }
+
+    void StopMessageHandlers()
+    {
+        {
+            std::unique_lock<std::mutex> lock(connman.mutexMsgProc);
+            connman.flagInterruptMsgProc = true;
+            for (const auto& worker : connman.vMessageHandlers) {
+                worker->cond.notify_all();
+            }
+        }
+        for (const auto& worker : connman.vMessageHandlers) {
+            worker->thread.join();
+        }
+    }
+
+#ifndef WIN32
+    void SetSocketEventsMode(SocketEventsMode mode)
+    {
+        connman.socketEventsMode = mode;
+#ifdef USE_EPOLL
+        if (mode == SocketEventsMode::EPOLL) assert(connman.InitEpoll());
+#endif
+    }
+
+    /** Add an inbound peer on one end of a socket pair. The other end is kept in remotes. */
+    CNode* AddSocketNode()
+    {
+        int fds[2];
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        remotes.push_back(fds[1]);
+        CNode* node = AddNodeWithSocket(fds[0]);
+        connman.RegisterSocketEvents(node);
+        return node;
+    }
+
+    void SocketHandler() { connman.SocketHandler(); }
+#endif
+
+private:
+    CNode* AddNodeWithSocket(SOCKET hSocket)
+    {
+        CNode* node = new CNode(nodes.size(), NODE_NETWORK, 0, hSocket, CAddress(), 0, 0, CAddress(), "", true);
+        nodes.push_back(node);
+        LOCK(connman.cs_vNodes);
+        connman.vNodes.push_back(node);
+        return node;
+    }
+};
+
+#endif // BITCOIN_BENCH_CONNMAN_H
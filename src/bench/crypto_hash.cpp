@@ -5,15 +5,36 @@
 #include <iostream>
 
 #include <bench/bench.h>
+#include <arith_uint256.h>
 #include <bloom.h>
+#include <chainparams.h>
 #include <hash.h>
+#include <pow.h>
+#include <primitives/block.h>
 #include <random.h>
+#include <streams.h>
 #include <uint256.h>
 #include <util/time.h>
+#include <version.h>
+#include <versionbits.h>
 #include <crypto/ripemd160.h>
 #include <crypto/sha1.h>
 #include <crypto/sha256.h>
 #include <crypto/sha512.h>
+#include <crypto/x13sm3.h>
+#include <crypto/x13hash/sph_blake.h>
+#include <crypto/x13hash/sph_bmw.h>
+#include <crypto/x13hash/sph_groestl.h>
+#include <crypto/x13hash/sph_jh.h>
+#include <crypto/x13hash/sph_keccak.h>
+#include <crypto/x13hash/sph_skein.h>
+#include <crypto/x13hash/sph_cubehash.h>
+#include <crypto/x13hash/sph_shavite.h>
+#include <crypto/x13hash/sph_simd.h>
+#include <crypto/x13hash/sph_echo.h>
+#include <crypto/x13hash/sph_hamsi.h>
+#include <crypto/x13hash/sph_fugue.h>
+#include <crypto/x13hash/sph_sm3.h>
 
 /* Number of bytes to hash per iteration */
 static const uint64_t BUFFER_SIZE = 1000*1000;
@@ -60,6 +81,106 @@ static void SHA256D64_1024(benchmark::State& state)
     }
 }
 
+static void X13SM3_80b(benchmark::State& state)
+{
+    std::vector<uint8_t> in(80,0);
+    while (state.KeepRunning()) {
+        uint256 hash = HashX13sm3(in.begin(), in.end());
+        memcpy(in.data(), hash.begin(), hash.size());
+    }
+}
+
+static void X13SM3_80_1024(benchmark::State& state)
+{
+    std::vector<uint8_t> in(80 * 1024, 0);
+    std::vector<uint8_t> out(32 * 1024);
+    while (state.KeepRunning()) {
+        X13SM3_80(out.data(), in.data(), 1024);
+    }
+}
+
+/* Hash a single 64-byte chaining value (80 bytes for BLAKE) with one X13-SM3 stage. */
+template <typename Ctx, void (*Init)(void*), void (*Write)(void*, const void*, size_t), void (*Close)(void*, void*), size_t INPUT_SIZE>
+static void X13SM3Stage(benchmark::State& state)
+{
+    unsigned char in[INPUT_SIZE] = {0};
+    while (state.KeepRunning()) {
+        Ctx ctx;
+        Init(&ctx);
+        Write(&ctx, in, INPUT_SIZE);
+        Close(&ctx, in);
+    }
+}
+
+static void SM3Init(void* ctx)
+{
+    sm3_init(static_cast<sm3_ctx_t*>(ctx));
+}
+
+static void X13SM3_BLAKE512_80b(benchmark::State& state) { X13SM3Stage<sph_blake512_context, sph_blake512_init, sph_blake512, sph_blake512_close, 80>(state); }
+static void X13SM3_BMW512_64b(benchmark::State& state) { X13SM3Stage<sph_bmw512_context, sph_bmw512_init, sph_bmw512, sph_bmw512_close, 64>(state); }
+static void X13SM3_GROESTL512_64b(benchmark::State& state) { X13SM3Stage<sph_groestl512_context, sph_groestl512_init, sph_groestl512, sph_groestl512_close, 64>(state); }
+static void X13SM3_SKEIN512_64b(benchmark::State& state) { X13SM3Stage<sph_skein512_context, sph_skein512_init, sph_skein512, sph_skein512_close, 64>(state); }
+static void X13SM3_JH512_64b(benchmark::State& state) { X13SM3Stage<sph_jh512_context, sph_jh512_init, sph_jh512, sph_jh512_close, 64>(state); }
+static void X13SM3_KECCAK512_64b(benchmark::State& state) { X13SM3Stage<sph_keccak512_context, sph_keccak512_init, sph_keccak512, sph_keccak512_close, 64>(state); }
+static void X13SM3_SM3_64b(benchmark::State& state) { X13SM3Stage<sm3_ctx_t, SM3Init, sph_sm3, sph_sm3_close, 64>(state); }
+static void X13SM3_CUBEHASH512_64b(benchmark::State& state) { X13SM3Stage<sph_cubehash512_context, sph_cubehash512_init, sph_cubehash512, sph_cubehash512_close, 64>(state); }
+static void X13SM3_SHAVITE512_64b(benchmark::State& state) { X13SM3Stage<sph_shavite512_context, sph_shavite512_init, sph_shavite512, sph_shavite512_close, 64>(state); }
+static void X13SM3_SIMD512_64b(benchmark::State& state) { X13SM3Stage<sph_simd512_context, sph_simd512_init, sph_simd512, sph_simd512_close, 64>(state); }
+static void X13SM3_ECHO512_64b(benchmark::State& state) { X13SM3Stage<sph_echo512_context, sph_echo512_init, sph_echo512, sph_echo512_close, 64>(state); }
+static void X13SM3_HAMSI512_64b(benchmark::State& state) { X13SM3Stage<sph_hamsi512_context, sph_hamsi512_init, sph_hamsi512, sph_hamsi512_close, 64>(state); }
+static void X13SM3_FUGUE512_64b(benchmark::State& state) { X13SM3Stage<sph_fugue512_context, sph_fugue512_init, sph_fugue512, sph_fugue512_close, 64>(state); }
+
+/* Check the proof of work of a run of 2000 headers, as a headers message from a peer would carry.
+ * The headers are mined once at the regtest limit, so every check succeeds. */
+static const size_t HEADER_BATCH_SIZE = 2000;
+
+static std::vector<CBlockHeader> CreateHeaderBatch(const Consensus::Params& params)
+{
+    std::vector<CBlockHeader> headers(HEADER_BATCH_SIZE);
+    for (size_t i = 0; i < headers.size(); ++i) {
+        headers[i].nVersion = VERSIONBITS_TOP_BITS | VERSIONBITS_FORK_BCD;
+        headers[i].hashPrevBlock = i ? headers[i - 1].GetHash() : uint256();
+        headers[i].nTime = 1500000000 + 600 * i;
+        headers[i].nBits = UintToArith256(params.powLimit).GetCompact();
+        headers[i].nNonce = 0;
+        while (!CheckProofOfWork(headers[i].GetPoWHash(true), headers[i].nBits, params)) {
+            ++headers[i].nNonce;
+        }
+    }
+    return headers;
+}
+
+static void X13SM3_HeaderBatch(benchmark::State& state)
+{
+    const auto chainParams = CreateChainParams(CBaseChainParams::REGTEST);
+    const Consensus::Params& params = chainParams->GetConsensus();
+    const std::vector<CBlockHeader> headers = CreateHeaderBatch(params);
+    while (state.KeepRunning()) {
+        for (const CBlockHeader& header : headers) {
+            assert(CheckProofOfWork(header.GetPoWHash(true), header.nBits, params));
+        }
+    }
+}
+
+static void X13SM3_HeaderBatch_80(benchmark::State& state)
+{
+    const auto chainParams = CreateChainParams(CBaseChainParams::REGTEST);
+    const Consensus::Params& params = chainParams->GetConsensus();
+    const std::vector<CBlockHeader> headers = CreateHeaderBatch(params);
+    CDataStream in(SER_NETWORK, PROTOCOL_VERSION);
+    for (const CBlockHeader& header : headers) {
+        in << header;
+    }
+    std::vector<uint256> hashes(headers.size());
+    while (state.KeepRunning()) {
+        X13SM3_80(hashes[0].begin(), (const unsigned char*)in.data(), headers.size());
+        for (size_t i = 0; i < headers.size(); ++i) {
+            assert(CheckProofOfWork(hashes[i], headers[i].nBits, params));
+        }
+    }
+}
+
 static void SHA512(benchmark::State& state)
 {
     uint8_t hash[CSHA512::OUTPUT_SIZE];
@@ -105,3 +226,21 @@ BENCHMARK(SipHash_32b, 40 * 1000 * 1000);
 BENCHMARK(SHA256D64_1024, 7400);
 BENCHMARK(FastRandom_32bit, 110 * 1000 * 1000);
 BENCHMARK(FastRandom_1bit, 440 * 1000 * 1000);
+
+BENCHMARK(X13SM3_80b, 11000);
+BENCHMARK(X13SM3_80_1024, 11);
+BENCHMARK(X13SM3_BLAKE512_80b, 800 * 1000);
+BENCHMARK(X13SM3_BMW512_64b, 700 * 1000);
+BENCHMARK(X13SM3_GROESTL512_64b, 90 * 1000);
+BENCHMARK(X13SM3_SKEIN512_64b, 500 * 1000);
+BENCHMARK(X13SM3_JH512_64b, 200 * 1000);
+BENCHMARK(X13SM3_KECCAK512_64b, 600 * 1000);
+BENCHMARK(X13SM3_SM3_64b, 700 * 1000);
+BENCHMARK(X13SM3_CUBEHASH512_64b, 150 * 1000);
+BENCHMARK(X13SM3_SHAVITE512_64b, 150 * 1000);
+BENCHMARK(X13SM3_SIMD512_64b, 50 * 1000);
+BENCHMARK(X13SM3_ECHO512_64b, 60 * 1000);
+BENCHMARK(X13SM3_HAMSI512_64b, 200 * 1000);
+BENCHMARK(X13SM3_FUGUE512_64b, 200 * 1000);
+BENCHMARK(X13SM3_HeaderBatch, 6);
+BENCHMARK(X13SM3_HeaderBatch_80, 6);
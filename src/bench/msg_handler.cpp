@@ -0,0 +1,135 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <bench/connman.h>
+
+#include <chainparams.h>
+#include <consensus/merkle.h>
+#include <consensus/validation.h>
+#include <miner.h>
+#include <net.h>
+#include <net_processing.h>
+#include <netmessagemaker.h>
+#include <pow.h>
+#include <scheduler.h>
+#include <txdb.h>
+#include <util/time.h>
+#include <validation.h>
+#include <validationinterface.h>
+
+#include <boost/thread.hpp>
+
+#include <thread>
+#include <vector>
+
+// Serving blocks to 128 inbound peers, each of which asks for the last 16
+// blocks at once, on one message handler thread and on four. A peer is
+// served by the thread its id maps to, one block per pass, so the time of
+// an iteration is the latency of the last peer's last block.
+//
+// The threads only help with more cores than this benchmark's own polling
+// thread: on a single core the runs should come out about equal.
+
+static const int HANDLER_PEERS = 128;
+static const int HANDLER_BLOCKS = 16;
+static const size_t HANDLER_BLOCK_PADDING = 20000;
+
+static void MineBlock()
+{
+    auto block = std::make_shared<CBlock>(
+        BlockAssembler{Params()}
+            .CreateNewBlock(CScript() << OP_TRUE, /* fMineWitnessTx */ true)
+            ->block);
+
+    // Pad the coinbase, so that serving a block moves a realistic amount of data
+    CMutableTransaction coinbase(*block->vtx[0]);
+    coinbase.vout.emplace_back(0, CScript() << OP_RETURN << std::vector<unsigned char>(HANDLER_BLOCK_PADDING));
+    block->vtx[0] = MakeTransactionRef(std::move(coinbase));
+    block->nTime = ::chainActive.Tip()->GetMedianTimePast() + 1;
+    block->hashMerkleRoot = BlockMerkleRoot(*block);
+
+    while (!CheckProofOfWork(block->GetPoWHash(true), block->nBits, Params().GetConsensus())) {
+        assert(++block->nNonce);
+    }
+    bool processed{ProcessNewBlock(Params(), block, true, nullptr)};
+    assert(processed);
+}
+
+static void MessageHandler(benchmark::State& state, int threads)
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    boost::thread_group thread_group;
+    CScheduler scheduler;
+    thread_group.create_thread(boost::bind(&CScheduler::serviceQueue, &scheduler));
+    GetMainSignals().RegisterBackgroundSignalScheduler(scheduler);
+    if (!chainActive.Tip()) {
+        {
+            LOCK(cs_main);
+            ::pblocktree.reset(new CBlockTreeDB(1 << 20, true));
+            ::pcoinsdbview.reset(new CCoinsViewDB(1 << 23, true));
+            ::pcoinsTip.reset(new CCoinsViewCache(pcoinsdbview.get()));
+        }
+        LoadGenesisBlock(Params());
+        CValidationState validation_state;
+        ActivateBestChain(validation_state, Params());
+        assert(chainActive.Tip());
+    }
+    while (chainActive.Height() < HANDLER_BLOCKS) {
+        MineBlock();
+    }
+
+    // The last blocks, and what a peer is sent for them
+    std::vector<CInv> invs;
+    size_t served_bytes = 0;
+    {
+        LOCK(cs_main);
+        for (const CBlockIndex* pindex = chainActive.Tip(); invs.size() < HANDLER_BLOCKS; pindex = pindex->pprev) {
+            CBlock block;
+            assert(ReadBlockFromDisk(block, pindex, Params().GetConsensus()));
+            invs.emplace_back(MSG_WITNESS_BLOCK, pindex->GetBlockHash());
+            served_bytes += ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION) + CMessageHeader::HEADER_SIZE;
+        }
+    }
+    const std::vector<unsigned char> getdata = CConnmanBench::MessageBytes(CNetMsgMaker(PROTOCOL_VERSION).Make(NetMsgType::GETDATA, invs));
+
+    CConnmanBench bench;
+    PeerLogicValidation peer_logic(&bench.connman, scheduler, false);
+    for (int i = 0; i < HANDLER_PEERS; ++i) {
+        CNode* node = bench.AddNode();
+        node->SetSendVersion(PROTOCOL_VERSION);
+        node->SetRecvVersion(PROTOCOL_VERSION);
+        peer_logic.InitializeNode(node);
+        node->nVersion = PROTOCOL_VERSION;
+        node->fSuccessfullyConnected = true;
+    }
+    bench.StartMessageHandlers(&peer_logic, threads);
+
+    while (state.KeepRunning()) {
+        for (CNode* node : bench.nodes) {
+            bench.ReceiveMessage(node, getdata);
+        }
+        for (CNode* node : bench.nodes) {
+            while (!CConnmanBench::TakeSent(node, NetMsgType::BLOCK, served_bytes)) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    bench.StopMessageHandlers();
+    for (CNode* node : bench.nodes) {
+        bool update_connection_time;
+        peer_logic.FinalizeNode(node->GetId(), update_connection_time);
+    }
+    thread_group.interrupt_all();
+    thread_group.join_all();
+    GetMainSignals().FlushBackgroundCallbacks();
+    GetMainSignals().UnregisterBackgroundSignalScheduler();
+}
+
+static void MessageHandler_1(benchmark::State& state) { MessageHandler(state, 1); }
+static void MessageHandler_4(benchmark::State& state) { MessageHandler(state, 4); }
+
+BENCHMARK(MessageHandler_1, 20);
+BENCHMARK(MessageHandler_4, 20);
@@ -0,0 +1,72 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <bench/connman.h>
+
+#include <chainparams.h>
+#include <hash.h>
+#include <net.h>
+#include <netmessagemaker.h>
+#include <protocol.h>
+#include <streams.h>
+#include <version.h>
+
+#ifndef WIN32
+
+#include <unistd.h>
+
+#include <vector>
+
+// Cost of one socket handler wakeup, caused by a single active peer, while a
+// growing number of idle peers stays connected. The difference between the
+// peer counts is the CPU spent per idle peer on every wakeup.
+
+static void SocketEvents(benchmark::State& state, SocketEventsMode mode, size_t idle_peers)
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    const std::vector<unsigned char> ping = CConnmanBench::MessageBytes(CNetMsgMaker(PROTOCOL_VERSION).Make(NetMsgType::PING, (uint64_t)0));
+
+    CConnmanBench bench;
+    bench.SetSocketEventsMode(mode);
+    CNode* active = bench.AddSocketNode();
+    const int active_remote = bench.remotes.back();
+    for (size_t i = 0; i < idle_peers; ++i) {
+        bench.AddSocketNode();
+    }
+    // Absorb the initial writability of every socket
+    bench.SocketHandler();
+
+    while (state.KeepRunning()) {
+        assert(write(active_remote, ping.data(), ping.size()) == (ssize_t)ping.size());
+        bench.SocketHandler();
+
+        LOCK(active->cs_vProcessMsg);
+        assert(active->vProcessMsg.size() == 1);
+        active->vProcessMsg.clear();
+        active->nProcessQueueSize = 0;
+        active->fPauseRecv = false;
+    }
+}
+
+static void SocketEventsSelect_100(benchmark::State& state) { SocketEvents(state, SocketEventsMode::SELECT, 100); }
+static void SocketEventsSelect_400(benchmark::State& state) { SocketEvents(state, SocketEventsMode::SELECT, 400); }
+BENCHMARK(SocketEventsSelect_100, 5000);
+BENCHMARK(SocketEventsSelect_400, 2000);
+
+#ifdef USE_POLL
+static void SocketEventsPoll_100(benchmark::State& state) { SocketEvents(state, SocketEventsMode::POLL, 100); }
+static void SocketEventsPoll_400(benchmark::State& state) { SocketEvents(state, SocketEventsMode::POLL, 400); }
+BENCHMARK(SocketEventsPoll_100, 5000);
+BENCHMARK(SocketEventsPoll_400, 2000);
+#endif
+
+#ifdef USE_EPOLL
+static void SocketEventsEpoll_100(benchmark::State& state) { SocketEvents(state, SocketEventsMode::EPOLL, 100); }
+static void SocketEventsEpoll_400(benchmark::State& state) { SocketEvents(state, SocketEventsMode::EPOLL, 400); }
+BENCHMARK(SocketEventsEpoll_100, 20000);
+BENCHMARK(SocketEventsEpoll_400, 20000);
+#endif
+
+#endif // WIN32
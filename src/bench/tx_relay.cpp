@@ -0,0 +1,212 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <bench/connman.h>
+
+#include <chainparams.h>
+#include <consensus/validation.h>
+#include <net.h>
+#include <net_processing.h>
+#include <policy/policy.h>
+#include <scheduler.h>
+#include <txdb.h>
+#include <txmempool.h>
+#include <util/time.h>
+#include <validation.h>
+#include <validationinterface.h>
+
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <set>
+#include <vector>
+
+// Transaction relay at 10k tx/min to 100 inbound peers. Every iteration is
+// one second: the transactions accepted in it are relayed, and the peers
+// whose trickle timer fires (every 5 seconds on average) announce what they
+// may of their backlog, in mempool order.
+//
+// TxRelay runs this through PeerLogicValidation::SendMessages, which hands
+// each peer one batch per second with the mempool order looked up once.
+// TxRelayMempoolOrder is the announcement loop it replaced, in which every
+// peer queued every transaction on its own and heap-sorted its whole
+// backlog under the mempool lock on every trickle.
+
+static const int RELAY_PEERS = 100;
+static const int RELAY_TX_PER_SECOND = 10000 / 60;
+static const int RELAY_TRICKLE_INTERVAL = 5;
+static const int RELAY_MEMPOOL_TXS = 10000;
+static const unsigned int RELAY_INVENTORY_MAX = 7 * RELAY_TRICKLE_INTERVAL;
+
+static std::vector<CTransactionRef> FillMempool(CTxMemPool& pool)
+{
+    std::vector<CTransactionRef> txs;
+    LOCK(pool.cs);
+    for (int i = 0; i < RELAY_MEMPOOL_TXS; ++i) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.n = i;
+        tx.vin[0].scriptSig = CScript() << OP_1;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+        tx.vout[0].nValue = 10 * COIN;
+        CTransactionRef txr = MakeTransactionRef(tx);
+        LockPoints lp;
+        pool.addUnchecked(txr->GetHash(), CTxMemPoolEntry(txr, 1000 + (i * 7919) % 10000, 0, 1, false, 4, lp));
+        txs.push_back(txr);
+    }
+    return txs;
+}
+
+static void TxRelay(benchmark::State& state)
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    boost::thread_group thread_group;
+    CScheduler scheduler;
+    thread_group.create_thread(boost::bind(&CScheduler::serviceQueue, &scheduler));
+    GetMainSignals().RegisterBackgroundSignalScheduler(scheduler);
+    if (!chainActive.Tip()) {
+        {
+            LOCK(cs_main);
+            ::pblocktree.reset(new CBlockTreeDB(1 << 20, true));
+            ::pcoinsdbview.reset(new CCoinsViewDB(1 << 23, true));
+            ::pcoinsTip.reset(new CCoinsViewCache(pcoinsdbview.get()));
+        }
+        LoadGenesisBlock(Params());
+        CValidationState validation_state;
+        ActivateBestChain(validation_state, Params());
+        assert(chainActive.Tip());
+    }
+    const std::vector<CTransactionRef> txs = FillMempool(::mempool);
+
+    CConnmanBench bench;
+    PeerLogicValidation peer_logic(&bench.connman, scheduler, false);
+    for (int i = 0; i < RELAY_PEERS; ++i) {
+        CNode* node = bench.AddNode();
+        node->SetSendVersion(PROTOCOL_VERSION);
+        peer_logic.InitializeNode(node);
+        node->nVersion = PROTOCOL_VERSION;
+        node->fRelayTxes = true;
+        node->fSuccessfullyConnected = true;
+    }
+
+    int64_t now = GetTime();
+    size_t next_tx = 0;
+    int next_peer = 0;
+    while (state.KeepRunning()) {
+        SetMockTime(++now);
+        for (int i = 0; i < RELAY_TX_PER_SECOND; ++i) {
+            RelayTransaction(*txs[next_tx], &bench.connman);
+            next_tx = (next_tx + 1) % txs.size();
+        }
+
+        // Only the peers whose turn it is trickle
+        for (CNode* node : bench.nodes) {
+            node->nNextInvSend = std::numeric_limits<int64_t>::max();
+        }
+        for (int i = 0; i < RELAY_PEERS / RELAY_TRICKLE_INTERVAL; ++i) {
+            bench.nodes[next_peer]->nNextInvSend = 0;
+            next_peer = (next_peer + 1) % RELAY_PEERS;
+        }
+        for (CNode* node : bench.nodes) {
+            LOCK2(cs_main, node->cs_sendProcessing);
+            peer_logic.SendMessages(node);
+        }
+        for (CNode* node : bench.nodes) {
+            LOCK(node->cs_vSend);
+            node->vSendMsg.clear();
+            node->nSendSize = 0;
+        }
+    }
+    SetMockTime(0);
+
+    for (CNode* node : bench.nodes) {
+        bool update_connection_time;
+        peer_logic.FinalizeNode(node->GetId(), update_connection_time);
+    }
+    ::mempool.clear();
+    thread_group.interrupt_all();
+    thread_group.join_all();
+    GetMainSignals().FlushBackgroundCallbacks();
+    GetMainSignals().UnregisterBackgroundSignalScheduler();
+}
+
+namespace {
+class CompareInvMempoolOrder
+{
+    CTxMemPool *mp;
+public:
+    explicit CompareInvMempoolOrder(CTxMemPool *_mempool)
+    {
+        mp = _mempool;
+    }
+
+    bool operator()(std::set<uint256>::iterator a, std::set<uint256>::iterator b)
+    {
+        /* As std::make_heap produces a max-heap, we want the entries with the
+         * fewest ancestors/highest fee to sort later. */
+        return mp->CompareDepthAndScore(*b, *a);
+    }
+};
+} // namespace
+
+static void TxRelayMempoolOrder(benchmark::State& state)
+{
+    CTxMemPool pool;
+    const std::vector<CTransactionRef> txs = FillMempool(pool);
+
+    std::vector<std::unique_ptr<CNode>> nodes;
+    for (int i = 0; i < RELAY_PEERS; ++i) {
+        nodes.emplace_back(new CNode(i, NODE_NETWORK, 0, INVALID_SOCKET, CAddress(), 0, 0, CAddress(), "", true));
+    }
+
+    size_t next_tx = 0;
+    int next_peer = 0;
+    uint64_t announced = 0;
+    while (state.KeepRunning()) {
+        for (int i = 0; i < RELAY_TX_PER_SECOND; ++i) {
+            const uint256& hash = txs[next_tx]->GetHash();
+            next_tx = (next_tx + 1) % txs.size();
+            for (const auto& node : nodes) {
+                LOCK(node->cs_inventory);
+                if (!node->filterInventoryKnown.contains(hash)) {
+                    node->setInventoryTxToSend.insert(hash);
+                }
+            }
+        }
+
+        for (int i = 0; i < RELAY_PEERS / RELAY_TRICKLE_INTERVAL; ++i) {
+            CNode* node = nodes[next_peer].get();
+            next_peer = (next_peer + 1) % RELAY_PEERS;
+            LOCK(node->cs_inventory);
+            std::vector<std::set<uint256>::iterator> vInvTx;
+            vInvTx.reserve(node->setInventoryTxToSend.size());
+            for (std::set<uint256>::iterator it = node->setInventoryTxToSend.begin(); it != node->setInventoryTxToSend.end(); it++) {
+                vInvTx.push_back(it);
+            }
+            CompareInvMempoolOrder compareInvMempoolOrder(&pool);
+            std::make_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
+            unsigned int relayed = 0;
+            while (!vInvTx.empty() && relayed < RELAY_INVENTORY_MAX) {
+                std::pop_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
+                std::set<uint256>::iterator it = vInvTx.back();
+                vInvTx.pop_back();
+                uint256 hash = *it;
+                node->setInventoryTxToSend.erase(it);
+                if (node->filterInventoryKnown.contains(hash)) continue;
+                if (!pool.info(hash).tx) continue;
+                node->filterInventoryKnown.insert(hash);
+                relayed++;
+            }
+            announced += relayed;
+        }
+    }
+    assert(announced > 0);
+}
+
+BENCHMARK(TxRelay, 300);
+BENCHMARK(TxRelayMempoolOrder, 300);
@@ -0,0 +1,191 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <blockcache.h>
+
+#include <blockencodings.h>
+#include <chain.h>
+#include <core_memusage.h>
+#include <memusage.h>
+#include <primitives/block.h>
+#include <streams.h>
+#include <util/system.h>
+#include <validation.h>
+#include <version.h>
+
+CRecentBlockCache g_recent_blocks(DEFAULT_RECENT_BLOCKS, DEFAULT_RECENT_BLOCK_CACHE << 20);
+
+CRecentBlockCache::CRecentBlockCache(size_t max_blocks_in, size_t max_bytes_in) : max_blocks(max_blocks_in), max_bytes(max_bytes_in)
+{
+}
+
+void CRecentBlockCache::SetLimits(size_t max_blocks_in, size_t max_bytes_in)
+{
+    LOCK(cs);
+    max_blocks = max_blocks_in;
+    max_bytes = max_bytes_in;
+    Trim();
+}
+
+CRecentBlockCache::List::iterator CRecentBlockCache::Find(const uint256& hash)
+{
+    AssertLockHeld(cs);
+    for (List::iterator it = entries.begin(); it != entries.end(); ++it) {
+        if (it->first == hash) return it;
+    }
+    return entries.end();
+}
+
+size_t CRecentBlockCache::Usage(const Entry& entry)
+{
+    size_t usage = 0;
+    if (entry.block) usage += RecursiveDynamicUsage(entry.block);
+    if (entry.serialized) usage += memusage::DynamicUsage(entry.serialized) + memusage::DynamicUsage(*entry.serialized);
+    if (entry.compact) usage += memusage::DynamicUsage(entry.compact) + entry.compact->BlockTxCount() * sizeof(uint64_t);
+    return usage;
+}
+
+void CRecentBlockCache::Update(List::iterator it, size_t old_usage)
+{
+    AssertLockHeld(cs);
+    usage += Usage(it->second);
+    usage -= old_usage;
+    Trim();
+}
+
+void CRecentBlockCache::Trim()
+{
+    AssertLockHeld(cs);
+    while (!entries.empty() && (entries.size() > max_blocks || usage > max_bytes)) {
+        usage -= Usage(entries.back().second);
+        entries.pop_back();
+    }
+}
+
+bool CRecentBlockCache::Get(const uint256& hash, Entry& entry)
+{
+    LOCK(cs);
+    List::iterator it = Find(hash);
+    if (it == entries.end()) {
+        ++misses;
+        return false;
+    }
+    ++hits;
+    entries.splice(entries.begin(), entries, it);
+    entry = it->second;
+    return true;
+}
+
+void CRecentBlockCache::AddBlock(const std::shared_ptr<const CBlock>& block, const std::shared_ptr<const CBlockHeaderAndShortTxIDs>& compact)
+{
+    bool has_witness = false;
+    for (const CTransactionRef& tx : block->vtx) {
+        if (tx->HasWitness()) {
+            has_witness = true;
+            break;
+        }
+    }
+
+    LOCK(cs);
+    if (max_blocks == 0) return;
+    const uint256 hash = block->GetHash();
+    List::iterator it = Find(hash);
+    if (it == entries.end()) {
+        it = entries.emplace(entries.begin(), hash, Entry());
+    } else {
+        entries.splice(entries.begin(), entries, it);
+    }
+    const size_t old_usage = Usage(it->second);
+    it->second.block = block;
+    it->second.has_witness = has_witness;
+    if (compact) it->second.compact = compact;
+    Update(it, old_usage);
+}
+
+void CRecentBlockCache::AddSerialized(const uint256& hash, const std::shared_ptr<const std::vector<uint8_t>>& serialized, bool has_witness)
+{
+    LOCK(cs);
+    if (max_blocks == 0) return;
+    List::iterator it = Find(hash);
+    if (it == entries.end()) {
+        it = entries.emplace(entries.begin(), hash, Entry());
+    } else {
+        entries.splice(entries.begin(), entries, it);
+    }
+    const size_t old_usage = Usage(it->second);
+    it->second.serialized = serialized;
+    it->second.has_witness = has_witness;
+    Update(it, old_usage);
+}
+
+void CRecentBlockCache::AddCompact(const std::shared_ptr<const CBlockHeaderAndShortTxIDs>& compact)
+{
+    LOCK(cs);
+    List::iterator it = Find(compact->header.GetHash());
+    if (it == entries.end()) return;
+    const size_t old_usage = Usage(it->second);
+    it->second.compact = compact;
+    Update(it, old_usage);
+}
+
+CRecentBlockCache::Stats CRecentBlockCache::GetStats() const
+{
+    LOCK(cs);
+    Stats stats;
+    stats.blocks = entries.size();
+    stats.bytes = usage;
+    stats.hits = hits;
+    stats.misses = misses;
+    return stats;
+}
+
+void CRecentBlockCache::Clear()
+{
+    LOCK(cs);
+    entries.clear();
+    usage = 0;
+}
+
+std::shared_ptr<const std::vector<uint8_t>> SerializeBlock(const CBlock& block)
+{
+    std::shared_ptr<std::vector<uint8_t>> serialized = std::make_shared<std::vector<uint8_t>>();
+    CVectorWriter(SER_NETWORK, PROTOCOL_VERSION, *serialized, 0) << block;
+    serialized->shrink_to_fit();
+    return serialized;
+}
+
+bool ReadBlockCached(std::shared_ptr<const CBlock>& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
+{
+    CRecentBlockCache::Entry entry;
+    g_recent_blocks.Get(pindex->GetBlockHash(), entry);
+    return ReadBlockCached(block, pindex, consensusParams, entry);
+}
+
+bool ReadBlockCached(std::shared_ptr<const CBlock>& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams, const CRecentBlockCache::Entry& entry)
+{
+    if (entry.block || entry.serialized) {
+        if (entry.block) {
+            block = entry.block;
+            return true;
+        }
+        // Only the bytes read from disk are cached, parse them like ReadBlockFromDisk would.
+        std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+        try {
+            CDataStream((const char*)entry.serialized->data(), (const char*)entry.serialized->data() + entry.serialized->size(), SER_NETWORK, PROTOCOL_VERSION) >> *pblock;
+        } catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pindex->GetBlockPos().ToString());
+        }
+        block = pblock;
+        g_recent_blocks.AddBlock(block);
+        return true;
+    }
+
+    std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+    if (!ReadBlockFromDisk(*pblock, pindex, consensusParams)) {
+        return false;
+    }
+    block = pblock;
+    g_recent_blocks.AddBlock(block);
+    return true;
+}
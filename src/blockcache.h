@@ -0,0 +1,104 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKCACHE_H
+#define BITCOIN_BLOCKCACHE_H
+
+#include <sync.h>
+#include <uint256.h>
+
+#include <list>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+class CBlock;
+class CBlockHeaderAndShortTxIDs;
+class CBlockIndex;
+
+namespace Consensus { struct Params; }
+
+/** Default for -recentblocks, the maximum number of blocks in the recent block cache. */
+static const unsigned int DEFAULT_RECENT_BLOCKS = 16;
+/** Default for -recentblockcache, the memory limit of the recent block cache in MiB. */
+static const unsigned int DEFAULT_RECENT_BLOCK_CACHE = 64;
+
+/**
+ * A memory-bounded LRU cache of recently relayed or served blocks, shared by
+ * block relay (getdata, getblocktxn) and the RPC and REST interfaces.
+ *
+ * Each entry holds up to three representations of the same block, filled in
+ * as they are needed: the deserialized block, its witness serialization (as
+ * sent in a block message and stored on disk) and its compact block with
+ * wtxid-based short ids. An entry needs at least one of the first two.
+ */
+class CRecentBlockCache
+{
+public:
+    struct Entry {
+        std::shared_ptr<const CBlock> block;
+        std::shared_ptr<const std::vector<uint8_t>> serialized;
+        std::shared_ptr<const CBlockHeaderAndShortTxIDs> compact;
+        /** Whether any transaction has a witness, i.e. whether the serialization differs without witnesses. */
+        bool has_witness = false;
+    };
+
+    struct Stats {
+        size_t blocks;
+        size_t bytes;
+        uint64_t hits;
+        uint64_t misses;
+    };
+
+    CRecentBlockCache(size_t max_blocks, size_t max_bytes);
+
+    /** Change the limits, evicting entries as needed. A limit of zero disables the cache. */
+    void SetLimits(size_t max_blocks, size_t max_bytes);
+
+    /** Look up a block, marking it most recently used. Counts a hit or a miss. */
+    bool Get(const uint256& hash, Entry& entry);
+
+    /** Add a deserialized block, with its compact block if one was built. */
+    void AddBlock(const std::shared_ptr<const CBlock>& block, const std::shared_ptr<const CBlockHeaderAndShortTxIDs>& compact = nullptr);
+    /** Add the witness serialization of a block, as read from disk. */
+    void AddSerialized(const uint256& hash, const std::shared_ptr<const std::vector<uint8_t>>& serialized, bool has_witness);
+    /** Attach a compact block to the entry of its block, if it is still cached. */
+    void AddCompact(const std::shared_ptr<const CBlockHeaderAndShortTxIDs>& compact);
+
+    Stats GetStats() const;
+    void Clear();
+
+private:
+    typedef std::list<std::pair<uint256, Entry>> List;
+
+    mutable CCriticalSection cs;
+    /** Entries, most recently used first. The list is short, so lookups scan it. */
+    List entries GUARDED_BY(cs);
+    size_t max_blocks GUARDED_BY(cs);
+    size_t max_bytes GUARDED_BY(cs);
+    size_t usage GUARDED_BY(cs) = 0;
+    uint64_t hits GUARDED_BY(cs) = 0;
+    uint64_t misses GUARDED_BY(cs) = 0;
+
+    List::iterator Find(const uint256& hash);
+    static size_t Usage(const Entry& entry);
+    /** Recompute the usage of an entry after it was changed, and enforce the limits. */
+    void Update(List::iterator it, size_t old_usage);
+    void Trim();
+};
+
+extern CRecentBlockCache g_recent_blocks;
+
+/** Witness serialization of a block. */
+std::shared_ptr<const std::vector<uint8_t>> SerializeBlock(const CBlock& block);
+
+/**
+ * Get a block through the recent block cache, reading it from disk and
+ * adding it to the cache on a miss.
+ */
+bool ReadBlockCached(std::shared_ptr<const CBlock>& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/** Same, with the entry a lookup of the block already returned, which is empty if it missed. */
+bool ReadBlockCached(std::shared_ptr<const CBlock>& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams, const CRecentBlockCache::Entry& entry);
+
+#endif // BITCOIN_BLOCKCACHE_H
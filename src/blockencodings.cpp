@@ -15,6 +15,9 @@
 
 #include <unordered_map>
 
+/** Mempool entries in a row without a match after which the mining score order pass gives up. */
+static const size_t SCORE_ORDER_MAX_MISSES = 500;
+
 CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block, bool fUseWTXID) :
         nonce(GetRand(std::numeric_limits<uint64_t>::max())),
         shorttxids(block.vtx.size() - 1), prefilledtxn(1), header(block) {
@@ -102,32 +105,49 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
         return READ_STATUS_FAILED; // Short ID collision
 
     std::vector<bool> have_txn(txn_available.size());
-    {
-    LOCK(pool->cs);
-    const std::vector<std::pair<uint256, CTxMemPool::txiter> >& vTxHashes = pool->vTxHashes;
-    for (size_t i = 0; i < vTxHashes.size(); i++) {
-        uint64_t shortid = cmpctblock.GetShortID(vTxHashes[i].first);
+    auto add_mempool_tx = [&](const uint256& wtxid, const CTxMemPoolEntry& entry) {
+        uint64_t shortid = cmpctblock.GetShortID(wtxid);
         std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(shortid);
         if (idit != shorttxids.end()) {
             if (!have_txn[idit->second]) {
-                txn_available[idit->second] = vTxHashes[i].second->GetSharedTx();
+                txn_available[idit->second] = entry.GetSharedTx();
                 have_txn[idit->second]  = true;
                 mempool_count++;
             } else {
                 // If we find two mempool txn that match the short id, just request it.
                 // This should be rare enough that the extra bandwidth doesn't matter,
                 // but eating a round-trip due to FillBlock failure would be annoying
-                if (txn_available[idit->second]) {
+                // Note that the full scan below sees the transactions found in mining
+                // score order again, so we compare witness hashes first
+                if (txn_available[idit->second] &&
+                        txn_available[idit->second]->GetWitnessHash() != wtxid) {
                     txn_available[idit->second].reset();
                     mempool_count--;
                 }
             }
         }
-        // Though ideally we'd continue scanning for the two-txn-match-shortid case,
-        // the performance win of an early exit here is too good to pass up and worth
-        // the extra risk.
-        if (mempool_count == shorttxids.size())
-            break;
+    };
+
+    {
+    LOCK(pool->cs);
+    // Short ids are keyed by the header and nonce, so they cannot be indexed before
+    // the block arrives. But blocks are mostly made of the transactions a miner picks
+    // first, so look at our mempool in that same order, as long as it keeps matching,
+    // before scanning all of it.
+    const CTxMemPool::indexed_transaction_set::index<ancestor_score>::type& by_score = pool->mapTx.get<ancestor_score>();
+    size_t misses = 0;
+    for (auto it = by_score.begin(); it != by_score.end() && misses < SCORE_ORDER_MAX_MISSES && mempool_count < shorttxids.size(); ++it) {
+        const size_t prev_count = mempool_count;
+        add_mempool_tx(it->GetTx().GetWitnessHash(), *it);
+        misses = mempool_count > prev_count ? 0 : misses + 1;
+    }
+
+    // Though ideally we'd continue scanning for the two-txn-match-shortid case,
+    // the performance win of an early exit here is too good to pass up and worth
+    // the extra risk.
+    const std::vector<std::pair<uint256, CTxMemPool::txiter> >& vTxHashes = pool->vTxHashes;
+    for (size_t i = 0; i < vTxHashes.size() && mempool_count < shorttxids.size(); i++) {
+        add_mempool_tx(vTxHashes[i].first, *vTxHashes[i].second);
     }
     }
 
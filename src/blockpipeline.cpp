@@ -0,0 +1,339 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <blockpipeline.h>
+
+#include <coins.h>
+#include <primitives/block.h>
+#include <util/system.h>
+#include <validation.h>
+
+#include <functional>
+
+CBlockFileWriter g_block_writer;
+CBlockPrefetcher g_block_prefetcher;
+
+CBlockFileWriter::~CBlockFileWriter()
+{
+    Stop();
+}
+
+void CBlockFileWriter::Start()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    assert(!running);
+    running = true;
+    thread = std::thread(&TraceThread<std::function<void()> >, "blkwrite", std::function<void()>(std::bind(&CBlockFileWriter::ThreadWrite, this)));
+}
+
+void CBlockFileWriter::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!running) return;
+        stop = true;
+    }
+    cond_queued.notify_all();
+    thread.join();
+    std::lock_guard<std::mutex> lock(mutex);
+    running = false;
+    stop = false;
+}
+
+bool CBlockFileWriter::WriteJob(const Job& job)
+{
+    // WriteBlockToDisk starts at the record header and reports where the block data begins.
+    CDiskBlockPos pos(job.pos.nFile, job.pos.nPos - 8);
+    if (!WriteBlockToDisk(*job.block, pos, job.message_start))
+        return false;
+    assert(pos == job.pos);
+    return true;
+}
+
+bool CBlockFileWriter::Write(const std::shared_ptr<const CBlock>& block, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& message_start)
+{
+    Job job;
+    job.pos = pos;
+    job.block = block;
+    memcpy(job.message_start, message_start, CMessageHeader::MESSAGE_START_SIZE);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!running) {
+        lock.unlock();
+        return WriteJob(job);
+    }
+    cond_written.wait(lock, [this] { return queue.size() < MAX_BLOCK_WRITE_QUEUE; });
+    if (failed) return false;
+    queue.push_back(std::move(job));
+    cond_queued.notify_one();
+    return true;
+}
+
+bool CBlockFileWriter::Flush()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cond_written.wait(lock, [this] { return queue.empty(); });
+    return !failed;
+}
+
+std::shared_ptr<const CBlock> CBlockFileWriter::Get(const CDiskBlockPos& pos) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const Job& job : queue) {
+        if (job.pos == pos) return job.block;
+    }
+    return nullptr;
+}
+
+void CBlockFileWriter::ThreadWrite()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cond_queued.wait(lock, [this] { return stop || !queue.empty(); });
+        // Only exit once every queued block is on disk.
+        if (queue.empty()) return;
+        const Job job = queue.front();
+        lock.unlock();
+        const bool written = WriteJob(job);
+        lock.lock();
+        if (!written) failed = true;
+        queue.pop_front();
+        cond_written.notify_all();
+    }
+}
+
+CBlockPrefetcher::~CBlockPrefetcher()
+{
+    Stop();
+}
+
+void CBlockPrefetcher::Start()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    assert(!running);
+    running = true;
+    thread = std::thread(&TraceThread<std::function<void()> >, "blkprefetch", std::function<void()>(std::bind(&CBlockPrefetcher::ThreadPrefetch, this)));
+}
+
+void CBlockPrefetcher::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!running) return;
+        stop = true;
+    }
+    cond.notify_all();
+    thread.join();
+    std::lock_guard<std::mutex> lock(mutex);
+    running = false;
+    stop = false;
+    requested = false;
+    hash.SetNull();
+    view = nullptr;
+    block.reset();
+}
+
+void CBlockPrefetcher::Prefetch(const uint256& hash_in, const CDiskBlockPos& pos_in, const CCoinsView* view_in, const Consensus::Params& params_in)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!running) return;
+        hash = hash_in;
+        pos = pos_in;
+        view = view_in;
+        params = &params_in;
+        requested = true;
+        block.reset();
+    }
+    cond.notify_all();
+}
+
+std::shared_ptr<const CBlock> CBlockPrefetcher::Get(const uint256& hash_in)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!running || hash != hash_in) return nullptr;
+    cond.wait(lock, [this] { return stop || (!requested && !reading); });
+    if (hash != hash_in) return nullptr;
+    return block;
+}
+
+void CBlockPrefetcher::ThreadPrefetch()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cond.wait(lock, [this] { return stop || requested; });
+        if (stop) return;
+        const uint256 hash_read = hash;
+        const CDiskBlockPos pos_read = pos;
+        const CCoinsView* view_read = view;
+        const Consensus::Params& params_read = *params;
+        requested = false;
+        reading = true;
+        lock.unlock();
+
+        std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+        if (!ReadBlockFromDisk(*pblock, pos_read, params_read, false) || pblock->GetHash() != hash_read) {
+            pblock.reset();
+        }
+
+        lock.lock();
+        reading = false;
+        if (!requested) block = pblock;
+        cond.notify_all();
+        if (!pblock || requested || stop) continue;
+        lock.unlock();
+
+        // Looking the inputs up brings them into the database block cache,
+        // abandon that as soon as a newer block is requested.
+        for (const CTransactionRef& tx : pblock->vtx) {
+            if (tx->IsCoinBase()) continue;
+            lock.lock();
+            const bool abandon = requested || stop;
+            lock.unlock();
+            if (abandon) break;
+            for (const CTxIn& txin : tx->vin) {
+                view_read->HaveCoin(txin.prevout);
+            }
+        }
+        lock.lock();
+    }
+}
+
+CCoinsViewWriter::~CCoinsViewWriter()
+{
+    Stop();
+}
+
+void CCoinsViewWriter::Start()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    assert(!running);
+    running = true;
+    thread = std::thread(&TraceThread<std::function<void()> >, "coinswrite", std::function<void()>(std::bind(&CCoinsViewWriter::ThreadWrite, this)));
+}
+
+void CCoinsViewWriter::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!running) return;
+        stop = true;
+    }
+    cond.notify_all();
+    thread.join();
+    std::lock_guard<std::mutex> lock(mutex);
+    running = false;
+    stop = false;
+}
+
+bool CCoinsViewWriter::GetCoin(const COutPoint& outpoint, Coin& coin) const
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        CCoinsMap::const_iterator it = pending.find(outpoint);
+        if (it != pending.end()) {
+            if (it->second.coin.IsSpent()) return false;
+            coin = it->second.coin;
+            return true;
+        }
+    }
+    return base->GetCoin(outpoint, coin);
+}
+
+bool CCoinsViewWriter::HaveCoin(const COutPoint& outpoint) const
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        CCoinsMap::const_iterator it = pending.find(outpoint);
+        if (it != pending.end()) return !it->second.coin.IsSpent();
+    }
+    return base->HaveCoin(outpoint);
+}
+
+uint256 CCoinsViewWriter::GetBestBlock() const
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!hashPending.IsNull()) return hashPending;
+    }
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewWriter::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool erase)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!running) {
+        lock.unlock();
+        return base->BatchWrite(mapCoins, hashBlock, erase);
+    }
+    cond.wait(lock, [this] { return !writing; });
+    if (failed) return false;
+    assert(pending.empty());
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+            Coin coin = erase ? std::move(it->second.coin) : it->second.coin;
+            pendingCoinsUsage += coin.DynamicMemoryUsage();
+            pending.try_emplace(it->first, std::move(coin)).first->second.flags = CCoinsCacheEntry::DIRTY;
+        }
+        if (erase) {
+            it = mapCoins.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    hashPending = hashBlock;
+    writing = true;
+    cond.notify_all();
+    return true;
+}
+
+bool CCoinsViewWriter::Wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this] { return !writing; });
+    return !failed;
+}
+
+bool CCoinsViewWriter::IsPending(const COutPoint& outpoint) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return pending.find(outpoint) != pending.end();
+}
+
+size_t CCoinsViewWriter::DynamicMemoryUsage() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return pending.DynamicMemoryUsage() + pendingCoinsUsage;
+}
+
+void CCoinsViewWriter::ThreadWrite()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cond.wait(lock, [this] { return stop || writing; });
+        // Only exit once the pending batch is written.
+        if (!writing) return;
+        const uint256 hashBlock = hashPending;
+        lock.unlock();
+        // Readers only look pending up while it is written, it is not changed
+        // until the write is done.
+        bool written = false;
+        try {
+            written = base->BatchWrite(pending, hashBlock, false);
+        } catch (const std::runtime_error& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+        }
+        lock.lock();
+        if (written) {
+            pending.clear();
+            pendingCoinsUsage = 0;
+            hashPending.SetNull();
+        } else {
+            // Keep serving the batch; the next flush reports the failure.
+            failed = true;
+        }
+        writing = false;
+        cond.notify_all();
+    }
+}
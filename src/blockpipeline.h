@@ -0,0 +1,172 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKPIPELINE_H
+#define BITCOIN_BLOCKPIPELINE_H
+
+#include <chain.h>
+#include <coins.h>
+#include <protocol.h>
+#include <uint256.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+class CBlock;
+
+namespace Consensus { struct Params; }
+
+/** Maximum number of blocks queued for writing before Write() waits for the writer thread. */
+static const unsigned int MAX_BLOCK_WRITE_QUEUE = 16;
+
+/**
+ * Writes accepted blocks to the block files on a background thread, so that
+ * AcceptBlock only has to find a position for them while holding cs_main.
+ *
+ * Until its write completes, a block is served from memory by Get(), which
+ * ReadBlockFromDisk and ReadRawBlockFromDisk consult before the disk.
+ * FlushBlockFile waits for all queued writes before committing the files.
+ * While the thread is not running, blocks are written synchronously.
+ */
+class CBlockFileWriter
+{
+public:
+    ~CBlockFileWriter();
+
+    void Start();
+    /** Write all queued blocks and stop the thread. */
+    void Stop();
+
+    /**
+     * Write a block whose data starts at pos, right after its 8 byte record
+     * header. Returns false if this write, or an earlier one, failed.
+     */
+    bool Write(const std::shared_ptr<const CBlock>& block, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& message_start);
+    /** Wait until all queued blocks are written. Returns false if any write failed. */
+    bool Flush();
+    /** The block at pos if its write is still pending, or nullptr. */
+    std::shared_ptr<const CBlock> Get(const CDiskBlockPos& pos) const;
+
+private:
+    struct Job {
+        CDiskBlockPos pos;
+        std::shared_ptr<const CBlock> block;
+        CMessageHeader::MessageStartChars message_start;
+    };
+
+    mutable std::mutex mutex;
+    /** Signalled when a block is queued or the writer is stopped. */
+    std::condition_variable cond_queued;
+    /** Signalled when a block was written. */
+    std::condition_variable cond_written;
+    /** Blocks not yet written, in order. The front one is being written by the thread. */
+    std::deque<Job> queue;
+    bool running = false;
+    bool stop = false;
+    bool failed = false;
+    std::thread thread;
+
+    static bool WriteJob(const Job& job);
+    void ThreadWrite();
+};
+
+/**
+ * Reads the next block to connect while the current one is being connected,
+ * and looks up its inputs in the coins database so that they are in the
+ * database cache by the time ConnectBlock needs them. There is a single
+ * outstanding request; a new one abandons the previous.
+ */
+class CBlockPrefetcher
+{
+public:
+    ~CBlockPrefetcher();
+
+    void Start();
+    void Stop();
+
+    /** Start reading the block with the given hash from pos, and touch its inputs in view. */
+    void Prefetch(const uint256& hash, const CDiskBlockPos& pos, const CCoinsView* view, const Consensus::Params& params);
+    /** The block with the given hash if it is the one requested, waiting for it to be read. Returns nullptr otherwise. */
+    std::shared_ptr<const CBlock> Get(const uint256& hash);
+
+private:
+    std::mutex mutex;
+    std::condition_variable cond;
+    /** The block requested, null if there is none. */
+    uint256 hash;
+    CDiskBlockPos pos;
+    const CCoinsView* view = nullptr;
+    const Consensus::Params* params = nullptr;
+    /** Whether the thread has yet to pick up the request. */
+    bool requested = false;
+    /** Whether the thread is reading the requested block. */
+    bool reading = false;
+    /** The requested block once read, nullptr if the read failed. */
+    std::shared_ptr<const CBlock> block;
+    bool running = false;
+    bool stop = false;
+    std::thread thread;
+
+    void ThreadPrefetch();
+};
+
+/**
+ * Sits between the coins cache and the coins database, and writes what the
+ * cache flushes into it to the database on a background thread, so that
+ * flushing the chainstate does not hold up connecting blocks.
+ *
+ * BatchWrite keeps the dirty coins it is given as the pending batch and
+ * returns; it first waits for the write of the previous batch to finish.
+ * Until the pending batch is written, reads see it on top of the database.
+ * The database tracks a partially written batch through DB_HEAD_BLOCKS like
+ * any other, so a crash during a write is recovered by replaying blocks.
+ * While the thread is not running, batches are written synchronously.
+ */
+class CCoinsViewWriter : public CCoinsViewBacked
+{
+public:
+    explicit CCoinsViewWriter(CCoinsView* viewIn) : CCoinsViewBacked(viewIn) {}
+    ~CCoinsViewWriter();
+
+    void Start();
+    /** Write the pending batch and stop the thread. */
+    void Stop();
+
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const override;
+    bool HaveCoin(const COutPoint& outpoint) const override;
+    uint256 GetBestBlock() const override;
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool erase = true) override;
+
+    /** Wait until the pending batch is written. Returns false if a write failed. */
+    bool Wait();
+    /** Whether outpoint is in the batch being written, so the database may not have it yet. */
+    bool IsPending(const COutPoint& outpoint) const;
+    /** Memory used by the pending batch. */
+    size_t DynamicMemoryUsage() const;
+
+private:
+    mutable std::mutex mutex;
+    /** Signalled when a batch is queued, written, or the writer is stopped. */
+    std::condition_variable cond;
+    /** Coins not yet written. Only changed while no write is in progress. */
+    CCoinsMap pending;
+    size_t pendingCoinsUsage = 0;
+    /** The best block of the pending batch, null if there is none. */
+    uint256 hashPending;
+    bool writing = false;
+    bool running = false;
+    bool stop = false;
+    bool failed = false;
+    std::thread thread;
+
+    void ThreadWrite();
+};
+
+extern CBlockFileWriter g_block_writer;
+extern CBlockPrefetcher g_block_prefetcher;
+
+#endif // BITCOIN_BLOCKPIPELINE_H
@@ -5,6 +5,10 @@
 
 #include <chain.h>
 
+#include <sync.h>
+
+#include <memory>
+
 /**
  * CChain implementation
  */
@@ -66,6 +70,62 @@ CBlockIndex* CChain::FindEarliestAtLeast(int64_t nTime) const
     return (lower == vChain.end() ? nullptr : *lower);
 }
 
+namespace {
+
+/** Number of entries in the PoW hash cache (4 MiB). */
+static const size_t POW_HASH_CACHE_SIZE = 1 << 16;
+
+/** Direct-mapped cache from block hash to X13-SM3 hash. Block hashes are
+ *  uniformly distributed, so their low bits select the slot and a newer
+ *  entry simply replaces an older one that maps to the same slot. */
+class CPoWHashCache
+{
+    struct Entry {
+        uint256 hashBlock;
+        uint256 hashPoW;
+    };
+
+    CCriticalSection cs;
+    std::unique_ptr<Entry[]> entries GUARDED_BY(cs);
+
+public:
+    bool Get(const uint256& hashBlock, uint256& hashPoW)
+    {
+        LOCK(cs);
+        if (!entries) return false;
+        const Entry& entry = entries[hashBlock.GetCheapHash() % POW_HASH_CACHE_SIZE];
+        if (entry.hashBlock != hashBlock) return false;
+        hashPoW = entry.hashPoW;
+        return true;
+    }
+
+    void Set(const uint256& hashBlock, const uint256& hashPoW)
+    {
+        LOCK(cs);
+        if (!entries) entries.reset(new Entry[POW_HASH_CACHE_SIZE]);
+        Entry& entry = entries[hashBlock.GetCheapHash() % POW_HASH_CACHE_SIZE];
+        entry.hashBlock = hashBlock;
+        entry.hashPoW = hashPoW;
+    }
+};
+
+CPoWHashCache powHashCache;
+
+} // namespace
+
+uint256 CBlockIndex::GetBlockPoWHash(bool isBCDBlock) const
+{
+    if (!((nVersion & 0x40000000UL) && isBCDBlock))
+        return *phashBlock;
+
+    uint256 hashPoW;
+    if (!powHashCache.Get(*phashBlock, hashPoW)) {
+        hashPoW = GetBlockHeader().GetPoWHash(isBCDBlock);
+        powHashCache.Set(*phashBlock, hashPoW);
+    }
+    return hashPoW;
+}
+
 /** Turn the lowest '1' bit in the binary representation of a number into a '0'. */
 int static inline InvertLowestOne(int n) { return n & (n - 1); }
 
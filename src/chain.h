@@ -160,6 +160,8 @@ enum BlockStatus: uint32_t {
     BLOCK_FAILED_MASK        =   BLOCK_FAILED_VALID | BLOCK_FAILED_CHILD,
 
     BLOCK_OPT_WITNESS       =   128, //!< block data in blk*.data was received with a witness-enforcing client
+
+    BLOCK_POW_VALID         =   256, //!< header proof of work was verified, no need to rehash it when loading the index
 };
 
 /** The block chain is a tree shaped structure starting with the
@@ -294,13 +296,9 @@ public:
         return *phashBlock;
     }
 
-    uint256 GetBlockPoWHash(bool isBCDBlock = false) const
-    {
-    	if ((nVersion & 0x40000000UL) && isBCDBlock)
-    		return GetBlockHeader().GetPoWHash(isBCDBlock);
-    	else
-    		return *phashBlock;
-    }
+    /** The proof-of-work hash of this block. X13-SM3 hashes are computed on first use and kept in a
+     *  fixed-size cache keyed by block hash, as RPC and logging ask for the same headers repeatedly. */
+    uint256 GetBlockPoWHash(bool isBCDBlock = false) const;
 	
     int64_t GetBlockTime() const
     {
@@ -7,10 +7,12 @@
 #include <consensus/consensus.h>
 #include <random.h>
 
+#include <functional>
+
 bool CCoinsView::GetCoin(const COutPoint &outpoint, Coin &coin) const { return false; }
 uint256 CCoinsView::GetBestBlock() const { return uint256(); }
 std::vector<uint256> CCoinsView::GetHeadBlocks() const { return std::vector<uint256>(); }
-bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return false; }
+bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool erase) { return false; }
 CCoinsViewCursor *CCoinsView::Cursor() const { return nullptr; }
 
 bool CCoinsView::HaveCoin(const COutPoint &outpoint) const
@@ -25,26 +27,136 @@ bool CCoinsViewBacked::HaveCoin(const COutPoint &outpoint) const { return base->
 uint256 CCoinsViewBacked::GetBestBlock() const { return base->GetBestBlock(); }
 std::vector<uint256> CCoinsViewBacked::GetHeadBlocks() const { return base->GetHeadBlocks(); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return base->BatchWrite(mapCoins, hashBlock); }
+bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool erase) { return base->BatchWrite(mapCoins, hashBlock, erase); }
 CCoinsViewCursor *CCoinsViewBacked::Cursor() const { return base->Cursor(); }
 size_t CCoinsViewBacked::EstimateSize() const { return base->EstimateSize(); }
 
+constexpr uint32_t CCoinsMap::EMPTY;
+constexpr uint32_t CCoinsMap::DELETED;
+constexpr uint32_t CCoinsMap::CHUNK_ENTRIES;
+constexpr size_t CCoinsMap::MIN_SLOTS;
+constexpr size_t CCoinsMap::ENTRY_USAGE;
+
+size_t CCoinsMap::Place(const Slot& slot)
+{
+    const size_t mask = slots.size() - 1;
+    size_t pos = slot.hash & mask;
+    while (slots[pos].index < DELETED) {
+        pos = (pos + 1) & mask;
+    }
+    if (slots[pos].index == DELETED) --deleted;
+    slots[pos] = slot;
+    return pos;
+}
+
+void CCoinsMap::Rehash(size_t n)
+{
+    size_t size = MIN_SLOTS;
+    while (size * 2 < n * 3) {
+        size *= 2;
+    }
+    std::vector<Slot> old(size, Slot{0, EMPTY});
+    old.swap(slots);
+    deleted = 0;
+    for (const Slot& slot : old) {
+        if (slot.index < DELETED) Place(slot);
+    }
+}
+
+uint32_t CCoinsMap::Allocate()
+{
+    uint32_t index = free_head;
+    if (index != EMPTY) {
+        memcpy(&free_head, Raw(index), sizeof(free_head));
+        return index;
+    }
+    assert(allocated < DELETED);
+    if (allocated == chunks.size() * CHUNK_ENTRIES) {
+        chunks.emplace_back(new Storage[CHUNK_ENTRIES]);
+    }
+    return allocated++;
+}
+
+CCoinsMap::iterator CCoinsMap::erase(const_iterator it)
+{
+    Slot& slot = slots[it.pos];
+    Entry(slot.index).~value_type();
+    memcpy(Raw(slot.index), &free_head, sizeof(free_head));
+    free_head = slot.index;
+    // Probing for other keys only needs to get past this slot if the next one is used
+    if (slots[(it.pos + 1) & (slots.size() - 1)].index == EMPTY) {
+        slot.index = EMPTY;
+    } else {
+        slot.index = DELETED;
+        ++deleted;
+    }
+    --count;
+    return iterator(this, NextUsed(it.pos + 1));
+}
+
+void CCoinsMap::clear()
+{
+    for (const Slot& slot : slots) {
+        if (slot.index < DELETED) Entry(slot.index).~value_type();
+    }
+    std::vector<Slot>().swap(slots);
+    std::vector<std::unique_ptr<Storage[]>>().swap(chunks);
+    count = 0;
+    deleted = 0;
+    allocated = 0;
+    free_head = EMPTY;
+}
+
+void CCoinsMap::Compact()
+{
+    if (count == 0) {
+        clear();
+        return;
+    }
+    std::vector<Slot> old_slots;
+    std::vector<std::unique_ptr<Storage[]>> old_chunks;
+    old_slots.swap(slots);
+    old_chunks.swap(chunks);
+    allocated = 0;
+    free_head = EMPTY;
+    Rehash(count);
+    chunks.reserve((count + CHUNK_ENTRIES - 1) / CHUNK_ENTRIES);
+    for (Slot slot : old_slots) {
+        if (slot.index >= DELETED) continue;
+        value_type* entry = reinterpret_cast<value_type*>(&old_chunks[slot.index >> CHUNK_BITS][slot.index & (CHUNK_ENTRIES - 1)]);
+        slot.index = Allocate();
+        new (Raw(slot.index)) value_type(std::move(*entry));
+        entry->~value_type();
+        Place(slot);
+    }
+}
+
+size_t CCoinsMap::DynamicMemoryUsage() const
+{
+    return memusage::MallocUsage(slots.capacity() * sizeof(Slot)) +
+           memusage::MallocUsage(chunks.capacity() * sizeof(chunks[0])) +
+           chunks.size() * memusage::MallocUsage(CHUNK_ENTRIES * sizeof(Storage));
+}
+
 SaltedOutpointHasher::SaltedOutpointHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), cachedCoinsUsage(0) {}
+CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), cachedCoinsUsage(0), nBatches(0) {}
 
 size_t CCoinsViewCache::DynamicMemoryUsage() const {
-    return memusage::DynamicUsage(cacheCoins) + cachedCoinsUsage;
+    return cacheCoins.DynamicMemoryUsage() + cachedCoinsUsage;
 }
 
 CCoinsMap::iterator CCoinsViewCache::FetchCoin(const COutPoint &outpoint) const {
     CCoinsMap::iterator it = cacheCoins.find(outpoint);
-    if (it != cacheCoins.end())
+    if (it != cacheCoins.end()) {
+        it->second.nLastUsed = nBatches;
         return it;
+    }
     Coin tmp;
     if (!base->GetCoin(outpoint, tmp))
         return cacheCoins.end();
-    CCoinsMap::iterator ret = cacheCoins.emplace(std::piecewise_construct, std::forward_as_tuple(outpoint), std::forward_as_tuple(std::move(tmp))).first;
+    CCoinsMap::iterator ret = cacheCoins.try_emplace(outpoint, std::move(tmp)).first;
+    ret->second.nLastUsed = nBatches;
     if (ret->second.coin.IsSpent()) {
         // The parent only has an empty entry for this outpoint; we can consider our
         // version as fresh.
@@ -54,6 +166,17 @@ CCoinsMap::iterator CCoinsViewCache::FetchCoin(const COutPoint &outpoint) const
     return ret;
 }
 
+void CCoinsViewCache::CacheCoin(const COutPoint& outpoint, Coin&& coin) {
+    assert(!coin.IsSpent());
+    CCoinsMap::iterator it;
+    bool inserted;
+    std::tie(it, inserted) = cacheCoins.try_emplace(outpoint, std::move(coin));
+    it->second.nLastUsed = nBatches;
+    if (inserted) {
+        cachedCoinsUsage += it->second.coin.DynamicMemoryUsage();
+    }
+}
+
 bool CCoinsViewCache::GetCoin(const COutPoint &outpoint, Coin &coin) const {
     CCoinsMap::const_iterator it = FetchCoin(outpoint);
     if (it != cacheCoins.end()) {
@@ -68,7 +191,7 @@ void CCoinsViewCache::AddCoin(const COutPoint &outpoint, Coin&& coin, bool possi
     if (coin.out.scriptPubKey.IsUnspendable()) return;
     CCoinsMap::iterator it;
     bool inserted;
-    std::tie(it, inserted) = cacheCoins.emplace(std::piecewise_construct, std::forward_as_tuple(outpoint), std::tuple<>());
+    std::tie(it, inserted) = cacheCoins.try_emplace(outpoint);
     bool fresh = false;
     if (!inserted) {
         cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
@@ -81,6 +204,7 @@ void CCoinsViewCache::AddCoin(const COutPoint &outpoint, Coin&& coin, bool possi
     }
     it->second.coin = std::move(coin);
     it->second.flags |= CCoinsCacheEntry::DIRTY | (fresh ? CCoinsCacheEntry::FRESH : 0);
+    it->second.nLastUsed = nBatches;
     cachedCoinsUsage += it->second.coin.DynamicMemoryUsage();
 }
 
@@ -142,8 +266,9 @@ void CCoinsViewCache::SetBestBlock(const uint256 &hashBlockIn) {
     hashBlock = hashBlockIn;
 }
 
-bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn) {
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); it = mapCoins.erase(it)) {
+bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn, bool erase) {
+    ++nBatches;
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); it = erase ? mapCoins.erase(it) : std::next(it)) {
         // Ignore non-dirty entries (optimization).
         if (!(it->second.flags & CCoinsCacheEntry::DIRTY)) {
             continue;
@@ -156,9 +281,14 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                 // Otherwise we will need to create it in the parent
                 // and move the data up and mark it as dirty
                 CCoinsCacheEntry& entry = cacheCoins[it->first];
-                entry.coin = std::move(it->second.coin);
+                if (erase) {
+                    entry.coin = std::move(it->second.coin);
+                } else {
+                    entry.coin = it->second.coin;
+                }
                 cachedCoinsUsage += entry.coin.DynamicMemoryUsage();
                 entry.flags = CCoinsCacheEntry::DIRTY;
+                entry.nLastUsed = nBatches;
                 // We can mark it FRESH in the parent if it was FRESH in the child
                 // Otherwise it might have just been flushed from the parent's cache
                 // and already exist in the grandparent
@@ -185,9 +315,14 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
             } else {
                 // A normal modification.
                 cachedCoinsUsage -= itUs->second.coin.DynamicMemoryUsage();
-                itUs->second.coin = std::move(it->second.coin);
+                if (erase) {
+                    itUs->second.coin = std::move(it->second.coin);
+                } else {
+                    itUs->second.coin = it->second.coin;
+                }
                 cachedCoinsUsage += itUs->second.coin.DynamicMemoryUsage();
                 itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+                itUs->second.nLastUsed = nBatches;
                 // NOTE: It is possible the child has a FRESH flag here in
                 // the event the entry we found in the parent is pruned. But
                 // we must not copy that FRESH flag to the parent as that
@@ -207,6 +342,63 @@ bool CCoinsViewCache::Flush() {
     return fOk;
 }
 
+bool CCoinsViewCache::Sync() {
+    bool fOk = base->BatchWrite(cacheCoins, hashBlock, false);
+    // The base now has every change, so spent coins need not be remembered
+    // and unspent ones match the base.
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); ) {
+        if (it->second.coin.IsSpent()) {
+            cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
+            it = cacheCoins.erase(it);
+        } else {
+            it->second.flags = 0;
+            ++it;
+        }
+    }
+    return fOk;
+}
+
+void CCoinsViewCache::Trim(size_t nTargetUsage) {
+    const size_t nUsage = DynamicMemoryUsage();
+    if (nUsage <= nTargetUsage) return;
+
+    // Memory taken by the unmodified entries, by how many batches ago they were last used.
+    std::map<uint32_t, size_t, std::greater<uint32_t>> mapAgeUsage;
+    for (const auto& entry : cacheCoins) {
+        if (entry.second.flags == 0) {
+            mapAgeUsage[nBatches - entry.second.nLastUsed] += CCoinsMap::ENTRY_USAGE + entry.second.coin.DynamicMemoryUsage();
+        }
+    }
+
+    // Evict all entries older than the cutoff age, and as many entries of
+    // that age as it takes to reach the target.
+    uint32_t nCutoffAge = 0;
+    size_t nOlderUsage = 0;
+    for (const auto& age : mapAgeUsage) {
+        nCutoffAge = age.first;
+        if (nUsage - nOlderUsage <= nTargetUsage + age.second) break;
+        nOlderUsage += age.second;
+    }
+    size_t nEvictedUsage = 0;
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); ) {
+        const uint32_t nAge = nBatches - it->second.nLastUsed;
+        if (it->second.flags != 0 || nAge < nCutoffAge ||
+            (nAge == nCutoffAge && nUsage - nEvictedUsage <= nTargetUsage + nOlderUsage)) {
+            ++it;
+            continue;
+        }
+        const size_t nEntryUsage = CCoinsMap::ENTRY_USAGE + it->second.coin.DynamicMemoryUsage();
+        if (nAge > nCutoffAge) {
+            nOlderUsage -= nEntryUsage;
+        }
+        nEvictedUsage += nEntryUsage;
+        cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
+        it = cacheCoins.erase(it);
+    }
+    // Give the memory of the evicted entries back.
+    cacheCoins.Compact();
+}
+
 void CCoinsViewCache::Uncache(const COutPoint& hash)
 {
     CCoinsMap::iterator it = cacheCoins.find(hash);
@@ -17,7 +17,12 @@
 #include <assert.h>
 #include <stdint.h>
 
-#include <unordered_map>
+#include <iterator>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 /**
  * A UTXO entry.
@@ -104,6 +109,8 @@ struct CCoinsCacheEntry
 {
     Coin coin; // The actual cached data.
     unsigned char flags;
+    // The number of batches the cache had received when this entry was last used.
+    uint32_t nLastUsed;
 
     enum Flags {
         DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
@@ -115,11 +122,159 @@ struct CCoinsCacheEntry
          */
     };
 
-    CCoinsCacheEntry() : flags(0) {}
-    explicit CCoinsCacheEntry(Coin&& coin_) : coin(std::move(coin_)), flags(0) {}
+    CCoinsCacheEntry() : flags(0), nLastUsed(0) {}
+    explicit CCoinsCacheEntry(Coin&& coin_) : coin(std::move(coin_)), flags(0), nLastUsed(0) {}
 };
 
-typedef std::unordered_map<COutPoint, CCoinsCacheEntry, SaltedOutpointHasher> CCoinsMap;
+/**
+ * The map of cached coins: an open addressing hash table with linear probing,
+ * whose slots refer to entries allocated from an arena of fixed-size chunks.
+ *
+ * Like with std::unordered_map, entries stay where they are while they are in
+ * the map, so references to them are only invalidated by erasing them, and
+ * iterators by inserting. The memory of erased entries is reused by later
+ * insertions; clear() and Compact() give it back.
+ */
+class CCoinsMap
+{
+public:
+    typedef COutPoint key_type;
+    typedef CCoinsCacheEntry mapped_type;
+    typedef std::pair<const COutPoint, CCoinsCacheEntry> value_type;
+
+private:
+    struct Slot {
+        uint32_t hash;  // Folded hash of the key, the slot it belongs in are its low bits
+        uint32_t index; // Position of the entry in the arena, or EMPTY or DELETED
+    };
+    static constexpr uint32_t EMPTY = 0xffffffff;
+    static constexpr uint32_t DELETED = 0xfffffffe;
+    static constexpr int CHUNK_BITS = 8;
+    static constexpr uint32_t CHUNK_ENTRIES = 1 << CHUNK_BITS;
+    static constexpr size_t MIN_SLOTS = 16;
+
+    typedef typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type Storage;
+
+    SaltedOutpointHasher hasher;
+    std::vector<Slot> slots;
+    std::vector<std::unique_ptr<Storage[]>> chunks;
+    // Number of entries, of DELETED slots, and of entries ever allocated from the chunks
+    size_t count = 0;
+    size_t deleted = 0;
+    uint32_t allocated = 0;
+    // Erased entries, linked through their storage
+    uint32_t free_head = EMPTY;
+
+    template <bool Const>
+    class Iterator
+    {
+        friend class CCoinsMap;
+        template <bool> friend class Iterator;
+        typedef typename std::conditional<Const, const CCoinsMap, CCoinsMap>::type Map;
+
+        Map* map;
+        size_t pos;
+
+        Iterator(Map* map_in, size_t pos_in) : map(map_in), pos(pos_in) {}
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef CCoinsMap::value_type value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef typename std::conditional<Const, const value_type*, value_type*>::type pointer;
+        typedef typename std::conditional<Const, const value_type&, value_type&>::type reference;
+
+        Iterator() : map(nullptr), pos(0) {}
+        Iterator(const Iterator<false>& other) : map(other.map), pos(other.pos) {}
+
+        reference operator*() const { return map->Entry(map->slots[pos].index); }
+        pointer operator->() const { return &map->Entry(map->slots[pos].index); }
+        Iterator& operator++() { pos = map->NextUsed(pos + 1); return *this; }
+        Iterator operator++(int) { Iterator ret = *this; ++*this; return ret; }
+
+        friend bool operator==(const Iterator& a, const Iterator& b) { return a.pos == b.pos; }
+        friend bool operator!=(const Iterator& a, const Iterator& b) { return a.pos != b.pos; }
+    };
+
+    static uint32_t FoldHash(uint64_t hash) { return (uint32_t)(hash ^ (hash >> 32)); }
+
+    void* Raw(uint32_t index) const { return &chunks[index >> CHUNK_BITS][index & (CHUNK_ENTRIES - 1)]; }
+    value_type& Entry(uint32_t index) const { return *static_cast<value_type*>(Raw(index)); }
+
+    size_t NextUsed(size_t pos) const
+    {
+        while (pos < slots.size() && slots[pos].index >= DELETED) ++pos;
+        return pos;
+    }
+
+    /** The slot holding key, or slots.size() if there is none. */
+    size_t Find(const COutPoint& key, uint32_t hash) const
+    {
+        if (slots.empty()) return 0;
+        const size_t mask = slots.size() - 1;
+        for (size_t pos = hash & mask; ; pos = (pos + 1) & mask) {
+            const Slot& slot = slots[pos];
+            if (slot.index == EMPTY) return slots.size();
+            if (slot.hash == hash && slot.index != DELETED && Entry(slot.index).first == key) return pos;
+        }
+    }
+
+    /** Put slot in the first free slot from where it belongs. */
+    size_t Place(const Slot& slot);
+    /** Resize the table for n entries, dropping DELETED slots. */
+    void Rehash(size_t n);
+    /** Take storage for an entry from the free list or the arena. */
+    uint32_t Allocate();
+
+public:
+    typedef Iterator<false> iterator;
+    typedef Iterator<true> const_iterator;
+
+    /** The memory an entry takes, besides the dynamic memory of its coin. */
+    static constexpr size_t ENTRY_USAGE = sizeof(value_type) + sizeof(Slot) * 3 / 2;
+
+    CCoinsMap() = default;
+    CCoinsMap(const CCoinsMap&) = delete;
+    CCoinsMap& operator=(const CCoinsMap&) = delete;
+    ~CCoinsMap() { clear(); }
+
+    iterator begin() { return iterator(this, NextUsed(0)); }
+    const_iterator begin() const { return const_iterator(this, NextUsed(0)); }
+    iterator end() { return iterator(this, slots.size()); }
+    const_iterator end() const { return const_iterator(this, slots.size()); }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    iterator find(const COutPoint& key) { return iterator(this, Find(key, FoldHash(hasher(key)))); }
+    const_iterator find(const COutPoint& key) const { return const_iterator(this, Find(key, FoldHash(hasher(key)))); }
+
+    /** Insert an entry constructed from args, unless there is one for key already. */
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(const COutPoint& key, Args&&... args)
+    {
+        const uint32_t hash = FoldHash(hasher(key));
+        size_t pos = Find(key, hash);
+        if (pos != slots.size()) return std::make_pair(iterator(this, pos), false);
+        if ((count + deleted + 1) * 4 > slots.size() * 3) Rehash(count + 1);
+        const uint32_t index = Allocate();
+        new (Raw(index)) value_type(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...));
+        pos = Place(Slot{hash, index});
+        ++count;
+        return std::make_pair(iterator(this, pos), true);
+    }
+
+    CCoinsCacheEntry& operator[](const COutPoint& key) { return try_emplace(key).first->second; }
+
+    /** Erase the entry at it, returning an iterator to the next one. */
+    iterator erase(const_iterator it);
+    /** Erase all entries and free all memory. */
+    void clear();
+    /** Move the entries into as little memory as they need. */
+    void Compact();
+
+    size_t DynamicMemoryUsage() const;
+};
 
 /** Cursor for iterating over CoinsView state */
 class CCoinsViewCursor
@@ -164,8 +319,9 @@ public:
     virtual std::vector<uint256> GetHeadBlocks() const;
 
     //! Do a bulk modification (multiple Coin changes + BestBlock change).
-    //! The passed mapCoins can be modified.
-    virtual bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    //! The passed mapCoins can be modified, unless erase is false, in which
+    //! case its entries are copied rather than moved.
+    virtual bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool erase = true);
 
     //! Get a cursor to iterate over the whole state
     virtual CCoinsViewCursor *Cursor() const;
@@ -191,7 +347,7 @@ public:
     uint256 GetBestBlock() const override;
     std::vector<uint256> GetHeadBlocks() const override;
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) override;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool erase = true) override;
     CCoinsViewCursor *Cursor() const override;
     size_t EstimateSize() const override;
 };
@@ -211,6 +367,10 @@ protected:
     /* Cached dynamic memory usage for the inner Coin objects. */
     mutable size_t cachedCoinsUsage;
 
+    /* Number of batches written to this cache, usually one per block, which
+     * is the clock entries are evicted by in Trim. */
+    uint32_t nBatches;
+
 public:
     CCoinsViewCache(CCoinsView *baseIn);
 
@@ -224,7 +384,7 @@ public:
     bool HaveCoin(const COutPoint &outpoint) const override;
     uint256 GetBestBlock() const override;
     void SetBestBlock(const uint256 &hashBlock);
-    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) override;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool erase = true) override;
     CCoinsViewCursor* Cursor() const override {
         throw std::logic_error("CCoinsViewCache cursor iteration not supported.");
     }
@@ -248,6 +408,12 @@ public:
      */
     const Coin& AccessCoin(const COutPoint &output) const;
 
+    /**
+     * Add an unspent coin the caller read from the backing view itself, as
+     * if it had been fetched. Does nothing if the outpoint is cached already.
+     */
+    void CacheCoin(const COutPoint& outpoint, Coin&& coin);
+
     /**
      * Add a coin. Set potential_overwrite to true if a non-pruned version may
      * already exist.
@@ -268,6 +434,19 @@ public:
      */
     bool Flush();
 
+    /**
+     * Push the modifications applied to this cache to its base like Flush,
+     * but keep the cached coins: afterwards no entry is modified and spent
+     * ones are gone. Use Trim to bound the memory they take.
+     */
+    bool Sync();
+
+    /**
+     * Evict unmodified coins, least recently used first, until the cache
+     * takes at most nTargetUsage bytes or only modified coins are left.
+     */
+    void Trim(size_t nTargetUsage);
+
     /**
      * Removes the UTXO with the given outpoint from the cache, if it is
      * not modified.
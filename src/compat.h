@@ -102,8 +102,16 @@ typedef void* sockopt_arg_type;
 typedef char* sockopt_arg_type;
 #endif
 
+// poll() works on any descriptor, and on Linux epoll() can replace it
+#if defined(__linux__)
+#define USE_POLL
+#if defined(HAVE_SYS_EPOLL_H)
+#define USE_EPOLL
+#endif
+#endif
+
 bool static inline IsSelectableSocket(const SOCKET& s) {
-#ifdef WIN32
+#if defined(WIN32) || defined(USE_POLL)
     return true;
 #else
     return (s < FD_SETSIZE);
@@ -0,0 +1,229 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <crypto/x13sm3.h>
+
+#include <crypto/x13hash/sph_blake.h>
+#include <crypto/x13hash/sph_bmw.h>
+#include <crypto/x13hash/sph_groestl.h>
+#include <crypto/x13hash/sph_jh.h>
+#include <crypto/x13hash/sph_keccak.h>
+#include <crypto/x13hash/sph_skein.h>
+#include <crypto/x13hash/sph_cubehash.h>
+#include <crypto/x13hash/sph_shavite.h>
+#include <crypto/x13hash/sph_simd.h>
+#include <crypto/x13hash/sph_echo.h>
+#include <crypto/x13hash/sph_hamsi.h>
+#include <crypto/x13hash/sph_fugue.h>
+#include <crypto/x13hash/sph_sm3.h>
+
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__amd64__) || defined(__i386__)
+#if defined(ENABLE_AESNI) && !defined(BUILD_BITCOIN_INTERNAL)
+#include <cpuid.h>
+namespace x13sm3_aesni
+{
+void Shavite512(unsigned char* out, const unsigned char* in, size_t lanes);
+void Echo512(unsigned char* out, const unsigned char* in, size_t lanes);
+}
+#endif
+#endif
+
+// Internal implementation code.
+namespace
+{
+/** Number of headers pushed through the stage pipeline together. */
+const size_t MAX_LANES = 8;
+
+/** One chain stage: hash `lanes` consecutive 64-byte inputs into 64-byte outputs. */
+typedef void (*StageType)(unsigned char* out, const unsigned char* in, size_t lanes);
+
+/** Initial states of all stage contexts. They are set up once and only
+ *  copied afterwards, so any number of threads can start hashes from them. */
+struct InitialStates
+{
+    sph_blake512_context blake;
+    sph_bmw512_context bmw;
+    sph_groestl512_context groestl;
+    sph_skein512_context skein;
+    sph_jh512_context jh;
+    sph_keccak512_context keccak;
+    sm3_ctx_t sm3;
+    sph_cubehash512_context cubehash;
+    sph_shavite512_context shavite;
+    sph_simd512_context simd;
+    sph_echo512_context echo;
+    sph_hamsi512_context hamsi;
+    sph_fugue512_context fugue;
+
+    InitialStates()
+    {
+        sph_blake512_init(&blake);
+        sph_bmw512_init(&bmw);
+        sph_groestl512_init(&groestl);
+        sph_skein512_init(&skein);
+        sph_jh512_init(&jh);
+        sph_keccak512_init(&keccak);
+        sm3_init(&sm3);
+        sph_cubehash512_init(&cubehash);
+        sph_shavite512_init(&shavite);
+        sph_simd512_init(&simd);
+        sph_echo512_init(&echo);
+        sph_hamsi512_init(&hamsi);
+        sph_fugue512_init(&fugue);
+    }
+};
+
+const InitialStates& Initial()
+{
+    static const InitialStates initial;
+    return initial;
+}
+
+namespace x13sm3
+{
+/** Run a sph hash over each lane, starting every lane from a copy of the initial state. */
+template <typename Ctx, Ctx InitialStates::*INITIAL, void (*Write)(void*, const void*, size_t), void (*Close)(void*, void*), size_t INPUT_SIZE>
+void Stage(unsigned char* out, const unsigned char* in, size_t lanes)
+{
+    const Ctx& init = Initial().*INITIAL;
+    for (size_t i = 0; i < lanes; ++i) {
+        Ctx ctx = init;
+        Write(&ctx, in + INPUT_SIZE * i, INPUT_SIZE);
+        Close(&ctx, out + 64 * i);
+    }
+}
+
+/** SM3 produces 256 bits; the upper half of the 512-bit chaining value is zero. */
+void SM3(unsigned char* out, const unsigned char* in, size_t lanes)
+{
+    for (size_t i = 0; i < lanes; ++i) {
+        sm3_ctx_t ctx = Initial().sm3;
+        memset(out + 64 * i + 32, 0, 32);
+        sph_sm3(&ctx, in + 64 * i, 64);
+        sph_sm3_close(&ctx, out + 64 * i);
+    }
+}
+
+const StageType Blake512_80 = Stage<sph_blake512_context, &InitialStates::blake, sph_blake512, sph_blake512_close, 80>;
+const StageType Bmw512 = Stage<sph_bmw512_context, &InitialStates::bmw, sph_bmw512, sph_bmw512_close, 64>;
+const StageType Groestl512 = Stage<sph_groestl512_context, &InitialStates::groestl, sph_groestl512, sph_groestl512_close, 64>;
+const StageType Skein512 = Stage<sph_skein512_context, &InitialStates::skein, sph_skein512, sph_skein512_close, 64>;
+const StageType Jh512 = Stage<sph_jh512_context, &InitialStates::jh, sph_jh512, sph_jh512_close, 64>;
+const StageType Keccak512 = Stage<sph_keccak512_context, &InitialStates::keccak, sph_keccak512, sph_keccak512_close, 64>;
+const StageType Cubehash512 = Stage<sph_cubehash512_context, &InitialStates::cubehash, sph_cubehash512, sph_cubehash512_close, 64>;
+const StageType Shavite512 = Stage<sph_shavite512_context, &InitialStates::shavite, sph_shavite512, sph_shavite512_close, 64>;
+const StageType Simd512 = Stage<sph_simd512_context, &InitialStates::simd, sph_simd512, sph_simd512_close, 64>;
+const StageType Echo512 = Stage<sph_echo512_context, &InitialStates::echo, sph_echo512, sph_echo512_close, 64>;
+const StageType Hamsi512 = Stage<sph_hamsi512_context, &InitialStates::hamsi, sph_hamsi512, sph_hamsi512_close, 64>;
+const StageType Fugue512 = Stage<sph_fugue512_context, &InitialStates::fugue, sph_fugue512, sph_fugue512_close, 64>;
+
+} // namespace x13sm3
+
+StageType Shavite512 = x13sm3::Shavite512;
+StageType Echo512 = x13sm3::Echo512;
+
+/** Run up to MAX_LANES BLAKE-512 outputs through the rest of the chain, one stage at a time for all lanes. */
+void X13SM3Chain(unsigned char* out, unsigned char* a, size_t lanes, StageType shavite, StageType echo)
+{
+    unsigned char b[64 * MAX_LANES];
+
+    x13sm3::Bmw512(b, a, lanes);
+    x13sm3::Groestl512(a, b, lanes);
+    x13sm3::Skein512(b, a, lanes);
+    x13sm3::Jh512(a, b, lanes);
+    x13sm3::Keccak512(b, a, lanes);
+    x13sm3::SM3(a, b, lanes);
+    x13sm3::Cubehash512(b, a, lanes);
+    shavite(a, b, lanes);
+    x13sm3::Simd512(b, a, lanes);
+    echo(a, b, lanes);
+    x13sm3::Hamsi512(b, a, lanes);
+    x13sm3::Fugue512(a, b, lanes);
+
+    for (size_t i = 0; i < lanes; ++i) {
+        memcpy(out + 32 * i, a + 64 * i, 32);
+    }
+}
+
+/** Run up to MAX_LANES headers through the chain. */
+void X13SM3Lanes(unsigned char* out, const unsigned char* in, size_t lanes, StageType shavite, StageType echo)
+{
+    unsigned char a[64 * MAX_LANES];
+    x13sm3::Blake512_80(a, in, lanes);
+    X13SM3Chain(out, a, lanes, shavite, echo);
+}
+
+bool SelfTest() {
+    // Compare the selected stages against the reference ones on a few distinct headers.
+    unsigned char in[80 * MAX_LANES];
+    for (size_t i = 0; i < sizeof(in); ++i) {
+        in[i] = (unsigned char)(i * 131 + 7);
+    }
+    unsigned char expected[32 * MAX_LANES];
+    unsigned char out[32 * MAX_LANES];
+    X13SM3Lanes(expected, in, MAX_LANES, x13sm3::Shavite512, x13sm3::Echo512);
+    for (size_t lanes = 1; lanes <= MAX_LANES; ++lanes) {
+        X13SM3Lanes(out, in, lanes, Shavite512, Echo512);
+        if (memcmp(out, expected, 32 * lanes)) return false;
+    }
+    return true;
+}
+
+} // namespace
+
+
+std::string X13SM3AutoDetect()
+{
+    std::string ret = "standard";
+#if defined(ENABLE_AESNI) && !defined(BUILD_BITCOIN_INTERNAL) && (defined(__x86_64__) || defined(__amd64__) || defined(__i386__))
+    uint32_t eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && ((ecx >> 25) & 1)) {
+        Shavite512 = x13sm3_aesni::Shavite512;
+        Echo512 = x13sm3_aesni::Echo512;
+        ret = "aesni(shavite,echo)";
+    }
+#endif
+
+    assert(SelfTest());
+    return ret;
+}
+
+CX13SM3::CX13SM3()
+{
+    Reset();
+}
+
+CX13SM3& CX13SM3::Write(const unsigned char* data, size_t len)
+{
+    sph_blake512(&blake, data, len);
+    return *this;
+}
+
+void CX13SM3::Finalize(unsigned char hash[OUTPUT_SIZE])
+{
+    unsigned char a[64 * MAX_LANES];
+    sph_blake512_close(&blake, a);
+    X13SM3Chain(hash, a, 1, Shavite512, Echo512);
+}
+
+CX13SM3& CX13SM3::Reset()
+{
+    blake = Initial().blake;
+    return *this;
+}
+
+void X13SM3_80(unsigned char* out, const unsigned char* in, size_t blocks)
+{
+    while (blocks) {
+        size_t lanes = std::min(blocks, MAX_LANES);
+        X13SM3Lanes(out, in, lanes, Shavite512, Echo512);
+        out += 32 * lanes;
+        in += 80 * lanes;
+        blocks -= lanes;
+    }
+}
@@ -0,0 +1,48 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_X13SM3_H
+#define BITCOIN_CRYPTO_X13SM3_H
+
+#include <crypto/x13hash/sph_blake.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+
+/** A hasher class for X13-SM3 over input of any length.
+ *
+ *  Only the first stage (BLAKE-512) sees the input; the other stages hash a
+ *  fixed 64-byte chaining value when finalizing. Every stage starts from a
+ *  copy of initial states computed once per process, so instances need no
+ *  setup, can be copied, and are safe to use from several threads at once.
+ */
+class CX13SM3
+{
+private:
+    sph_blake512_context blake;
+
+public:
+    static const size_t OUTPUT_SIZE = 32;
+
+    CX13SM3();
+    CX13SM3& Write(const unsigned char* data, size_t len);
+    void Finalize(unsigned char hash[OUTPUT_SIZE]);
+    CX13SM3& Reset();
+};
+
+/** Autodetect the best available X13-SM3 stage implementations.
+ *  Returns the name of the implementation.
+ */
+std::string X13SM3AutoDetect();
+
+/** Compute multiple X13-SM3 hashes of 80-byte block headers.
+ *  The result for each header is identical to CX13SM3 over the same bytes.
+ *  output:  pointer to a blocks*32 byte output buffer
+ *  input:   pointer to a blocks*80 byte input buffer
+ *  blocks:  the number of hashes to compute.
+ */
+void X13SM3_80(unsigned char* output, const unsigned char* input, size_t blocks);
+
+#endif // BITCOIN_CRYPTO_X13SM3_H
@@ -0,0 +1,243 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+//
+// AES-NI implementations of the SHAvite-3-512 and ECHO-512 stages of X13-SM3,
+// specialized for the fixed 64-byte message every chain stage hashes. They
+// follow the sph reference code in crypto/x13hash and interleave several
+// independent lanes so the AES units stay busy.
+
+#ifdef ENABLE_AESNI
+
+#include <stdint.h>
+#include <stddef.h>
+#include <wmmintrin.h>
+#include <emmintrin.h>
+
+namespace {
+
+/** Number of independent messages processed in lockstep. */
+const int LANES = 4;
+
+inline __m128i Load(const unsigned char* in) { return _mm_loadu_si128((const __m128i*)in); }
+inline void Store(unsigned char* out, __m128i s) { _mm_storeu_si128((__m128i*)out, s); }
+inline __m128i Xor(__m128i x, __m128i y) { return _mm_xor_si128(x, y); }
+
+/** Multiply each byte by 2 in GF(2^8) with the AES polynomial. */
+inline __m128i XTime(__m128i x)
+{
+    const __m128i carry = _mm_cmplt_epi8(x, _mm_setzero_si128());
+    return Xor(_mm_add_epi8(x, x), _mm_and_si128(carry, _mm_set1_epi8(0x1b)));
+}
+
+/** The four 32-bit words of x rotated down by one: (x1, x2, x3, x0). */
+inline __m128i Rot32(__m128i x) { return _mm_shuffle_epi32(x, 0x39); }
+
+/** Words (lo1, lo2, lo3, hi0), i.e. the 128 bits starting one word into lo. */
+inline __m128i Shift32(__m128i lo, __m128i hi) { return _mm_or_si128(_mm_srli_si128(lo, 4), _mm_slli_si128(hi, 12)); }
+
+namespace shavite {
+
+/** SHAvite-3-512 initial value. */
+inline __m128i IV(int i)
+{
+    switch (i) {
+    case 0: return _mm_set_epi32(0x40D55AEC, 0x128A077B, 0x79CA4727, 0x72FCCDD8);
+    case 1: return _mm_set_epi32(0xDF07FBFC, 0xB29F5CD1, 0x430AE307, 0xD1901A06);
+    case 2: return _mm_set_epi32(0xDD577E47, 0xBDE86578, 0x681AB538, 0x8E45D73D);
+    default: return _mm_set_epi32(0x022A4B9A, 0xB9357178, 0x502D9FCD, 0xE275EADE);
+    }
+}
+
+/** Hash N 64-byte messages. The 512-bit message length is the only counter value. */
+template <int N>
+void Transform(unsigned char* out, const unsigned char* in)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i rk[N][112];
+
+    for (int l = 0; l < N; ++l) {
+        for (int i = 0; i < 4; ++i) {
+            rk[l][i] = Load(in + 64 * l + 16 * i);
+        }
+        // Padding bit, bit count (512) at byte 110 and digest size (512) at byte 126.
+        rk[l][4] = _mm_set_epi32(0, 0, 0, 0x80);
+        rk[l][5] = zero;
+        rk[l][6] = _mm_set_epi32(0x02000000, 0, 0, 0);
+        rk[l][7] = _mm_set_epi32(0x02000000, 0, 0, 0);
+    }
+
+    // Key schedule: four nonlinear steps per half, then eight linear ones.
+    int w = 8;
+    for (;;) {
+        for (int s = 0; s < 4; ++s) {
+            for (int l = 0; l < N; ++l) {
+                rk[l][w] = Xor(_mm_aesenc_si128(Rot32(rk[l][w - 8]), zero), rk[l][w - 1]);
+                if (w == 8) {
+                    rk[l][w] = Xor(rk[l][w], _mm_set_epi32(-1, 0, 0, 512));
+                } else if (w == 110) {
+                    rk[l][w] = Xor(rk[l][w], _mm_set_epi32(-1, 0, 512, 0));
+                }
+                rk[l][w + 1] = Xor(_mm_aesenc_si128(Rot32(rk[l][w - 7]), zero), rk[l][w]);
+                if (w + 1 == 41) {
+                    rk[l][w + 1] = Xor(rk[l][w + 1], _mm_set_epi32(~512, 0, 0, 0));
+                } else if (w + 1 == 79) {
+                    rk[l][w + 1] = Xor(rk[l][w + 1], _mm_set_epi32(-1, 512, 0, 0));
+                }
+            }
+            w += 2;
+        }
+        if (w == 112) break;
+        for (int s = 0; s < 8; ++s) {
+            for (int l = 0; l < N; ++l) {
+                rk[l][w] = Xor(rk[l][w - 8], Shift32(rk[l][w - 2], rk[l][w - 1]));
+            }
+            ++w;
+        }
+    }
+
+    __m128i p[N][4];
+    for (int l = 0; l < N; ++l) {
+        for (int i = 0; i < 4; ++i) {
+            p[l][i] = IV(i);
+        }
+    }
+    for (int r = 0, k = 0; r < 14; ++r, k += 8) {
+        for (int l = 0; l < N; ++l) {
+            __m128i x = Xor(p[l][1], rk[l][k]);
+            __m128i y = Xor(p[l][3], rk[l][k + 4]);
+            x = _mm_aesenc_si128(x, rk[l][k + 1]);
+            y = _mm_aesenc_si128(y, rk[l][k + 5]);
+            x = _mm_aesenc_si128(x, rk[l][k + 2]);
+            y = _mm_aesenc_si128(y, rk[l][k + 6]);
+            x = _mm_aesenc_si128(x, rk[l][k + 3]);
+            y = _mm_aesenc_si128(y, rk[l][k + 7]);
+            x = _mm_aesenc_si128(x, zero);
+            y = _mm_aesenc_si128(y, zero);
+            const __m128i t = Xor(p[l][2], y);
+            p[l][2] = p[l][1];
+            p[l][1] = Xor(p[l][0], x);
+            p[l][0] = p[l][3];
+            p[l][3] = t;
+        }
+    }
+
+    for (int l = 0; l < N; ++l) {
+        for (int i = 0; i < 4; ++i) {
+            Store(out + 64 * l + 16 * i, Xor(p[l][i], IV(i)));
+        }
+    }
+}
+
+} // namespace shavite
+
+namespace echo {
+
+/** Hash N 64-byte messages with ECHO-512: a single 1024-bit block, counter 512. */
+template <int N>
+void Transform(unsigned char* out, const unsigned char* in)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i iv = _mm_set_epi32(0, 0, 0, 512);
+    __m128i W[N][16];
+
+    for (int l = 0; l < N; ++l) {
+        for (int i = 0; i < 8; ++i) {
+            W[l][i] = iv;
+        }
+        for (int i = 0; i < 4; ++i) {
+            W[l][8 + i] = Load(in + 64 * l + 16 * i);
+        }
+        // Padding bit, digest size (512) at byte 110 and the 128-bit counter (512).
+        W[l][12] = _mm_set_epi32(0, 0, 0, 0x80);
+        W[l][13] = zero;
+        W[l][14] = _mm_set_epi32(0x02000000, 0, 0, 0);
+        W[l][15] = iv;
+    }
+
+    __m128i k = iv;
+    const __m128i one = _mm_set_epi32(0, 0, 0, 1);
+    for (int r = 0; r < 10; ++r) {
+        // BIG.SubWords
+        for (int i = 0; i < 16; ++i) {
+            for (int l = 0; l < N; ++l) {
+                W[l][i] = _mm_aesenc_si128(W[l][i], k);
+            }
+            for (int l = 0; l < N; ++l) {
+                W[l][i] = _mm_aesenc_si128(W[l][i], zero);
+            }
+            k = _mm_add_epi32(k, one);
+        }
+        for (int l = 0; l < N; ++l) {
+            // BIG.ShiftRows
+            __m128i t = W[l][1];
+            W[l][1] = W[l][5];
+            W[l][5] = W[l][9];
+            W[l][9] = W[l][13];
+            W[l][13] = t;
+            t = W[l][2];
+            W[l][2] = W[l][10];
+            W[l][10] = t;
+            t = W[l][6];
+            W[l][6] = W[l][14];
+            W[l][14] = t;
+            t = W[l][15];
+            W[l][15] = W[l][11];
+            W[l][11] = W[l][7];
+            W[l][7] = W[l][3];
+            W[l][3] = t;
+            // BIG.MixColumns
+            for (int c = 0; c < 16; c += 4) {
+                const __m128i a = W[l][c], b = W[l][c + 1], cc = W[l][c + 2], d = W[l][c + 3];
+                const __m128i ab = Xor(a, b), bc = Xor(b, cc), cd = Xor(cc, d);
+                const __m128i abx = XTime(ab), bcx = XTime(bc), cdx = XTime(cd);
+                W[l][c] = Xor(Xor(abx, bc), d);
+                W[l][c + 1] = Xor(Xor(bcx, a), cd);
+                W[l][c + 2] = Xor(Xor(cdx, ab), d);
+                W[l][c + 3] = Xor(Xor(Xor(abx, bcx), Xor(cdx, ab)), cc);
+            }
+        }
+    }
+
+    // BIG.Final, keeping only the 512 output bits.
+    for (int l = 0; l < N; ++l) {
+        for (int i = 0; i < 4; ++i) {
+            const __m128i m = Load(in + 64 * l + 16 * i);
+            Store(out + 64 * l + 16 * i, Xor(Xor(iv, m), Xor(W[l][i], W[l][i + 8])));
+        }
+    }
+}
+
+} // namespace echo
+
+template <void (*TransformN)(unsigned char*, const unsigned char*), void (*Transform1)(unsigned char*, const unsigned char*)>
+void Lanes(unsigned char* out, const unsigned char* in, size_t lanes)
+{
+    while (lanes >= LANES) {
+        TransformN(out, in);
+        out += 64 * LANES;
+        in += 64 * LANES;
+        lanes -= LANES;
+    }
+    while (lanes--) {
+        Transform1(out, in);
+        out += 64;
+        in += 64;
+    }
+}
+
+} // namespace
+
+namespace x13sm3_aesni {
+void Shavite512(unsigned char* out, const unsigned char* in, size_t lanes)
+{
+    Lanes<shavite::Transform<LANES>, shavite::Transform<1>>(out, in, lanes);
+}
+
+void Echo512(unsigned char* out, const unsigned char* in, size_t lanes)
+{
+    Lanes<echo::Transform<LANES>, echo::Transform<1>>(out, in, lanes);
+}
+}
+
+#endif
@@ -180,6 +180,15 @@ CDBWrapper::~CDBWrapper()
     options.env = nullptr;
 }
 
+CDBSnapshot::CDBSnapshot(const CDBWrapper &_parent) : parent(_parent), snapshot(_parent.pdb->GetSnapshot())
+{
+}
+
+CDBSnapshot::~CDBSnapshot()
+{
+    parent.pdb->ReleaseSnapshot(snapshot);
+}
+
 bool CDBWrapper::WriteBatch(CDBBatch& batch, bool fSync)
 {
     const bool log_memory = LogAcceptCategory(BCLog::LEVELDB);
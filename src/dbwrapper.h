@@ -16,6 +16,9 @@
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+#include <algorithm>
+#include <numeric>
+
 static const size_t DBWRAPPER_PREALLOC_KEY_SIZE = 64;
 static const size_t DBWRAPPER_PREALLOC_VALUE_SIZE = 1024;
 
@@ -173,9 +176,27 @@ public:
 
 };
 
+/** A consistent view of a CDBWrapper as of when it was taken, to read several keys from. */
+class CDBSnapshot
+{
+    friend class CDBWrapper;
+
+private:
+    const CDBWrapper &parent;
+    const leveldb::Snapshot *snapshot;
+
+public:
+    explicit CDBSnapshot(const CDBWrapper &_parent);
+    ~CDBSnapshot();
+
+    CDBSnapshot(const CDBSnapshot&) = delete;
+    CDBSnapshot& operator=(const CDBSnapshot&) = delete;
+};
+
 class CDBWrapper
 {
     friend const std::vector<unsigned char>& dbwrapper_private::GetObfuscateKey(const CDBWrapper &w);
+    friend class CDBSnapshot;
 private:
     //! custom environment this database is using (may be nullptr in case of default environment)
     leveldb::Env* penv;
@@ -212,6 +233,19 @@ private:
 
     std::vector<unsigned char> CreateObfuscateKey() const;
 
+    template <typename V>
+    bool DecodeValue(const std::string& strValue, V& value) const
+    {
+        try {
+            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue.Xor(obfuscate_key);
+            ssValue >> value;
+        } catch (const std::exception&) {
+            return false;
+        }
+        return true;
+    }
+
 public:
     /**
      * @param[in] path        Location in the filesystem where leveldb data will be stored.
@@ -243,14 +277,58 @@ public:
             LogPrintf("LevelDB read failure: %s\n", status.ToString());
             dbwrapper_private::HandleError(status);
         }
-        try {
-            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
-            ssValue.Xor(obfuscate_key);
-            ssValue >> value;
-        } catch (const std::exception&) {
-            return false;
+        return DecodeValue(strValue, value);
+    }
+
+    /**
+     * Read the values of several keys. The keys are serialized into a single
+     * buffer and looked up in key order, so that neighbouring keys are read
+     * from the same database blocks. found[i] is set if keys[i] exists and
+     * values[i] could be read. If snapshot is given, read from it.
+     * Returns the number of values read.
+     */
+    template <typename K, typename V>
+    size_t MultiRead(const std::vector<K>& keys, std::vector<V>& values, std::vector<bool>& found, const CDBSnapshot* snapshot = nullptr) const
+    {
+        values.resize(keys.size());
+        found.assign(keys.size(), false);
+
+        CDataStream ssKeys(SER_DISK, CLIENT_VERSION);
+        ssKeys.reserve(keys.size() * DBWRAPPER_PREALLOC_KEY_SIZE);
+        std::vector<size_t> vKeyEnd(keys.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+            ssKeys << keys[i];
+            vKeyEnd[i] = ssKeys.size();
         }
-        return true;
+        auto key_slice = [&](size_t i) {
+            const size_t nBegin = i == 0 ? 0 : vKeyEnd[i - 1];
+            return leveldb::Slice(ssKeys.data() + nBegin, vKeyEnd[i] - nBegin);
+        };
+        std::vector<size_t> vOrder(keys.size());
+        std::iota(vOrder.begin(), vOrder.end(), 0);
+        std::sort(vOrder.begin(), vOrder.end(), [&](size_t a, size_t b) { return key_slice(a).compare(key_slice(b)) < 0; });
+
+        leveldb::ReadOptions options = readoptions;
+        if (snapshot) {
+            assert(&snapshot->parent == this);
+            options.snapshot = snapshot->snapshot;
+        }
+        std::string strValue;
+        size_t nRead = 0;
+        for (size_t i : vOrder) {
+            leveldb::Status status = pdb->Get(options, key_slice(i), &strValue);
+            if (!status.ok()) {
+                if (status.IsNotFound())
+                    continue;
+                LogPrintf("LevelDB read failure: %s\n", status.ToString());
+                dbwrapper_private::HandleError(status);
+            }
+            if (DecodeValue(strValue, values[i])) {
+                found[i] = true;
+                nRead++;
+            }
+        }
+        return nRead;
     }
 
     template <typename K, typename V>
@@ -8,228 +8,27 @@
 
 #include <crypto/ripemd160.h>
 #include <crypto/sha256.h>
+#include <crypto/x13sm3.h>
 #include <prevector.h>
 #include <serialize.h>
 #include <uint256.h>
 #include <version.h>
 
 #include <vector>
-#include "crypto/x13hash/sph_blake.h"
-#include "crypto/x13hash/sph_bmw.h"
-#include "crypto/x13hash/sph_groestl.h"
-#include "crypto/x13hash/sph_jh.h"
-#include "crypto/x13hash/sph_keccak.h"
-#include "crypto/x13hash/sph_skein.h"
-#include "crypto/x13hash/sph_luffa.h"
-#include "crypto/x13hash/sph_cubehash.h"
-#include "crypto/x13hash/sph_shavite.h"
-#include "crypto/x13hash/sph_simd.h"
-#include "crypto/x13hash/sph_echo.h"
-#include "crypto/x13hash/sph_hamsi.h"
-#include "crypto/x13hash/sph_fugue.h"
-#include "crypto/x13hash/sph_sm3.h"
-
-#ifdef GLOBALDEFINED
-#define GLOBAL
-#else
-#define GLOBAL extern
-#endif
-
-GLOBAL sph_blake512_context     z_blake;
-GLOBAL sph_bmw512_context       z_bmw;
-GLOBAL sph_groestl512_context   z_groestl;
-GLOBAL sph_jh512_context        z_jh;
-GLOBAL sph_keccak512_context    z_keccak;
-GLOBAL sph_skein512_context     z_skein;
-GLOBAL sph_luffa512_context     z_luffa;
-GLOBAL sph_cubehash512_context  z_cubehash;
-GLOBAL sph_shavite512_context   z_shavite;
-GLOBAL sph_simd512_context      z_simd;
-GLOBAL sph_echo512_context      z_echo;
-GLOBAL sph_hamsi512_context     z_hamsi;
-GLOBAL sph_fugue512_context     z_fugue;
-#define fillz() do { \
-    sph_blake512_init(&z_blake); \
-    sph_bmw512_init(&z_bmw); \
-    sph_groestl512_init(&z_groestl); \
-    sph_jh512_init(&z_jh); \
-    sph_keccak512_init(&z_keccak); \
-    sph_skein512_init(&z_skein); \
-    sph_luffa512_init(&z_luffa); \
-    sph_cubehash512_init(&z_cubehash); \
-    sph_shavite512_init(&z_shavite); \
-    sph_simd512_init(&z_simd); \
-    sph_echo512_init(&z_echo); \
-    sph_hamsi512_init(&z_hamsi); \
-    sph_fugue512_init(&z_fugue); \
-} while (0) 
-typedef uint256 ChainCode;
-template<typename T1>
-inline uint256 HashX13(const T1 pbegin, const T1 pend)
-
-{
-    sph_blake512_context     ctx_blake;
-    sph_bmw512_context       ctx_bmw;
-    sph_groestl512_context   ctx_groestl;
-    sph_jh512_context        ctx_jh;
-    sph_keccak512_context    ctx_keccak;
-    sph_skein512_context     ctx_skein;
-    sph_luffa512_context     ctx_luffa;
-    sph_cubehash512_context  ctx_cubehash;
-    sph_shavite512_context   ctx_shavite;
-    sph_simd512_context      ctx_simd;
-    sph_echo512_context      ctx_echo;
-    sph_hamsi512_context      ctx_hamsi;
-    sph_fugue512_context      ctx_fugue;
-    static unsigned char pblank[1];
-
-#ifndef QT_NO_DEBUG
-    //std::string strhash;
-    //strhash = "";
-#endif
-
-    uint256 hash[34];
-
-    sph_blake512_init(&ctx_blake);
-    sph_blake512 (&ctx_blake, (pbegin == pend ? pblank : static_cast<const void*>(&pbegin[0])), (pend - pbegin) * sizeof(pbegin[0]));
-    sph_blake512_close(&ctx_blake, static_cast<void*>(&hash[0]));
-
-    sph_bmw512_init(&ctx_bmw);
-    sph_bmw512 (&ctx_bmw, static_cast<const void*>(&hash[0]), 64);
-    sph_bmw512_close(&ctx_bmw, static_cast<void*>(&hash[2]));
-
-    sph_groestl512_init(&ctx_groestl);
-    sph_groestl512 (&ctx_groestl, static_cast<const void*>(&hash[2]), 64);
-    sph_groestl512_close(&ctx_groestl, static_cast<void*>(&hash[4]));
-
-    sph_skein512_init(&ctx_skein);
-    sph_skein512 (&ctx_skein, static_cast<const void*>(&hash[4]), 64);
-    sph_skein512_close(&ctx_skein, static_cast<void*>(&hash[6]));
-
-    sph_jh512_init(&ctx_jh);
-    sph_jh512 (&ctx_jh, static_cast<const void*>(&hash[6]), 64);
-    sph_jh512_close(&ctx_jh, static_cast<void*>(&hash[8]));
-
-    sph_keccak512_init(&ctx_keccak);
-    sph_keccak512 (&ctx_keccak, static_cast<const void*>(&hash[8]), 64);
-    sph_keccak512_close(&ctx_keccak, static_cast<void*>(&hash[10]));
-
-    sph_luffa512_init(&ctx_luffa);
-    sph_luffa512 (&ctx_luffa, static_cast<void*>(&hash[10]), 64);
-    sph_luffa512_close(&ctx_luffa, static_cast<void*>(&hash[12]));
-
-    sph_cubehash512_init(&ctx_cubehash);
-    sph_cubehash512 (&ctx_cubehash, static_cast<const void*>(&hash[12]), 64);
-    sph_cubehash512_close(&ctx_cubehash, static_cast<void*>(&hash[14]));
-
-    sph_shavite512_init(&ctx_shavite);
-    sph_shavite512(&ctx_shavite, static_cast<const void*>(&hash[14]), 64);
-    sph_shavite512_close(&ctx_shavite, static_cast<void*>(&hash[16]));
-
-    sph_simd512_init(&ctx_simd);
-    sph_simd512 (&ctx_simd, static_cast<const void*>(&hash[16]), 64);
-    sph_simd512_close(&ctx_simd, static_cast<void*>(&hash[18]));
-
-    sph_echo512_init(&ctx_echo);
-    sph_echo512 (&ctx_echo, static_cast<const void*>(&hash[18]), 64);
-    sph_echo512_close(&ctx_echo, static_cast<void*>(&hash[20]));
-
-    sph_hamsi512_init(&ctx_hamsi);
-    sph_hamsi512 (&ctx_hamsi, static_cast<const void*>(&hash[20]), 64);
-    sph_hamsi512_close(&ctx_hamsi, static_cast<void*>(&hash[22]));
-
-    sph_fugue512_init(&ctx_fugue);
-    sph_fugue512 (&ctx_fugue, static_cast<const void*>(&hash[22]), 64);
-    sph_fugue512_close(&ctx_fugue, static_cast<void*>(&hash[24]));
-
-
-    return hash[24];
-}
 
+typedef uint256 ChainCode;
 
+/** Compute the X13-SM3 hash of an object. */
 template<typename T1>
 inline uint256 HashX13sm3(const T1 pbegin, const T1 pend)
-
 {
-    sph_blake512_context     ctx_blake;
-    sph_bmw512_context       ctx_bmw;
-    sph_groestl512_context   ctx_groestl;
-    sph_jh512_context        ctx_jh;
-    sph_keccak512_context    ctx_keccak;
-    sph_skein512_context     ctx_skein;
-    sm3_ctx_t		     ctx_sm3;
-    sph_cubehash512_context  ctx_cubehash;
-    sph_shavite512_context   ctx_shavite;
-    sph_simd512_context      ctx_simd;
-    sph_echo512_context      ctx_echo;
-    sph_hamsi512_context      ctx_hamsi;
-    sph_fugue512_context      ctx_fugue;
-    static unsigned char pblank[1];
-
-#ifndef QT_NO_DEBUG
-    //std::string strhash;
-    //strhash = "";
-#endif
-
-    uint256 hash[34];
-
-    sph_blake512_init(&ctx_blake);
-    sph_blake512 (&ctx_blake, (pbegin == pend ? pblank : static_cast<const void*>(&pbegin[0])), (pend - pbegin) * sizeof(pbegin[0]));
-    sph_blake512_close(&ctx_blake, static_cast<void*>(&hash[0]));
-
-    sph_bmw512_init(&ctx_bmw);
-    sph_bmw512 (&ctx_bmw, static_cast<const void*>(&hash[0]), 64);
-    sph_bmw512_close(&ctx_bmw, static_cast<void*>(&hash[2]));
-
-    sph_groestl512_init(&ctx_groestl);
-    sph_groestl512 (&ctx_groestl, static_cast<const void*>(&hash[2]), 64);
-    sph_groestl512_close(&ctx_groestl, static_cast<void*>(&hash[4]));
-
-    sph_skein512_init(&ctx_skein);
-    sph_skein512 (&ctx_skein, static_cast<const void*>(&hash[4]), 64);
-    sph_skein512_close(&ctx_skein, static_cast<void*>(&hash[6]));
-
-    sph_jh512_init(&ctx_jh);
-    sph_jh512 (&ctx_jh, static_cast<const void*>(&hash[6]), 64);
-    sph_jh512_close(&ctx_jh, static_cast<void*>(&hash[8]));
-
-    sph_keccak512_init(&ctx_keccak);
-    sph_keccak512 (&ctx_keccak, static_cast<const void*>(&hash[8]), 64);
-    sph_keccak512_close(&ctx_keccak, static_cast<void*>(&hash[10]));
-
-    hash[12].SetNull();	//sm3 is 256bit, just in case
-    hash[13].SetNull();
-    sm3_init(&ctx_sm3);
-    sph_sm3(&ctx_sm3, static_cast<const void*>(&hash[10]), 64);
-    sph_sm3_close(&ctx_sm3, static_cast<void*>(&hash[12]));
-
-    sph_cubehash512_init(&ctx_cubehash);
-    sph_cubehash512 (&ctx_cubehash, static_cast<const void*>(&hash[12]), 64);
-    sph_cubehash512_close(&ctx_cubehash, static_cast<void*>(&hash[14]));
-
-    sph_shavite512_init(&ctx_shavite);
-    sph_shavite512(&ctx_shavite, static_cast<const void*>(&hash[14]), 64);
-    sph_shavite512_close(&ctx_shavite, static_cast<void*>(&hash[16]));
-
-    sph_simd512_init(&ctx_simd);
-    sph_simd512 (&ctx_simd, static_cast<const void*>(&hash[16]), 64);
-    sph_simd512_close(&ctx_simd, static_cast<void*>(&hash[18]));
-
-    sph_echo512_init(&ctx_echo);
-    sph_echo512 (&ctx_echo, static_cast<const void*>(&hash[18]), 64);
-    sph_echo512_close(&ctx_echo, static_cast<void*>(&hash[20]));
-
-    sph_hamsi512_init(&ctx_hamsi);
-    sph_hamsi512 (&ctx_hamsi, static_cast<const void*>(&hash[20]), 64);
-    sph_hamsi512_close(&ctx_hamsi, static_cast<void*>(&hash[22]));
-
-    sph_fugue512_init(&ctx_fugue);
-    sph_fugue512 (&ctx_fugue, static_cast<const void*>(&hash[22]), 64);
-    sph_fugue512_close(&ctx_fugue, static_cast<void*>(&hash[24]));
-
-
-    return hash[24];
+    static const unsigned char pblank[1] = {};
+    uint256 result;
+    CX13SM3().Write(pbegin == pend ? pblank : (const unsigned char*)&pbegin[0], (pend - pbegin) * sizeof(pbegin[0]))
+             .Finalize(result.begin());
+    return result;
 }
+
 /** A hasher class for Bitcoin's 256-bit hash (double SHA-256). */
 class CHash256 {
 private:
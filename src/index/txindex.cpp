@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <index/txindex.h>
+#include <blockpipeline.h>
 #include <shutdown.h>
 #include <ui_interface.h>
 #include <util/system.h>
@@ -59,6 +60,10 @@ public:
     /// transaction hash is not indexed.
     bool ReadTxPos(const uint256& txid, CDiskTxPos& pos) const;
 
+    /// Read the disk locations of several transactions at once. found[i] is set if txids[i] is
+    /// indexed. Returns the number of transactions found.
+    size_t ReadTxPositions(const std::vector<uint256>& txids, std::vector<CDiskTxPos>& positions, std::vector<bool>& found) const;
+
     /// Write a batch of transaction positions to the DB.
     bool WriteTxs(const std::vector<std::pair<uint256, CDiskTxPos>>& v_pos);
 
@@ -76,6 +81,16 @@ bool TxIndex::DB::ReadTxPos(const uint256 &txid, CDiskTxPos& pos) const
     return Read(std::make_pair(DB_TXINDEX, txid), pos);
 }
 
+size_t TxIndex::DB::ReadTxPositions(const std::vector<uint256>& txids, std::vector<CDiskTxPos>& positions, std::vector<bool>& found) const
+{
+    std::vector<std::pair<char, uint256>> keys;
+    keys.reserve(txids.size());
+    for (const uint256& txid : txids) {
+        keys.emplace_back(DB_TXINDEX, txid);
+    }
+    return MultiRead(keys, positions, found);
+}
+
 bool TxIndex::DB::WriteTxs(const std::vector<std::pair<uint256, CDiskTxPos>>& v_pos)
 {
     CDBBatch batch(*this);
@@ -257,11 +272,19 @@ bool TxIndex::WriteBlock(const CBlock& block, const CBlockIndex* pindex)
 
 BaseIndex::DB& TxIndex::GetDB() const { return *m_db; }
 
-bool TxIndex::FindTx(const uint256& tx_hash, uint256& block_hash, CTransactionRef& tx) const
+/// Read the transaction with the given hash at postx, and the hash of the block it is in.
+static bool ReadTxFromDisk(const CDiskTxPos& postx, const uint256& tx_hash, uint256& block_hash, CTransactionRef& tx)
 {
-    CDiskTxPos postx;
-    if (!m_db->ReadTxPos(tx_hash, postx)) {
-        return false;
+    // A block still queued for writing is only in memory
+    if (std::shared_ptr<const CBlock> pending = g_block_writer.Get(CDiskBlockPos(postx.nFile, postx.nPos))) {
+        for (const CTransactionRef& block_tx : pending->vtx) {
+            if (block_tx->GetHash() == tx_hash) {
+                tx = block_tx;
+                block_hash = pending->GetHash();
+                return true;
+            }
+        }
+        return error("%s: txid mismatch", __func__);
     }
 
     CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
@@ -284,3 +307,32 @@ bool TxIndex::FindTx(const uint256& tx_hash, uint256& block_hash, CTransactionRe
     block_hash = header.GetHash();
     return true;
 }
+
+bool TxIndex::FindTx(const uint256& tx_hash, uint256& block_hash, CTransactionRef& tx) const
+{
+    CDiskTxPos postx;
+    if (!m_db->ReadTxPos(tx_hash, postx)) {
+        return false;
+    }
+    return ReadTxFromDisk(postx, tx_hash, block_hash, tx);
+}
+
+size_t TxIndex::FindTxs(const std::vector<uint256>& tx_hashes, std::vector<uint256>& block_hashes, std::vector<CTransactionRef>& txs) const
+{
+    std::vector<CDiskTxPos> positions;
+    std::vector<bool> found;
+    m_db->ReadTxPositions(tx_hashes, positions, found);
+
+    block_hashes.assign(tx_hashes.size(), uint256());
+    txs.assign(tx_hashes.size(), nullptr);
+    size_t n_found = 0;
+    for (size_t i = 0; i < tx_hashes.size(); ++i) {
+        if (!found[i]) continue;
+        if (ReadTxFromDisk(positions[i], tx_hashes[i], block_hashes[i], txs[i])) {
+            ++n_found;
+        } else {
+            txs[i] = nullptr;
+        }
+    }
+    return n_found;
+}
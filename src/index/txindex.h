@@ -46,6 +46,14 @@ public:
     /// @param[out]  tx  The transaction itself.
     /// @return  true if transaction is found, false otherwise
     bool FindTx(const uint256& tx_hash, uint256& block_hash, CTransactionRef& tx) const;
+
+    /// Look up several transactions by hash, reading their locations from the index in one pass.
+    ///
+    /// @param[in]   tx_hashes  The hashes of the transactions to be returned.
+    /// @param[out]  block_hashes  For each transaction found, the hash of the block it is in.
+    /// @param[out]  txs  For each transaction found, the transaction itself, nullptr otherwise.
+    /// @return  the number of transactions found
+    size_t FindTxs(const std::vector<uint256>& tx_hashes, std::vector<uint256>& block_hashes, std::vector<CTransactionRef>& txs) const;
 };
 
 /// The global transaction index, used in GetTransaction. May be null.
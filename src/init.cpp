@@ -11,11 +11,14 @@
 
 #include <addrman.h>
 #include <amount.h>
+#include <blockcache.h>
+#include <blockpipeline.h>
 #include <chain.h>
 #include <chainparams.h>
 #include <checkpoints.h>
 #include <compat/sanity.h>
 #include <consensus/validation.h>
+#include <crypto/x13sm3.h>
 #include <fs.h>
 #include <httpserver.h>
 #include <httprpc.h>
@@ -217,6 +220,8 @@ void Shutdown()
     // CScheduler/checkqueue threadGroup
     threadGroup.interrupt_all();
     threadGroup.join_all();
+    g_block_prefetcher.Stop();
+    g_block_writer.Stop();
 
     // After the threads that potentially access these pointers have been stopped,
     // destruct and reset all to nullptr.
@@ -261,6 +266,7 @@ void Shutdown()
             FlushStateToDisk();
         }
         pcoinsTip.reset();
+        pcoinswriter.reset();
         pcoinscatcher.reset();
         pcoinsdbview.reset();
         pblocktree.reset();
@@ -385,6 +391,8 @@ void SetupServerArgs()
     gArgs.AddArg("-prune=<n>", strprintf("Reduce storage requirements by enabling pruning (deleting) of old blocks. This allows the pruneblockchain RPC to be called to delete specific blocks, and enables automatic pruning of old blocks if a target size in MiB is provided. This mode is incompatible with -txindex and -rescan. "
             "Warning: Reverting this setting requires re-downloading the entire blockchain. "
             "(default: 0 = disable pruning blocks, 1 = allow manual pruning via RPC, >=%u = automatically prune block files to stay under the specified target size in MiB)", MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024), false, OptionsCategory::OPTIONS);
+    gArgs.AddArg("-recentblockcache=<n>", strprintf("Keep recently relayed or served blocks in memory up to <n> megabytes (default: %u)", DEFAULT_RECENT_BLOCK_CACHE), false, OptionsCategory::OPTIONS);
+    gArgs.AddArg("-recentblocks=<n>", strprintf("Keep at most <n> recently relayed or served blocks in memory (0 to disable, default: %u)", DEFAULT_RECENT_BLOCKS), false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-reindex", "Rebuild chain state and block index from the blk*.dat files on disk", false, OptionsCategory::OPTIONS);
     gArgs.AddArg("-reindex-chainstate", "Rebuild chain state from the currently indexed blocks", false, OptionsCategory::OPTIONS);
 #ifndef WIN32
@@ -412,6 +420,7 @@ void SetupServerArgs()
     gArgs.AddArg("-maxsendbuffer=<n>", strprintf("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)", DEFAULT_MAXSENDBUFFER), false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-maxtimeadjustment", strprintf("Maximum allowed median peer time offset adjustment. Local perspective of time may be influenced by peers forward or backward by this amount. (default: %u seconds)", DEFAULT_MAX_TIME_ADJUSTMENT), false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-maxuploadtarget=<n>", strprintf("Tries to keep outbound traffic under the given target (in MiB per 24h), 0 = no limit (default: %d)", DEFAULT_MAX_UPLOAD_TARGET), false, OptionsCategory::CONNECTION);
+    gArgs.AddArg("-msghandlerthreads=<n>", strprintf("Set the number of threads processing peer messages (1 to %d, 0 = auto, <0 = leave that many cores free, default: %d)", MAX_MSGHANDLER_THREADS, DEFAULT_MSGHANDLER_THREADS), false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-onion=<ip:port>", "Use separate SOCKS5 proxy to reach peers via Tor hidden services, set -noonion to disable (default: -proxy)", false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-onlynet=<net>", "Make outgoing connections only through network <net> (ipv4, ipv6 or onion). Incoming connections are not affected by this option. This option can be specified multiple times to allow multiple networks.", false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-peerbloomfilters", strprintf("Support filtering of blocks and transaction with bloom filters (default: %u)", DEFAULT_PEERBLOOMFILTERS), false, OptionsCategory::CONNECTION);
@@ -420,6 +429,14 @@ void SetupServerArgs()
     gArgs.AddArg("-proxy=<ip:port>", "Connect through SOCKS5 proxy, set -noproxy to disable (default: disabled)", false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-proxyrandomize", strprintf("Randomize credentials for every proxy connection. This enables Tor stream isolation (default: %u)", DEFAULT_PROXYRANDOMIZE), false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-seednode=<ip>", "Connect to a node to retrieve peer addresses, and disconnect. This option can be specified multiple times to connect to multiple nodes.", false, OptionsCategory::CONNECTION);
+    std::string socket_events_modes = "select";
+#ifdef USE_POLL
+    socket_events_modes += ", poll";
+#endif
+#ifdef USE_EPOLL
+    socket_events_modes += ", epoll";
+#endif
+    gArgs.AddArg("-socketevents=<mode>", strprintf("Wait for socket events with <mode>, which must be one of: %s (default: %s)", socket_events_modes, GetSocketEventsModeName(DEFAULT_SOCKET_EVENTS)), false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-timeout=<n>", strprintf("Specify connection timeout in milliseconds (minimum: 1, default: %d)", DEFAULT_CONNECT_TIMEOUT), false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-torcontrol=<ip>:<port>", strprintf("Tor control port to use if onion listening enabled (default: %s)", DEFAULT_TOR_CONTROL), false, OptionsCategory::CONNECTION);
     gArgs.AddArg("-torpassword=<pass>", "Tor control port password (default: empty)", false, OptionsCategory::CONNECTION);
@@ -452,6 +469,7 @@ void SetupServerArgs()
 
     gArgs.AddArg("-checkblocks=<n>", strprintf("How many blocks to check at startup (default: %u, 0 = all)", DEFAULT_CHECKBLOCKS), true, OptionsCategory::DEBUG_TEST);
     gArgs.AddArg("-checklevel=<n>", strprintf("How thorough the block verification of -checkblocks is (0-4, default: %u)", DEFAULT_CHECKLEVEL), true, OptionsCategory::DEBUG_TEST);
+    gArgs.AddArg("-checkindexpow", strprintf("Re-verify the proof of work of every block index entry at startup, in parallel on all script verification threads (default: %u)", DEFAULT_CHECKINDEXPOW), true, OptionsCategory::DEBUG_TEST);
     gArgs.AddArg("-checkblockindex", strprintf("Do a full consistency check for mapBlockIndex, setBlockIndexCandidates, chainActive and mapBlocksUnlinked occasionally. (default: %u)", defaultChainParams->DefaultConsistencyChecks()), true, OptionsCategory::DEBUG_TEST);
     gArgs.AddArg("-checkmempool=<n>", strprintf("Run checks every <n> transactions (default: %u)", defaultChainParams->DefaultConsistencyChecks()), true, OptionsCategory::DEBUG_TEST);
     gArgs.AddArg("-checkpoints", strprintf("Disable expensive verification for known chain history (default: %u)", DEFAULT_CHECKPOINTS_ENABLED), true, OptionsCategory::DEBUG_TEST);
@@ -852,6 +870,7 @@ namespace { // Variables internal to initialization process only
 int nMaxConnections;
 int nUserMaxConnections;
 int nFD;
+SocketEventsMode socketEventsMode;
 ServiceFlags nLocalServices = ServiceFlags(NODE_NETWORK | NODE_NETWORK_LIMITED);
 
 } // namespace
@@ -942,6 +961,11 @@ bool AppInitParameterInteraction()
         return InitError("Cannot set -bind or -whitebind together with -listen=0");
     }
 
+    socketEventsMode = DEFAULT_SOCKET_EVENTS;
+    if (gArgs.IsArgSet("-socketevents") && !ParseSocketEventsMode(gArgs.GetArg("-socketevents", ""), socketEventsMode)) {
+        return InitError(strprintf(_("Unsupported socket events mode -socketevents=%s."), gArgs.GetArg("-socketevents", "")));
+    }
+
     // Make sure enough file descriptors are available
     int nBind = std::max(nUserBind, size_t(1));
     nUserMaxConnections = gArgs.GetArg("-maxconnections", DEFAULT_MAX_PEER_CONNECTIONS);
@@ -949,7 +973,9 @@ bool AppInitParameterInteraction()
 
     // Trim requested connection counts, to fit into system limitations
     // <int> in std::min<int>(...) to work around FreeBSD compilation issue described in #2695
-    nMaxConnections = std::max(std::min<int>(nMaxConnections, FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS - MAX_ADDNODE_CONNECTIONS), 0);
+    if (socketEventsMode == SocketEventsMode::SELECT) {
+        nMaxConnections = std::max(std::min<int>(nMaxConnections, FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS - MAX_ADDNODE_CONNECTIONS), 0);
+    }
     nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS + MAX_ADDNODE_CONNECTIONS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -1005,6 +1031,7 @@ bool AppInitParameterInteraction()
         mempool.setSanityCheck(1.0 / ratio);
     }
     fCheckBlockIndex = gArgs.GetBoolArg("-checkblockindex", chainparams.DefaultConsistencyChecks());
+    fCheckIndexPoW = gArgs.GetBoolArg("-checkindexpow", DEFAULT_CHECKINDEXPOW);
     fCheckpointsEnabled = gArgs.GetBoolArg("-checkpoints", DEFAULT_CHECKPOINTS_ENABLED);
 
     hashAssumeValid = uint256S(gArgs.GetArg("-assumevalid", chainparams.GetConsensus().defaultAssumeValid.GetHex()));
@@ -1032,6 +1059,14 @@ bool AppInitParameterInteraction()
     int64_t nMempoolSizeMin = gArgs.GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000 * 40;
     if (nMempoolSizeMax < 0 || nMempoolSizeMax < nMempoolSizeMin)
         return InitError(strprintf(_("-maxmempool must be at least %d MB"), std::ceil(nMempoolSizeMin / 1000000.0)));
+
+    // recent block cache limits
+    int64_t nRecentBlocks = gArgs.GetArg("-recentblocks", DEFAULT_RECENT_BLOCKS);
+    int64_t nRecentBlockCache = gArgs.GetArg("-recentblockcache", DEFAULT_RECENT_BLOCK_CACHE);
+    if (nRecentBlocks < 0 || nRecentBlockCache < 0)
+        return InitError(_("-recentblocks and -recentblockcache must not be negative"));
+    g_recent_blocks.SetLimits(nRecentBlocks, nRecentBlockCache << 20);
+
     // incremental relay fee sets the minimum feerate increase necessary for BIP 125 replacement in the mempool
     // and the amount the mempool min fee increases above the feerate of txs evicted due to mempool limiting.
     if (gArgs.IsArgSet("-incrementalrelayfee"))
@@ -1195,6 +1230,8 @@ bool AppInitSanityChecks()
     // Initialize elliptic curve code
     std::string sha256_algo = SHA256AutoDetect();
     LogPrintf("Using the '%s' SHA256 implementation\n", sha256_algo);
+    std::string x13sm3_algo = X13SM3AutoDetect();
+    LogPrintf("Using the '%s' X13-SM3 implementation\n", x13sm3_algo);
     RandomInit();
     ECC_Start();
     globalVerifyHandle.reset(new ECCVerifyHandle());
@@ -1263,6 +1300,10 @@ bool AppInitMain()
     if (nScriptCheckThreads) {
         for (int i=0; i<nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadPoWCheck);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadCoinFetch);
     }
 
     // Start the lightweight task scheduler thread
@@ -1449,6 +1490,7 @@ bool AppInitMain()
                 LOCK(cs_main);
                 UnloadBlockIndex();
                 pcoinsTip.reset();
+                pcoinswriter.reset();
                 pcoinsdbview.reset();
                 pcoinscatcher.reset();
                 // new CBlockTreeDB tries to delete the existing file, which
@@ -1516,7 +1558,9 @@ bool AppInitMain()
                 }
 
                 // The on-disk coinsdb is now in a good state, create the cache
-                pcoinsTip.reset(new CCoinsViewCache(pcoinscatcher.get()));
+                pcoinswriter.reset(new CCoinsViewWriter(pcoinscatcher.get()));
+                pcoinswriter->Start();
+                pcoinsTip.reset(new CCoinsViewCache(pcoinswriter.get()));
 
                 is_coinsview_empty = fReset || fReindexChainState || pcoinsTip->GetBestBlock().IsNull();
                 if (!is_coinsview_empty) {
@@ -1561,7 +1605,7 @@ bool AppInitMain()
                         break;
                     }
 
-                    if (!CVerifyDB().VerifyDB(chainparams, pcoinsdbview.get(), gArgs.GetArg("-checklevel", DEFAULT_CHECKLEVEL),
+                    if (!CVerifyDB().VerifyDB(chainparams, pcoinswriter.get(), gArgs.GetArg("-checklevel", DEFAULT_CHECKLEVEL),
                                   gArgs.GetArg("-checkblocks", DEFAULT_CHECKBLOCKS))) {
                         strLoadError = _("Corrupted block database detected");
                         break;
@@ -1664,6 +1708,10 @@ bool AppInitMain()
         vImportFiles.push_back(strFile);
     }
 
+    // Write accepted blocks and read ahead blocks to connect on their own threads
+    g_block_writer.Start();
+    g_block_prefetcher.Start();
+
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
 
     // Wait for genesis block to be processed
@@ -1715,6 +1763,12 @@ bool AppInitMain()
     connOptions.m_msgproc = peerLogic.get();
     connOptions.nSendBufferMaxSize = 1000*gArgs.GetArg("-maxsendbuffer", DEFAULT_MAXSENDBUFFER);
     connOptions.nReceiveFloodSize = 1000*gArgs.GetArg("-maxreceivebuffer", DEFAULT_MAXRECEIVEBUFFER);
+    connOptions.socketEventsMode = socketEventsMode;
+    // -msghandlerthreads=0 means one thread per core
+    connOptions.nMessageHandlerThreads = gArgs.GetArg("-msghandlerthreads", DEFAULT_MSGHANDLER_THREADS);
+    if (connOptions.nMessageHandlerThreads <= 0)
+        connOptions.nMessageHandlerThreads += GetNumCores();
+    connOptions.nMessageHandlerThreads = std::max(1, std::min(connOptions.nMessageHandlerThreads, MAX_MSGHANDLER_THREADS));
     connOptions.m_added_nodes = gArgs.GetArgs("-addnode");
 
     connOptions.nMaxOutboundTimeframe = nMaxOutboundTimeframe;
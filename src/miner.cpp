@@ -13,6 +13,7 @@
 #include <consensus/tx_verify.h>
 #include <consensus/merkle.h>
 #include <consensus/validation.h>
+#include <crypto/x13sm3.h>
 #include <hash.h>
 #include <net.h>
 #include <policy/feerate.h>
@@ -23,10 +24,14 @@
 #include <timedata.h>
 #include <util/system.h>
 #include <util/moneystr.h>
+#include <util/strencodings.h>
 #include <validationinterface.h>
+#include <versionbits.h>
 
 #include <algorithm>
+#include <atomic>
 #include <queue>
+#include <thread>
 #include <utility>
 
 // Unconfirmed transactions in the memory pool often depend on other
@@ -452,3 +457,78 @@ void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned
     pblock->vtx[0] = MakeTransactionRef(std::move(txCoinbase));
     pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
 }
+
+bool ScanNonces(CBlockHeader* pblock, uint32_t nNonceEnd, int nThreads, uint64_t& nMaxTries, bool isBCDBlock, const Consensus::Params& consensusParams)
+{
+    // Nonces are handed out in batches that go through the X13-SM3 stages
+    // together. The header fits in a single BLAKE-512 block, so there is no
+    // midstate to share between nonces; batching is what amortizes setup.
+    // Blocks from before the fork are hashed with SHA256d, like GetPoWHash() does.
+    static const uint32_t BATCH_SIZE = 8;
+    static const size_t HEADER_SIZE = 80;
+    static const size_t NONCE_OFFSET = 76;
+
+    const uint32_t nNonceBegin = pblock->nNonce;
+    if (nNonceBegin >= nNonceEnd) return false;
+    const uint64_t nLimit = std::min<uint64_t>(nNonceEnd - nNonceBegin, nMaxTries);
+    const bool fX13 = (pblock->nVersion & VERSIONBITS_FORK_BCD) && isBCDBlock;
+    // Same in-memory header layout GetPoWHash() hashes.
+    const unsigned char* header = (const unsigned char*)BEGIN(pblock->nVersion);
+
+    std::atomic<uint64_t> next{0};
+    std::atomic<uint64_t> tried{0};
+    std::atomic<bool> found{false};
+    std::atomic<uint64_t> solution{nLimit};
+
+    auto worker = [&]() {
+        unsigned char in[HEADER_SIZE * BATCH_SIZE];
+        unsigned char out[32 * BATCH_SIZE];
+        for (uint32_t i = 0; i < BATCH_SIZE; ++i) {
+            memcpy(in + HEADER_SIZE * i, header, HEADER_SIZE);
+        }
+        while (!found) {
+            const uint64_t offset = next.fetch_add(BATCH_SIZE);
+            if (offset >= nLimit) break;
+            const uint32_t count = std::min<uint64_t>(BATCH_SIZE, nLimit - offset);
+            for (uint32_t i = 0; i < count; ++i) {
+                const uint32_t nonce = nNonceBegin + offset + i;
+                memcpy(in + HEADER_SIZE * i + NONCE_OFFSET, &nonce, sizeof(nonce));
+            }
+            if (fX13) {
+                X13SM3_80(out, in, count);
+            } else {
+                for (uint32_t i = 0; i < count; ++i) {
+                    CHash256().Write(in + HEADER_SIZE * i, HEADER_SIZE).Finalize(out + 32 * i);
+                }
+            }
+            tried += count;
+            for (uint32_t i = 0; i < count; ++i) {
+                uint256 hash;
+                memcpy(hash.begin(), out + 32 * i, 32);
+                if (CheckProofOfWork(hash, pblock->nBits, consensusParams)) {
+                    // Batches below this one were handed out earlier and still run to
+                    // completion, so keeping the lowest solution makes the result the
+                    // first one in nonce order whatever the thread count.
+                    uint64_t current = solution;
+                    while (offset + i < current && !solution.compare_exchange_weak(current, offset + i)) {}
+                    found = true;
+                    break;
+                }
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < nThreads; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    nMaxTries -= std::min<uint64_t>(tried, nMaxTries);
+    if (!found) return false;
+    pblock->nNonce = nNonceBegin + solution;
+    return true;
+}
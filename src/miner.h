@@ -197,4 +197,10 @@ private:
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
 
+/** Search nonces from pblock->nNonce up to (excluding) nNonceEnd for a valid proof of work, as hashed by
+ *  GetPoWHash(isBCDBlock), splitting the range over nThreads threads. At most nMaxTries nonces are tried
+ *  and nMaxTries is reduced by the number actually tried. Returns true and sets pblock->nNonce if a
+ *  solution was found. */
+bool ScanNonces(CBlockHeader* pblock, uint32_t nNonceEnd, int nThreads, uint64_t& nMaxTries, bool isBCDBlock, const Consensus::Params& consensusParams);
+
 #endif // BITCOIN_MINER_H
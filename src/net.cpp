@@ -26,6 +26,14 @@
 #include <fcntl.h>
 #endif
 
+#ifdef USE_POLL
+#include <poll.h>
+#endif
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -367,6 +375,16 @@ static CAddress GetBindAddress(SOCKET sock)
     return addr_bind;
 }
 
+/** Whether select() can wait on a socket, which on POSIX limits descriptors to FD_SETSIZE. */
+static bool FitsFdSet(SOCKET hSocket)
+{
+#ifdef WIN32
+    return true;
+#else
+    return hSocket < FD_SETSIZE;
+#endif
+}
+
 CNode* CConnman::ConnectNode(CAddress addrConnect, const char *pszDest, bool fCountFailure, bool manual_connection)
 {
     if (pszDest == nullptr) {
@@ -452,6 +470,11 @@ CNode* CConnman::ConnectNode(CAddress addrConnect, const char *pszDest, bool fCo
         CloseSocket(hSocket);
         return nullptr;
     }
+    if (socketEventsMode == SocketEventsMode::SELECT && !FitsFdSet(hSocket)) {
+        LogPrintf("connection to %s dropped: non-selectable socket\n", pszDest ? pszDest : addrConnect.ToString());
+        CloseSocket(hSocket);
+        return nullptr;
+    }
 
     // Add node
     NodeId id = GetNewNodeId();
@@ -714,6 +737,9 @@ void CNode::copyStats(CNodeStats &stats)
         X(mapRecvBytesPerMsgCmd);
         X(nRecvBytes);
     }
+    stats.nRecvBufferAllocs = recvBufferPool.GetAllocs();
+    stats.nRecvBufferReuses = recvBufferPool.GetReuses();
+    stats.nLastAnnounceLatency = nLastAnnounceLatency;
     X(fWhitelisted);
 
     // It is common for nodes with good ping times to suddenly become lagged,
@@ -778,6 +804,10 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete
             return false;
         }
 
+        // Once the size is known, take a buffer that fits the whole message
+        if (msg.in_data && msg.nDataPos == 0 && msg.hdr.nMessageSize > 0 && msg.vRecv.empty())
+            recvBufferPool.Get(msg.vRecv, msg.hdr.nMessageSize);
+
         pch += handled;
         nBytes -= handled;
 
@@ -828,25 +858,32 @@ int CNode::GetSendVersion() const
 
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
-    // copy data to temporary parsing buffer
-    unsigned int nRemaining = 24 - nHdrPos;
-    unsigned int nCopy = std::min(nRemaining, nBytes);
-
-    memcpy(&hdrbuf[nHdrPos], pch, nCopy);
-    nHdrPos += nCopy;
+    const unsigned char* pheader;
+    unsigned int nCopy;
+    if (nHdrPos == 0 && nBytes >= CMessageHeader::HEADER_SIZE) {
+        // the whole header was received at once, parse it in place
+        pheader = (const unsigned char*)pch;
+        nCopy = CMessageHeader::HEADER_SIZE;
+    } else {
+        // copy data to temporary parsing buffer
+        unsigned int nRemaining = CMessageHeader::HEADER_SIZE - nHdrPos;
+        nCopy = std::min(nRemaining, nBytes);
 
-    // if header incomplete, exit
-    if (nHdrPos < 24)
-        return nCopy;
+        memcpy(&hdrbuf[nHdrPos], pch, nCopy);
+        nHdrPos += nCopy;
 
-    // deserialize to CMessageHeader
-    try {
-        hdrbuf >> hdr;
-    }
-    catch (const std::exception&) {
-        return -1;
+        // if header incomplete, exit
+        if (nHdrPos < CMessageHeader::HEADER_SIZE)
+            return nCopy;
+        pheader = hdrbuf;
     }
 
+    // deserialize to CMessageHeader, which has a fixed size
+    memcpy(hdr.pchMessageStart, pheader, CMessageHeader::MESSAGE_START_SIZE);
+    memcpy(hdr.pchCommand, pheader + CMessageHeader::MESSAGE_START_SIZE, CMessageHeader::COMMAND_SIZE);
+    hdr.nMessageSize = ReadLE32(pheader + CMessageHeader::MESSAGE_SIZE_OFFSET);
+    memcpy(hdr.pchChecksum, pheader + CMessageHeader::CHECKSUM_OFFSET, CMessageHeader::CHECKSUM_SIZE);
+
     // reject messages larger than MAX_SIZE
     if (hdr.nMessageSize > MAX_SIZE)
         return -1;
@@ -874,6 +911,58 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     return nCopy;
 }
 
+std::atomic<uint64_t> CNetMessageBufferPool::nTotalAllocs{0};
+std::atomic<uint64_t> CNetMessageBufferPool::nTotalReuses{0};
+
+void CNetMessageBufferPool::Get(CDataStream& stream, size_t nSize)
+{
+    int nClass = MIN_SIZE_CLASS;
+    while (nClass <= MAX_SIZE_CLASS && ((size_t)1 << nClass) < nSize)
+        nClass++;
+
+    CSerializeData buf;
+    if (nClass <= MAX_SIZE_CLASS) {
+        LOCK(cs);
+        std::vector<CSerializeData>& vClass = vFree[nClass - MIN_SIZE_CLASS];
+        if (!vClass.empty()) {
+            buf.swap(vClass.back());
+            vClass.pop_back();
+            nPooledBytes -= buf.capacity();
+        }
+    }
+    if (buf.capacity() != 0) {
+        nReuses++;
+        nTotalReuses++;
+    } else {
+        // Reserve the full class so the buffer can be reused for any message of its class.
+        // Larger messages are allocated as they arrive, see CNetMessage::readData.
+        if (nClass <= MAX_SIZE_CLASS)
+            buf.reserve((size_t)1 << nClass);
+        nAllocs++;
+        nTotalAllocs++;
+    }
+    stream.swap(buf);
+}
+
+void CNetMessageBufferPool::Put(CDataStream& stream)
+{
+    CSerializeData buf;
+    stream.swap(buf);
+    size_t nCapacity = buf.capacity();
+    if (nCapacity < ((size_t)1 << MIN_SIZE_CLASS) || nCapacity > ((size_t)1 << MAX_SIZE_CLASS))
+        return;
+    int nClass = MIN_SIZE_CLASS;
+    while (((size_t)2 << nClass) <= nCapacity)
+        nClass++;
+
+    buf.clear();
+    LOCK(cs);
+    if (nPooledBytes + nCapacity > MAX_POOLED_BYTES)
+        return;
+    nPooledBytes += nCapacity;
+    vFree[nClass - MIN_SIZE_CLASS].push_back(std::move(buf));
+}
+
 const uint256& CNetMessage::GetMessageHash() const
 {
     assert(complete());
@@ -912,6 +1001,10 @@ size_t CConnman::SocketSendData(CNode *pnode) const
             pnode->nSendOffset += nBytes;
             nSentSize += nBytes;
             if (pnode->nSendOffset == data.size()) {
+                if (data.nTimeStart) {
+                    pnode->nLastAnnounceLatency = GetTimeMicros() - data.nTimeStart;
+                    LogPrint(BCLog::BENCH, "Sent block announcement to peer=%d %.2fms after validation\n", pnode->GetId(), pnode->nLastAnnounceLatency * 0.001);
+                }
                 pnode->nSendOffset = 0;
                 pnode->nSendSize -= data.size();
                 pnode->fPauseSend = pnode->nSendSize > nSendBufferMaxSize;
@@ -1116,7 +1209,7 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
         return;
     }
 
-    if (!IsSelectableSocket(hSocket))
+    if (!IsSelectableSocket(hSocket) || (socketEventsMode == SocketEventsMode::SELECT && !FitsFdSet(hSocket)))
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
@@ -1159,6 +1252,7 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
     }
+    RegisterSocketEvents(pnode);
 }
 
 void CConnman::DisconnectNodes()
@@ -1184,6 +1278,9 @@ void CConnman::DisconnectNodes()
             {
                 // remove from vNodes
                 vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+#ifdef USE_EPOLL
+                setNodesRecvPending.erase(pnode);
+#endif
 
                 // release outbound grant (if any)
                 pnode->grantOutbound.Release();
@@ -1270,28 +1367,98 @@ void CConnman::InactivityCheck(CNode *pnode)
     }
 }
 
-void CConnman::SocketHandler()
+bool ParseSocketEventsMode(const std::string& str, SocketEventsMode& mode)
 {
-    //
-    // Find which sockets have data to receive
-    //
-    struct timeval timeout;
-    timeout.tv_sec  = 0;
-    timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+    if (str == "select") {
+        mode = SocketEventsMode::SELECT;
+        return true;
+    }
+#ifdef USE_POLL
+    if (str == "poll") {
+        mode = SocketEventsMode::POLL;
+        return true;
+    }
+#endif
+#ifdef USE_EPOLL
+    if (str == "epoll") {
+        mode = SocketEventsMode::EPOLL;
+        return true;
+    }
+#endif
+    return false;
+}
 
-    fd_set fdsetRecv;
-    fd_set fdsetSend;
-    fd_set fdsetError;
-    FD_ZERO(&fdsetRecv);
-    FD_ZERO(&fdsetSend);
-    FD_ZERO(&fdsetError);
-    SOCKET hSocketMax = 0;
-    bool have_fds = false;
+std::string GetSocketEventsModeName(SocketEventsMode mode)
+{
+    switch (mode) {
+    case SocketEventsMode::SELECT: return "select";
+    case SocketEventsMode::POLL: return "poll";
+    case SocketEventsMode::EPOLL: return "epoll";
+    }
+    assert(false);
+}
+
+bool CConnman::SocketRecvData(CNode *pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = 0;
+    {
+        LOCK(pnode->cs_hSocket);
+        if (pnode->hSocket == INVALID_SOCKET)
+            return false;
+        nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    }
+    if (nBytes > 0)
+    {
+        bool notify = false;
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, notify))
+            pnode->CloseSocketDisconnect();
+        RecordBytesRecv(nBytes);
+        if (notify) {
+            size_t nSizeAdded = 0;
+            auto it(pnode->vRecvMsg.begin());
+            for (; it != pnode->vRecvMsg.end(); ++it) {
+                if (!it->complete())
+                    break;
+                nSizeAdded += it->vRecv.size() + CMessageHeader::HEADER_SIZE;
+            }
+            {
+                LOCK(pnode->cs_vProcessMsg);
+                pnode->vProcessMsg.splice(pnode->vProcessMsg.end(), pnode->vRecvMsg, pnode->vRecvMsg.begin(), it);
+                pnode->nProcessQueueSize += nSizeAdded;
+                pnode->fPauseRecv = pnode->nProcessQueueSize > nReceiveFloodSize;
+            }
+            WakeMessageHandler(pnode);
+        }
+        return true;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect) {
+            LogPrint(BCLog::NET, "socket closed\n");
+        }
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
 
+bool CConnman::GenerateSelectSet(std::set<SOCKET> &recv_set, std::set<SOCKET> &send_set, std::set<SOCKET> &error_set)
+{
     for (const ListenSocket& hListenSocket : vhListenSocket) {
-        FD_SET(hListenSocket.socket, &fdsetRecv);
-        hSocketMax = std::max(hSocketMax, hListenSocket.socket);
-        have_fds = true;
+        recv_set.insert(hListenSocket.socket);
     }
 
     {
@@ -1320,153 +1487,392 @@ void CConnman::SocketHandler()
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
 
-            FD_SET(pnode->hSocket, &fdsetError);
-            hSocketMax = std::max(hSocketMax, pnode->hSocket);
-            have_fds = true;
-
+            error_set.insert(pnode->hSocket);
             if (select_send) {
-                FD_SET(pnode->hSocket, &fdsetSend);
+                send_set.insert(pnode->hSocket);
                 continue;
             }
             if (select_recv) {
-                FD_SET(pnode->hSocket, &fdsetRecv);
+                recv_set.insert(pnode->hSocket);
             }
         }
     }
 
-    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    return !recv_set.empty() || !send_set.empty() || !error_set.empty();
+}
+
+void CConnman::SocketEventsSelect(std::set<SOCKET> &recv_set, std::set<SOCKET> &send_set, std::set<SOCKET> &error_set)
+{
+    std::set<SOCKET> recv_select_set, send_select_set, error_select_set;
+    if (!GenerateSelectSet(recv_select_set, send_select_set, error_select_set)) {
+        interruptNet.sleep_for(std::chrono::milliseconds(SELECT_TIMEOUT_MILLISECONDS));
+        return;
+    }
+
+    //
+    // Find which sockets have data to receive
+    //
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = SELECT_TIMEOUT_MILLISECONDS * 1000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+
+    for (SOCKET hSocket : recv_select_set) {
+        if (!FitsFdSet(hSocket)) continue;
+        FD_SET(hSocket, &fdsetRecv);
+        hSocketMax = std::max(hSocketMax, hSocket);
+    }
+    for (SOCKET hSocket : send_select_set) {
+        if (!FitsFdSet(hSocket)) continue;
+        FD_SET(hSocket, &fdsetSend);
+        hSocketMax = std::max(hSocketMax, hSocket);
+    }
+    for (SOCKET hSocket : error_select_set) {
+        if (!FitsFdSet(hSocket)) continue;
+        FD_SET(hSocket, &fdsetError);
+        hSocketMax = std::max(hSocketMax, hSocket);
+    }
+
+    int nSelect = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
     if (interruptNet)
         return;
 
     if (nSelect == SOCKET_ERROR)
     {
-        if (have_fds)
-        {
-            int nErr = WSAGetLastError();
-            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-            for (unsigned int i = 0; i <= hSocketMax; i++)
-                FD_SET(i, &fdsetRecv);
-        }
+        int nErr = WSAGetLastError();
+        LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+        for (unsigned int i = 0; i <= hSocketMax; i++)
+            FD_SET(i, &fdsetRecv);
         FD_ZERO(&fdsetSend);
         FD_ZERO(&fdsetError);
-        if (!interruptNet.sleep_for(std::chrono::milliseconds(timeout.tv_usec/1000)))
+        if (!interruptNet.sleep_for(std::chrono::milliseconds(SELECT_TIMEOUT_MILLISECONDS)))
             return;
     }
 
-    //
-    // Accept new connections
-    //
-    for (const ListenSocket& hListenSocket : vhListenSocket)
-    {
-        if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
-        {
-            AcceptConnection(hListenSocket);
+    for (SOCKET hSocket : recv_select_set) {
+        if (FitsFdSet(hSocket) && FD_ISSET(hSocket, &fdsetRecv)) {
+            recv_set.insert(hSocket);
+        }
+    }
+    for (SOCKET hSocket : send_select_set) {
+        if (FitsFdSet(hSocket) && FD_ISSET(hSocket, &fdsetSend)) {
+            send_set.insert(hSocket);
+        }
+    }
+    for (SOCKET hSocket : error_select_set) {
+        if (FitsFdSet(hSocket) && FD_ISSET(hSocket, &fdsetError)) {
+            error_set.insert(hSocket);
         }
     }
+}
 
-    //
-    // Service each socket
-    //
-    std::vector<CNode*> vNodesCopy;
+#ifdef USE_POLL
+void CConnman::SocketEventsPoll(std::set<SOCKET> &recv_set, std::set<SOCKET> &send_set, std::set<SOCKET> &error_set)
+{
+    std::set<SOCKET> recv_select_set, send_select_set, error_select_set;
+    if (!GenerateSelectSet(recv_select_set, send_select_set, error_select_set)) {
+        interruptNet.sleep_for(std::chrono::milliseconds(SELECT_TIMEOUT_MILLISECONDS));
+        return;
+    }
+
+    // Every node socket is in the error set, so the sets merge into one pollfd per socket
+    std::map<SOCKET, struct pollfd> pollfds;
+    for (SOCKET hSocket : recv_select_set) {
+        pollfds[hSocket].fd = hSocket;
+        pollfds[hSocket].events |= POLLIN;
+    }
+    for (SOCKET hSocket : send_select_set) {
+        pollfds[hSocket].fd = hSocket;
+        pollfds[hSocket].events |= POLLOUT;
+    }
+    for (SOCKET hSocket : error_select_set) {
+        pollfds[hSocket].fd = hSocket;
+        // POLLERR and POLLHUP are always reported, no need to ask for them
+    }
+
+    std::vector<struct pollfd> vpollfds;
+    vpollfds.reserve(pollfds.size());
+    for (const auto& it : pollfds) {
+        vpollfds.push_back(it.second);
+    }
+
+    if (poll(vpollfds.data(), vpollfds.size(), SELECT_TIMEOUT_MILLISECONDS) < 0) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEINTR) {
+            LogPrintf("socket poll error %s\n", NetworkErrorString(nErr));
+            interruptNet.sleep_for(std::chrono::milliseconds(SELECT_TIMEOUT_MILLISECONDS));
+        }
+        return;
+    }
+    if (interruptNet)
+        return;
+
+    for (const struct pollfd& pollfd_entry : vpollfds) {
+        if (pollfd_entry.revents & POLLIN)
+            recv_set.insert(pollfd_entry.fd);
+        if (pollfd_entry.revents & POLLOUT)
+            send_set.insert(pollfd_entry.fd);
+        if (pollfd_entry.revents & (POLLERR | POLLHUP))
+            error_set.insert(pollfd_entry.fd);
+    }
+}
+#endif
+
+#ifdef USE_EPOLL
+bool CConnman::InitEpoll()
+{
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd == -1) {
+        LogPrintf("epoll_create1 failed: %s\n", NetworkErrorString(WSAGetLastError()));
+        return false;
+    }
+    for (ListenSocket& hListenSocket : vhListenSocket) {
+        // Listening sockets stay level-triggered, so pending connections are accepted one per wakeup
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = &hListenSocket;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0) {
+            LogPrintf("epoll_ctl failed for listening socket: %s\n", NetworkErrorString(WSAGetLastError()));
+            close(epollfd);
+            epollfd = -1;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Wait for and service socket events with epoll.
+ *
+ * Node sockets are registered once, edge-triggered, for both reading and
+ * writing. A write event only matters when messages are queued, which means an
+ * earlier send() filled the socket buffer. A read event makes the node pending
+ * until recv() would block; nodes that may not read yet (a full receive queue,
+ * or queued sends going first, as in GenerateSelectSet) stay pending and are
+ * retried every SELECT_TIMEOUT_MILLISECONDS. Idle nodes cost nothing here.
+ */
+void CConnman::SocketHandlerEpoll()
+{
+    static const int MAX_EPOLL_EVENTS = 256;
+
+    // Don't sleep if some pending node can read right away
+    int timeout = SELECT_TIMEOUT_MILLISECONDS;
+    for (CNode* pnode : setNodesRecvPending) {
+        if (!pnode->fPauseRecv) {
+            LOCK(pnode->cs_vSend);
+            if (pnode->vSendMsg.empty()) {
+                timeout = 0;
+                break;
+            }
+        }
+    }
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int nEvents = epoll_wait(epollfd, events, MAX_EPOLL_EVENTS, timeout);
+    if (interruptNet)
+        return;
+    if (nEvents < 0) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEINTR) {
+            LogPrintf("socket epoll error %s\n", NetworkErrorString(nErr));
+            interruptNet.sleep_for(std::chrono::milliseconds(SELECT_TIMEOUT_MILLISECONDS));
+        }
+        return;
+    }
+
+    std::set<CNode*> setSend;
+    for (int i = 0; i < nEvents; i++) {
+        void* ptr = events[i].data.ptr;
+        bool fListen = false;
+        for (const ListenSocket& hListenSocket : vhListenSocket) {
+            if (ptr == &hListenSocket) {
+                AcceptConnection(hListenSocket);
+                fListen = true;
+                break;
+            }
+        }
+        if (fListen) continue;
+
+        CNode* pnode = static_cast<CNode*>(ptr);
+        if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            setNodesRecvPending.insert(pnode);
+        if (events[i].events & EPOLLOUT)
+            setSend.insert(pnode);
+    }
+
+    // Nodes only leave vNodes in DisconnectNodes on this thread, and their
+    // sockets are closed then, so every node an event points to is still here
+    std::vector<CNode*> vNodesService(setSend.begin(), setSend.end());
+    for (CNode* pnode : setNodesRecvPending) {
+        if (!setSend.count(pnode))
+            vNodesService.push_back(pnode);
+    }
     {
         LOCK(cs_vNodes);
-        vNodesCopy = vNodes;
-        for (CNode* pnode : vNodesCopy)
+        for (CNode* pnode : vNodesService)
             pnode->AddRef();
     }
-    for (CNode* pnode : vNodesCopy)
+    for (CNode* pnode : vNodesService)
+    {
+        if (interruptNet)
+            break;
+
+        bool fSendPending;
+        {
+            LOCK(pnode->cs_vSend);
+            if (setSend.count(pnode) && !pnode->vSendMsg.empty()) {
+                size_t nBytes = SocketSendData(pnode);
+                if (nBytes) {
+                    RecordBytesSent(nBytes);
+                }
+            }
+            fSendPending = !pnode->vSendMsg.empty();
+        }
+
+        if (setNodesRecvPending.count(pnode) && !pnode->fPauseRecv && !fSendPending) {
+            if (!SocketRecvData(pnode))
+                setNodesRecvPending.erase(pnode);
+        }
+    }
     {
+        LOCK(cs_vNodes);
+        for (CNode* pnode : vNodesService)
+            pnode->Release();
+    }
+}
+#endif
+
+void CConnman::RegisterSocketEvents(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    if (socketEventsMode != SocketEventsMode::EPOLL || epollfd == -1)
+        return;
+    LOCK(pnode->cs_hSocket);
+    if (pnode->hSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0) {
+        LogPrintf("epoll_ctl failed for peer=%d: %s\n", pnode->GetId(), NetworkErrorString(WSAGetLastError()));
+        pnode->fDisconnect = true;
+    }
+#endif
+}
+
+void CConnman::SocketHandler()
+{
+#ifdef USE_EPOLL
+    if (socketEventsMode == SocketEventsMode::EPOLL) {
+        SocketHandlerEpoll();
+    } else
+#endif
+    {
+        std::set<SOCKET> recv_set, send_set, error_set;
+#ifdef USE_POLL
+        if (socketEventsMode == SocketEventsMode::POLL) {
+            SocketEventsPoll(recv_set, send_set, error_set);
+        } else
+#endif
+        {
+            SocketEventsSelect(recv_set, send_set, error_set);
+        }
         if (interruptNet)
             return;
 
         //
-        // Receive
+        // Accept new connections
         //
-        bool recvSet = false;
-        bool sendSet = false;
-        bool errorSet = false;
+        for (const ListenSocket& hListenSocket : vhListenSocket)
         {
-            LOCK(pnode->cs_hSocket);
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            recvSet = FD_ISSET(pnode->hSocket, &fdsetRecv);
-            sendSet = FD_ISSET(pnode->hSocket, &fdsetSend);
-            errorSet = FD_ISSET(pnode->hSocket, &fdsetError);
+            if (hListenSocket.socket != INVALID_SOCKET && recv_set.count(hListenSocket.socket) > 0)
+            {
+                AcceptConnection(hListenSocket);
+            }
+        }
+
+        //
+        // Service each socket
+        //
+        std::vector<CNode*> vNodesCopy;
+        {
+            LOCK(cs_vNodes);
+            vNodesCopy = vNodes;
+            for (CNode* pnode : vNodesCopy)
+                pnode->AddRef();
         }
-        if (recvSet || errorSet)
+        for (CNode* pnode : vNodesCopy)
         {
-            // typical socket buffer is 8K-64K
-            char pchBuf[0x10000];
-            int nBytes = 0;
+            if (interruptNet)
+                break;
+
+            //
+            // Receive
+            //
+            bool recvSet = false;
+            bool sendSet = false;
+            bool errorSet = false;
             {
                 LOCK(pnode->cs_hSocket);
                 if (pnode->hSocket == INVALID_SOCKET)
                     continue;
-                nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                recvSet = recv_set.count(pnode->hSocket) > 0;
+                sendSet = send_set.count(pnode->hSocket) > 0;
+                errorSet = error_set.count(pnode->hSocket) > 0;
             }
-            if (nBytes > 0)
+            if (recvSet || errorSet)
             {
-                bool notify = false;
-                if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, notify))
-                    pnode->CloseSocketDisconnect();
-                RecordBytesRecv(nBytes);
-                if (notify) {
-                    size_t nSizeAdded = 0;
-                    auto it(pnode->vRecvMsg.begin());
-                    for (; it != pnode->vRecvMsg.end(); ++it) {
-                        if (!it->complete())
-                            break;
-                        nSizeAdded += it->vRecv.size() + CMessageHeader::HEADER_SIZE;
-                    }
-                    {
-                        LOCK(pnode->cs_vProcessMsg);
-                        pnode->vProcessMsg.splice(pnode->vProcessMsg.end(), pnode->vRecvMsg, pnode->vRecvMsg.begin(), it);
-                        pnode->nProcessQueueSize += nSizeAdded;
-                        pnode->fPauseRecv = pnode->nProcessQueueSize > nReceiveFloodSize;
-                    }
-                    WakeMessageHandler();
-                }
+                SocketRecvData(pnode);
             }
-            else if (nBytes == 0)
-            {
-                // socket closed gracefully
-                if (!pnode->fDisconnect) {
-                    LogPrint(BCLog::NET, "socket closed\n");
-                }
-                pnode->CloseSocketDisconnect();
-            }
-            else if (nBytes < 0)
+
+            //
+            // Send
+            //
+            if (sendSet)
             {
-                // error
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                {
-                    if (!pnode->fDisconnect)
-                        LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                    pnode->CloseSocketDisconnect();
+                LOCK(pnode->cs_vSend);
+                size_t nBytes = SocketSendData(pnode);
+                if (nBytes) {
+                    RecordBytesSent(nBytes);
                 }
             }
         }
-
-        //
-        // Send
-        //
-        if (sendSet)
         {
-            LOCK(pnode->cs_vSend);
-            size_t nBytes = SocketSendData(pnode);
-            if (nBytes) {
-                RecordBytesSent(nBytes);
-            }
+            LOCK(cs_vNodes);
+            for (CNode* pnode : vNodesCopy)
+                pnode->Release();
         }
-
-        InactivityCheck(pnode);
     }
-    {
-        LOCK(cs_vNodes);
+    if (interruptNet)
+        return;
+
+    //
+    // Inactivity is measured in seconds, so checking every node once a second is enough
+    //
+    int64_t nTime = GetSystemTimeInSeconds();
+    if (nTime != nLastInactivityCheck) {
+        nLastInactivityCheck = nTime;
+        std::vector<CNode*> vNodesCopy;
+        {
+            LOCK(cs_vNodes);
+            vNodesCopy = vNodes;
+            for (CNode* pnode : vNodesCopy)
+                pnode->AddRef();
+        }
         for (CNode* pnode : vNodesCopy)
-            pnode->Release();
+            InactivityCheck(pnode);
+        {
+            LOCK(cs_vNodes);
+            for (CNode* pnode : vNodesCopy)
+                pnode->Release();
+        }
     }
 }
 
@@ -1482,11 +1888,21 @@ void CConnman::ThreadSocketHandler()
 
 void CConnman::WakeMessageHandler()
 {
-    {
-        std::lock_guard<std::mutex> lock(mutexMsgProc);
-        fMsgProcWake = true;
+    std::lock_guard<std::mutex> lock(mutexMsgProc);
+    for (const auto& worker : vMessageHandlers) {
+        worker->fWake = true;
+        worker->cond.notify_one();
+    }
+}
+
+void CConnman::WakeMessageHandler(const CNode* pnode)
+{
+    std::lock_guard<std::mutex> lock(mutexMsgProc);
+    size_t worker = pnode->GetId() % nMessageHandlerThreads;
+    if (worker < vMessageHandlers.size()) {
+        vMessageHandlers[worker]->fWake = true;
+        vMessageHandlers[worker]->cond.notify_one();
     }
-    condMsgProc.notify_one();
 }
 
 
@@ -2042,18 +2458,27 @@ void CConnman::OpenNetworkConnection(const CAddress& addrConnect, bool fCountFai
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
     }
+    RegisterSocketEvents(pnode);
 }
 
-void CConnman::ThreadMessageHandler()
+void CConnman::ThreadMessageHandler(int worker)
 {
+    MessageHandlerWorker* self;
+    {
+        std::lock_guard<std::mutex> lock(mutexMsgProc);
+        self = vMessageHandlers[worker].get();
+    }
+
     while (!flagInterruptMsgProc)
     {
         std::vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            for (CNode* pnode : vNodesCopy) {
+            for (CNode* pnode : vNodes) {
+                if (pnode->GetId() % nMessageHandlerThreads != worker)
+                    continue;
                 pnode->AddRef();
+                vNodesCopy.push_back(pnode);
             }
         }
 
@@ -2087,9 +2512,9 @@ void CConnman::ThreadMessageHandler()
 
         std::unique_lock<std::mutex> lock(mutexMsgProc);
         if (!fMoreWork) {
-            condMsgProc.wait_until(lock, std::chrono::steady_clock::now() + std::chrono::milliseconds(100), [this] { return fMsgProcWake; });
+            self->cond.wait_until(lock, std::chrono::steady_clock::now() + std::chrono::milliseconds(100), [self] { return self->fWake; });
         }
-        fMsgProcWake = false;
+        self->fWake = false;
     }
 }
 
@@ -2308,6 +2733,13 @@ bool CConnman::Start(CScheduler& scheduler, const Options& connOptions)
         return false;
     }
 
+#ifdef USE_EPOLL
+    if (socketEventsMode == SocketEventsMode::EPOLL && !InitEpoll()) {
+        socketEventsMode = SocketEventsMode::POLL;
+    }
+#endif
+    LogPrintf("Using %s for socket events\n", GetSocketEventsModeName(socketEventsMode));
+
     for (const auto& strDest : connOptions.vSeedNodes) {
         AddOneShot(strDest);
     }
@@ -2369,7 +2801,11 @@ bool CConnman::Start(CScheduler& scheduler, const Options& connOptions)
 
     {
         std::unique_lock<std::mutex> lock(mutexMsgProc);
-        fMsgProcWake = false;
+        vMessageHandlers.clear();
+        for (int i = 0; i < nMessageHandlerThreads; i++) {
+            vMessageHandlers.emplace_back(new MessageHandlerWorker());
+            vMessageHandlers.back()->name = nMessageHandlerThreads == 1 ? "msghand" : strprintf("msghand.%d", i);
+        }
     }
 
     // Send and receive from sockets, accept connections
@@ -2395,7 +2831,11 @@ bool CConnman::Start(CScheduler& scheduler, const Options& connOptions)
         threadOpenConnections = std::thread(&TraceThread<std::function<void()> >, "opencon", std::function<void()>(std::bind(&CConnman::ThreadOpenConnections, this, connOptions.m_specified_outgoing)));
 
     // Process messages
-    threadMessageHandler = std::thread(&TraceThread<std::function<void()> >, "msghand", std::function<void()>(std::bind(&CConnman::ThreadMessageHandler, this)));
+    LogPrintf("Using %d threads for message handling\n", nMessageHandlerThreads);
+    for (int i = 0; i < nMessageHandlerThreads; i++) {
+        MessageHandlerWorker& worker = *vMessageHandlers[i];
+        worker.thread = std::thread(&TraceThread<std::function<void()> >, worker.name.c_str(), std::function<void()>(std::bind(&CConnman::ThreadMessageHandler, this, i)));
+    }
 
     // Dump network addresses
     scheduler.scheduleEvery(std::bind(&CConnman::DumpData, this), DUMP_ADDRESSES_INTERVAL * 1000);
@@ -2423,8 +2863,10 @@ void CConnman::Interrupt()
     {
         std::lock_guard<std::mutex> lock(mutexMsgProc);
         flagInterruptMsgProc = true;
+        for (const auto& worker : vMessageHandlers) {
+            worker->cond.notify_all();
+        }
     }
-    condMsgProc.notify_all();
 
     interruptNet();
     InterruptSocks5(true);
@@ -2444,8 +2886,10 @@ void CConnman::Interrupt()
 
 void CConnman::Stop()
 {
-    if (threadMessageHandler.joinable())
-        threadMessageHandler.join();
+    for (const auto& worker : vMessageHandlers) {
+        if (worker->thread.joinable())
+            worker->thread.join();
+    }
     if (threadOpenConnections.joinable())
         threadOpenConnections.join();
     if (threadOpenAddedConnections.joinable())
@@ -2469,6 +2913,14 @@ void CConnman::Stop()
             if (!CloseSocket(hListenSocket.socket))
                 LogPrintf("CloseSocket(hListenSocket) failed with error %s\n", NetworkErrorString(WSAGetLastError()));
 
+#ifdef USE_EPOLL
+    if (epollfd != -1) {
+        close(epollfd);
+        epollfd = -1;
+    }
+    setNodesRecvPending.clear();
+#endif
+
     // clean up some globals (to help leak detection)
     for (CNode *pnode : vNodes) {
         DeleteNode(pnode);
@@ -2838,6 +3290,43 @@ bool CConnman::NodeFullyConnected(const CNode* pnode)
     return pnode && pnode->fSuccessfullyConnected && !pnode->fDisconnect;
 }
 
+static void SerializeMessageHeader(const std::string& command, const std::vector<unsigned char>& payload, std::vector<unsigned char>& serializedHeader)
+{
+    uint256 hash = Hash(payload.data(), payload.data() + payload.size());
+    CMessageHeader hdr(Params().MessageStart(), command.c_str(), payload.size());
+    memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+
+    CVectorWriter{SER_NETWORK, INIT_PROTO_VERSION, serializedHeader, 0, hdr};
+}
+
+CSharedNetMsg CConnman::MakeSharedMessage(CSerializedNetMsg&& msg, int64_t nTimeStart)
+{
+    std::vector<unsigned char> data;
+    data.reserve(CMessageHeader::HEADER_SIZE + msg.data.size());
+    SerializeMessageHeader(msg.command, msg.data, data);
+    data.insert(data.end(), msg.data.begin(), msg.data.end());
+
+    CSharedNetMsg shared;
+    shared.data = std::make_shared<const std::vector<unsigned char>>(std::move(data));
+    shared.command = std::move(msg.command);
+    shared.nTimeStart = nTimeStart;
+    return shared;
+}
+
+CSharedNetMsg CConnman::MakeSharedMessage(const std::string& command, const std::shared_ptr<const std::vector<unsigned char>>& payload, int64_t nTimeStart)
+{
+    std::vector<unsigned char> header;
+    header.reserve(CMessageHeader::HEADER_SIZE);
+    SerializeMessageHeader(command, *payload, header);
+
+    CSharedNetMsg shared;
+    shared.data = std::make_shared<const std::vector<unsigned char>>(std::move(header));
+    shared.payload = payload;
+    shared.command = command;
+    shared.nTimeStart = nTimeStart;
+    return shared;
+}
+
 void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
 {
     size_t nMessageSize = msg.data.size();
@@ -2846,11 +3335,7 @@ void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
 
     std::vector<unsigned char> serializedHeader;
     serializedHeader.reserve(CMessageHeader::HEADER_SIZE);
-    uint256 hash = Hash(msg.data.data(), msg.data.data() + nMessageSize);
-    CMessageHeader hdr(Params().MessageStart(), msg.command.c_str(), nMessageSize);
-    memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
-
-    CVectorWriter{SER_NETWORK, INIT_PROTO_VERSION, serializedHeader, 0, hdr};
+    SerializeMessageHeader(msg.command, msg.data, serializedHeader);
 
     size_t nBytesSent = 0;
     {
@@ -2863,9 +3348,41 @@ void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
 
         if (pnode->nSendSize > nSendBufferMaxSize)
             pnode->fPauseSend = true;
-        pnode->vSendMsg.push_back(std::move(serializedHeader));
+        pnode->vSendMsg.emplace_back(std::move(serializedHeader));
         if (nMessageSize)
-            pnode->vSendMsg.push_back(std::move(msg.data));
+            pnode->vSendMsg.emplace_back(std::move(msg.data));
+
+        // If write queue empty, attempt "optimistic write"
+        if (optimisticSend == true)
+            nBytesSent = SocketSendData(pnode);
+    }
+    if (nBytesSent)
+        RecordBytesSent(nBytesSent);
+}
+
+void CConnman::PushMessage(CNode* pnode, const CSharedNetMsg& msg)
+{
+    size_t nTotalSize = msg.data->size() + (msg.payload ? msg.payload->size() : 0);
+    LogPrint(BCLog::NET, "sending %s (%d bytes) peer=%d\n",  SanitizeString(msg.command.c_str()), nTotalSize - CMessageHeader::HEADER_SIZE, pnode->GetId());
+
+    size_t nBytesSent = 0;
+    {
+        LOCK(pnode->cs_vSend);
+        bool optimisticSend(pnode->vSendMsg.empty());
+
+        //log total amount of bytes per command
+        pnode->mapSendBytesPerMsgCmd[msg.command] += nTotalSize;
+        pnode->nSendSize += nTotalSize;
+
+        if (pnode->nSendSize > nSendBufferMaxSize)
+            pnode->fPauseSend = true;
+        if (msg.payload) {
+            // The latency is measured once the last buffer of the message is sent
+            pnode->vSendMsg.emplace_back(msg.data, 0);
+            pnode->vSendMsg.emplace_back(msg.payload, msg.nTimeStart);
+        } else {
+            pnode->vSendMsg.emplace_back(msg.data, msg.nTimeStart);
+        }
 
         // If write queue empty, attempt "optimistic write"
         if (optimisticSend == true)
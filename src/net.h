@@ -21,13 +21,16 @@
 #include <sync.h>
 #include <uint256.h>
 #include <threadinterrupt.h>
+#include <txrelay.h>
 
+#include <algorithm>
 #include <atomic>
 #include <deque>
 #include <stdint.h>
 #include <thread>
 #include <memory>
 #include <condition_variable>
+#include <set>
 
 #ifndef WIN32
 #include <arpa/inet.h>
@@ -77,6 +80,33 @@ static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
 static const uint64_t MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
 /** Default for blocks only*/
 static const bool DEFAULT_BLOCKSONLY = false;
+/** Time the socket handler waits for socket events before checking on peers again (in milliseconds). */
+static const int SELECT_TIMEOUT_MILLISECONDS = 50;
+
+/** How the socket handler waits for socket events. */
+enum class SocketEventsMode {
+    SELECT, //!< select() on all sockets every iteration, limited to FD_SETSIZE
+    POLL,   //!< poll() on all sockets every iteration
+    EPOLL,  //!< sockets are registered with epoll once and only reported when ready
+};
+
+/** Default for -socketevents, the most scalable mode this build supports. */
+#if defined(USE_EPOLL)
+static const SocketEventsMode DEFAULT_SOCKET_EVENTS = SocketEventsMode::EPOLL;
+#elif defined(USE_POLL)
+static const SocketEventsMode DEFAULT_SOCKET_EVENTS = SocketEventsMode::POLL;
+#else
+static const SocketEventsMode DEFAULT_SOCKET_EVENTS = SocketEventsMode::SELECT;
+#endif
+
+/** Parse a -socketevents value. Returns false if it is unknown or not supported by this build. */
+bool ParseSocketEventsMode(const std::string& str, SocketEventsMode& mode);
+std::string GetSocketEventsModeName(SocketEventsMode mode);
+
+/** Maximum number of message handler threads */
+static const int MAX_MSGHANDLER_THREADS = 8;
+/** -msghandlerthreads default (number of message handler threads, 0 = auto) */
+static const int DEFAULT_MSGHANDLER_THREADS = 0;
 
 static const bool DEFAULT_FORCEDNSSEED = false;
 static const size_t DEFAULT_MAXRECEIVEBUFFER = 5 * 1000;
@@ -111,6 +141,22 @@ struct CSerializedNetMsg
     std::string command;
 };
 
+/**
+ * A message serialized once, header included, to be pushed to several peers.
+ * Their send queues all hold the same buffers.
+ */
+struct CSharedNetMsg
+{
+    std::shared_ptr<const std::vector<unsigned char>> data;
+    // If set, the payload, which data then does not include. This lets a
+    // buffer that is already shared, like a cached block, be sent as it is.
+    std::shared_ptr<const std::vector<unsigned char>> payload;
+    std::string command;
+    // If nonzero, the time (in microseconds) the block this message announces
+    // was found valid, from which the latency of sending it is measured.
+    int64_t nTimeStart = 0;
+};
+
 class NetEventsInterface;
 class CConnman
 {
@@ -143,6 +189,8 @@ public:
         bool m_use_addrman_outgoing = true;
         std::vector<std::string> m_specified_outgoing;
         std::vector<std::string> m_added_nodes;
+        SocketEventsMode socketEventsMode = DEFAULT_SOCKET_EVENTS;
+        int nMessageHandlerThreads = 1;
     };
 
     void Init(const Options& connOptions) {
@@ -156,6 +204,8 @@ public:
         m_msgproc = connOptions.m_msgproc;
         nSendBufferMaxSize = connOptions.nSendBufferMaxSize;
         nReceiveFloodSize = connOptions.nReceiveFloodSize;
+        socketEventsMode = connOptions.socketEventsMode;
+        nMessageHandlerThreads = std::max(1, connOptions.nMessageHandlerThreads);
         {
             LOCK(cs_totalBytesSent);
             nMaxOutboundTimeframe = connOptions.nMaxOutboundTimeframe;
@@ -181,6 +231,11 @@ public:
     bool ForNode(NodeId id, std::function<bool(CNode* pnode)> func);
 
     void PushMessage(CNode* pnode, CSerializedNetMsg&& msg);
+    void PushMessage(CNode* pnode, const CSharedNetMsg& msg);
+    /** Serialize msg with its header, for pushing it to several peers without copying it. */
+    static CSharedNetMsg MakeSharedMessage(CSerializedNetMsg&& msg, int64_t nTimeStart = 0);
+    /** Serialize only the header of a message whose payload is already shared, which is queued as it is. */
+    static CSharedNetMsg MakeSharedMessage(const std::string& command, const std::shared_ptr<const std::vector<unsigned char>>& payload, int64_t nTimeStart = 0);
 
     template<typename Callable>
     void ForEachNode(Callable&& func)
@@ -311,7 +366,10 @@ public:
 
     unsigned int GetReceiveFloodSize() const;
 
+    /** Wake all message handler threads. */
     void WakeMessageHandler();
+    /** Wake the message handler thread that processes pnode. */
+    void WakeMessageHandler(const CNode* pnode);
 
     /** Attempts to obfuscate tx time through exponentially distributed emitting.
         Works assuming that a single interval is used.
@@ -334,11 +392,21 @@ private:
     void AddOneShot(const std::string& strDest);
     void ProcessOneShot();
     void ThreadOpenConnections(std::vector<std::string> connect);
-    void ThreadMessageHandler();
+    void ThreadMessageHandler(int worker);
     void AcceptConnection(const ListenSocket& hListenSocket);
     void DisconnectNodes();
     void NotifyNumConnectionsChanged();
     void InactivityCheck(CNode *pnode);
+    bool GenerateSelectSet(std::set<SOCKET> &recv_set, std::set<SOCKET> &send_set, std::set<SOCKET> &error_set);
+    void SocketEventsSelect(std::set<SOCKET> &recv_set, std::set<SOCKET> &send_set, std::set<SOCKET> &error_set);
+#ifdef USE_POLL
+    void SocketEventsPoll(std::set<SOCKET> &recv_set, std::set<SOCKET> &send_set, std::set<SOCKET> &error_set);
+#endif
+#ifdef USE_EPOLL
+    bool InitEpoll();
+    void SocketHandlerEpoll();
+#endif
+    void RegisterSocketEvents(CNode* pnode);
     void SocketHandler();
     void ThreadSocketHandler();
     void ThreadDNSAddressSeed();
@@ -359,6 +427,7 @@ private:
     NodeId GetNewNodeId();
 
     size_t SocketSendData(CNode *pnode) const;
+    bool SocketRecvData(CNode *pnode);
     //!check is the banlist has unwritten changes
     bool BannedSetIsDirty();
     //!set the "dirty" flag for the banlist
@@ -396,6 +465,16 @@ private:
     unsigned int nReceiveFloodSize;
 
     std::vector<ListenSocket> vhListenSocket;
+    SocketEventsMode socketEventsMode{DEFAULT_SOCKET_EVENTS};
+#ifdef USE_EPOLL
+    /** epoll instance all sockets are registered with in EPOLL mode, -1 otherwise. */
+    int epollfd{-1};
+    /** Nodes with data left to read, because their receive queue is full or sends go first.
+     *  Only used by the socket handler thread. */
+    std::set<CNode*> setNodesRecvPending;
+#endif
+    /** Last time all nodes went through InactivityCheck. Only used by the socket handler thread. */
+    int64_t nLastInactivityCheck{0};
     std::atomic<bool> fNetworkActive;
     banmap_t setBanned;
     CCriticalSection cs_setBanned;
@@ -428,11 +507,22 @@ private:
     /** SipHasher seeds for deterministic randomness */
     const uint64_t nSeed0, nSeed1;
 
-    /** flag for waking the message processor. */
-    bool fMsgProcWake;
+    /**
+     * A message handler thread. Every peer is processed by a single one of
+     * them, chosen by its id, so messages of a peer are handled in order
+     * while different peers are handled in parallel.
+     */
+    struct MessageHandlerWorker {
+        std::string name;
+        std::thread thread;
+        std::condition_variable cond;
+        /** flag for waking the message processor. */
+        bool fWake = false;
+    };
 
-    std::condition_variable condMsgProc;
+    int nMessageHandlerThreads{1};
     std::mutex mutexMsgProc;
+    std::vector<std::unique_ptr<MessageHandlerWorker>> vMessageHandlers;
     std::atomic<bool> flagInterruptMsgProc;
 
     CThreadInterrupt interruptNet;
@@ -441,7 +531,6 @@ private:
     std::thread threadSocketHandler;
     std::thread threadOpenAddedConnections;
     std::thread threadOpenConnections;
-    std::thread threadMessageHandler;
 
     /** flag for deciding to connect to an extra outbound peer,
      *  in excess of nMaxOutbound
@@ -451,6 +540,7 @@ private:
     std::atomic<int64_t> m_next_send_inv_to_incoming{0};
 
     friend struct CConnmanTest;
+    friend struct CConnmanBench;
 };
 extern std::unique_ptr<CConnman> g_connman;
 void Discover();
@@ -559,6 +649,9 @@ public:
     mapMsgCmdSize mapSendBytesPerMsgCmd;
     uint64_t nRecvBytes;
     mapMsgCmdSize mapRecvBytesPerMsgCmd;
+    uint64_t nRecvBufferAllocs;
+    uint64_t nRecvBufferReuses;
+    int64_t nLastAnnounceLatency;
     bool fWhitelisted;
     double dPingTime;
     double dPingWait;
@@ -574,6 +667,44 @@ public:
 
 
 
+/**
+ * Receive buffers of a connection, recycled once their message has been
+ * processed. Buffers are kept in power-of-two size classes, so a message
+ * gets a buffer that fits it without reallocating while it is received.
+ * Messages larger than the largest class get a buffer of their own.
+ */
+class CNetMessageBufferPool
+{
+public:
+    /** Smallest and largest pooled buffer capacity, as a power of two. */
+    static const int MIN_SIZE_CLASS = 8;
+    static const int MAX_SIZE_CLASS = 18;
+    /** Maximum capacity of the buffers kept by one connection. */
+    static const size_t MAX_POOLED_BYTES = 512 * 1024;
+
+    /** Give stream an empty buffer that holds at least nSize bytes. */
+    void Get(CDataStream& stream, size_t nSize);
+    /** Take back the buffer of a processed message, leaving stream empty. */
+    void Put(CDataStream& stream);
+
+    uint64_t GetAllocs() const { return nAllocs; }
+    uint64_t GetReuses() const { return nReuses; }
+
+    /** Totals over all connections. */
+    static uint64_t GetTotalAllocs() { return nTotalAllocs; }
+    static uint64_t GetTotalReuses() { return nTotalReuses; }
+
+private:
+    CCriticalSection cs;
+    std::vector<CSerializeData> vFree[MAX_SIZE_CLASS - MIN_SIZE_CLASS + 1] GUARDED_BY(cs);
+    size_t nPooledBytes GUARDED_BY(cs) = 0;
+    std::atomic<uint64_t> nAllocs{0};
+    std::atomic<uint64_t> nReuses{0};
+
+    static std::atomic<uint64_t> nTotalAllocs;
+    static std::atomic<uint64_t> nTotalReuses;
+};
+
 class CNetMessage {
 private:
     mutable CHash256 hasher;
@@ -581,7 +712,7 @@ private:
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
-    CDataStream hdrbuf;             // partially received header
+    unsigned char hdrbuf[CMessageHeader::HEADER_SIZE]; // partially received header
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
@@ -590,8 +721,7 @@ public:
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
-    CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
-        hdrbuf.resize(24);
+    CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
@@ -609,7 +739,6 @@ public:
 
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
@@ -618,10 +747,26 @@ public:
 };
 
 
+/** Data queued for sending to a peer, either owned by its send queue or shared with other peers. */
+struct CSendBuffer
+{
+    explicit CSendBuffer(std::vector<unsigned char>&& data) : owned(std::move(data)) {}
+    CSendBuffer(const std::shared_ptr<const std::vector<unsigned char>>& data, int64_t nTimeStartIn) : shared(data), nTimeStart(nTimeStartIn) {}
+
+    const unsigned char* data() const { return shared ? shared->data() : owned.data(); }
+    size_t size() const { return shared ? shared->size() : owned.size(); }
+
+    std::vector<unsigned char> owned;
+    std::shared_ptr<const std::vector<unsigned char>> shared;
+    // See CSharedNetMsg::nTimeStart
+    int64_t nTimeStart = 0;
+};
+
 /** Information about a peer */
 class CNode
 {
     friend class CConnman;
+    friend struct CConnmanBench;
 public:
     // socket
     std::atomic<ServiceFlags> nServices;
@@ -629,7 +774,7 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<std::vector<unsigned char>> vSendMsg;
+    std::deque<CSendBuffer> vSendMsg;
     CCriticalSection cs_vSend;
     CCriticalSection cs_hSocket;
     CCriticalSection cs_vRecv;
@@ -637,6 +782,8 @@ public:
     CCriticalSection cs_vProcessMsg;
     std::list<CNetMessage> vProcessMsg;
     size_t nProcessQueueSize;
+    // Receive buffers of messages, handed back when they have been processed
+    CNetMessageBufferPool recvBufferPool;
 
     CCriticalSection cs_sendProcessing;
 
@@ -646,6 +793,9 @@ public:
 
     std::atomic<int64_t> nLastSend;
     std::atomic<int64_t> nLastRecv;
+    // Microseconds from the last announced block being found valid to the
+    // last byte of its announcement being sent, -1 if none was sent yet
+    std::atomic<int64_t> nLastAnnounceLatency{-1};
     const int64_t nTimeConnected;
     std::atomic<int64_t> nTimeOffset;
     // Address of this peer
@@ -692,8 +842,10 @@ public:
     std::atomic<int> nStartingHeight;
 
     // flood relay
-    std::vector<CAddress> vAddrToSend;
-    CRollingBloomFilter addrKnown;
+    // Addresses are pushed by the message handler threads of other peers too
+    CCriticalSection cs_addrSend;
+    std::vector<CAddress> vAddrToSend GUARDED_BY(cs_addrSend);
+    CRollingBloomFilter addrKnown GUARDED_BY(cs_addrSend);
     bool fGetAddr;
     std::set<uint256> setKnown;
     int64_t nNextAddrSend;
@@ -701,9 +853,11 @@ public:
 
     // inventory based relay
     CRollingBloomFilter filterInventoryKnown;
-    // Set of transaction ids we still have to announce.
-    // They are sorted by the mempool before relay, so the order is not important.
+    // Set of transaction ids we still have to announce, and a heap of them
+    // in mempool order (see CTxRelayScheduler). The heap may hold ids that
+    // were since removed from the set.
     std::set<uint256> setInventoryTxToSend;
+    std::vector<CTxRelayInv> vInventoryTxQueue;
     // List of block ids we still have announce.
     // There is no final sorting before sending, as they are always sent immediately
     // and in the order requested.
@@ -814,11 +968,13 @@ public:
 
     void AddAddressKnown(const CAddress& _addr)
     {
+        LOCK(cs_addrSend);
         addrKnown.insert(_addr.GetKey());
     }
 
     void PushAddress(const CAddress& _addr, FastRandomContext &insecure_rand)
     {
+        LOCK(cs_addrSend);
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
@@ -844,14 +1000,44 @@ public:
     {
         LOCK(cs_inventory);
         if (inv.type == MSG_TX) {
-            if (!filterInventoryKnown.contains(inv.hash)) {
-                setInventoryTxToSend.insert(inv.hash);
+            if (!filterInventoryKnown.contains(inv.hash) && setInventoryTxToSend.insert(inv.hash).second) {
+                vInventoryTxQueue.emplace_back(inv.hash);
+                std::push_heap(vInventoryTxQueue.begin(), vInventoryTxQueue.end(), CompareTxRelayInv());
             }
         } else if (inv.type == MSG_BLOCK) {
             vInventoryBlockToSend.push_back(inv.hash);
         }
     }
 
+    void PushTxInventory(const std::vector<CTxRelayInv>& vTx)
+    {
+        LOCK(cs_inventory);
+        for (const CTxRelayInv& tx : vTx) {
+            if (!filterInventoryKnown.contains(tx.txid) && setInventoryTxToSend.insert(tx.txid).second) {
+                vInventoryTxQueue.push_back(tx);
+                std::push_heap(vInventoryTxQueue.begin(), vInventoryTxQueue.end(), CompareTxRelayInv());
+            }
+        }
+    }
+
+    /** Take the next transaction to announce, in mempool order across all batches queued. */
+    bool PopInventoryTx(uint256& hash) EXCLUSIVE_LOCKS_REQUIRED(cs_inventory)
+    {
+        while (!vInventoryTxQueue.empty()) {
+            std::pop_heap(vInventoryTxQueue.begin(), vInventoryTxQueue.end(), CompareTxRelayInv());
+            hash = vInventoryTxQueue.back().txid;
+            vInventoryTxQueue.pop_back();
+            if (setInventoryTxToSend.erase(hash)) return true;
+        }
+        return false;
+    }
+
+    void ClearInventoryTx() EXCLUSIVE_LOCKS_REQUIRED(cs_inventory)
+    {
+        setInventoryTxToSend.clear();
+        vInventoryTxQueue.clear();
+    }
+
     void PushBlockHash(const uint256 &hash)
     {
         LOCK(cs_inventory);
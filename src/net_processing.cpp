@@ -7,9 +7,11 @@
 
 #include <addrman.h>
 #include <arith_uint256.h>
+#include <blockcache.h>
 #include <blockencodings.h>
 #include <chainparams.h>
 #include <consensus/validation.h>
+#include <crypto/common.h>
 #include <hash.h>
 #include <validation.h>
 #include <merkleblock.h>
@@ -24,6 +26,7 @@
 #include <scheduler.h>
 #include <tinyformat.h>
 #include <txmempool.h>
+#include <txrelay.h>
 #include <ui_interface.h>
 #include <util/system.h>
 #include <util/moneystr.h>
@@ -133,6 +136,7 @@ namespace {
         uint256 hash;
         const CBlockIndex* pindex;                               //!< Optional.
         bool fValidatedHeaders;                                  //!< Whether this block has validated headers at the time of request.
+        int64_t nTimeRequested;                                  //!< When the block was requested (in microseconds).
         std::unique_ptr<PartiallyDownloadedBlock> partialBlock;  //!< Optional, used for CMPCTBLOCK downloads
     };
     std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> > mapBlocksInFlight GUARDED_BY(cs_main);
@@ -160,6 +164,9 @@ namespace {
 
     std::atomic<int64_t> nTimeBestReceived(0); // Used only to inform the wallet of when we last received a block
 
+    /** Transactions waiting to be announced to all peers */
+    CTxRelayScheduler txRelayScheduler;
+
     struct IteratorComparator
     {
         template<typename I>
@@ -221,6 +228,18 @@ struct CNodeState {
     int64_t nDownloadingSince;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
+    //! How many blocks may be in flight from this peer, sized from its measured throughput and ping time.
+    int nBlockDownloadWindow;
+    //! Moving average of the time the peer takes to deliver one block, not counting idle time (in microseconds), or 0.
+    int64_t nBlockTime;
+    //! Moving average of the block download rate in bytes per second.
+    int64_t nBlockBytesPerSecond;
+    //! When the last requested block from this peer arrived (in microseconds).
+    int64_t nLastBlockReceived;
+    //! Blocks received as requested, their total size, and blocks requested from another peer because this one stalled.
+    uint64_t nBlocksDownloaded;
+    uint64_t nBlockBytesDownloaded;
+    uint64_t nBlocksReassigned;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
     //! Whether this peer wants invs or headers (when possible) for block announcements.
@@ -288,6 +307,13 @@ struct CNodeState {
         nDownloadingSince = 0;
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
+        nBlockDownloadWindow = MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+        nBlockTime = 0;
+        nBlockBytesPerSecond = 0;
+        nLastBlockReceived = 0;
+        nBlocksDownloaded = 0;
+        nBlockBytesDownloaded = 0;
+        nBlocksReassigned = 0;
         fPreferredDownload = false;
         fPreferHeaders = false;
         fPreferHeaderAndIDs = false;
@@ -385,7 +411,7 @@ static bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const CBlock
     MarkBlockAsReceived(hash);
 
     std::list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(),
-            {hash, pindex, pindex != nullptr, std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : nullptr)});
+            {hash, pindex, pindex != nullptr, GetTimeMicros(), std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : nullptr)});
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += it->fValidatedHeaders;
     if (state->nBlocksInFlight == 1) {
@@ -401,6 +427,42 @@ static bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const CBlock
     return true;
 }
 
+/**
+ * Update the download statistics and window of a peer that delivered a block
+ * we requested from it. nPingTime is the peer's ping time in microseconds.
+ */
+static void RecordBlockDownload(NodeId nodeid, const uint256& hash, size_t nSize, int64_t nPingTime) EXCLUSIVE_LOCKS_REQUIRED(cs_main) {
+    std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != nodeid)
+        return;
+    CNodeState *state = State(nodeid);
+    assert(state != nullptr);
+
+    const bool fPing = nPingTime != std::numeric_limits<int64_t>::max();
+    const int64_t nNow = GetTimeMicros();
+    const int64_t nRequested = itInFlight->second.second->nTimeRequested;
+    // The peer starts sending a block after the previous one, or one way trip after
+    // we asked for it if it was idle; count neither our requests nor idle time.
+    int64_t nElapsed = nNow - std::max(nRequested, state->nLastBlockReceived);
+    if (nRequested >= state->nLastBlockReceived && fPing)
+        nElapsed -= nPingTime / 2;
+    nElapsed = std::max<int64_t>(nElapsed, 1);
+    state->nLastBlockReceived = nNow;
+
+    state->nBlocksDownloaded++;
+    state->nBlockBytesDownloaded += nSize;
+    const int64_t nBytesPerSecond = nSize * 1000000 / nElapsed;
+    if (state->nBlockTime == 0) {
+        state->nBlockTime = nElapsed;
+        state->nBlockBytesPerSecond = nBytesPerSecond;
+    } else {
+        state->nBlockTime = (state->nBlockTime * 7 + nElapsed) / 8;
+        state->nBlockBytesPerSecond = (state->nBlockBytesPerSecond * 7 + nBytesPerSecond) / 8;
+    }
+
+    state->nBlockDownloadWindow = NextBlockDownloadWindow(state->nBlockDownloadWindow, state->nBlockTime, nPingTime);
+}
+
 /** Check whether the last unknown block a peer advertised is not yet known. */
 static void ProcessBlockAvailability(NodeId nodeid) EXCLUSIVE_LOCKS_REQUIRED(cs_main) {
     CNodeState *state = State(nodeid);
@@ -502,8 +564,9 @@ static bool PeerHasHeader(CNodeState *state, const CBlockIndex *pindex) EXCLUSIV
 }
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
- *  at most count entries. */
-static void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<const CBlockIndex*>& vBlocks, NodeId& nodeStaller, const Consensus::Params& consensusParams) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+ *  at most count entries. If the download window keeps us from adding any, nodeStaller is set to the
+ *  peer that holds up the window and pindexStalled to the block we are waiting for. */
+static void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<const CBlockIndex*>& vBlocks, NodeId& nodeStaller, const CBlockIndex*& pindexStalled, const Consensus::Params& consensusParams) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
     if (count == 0)
         return;
@@ -534,12 +597,16 @@ static void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vec
 
     std::vector<const CBlockIndex*> vToFetch;
     const CBlockIndex *pindexWalk = state->pindexLastCommonBlock;
-    // Never fetch further than the best block we know the peer has, or more than BLOCK_DOWNLOAD_WINDOW + 1 beyond the last
+    // Never fetch further than the best block we know the peer has, or more than the download window + 1 beyond the last
     // linked block we have in common with this peer. The +1 is so we can detect stalling, namely if we would be able to
-    // download that next block if the window were 1 larger.
-    int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
+    // download that next block if the window were 1 larger. Peers with a deeper in-flight window may fetch further ahead.
+    unsigned int nWindow = BLOCK_DOWNLOAD_WINDOW;
+    if (!fPruneMode)
+        nWindow = std::min<unsigned int>(MAX_BLOCK_DOWNLOAD_WINDOW, BLOCK_DOWNLOAD_WINDOW * state->nBlockDownloadWindow / MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    int nWindowEnd = state->pindexLastCommonBlock->nHeight + nWindow;
     int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
     NodeId waitingfor = -1;
+    const CBlockIndex* pindexWaitingFor = nullptr;
     while (pindexWalk->nHeight < nMaxHeight) {
         // Read up to 128 (or more, if more blocks than that are needed) successors of pindexWalk (towards
         // pindexBestKnownBlock) into vToFetch. We fetch 128, because CBlockIndex::GetAncestor may be as expensive
@@ -575,6 +642,7 @@ static void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vec
                     if (vBlocks.size() == 0 && waitingfor != nodeid) {
                         // We aren't able to fetch anything, but we would be if the download window was one larger.
                         nodeStaller = waitingfor;
+                        pindexStalled = pindexWaitingFor;
                     }
                     return;
                 }
@@ -585,6 +653,7 @@ static void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vec
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                pindexWaitingFor = pindex;
             }
         }
     }
@@ -592,6 +661,27 @@ static void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vec
 
 } // namespace
 
+int NextBlockDownloadWindow(int nWindow, int64_t nBlockTime, int64_t nPingTime)
+{
+    // Keep enough blocks in flight to cover two ping times at the peer's rate, so that
+    // it never runs dry while our next requests are on their way.
+    int64_t nTarget = MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    if (nPingTime != std::numeric_limits<int64_t>::max() && nBlockTime > 0)
+        nTarget = std::max(nTarget, 2 * (nPingTime / nBlockTime + 1));
+    nTarget = std::min<int64_t>(nTarget, nWindow + 1);
+    return std::max<int64_t>(MAX_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(nTarget, MAX_BLOCKS_IN_TRANSIT_PER_PEER_ADAPTIVE));
+}
+
+int StalledBlockDownloadWindow(int nWindow)
+{
+    return std::max(MAX_BLOCKS_IN_TRANSIT_PER_PEER, nWindow / 2);
+}
+
+int64_t BlockStallingReassignTimeout(int64_t nBlockTime)
+{
+    return std::min(std::max(BLOCK_STALLING_REASSIGN_TIMEOUT_MIN, 4 * nBlockTime), BLOCK_STALLING_REASSIGN_TIMEOUT_MAX);
+}
+
 // This function is used for testing the stale tip eviction logic, see
 // denialofservice_tests.cpp
 void UpdateLastBlockAnnounceTime(NodeId node, int64_t time_in_seconds)
@@ -601,6 +691,18 @@ void UpdateLastBlockAnnounceTime(NodeId node, int64_t time_in_seconds)
     if (state) state->m_last_block_announcement = time_in_seconds;
 }
 
+// This function is used for testing the block download logic, see
+// denialofservice_tests.cpp
+void UpdateBestKnownBlock(NodeId node, const uint256& hash, bool have_witness)
+{
+    LOCK(cs_main);
+    CNodeState *state = State(node);
+    if (state) {
+        state->fHaveWitness = have_witness;
+        UpdateBlockAvailability(node, hash);
+    }
+}
+
 // Returns true for outbound peers, excluding manual connections, feelers, and
 // one-shots
 static bool IsOutboundDisconnectionCandidate(const CNode *node)
@@ -667,6 +769,12 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.nBlockDownloadWindow = state->nBlockDownloadWindow;
+    stats.nBlocksDownloaded = state->nBlocksDownloaded;
+    stats.nBlockBytesDownloaded = state->nBlockBytesDownloaded;
+    stats.nBlockTime = state->nBlockTime;
+    stats.nBlockBytesPerSecond = state->nBlockBytesPerSecond;
+    stats.nBlocksReassigned = state->nBlocksReassigned;
     return true;
 }
 
@@ -897,14 +1005,36 @@ static std::shared_ptr<const CBlock> most_recent_block GUARDED_BY(cs_most_recent
 static std::shared_ptr<const CBlockHeaderAndShortTxIDs> most_recent_compact_block GUARDED_BY(cs_most_recent_block);
 static uint256 most_recent_block_hash GUARDED_BY(cs_most_recent_block);
 static bool fWitnessesPresentInMostRecentCompactBlock GUARDED_BY(cs_most_recent_block);
+// When most_recent_block was found valid, in microseconds
+static int64_t nTimeMostRecentBlockValid GUARDED_BY(cs_most_recent_block);
+// The cmpctblock messages announcing most_recent_block, serialized on first use
+// and shared by every peer they are sent to: [0] for peers that do not want
+// witnesses, [1] for those that do
+static CSharedNetMsg most_recent_compact_block_msg[2] GUARDED_BY(cs_most_recent_block);
+
+static CSharedNetMsg MostRecentCompactBlockMsg(bool fWantsCmpctWitness) EXCLUSIVE_LOCKS_REQUIRED(cs_most_recent_block)
+{
+    CSharedNetMsg& msg = most_recent_compact_block_msg[fWantsCmpctWitness];
+    if (!msg.data) {
+        const CNetMsgMaker msgMaker(PROTOCOL_VERSION);
+        int nSendFlags = fWantsCmpctWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS;
+        if (fWantsCmpctWitness || !fWitnessesPresentInMostRecentCompactBlock) {
+            msg = CConnman::MakeSharedMessage(msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, *most_recent_compact_block), nTimeMostRecentBlockValid);
+        } else {
+            CBlockHeaderAndShortTxIDs cmpctblock(*most_recent_block, false);
+            msg = CConnman::MakeSharedMessage(msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock), nTimeMostRecentBlockValid);
+        }
+    }
+    return msg;
+}
 
 /**
  * Maintain state about the best-seen block and fast-announce a compact block
  * to compatible peers.
  */
 void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex *pindex, const std::shared_ptr<const CBlock>& pblock) {
+    const int64_t nTimeValid = GetTimeMicros();
     std::shared_ptr<const CBlockHeaderAndShortTxIDs> pcmpctblock = std::make_shared<const CBlockHeaderAndShortTxIDs> (*pblock, true);
-    const CNetMsgMaker msgMaker(PROTOCOL_VERSION);
 
     LOCK(cs_main);
 
@@ -922,12 +1052,18 @@ void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex *pindex, const std:
         most_recent_block = pblock;
         most_recent_compact_block = pcmpctblock;
         fWitnessesPresentInMostRecentCompactBlock = fWitnessEnabled;
+        nTimeMostRecentBlockValid = nTimeValid;
+        for (CSharedNetMsg& msg : most_recent_compact_block_msg) {
+            msg = CSharedNetMsg();
+        }
     }
+    g_recent_blocks.AddBlock(pblock, pcmpctblock);
 
-    connman->ForEachNode([this, &pcmpctblock, pindex, &msgMaker, fWitnessEnabled, &hashBlock](CNode* pnode) {
+    // Serialized at most once per witness variant, on the first peer that needs it
+    CSharedNetMsg msgs[2];
+    connman->ForEachNode([this, pindex, fWitnessEnabled, &hashBlock, &msgs](CNode* pnode) {
         AssertLockHeld(cs_main);
 
-        // TODO: Avoid the repeated-serialization here
         if (pnode->nVersion < INVALID_CB_NO_BAN_VERSION || pnode->fDisconnect)
             return;
         ProcessBlockAvailability(pnode->GetId());
@@ -939,7 +1075,12 @@ void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex *pindex, const std:
 
             LogPrint(BCLog::NET, "%s sending header-and-ids %s to peer=%d\n", "PeerLogicValidation::NewPoWValidBlock",
                     hashBlock.ToString(), pnode->GetId());
-            connman->PushMessage(pnode, msgMaker.Make(NetMsgType::CMPCTBLOCK, *pcmpctblock));
+            CSharedNetMsg& msg = msgs[state.fWantsCmpctWitness];
+            if (!msg.data) {
+                LOCK(cs_most_recent_block);
+                msg = MostRecentCompactBlockMsg(state.fWantsCmpctWitness);
+            }
+            connman->PushMessage(pnode, msg);
             state.pindexBestHeaderSent = pindex;
         }
     });
@@ -1060,13 +1201,10 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     return true;
 }
 
-static void RelayTransaction(const CTransaction& tx, CConnman* connman)
+void RelayTransaction(const CTransaction& tx, CConnman* connman)
 {
-    CInv inv(MSG_TX, tx.GetHash());
-    connman->ForEachNode([&inv](CNode* pnode)
-    {
-        pnode->PushInventory(inv);
-    });
+    // Peers get the transaction with the next batch, see SendMessages
+    txRelayScheduler.Relay(tx.GetHash());
 }
 
 static void RelayAddress(const CAddress& addr, bool fReachable, CConnman* connman)
@@ -1105,6 +1243,43 @@ static void RelayAddress(const CAddress& addr, bool fReachable, CConnman* connma
     connman->ForEachNodeThen(std::move(sortfunc), std::move(pushfunc));
 }
 
+/**
+ * Whether a serialized block may carry witness data. A valid block whose
+ * coinbase is not in the extended format has no witness commitment and so
+ * no witnesses at all, which makes its serialization on disk identical to
+ * its witness-stripped one. Only the start of the coinbase is inspected.
+ */
+static bool RawBlockHasWitness(const std::vector<uint8_t>& block_data)
+{
+    size_t pos = 80; // block header
+    if (block_data.size() <= pos) return true;
+    const uint8_t size_prefix = block_data[pos];
+    pos += size_prefix < 253 ? 1 : size_prefix == 253 ? 3 : size_prefix == 254 ? 5 : 9;
+    if (block_data.size() < pos + 4) return true;
+    const int32_t tx_version = ReadLE32(&block_data[pos]);
+    pos += 4;
+    if (tx_version == CTransaction::CURRENT_VERSION_FORK) {
+        pos += 32; // preBlockHash
+    }
+    // An empty vin marker here introduces the extended format
+    return block_data.size() <= pos || block_data[pos] == 0;
+}
+
+/**
+ * Handle a failed read of a block that was available when the request was
+ * checked under cs_main. Blocks are read without holding cs_main, so the
+ * block may have been pruned since.
+ */
+static void BlockReadFailed(CNode* pfrom, const CBlockIndex* pindex)
+{
+    LOCK(cs_main);
+    if (pindex->nStatus & BLOCK_HAVE_DATA) {
+        assert(!"cannot load block from disk");
+    }
+    LogPrint(BCLog::NET, "block %s was pruned before it could be read, disconnect peer=%d\n", pindex->GetBlockHash().ToString(), pfrom->GetId());
+    pfrom->fDisconnect = true;
+}
+
 void static ProcessGetBlockData(CNode* pfrom, const CChainParams& chainparams, const CInv& inv, CConnman* connman)
 {
     bool send = false;
@@ -1142,121 +1317,163 @@ void static ProcessGetBlockData(CNode* pfrom, const CChainParams& chainparams, c
         }
     }
 
-    LOCK(cs_main);
-    const CBlockIndex* pindex = LookupBlockIndex(inv.hash);
-    if (pindex) {
-        send = BlockRequestAllowed(pindex, consensusParams);
-        if (!send) {
-            LogPrint(BCLog::NET, "%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
-        }
-    }
+    const CBlockIndex* pindex;
     const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
-    // disconnect node in case we have reached the outbound limit for serving historical blocks
-    // never disconnect whitelisted nodes
-    if (send && connman->OutboundTargetReached(true) && ( ((pindexBestHeader != nullptr) && (pindexBestHeader->GetBlockTime() - pindex->GetBlockTime() > HISTORICAL_BLOCK_AGE)) || inv.type == MSG_FILTERED_BLOCK) && !pfrom->fWhitelisted)
+    bool fPeerWantsWitness;
+    bool fSendCompact;
+    uint256 hashTip;
     {
-        LogPrint(BCLog::NET, "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+        LOCK(cs_main);
+        pindex = LookupBlockIndex(inv.hash);
+        if (pindex) {
+            send = BlockRequestAllowed(pindex, consensusParams);
+            if (!send) {
+                LogPrint(BCLog::NET, "%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+            }
+        }
+        // disconnect node in case we have reached the outbound limit for serving historical blocks
+        // never disconnect whitelisted nodes
+        if (send && connman->OutboundTargetReached(true) && ( ((pindexBestHeader != nullptr) && (pindexBestHeader->GetBlockTime() - pindex->GetBlockTime() > HISTORICAL_BLOCK_AGE)) || inv.type == MSG_FILTERED_BLOCK) && !pfrom->fWhitelisted)
+        {
+            LogPrint(BCLog::NET, "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
 
-        //disconnect node
-        pfrom->fDisconnect = true;
-        send = false;
-    }
-    // Avoid leaking prune-height by never sending blocks below the NODE_NETWORK_LIMITED threshold
-    if (send && !pfrom->fWhitelisted && (
-            (((pfrom->GetLocalServices() & NODE_NETWORK_LIMITED) == NODE_NETWORK_LIMITED) && ((pfrom->GetLocalServices() & NODE_NETWORK) != NODE_NETWORK) && (chainActive.Tip()->nHeight - pindex->nHeight > (int)NODE_NETWORK_LIMITED_MIN_BLOCKS + 2 /* add two blocks buffer extension for possible races */) )
-       )) {
-        LogPrint(BCLog::NET, "Ignore block request below NODE_NETWORK_LIMITED threshold from peer=%d\n", pfrom->GetId());
+            //disconnect node
+            pfrom->fDisconnect = true;
+            send = false;
+        }
+        // Avoid leaking prune-height by never sending blocks below the NODE_NETWORK_LIMITED threshold
+        if (send && !pfrom->fWhitelisted && (
+                (((pfrom->GetLocalServices() & NODE_NETWORK_LIMITED) == NODE_NETWORK_LIMITED) && ((pfrom->GetLocalServices() & NODE_NETWORK) != NODE_NETWORK) && (chainActive.Tip()->nHeight - pindex->nHeight > (int)NODE_NETWORK_LIMITED_MIN_BLOCKS + 2 /* add two blocks buffer extension for possible races */) )
+           )) {
+            LogPrint(BCLog::NET, "Ignore block request below NODE_NETWORK_LIMITED threshold from peer=%d\n", pfrom->GetId());
 
-        //disconnect node and prevent it from stalling (would otherwise wait for the missing block)
-        pfrom->fDisconnect = true;
-        send = false;
+            //disconnect node and prevent it from stalling (would otherwise wait for the missing block)
+            pfrom->fDisconnect = true;
+            send = false;
+        }
+        // Pruned nodes may have deleted the block, so check whether
+        // it's available before trying to send.
+        if (!send || !(pindex->nStatus & BLOCK_HAVE_DATA)) return;
+        fPeerWantsWitness = State(pfrom->GetId())->fWantsCmpctWitness;
+        // If a peer is asking for old blocks, we're almost guaranteed
+        // they won't have a useful mempool to match against a compact block,
+        // and we don't feel like constructing the object for them, so
+        // instead we respond with the full, non-compact block.
+        fSendCompact = CanDirectFetch(consensusParams) && pindex->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+        hashTip = chainActive.Tip()->GetBlockHash();
+    } // release cs_main: reading and serializing the block only touches this peer
+
+    std::shared_ptr<const CBlock> pblock;
+    std::shared_ptr<const CBlockHeaderAndShortTxIDs> pcompact;
+    CRecentBlockCache::Entry cached;
+    if (g_recent_blocks.Get(pindex->GetBlockHash(), cached)) {
+        pblock = cached.block;
+        // Compact blocks are cached with wtxid short ids, which are the txids if there are no witnesses
+        if (cached.compact && (fPeerWantsWitness || !cached.has_witness)) {
+            pcompact = cached.compact;
+        }
+    } else if (a_recent_block && a_recent_block->GetHash() == pindex->GetBlockHash()) {
+        pblock = a_recent_block;
+    }
+    if ((inv.type == MSG_WITNESS_BLOCK || inv.type == MSG_BLOCK) && (cached.serialized || cached.block || !pblock)) {
+        // Fast-path: serve the block as serialized, either cached or read directly from
+        // disk, whenever the network format matches it
+        std::shared_ptr<const std::vector<uint8_t>> block_data = cached.serialized;
+        bool has_witness = cached.has_witness;
+        if (!block_data && !pblock) {
+            std::shared_ptr<std::vector<uint8_t>> block_read = std::make_shared<std::vector<uint8_t>>();
+            if (!ReadRawBlockFromDisk(*block_read, pindex, chainparams.MessageStart())) {
+                BlockReadFailed(pfrom, pindex);
+                return;
+            }
+            has_witness = RawBlockHasWitness(*block_read);
+            block_data = block_read;
+            g_recent_blocks.AddSerialized(pindex->GetBlockHash(), block_data, has_witness);
+            // Stripping the witnesses below parses these bytes instead of reading them again
+            cached.serialized = block_data;
+        } else if (!block_data && (inv.type == MSG_WITNESS_BLOCK || !has_witness)) {
+            // Serialize the cached block once for every peer that will ask for it
+            block_data = SerializeBlock(*pblock);
+            g_recent_blocks.AddSerialized(pindex->GetBlockHash(), block_data, has_witness);
+        }
+        if (inv.type == MSG_WITNESS_BLOCK || !has_witness) {
+            connman->PushMessage(pfrom, CConnman::MakeSharedMessage(NetMsgType::BLOCK, block_data));
+            // Clear pblock as we've sent the block
+            pblock.reset();
+        } else if (!pblock) {
+            // Witnesses have to be stripped, which needs the deserialized block
+            if (!ReadBlockCached(pblock, pindex, consensusParams, cached)) {
+                BlockReadFailed(pfrom, pindex);
+                return;
+            }
+        }
+    } else if (!pblock) {
+        // Send block from disk
+        if (!ReadBlockCached(pblock, pindex, consensusParams, cached)) {
+            BlockReadFailed(pfrom, pindex);
+            return;
+        }
     }
-    // Pruned nodes may have deleted the block, so check whether
-    // it's available before trying to send.
-    if (send && (pindex->nStatus & BLOCK_HAVE_DATA))
-    {
-        std::shared_ptr<const CBlock> pblock;
-        if (a_recent_block && a_recent_block->GetHash() == pindex->GetBlockHash()) {
-            pblock = a_recent_block;
-        } else if (inv.type == MSG_WITNESS_BLOCK) {
-            // Fast-path: in this case it is possible to serve the block directly from disk,
-            // as the network format matches the format on disk
-            std::vector<uint8_t> block_data;
-            if (!ReadRawBlockFromDisk(block_data, pindex, chainparams.MessageStart())) {
-                assert(!"cannot load block from disk");
-            }
-            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::BLOCK, MakeSpan(block_data)));
-            // Don't set pblock as we've sent the block
-        } else {
-            // Send block from disk
-            std::shared_ptr<CBlock> pblockRead = std::make_shared<CBlock>();
-            if (!ReadBlockFromDisk(*pblockRead, pindex, consensusParams))
-                assert(!"cannot load block from disk");
-            pblock = pblockRead;
-        }
-        if (pblock) {
-            if (inv.type == MSG_BLOCK)
-                connman->PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, *pblock));
-            else if (inv.type == MSG_WITNESS_BLOCK)
-                connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::BLOCK, *pblock));
-            else if (inv.type == MSG_FILTERED_BLOCK)
+    if (pblock) {
+        if (inv.type == MSG_BLOCK)
+            connman->PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, *pblock));
+        else if (inv.type == MSG_WITNESS_BLOCK)
+            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::BLOCK, *pblock));
+        else if (inv.type == MSG_FILTERED_BLOCK)
+        {
+            bool sendMerkleBlock = false;
+            CMerkleBlock merkleBlock;
             {
-                bool sendMerkleBlock = false;
-                CMerkleBlock merkleBlock;
-                {
-                    LOCK(pfrom->cs_filter);
-                    if (pfrom->pfilter) {
-                        sendMerkleBlock = true;
-                        merkleBlock = CMerkleBlock(*pblock, *pfrom->pfilter);
-                    }
-                }
-                if (sendMerkleBlock) {
-                    connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::MERKLEBLOCK, merkleBlock));
-                    // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
-                    // This avoids hurting performance by pointlessly requiring a round-trip
-                    // Note that there is currently no way for a node to request any single transactions we didn't send here -
-                    // they must either disconnect and retry or request the full block.
-                    // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                    // however we MUST always provide at least what the remote peer needs
-                    typedef std::pair<unsigned int, uint256> PairType;
-                    for (PairType& pair : merkleBlock.vMatchedTxn)
-                        connman->PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, *pblock->vtx[pair.first]));
+                LOCK(pfrom->cs_filter);
+                if (pfrom->pfilter) {
+                    sendMerkleBlock = true;
+                    merkleBlock = CMerkleBlock(*pblock, *pfrom->pfilter);
                 }
-                // else
-                    // no response
             }
-            else if (inv.type == MSG_CMPCT_BLOCK)
-            {
-                // If a peer is asking for old blocks, we're almost guaranteed
-                // they won't have a useful mempool to match against a compact block,
-                // and we don't feel like constructing the object for them, so
-                // instead we respond with the full, non-compact block.
-                bool fPeerWantsWitness = State(pfrom->GetId())->fWantsCmpctWitness;
-                int nSendFlags = fPeerWantsWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS;
-                if (CanDirectFetch(consensusParams) && pindex->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
-                    if ((fPeerWantsWitness || !fWitnessesPresentInARecentCompactBlock) && a_recent_compact_block && a_recent_compact_block->header.GetHash() == pindex->GetBlockHash()) {
-                        connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, *a_recent_compact_block));
-                    } else {
-                        CBlockHeaderAndShortTxIDs cmpctblock(*pblock, fPeerWantsWitness);
-                        connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock));
-                    }
+            if (sendMerkleBlock) {
+                connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::MERKLEBLOCK, merkleBlock));
+                // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
+                // This avoids hurting performance by pointlessly requiring a round-trip
+                // Note that there is currently no way for a node to request any single transactions we didn't send here -
+                // they must either disconnect and retry or request the full block.
+                // Thus, the protocol spec specified allows for us to provide duplicate txn here,
+                // however we MUST always provide at least what the remote peer needs
+                typedef std::pair<unsigned int, uint256> PairType;
+                for (PairType& pair : merkleBlock.vMatchedTxn)
+                    connman->PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, *pblock->vtx[pair.first]));
+            }
+            // else
+                // no response
+        }
+        else if (inv.type == MSG_CMPCT_BLOCK)
+        {
+            int nSendFlags = fPeerWantsWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS;
+            if (fSendCompact) {
+                if (pcompact) {
+                    connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, *pcompact));
+                } else if ((fPeerWantsWitness || !fWitnessesPresentInARecentCompactBlock) && a_recent_compact_block && a_recent_compact_block->header.GetHash() == pindex->GetBlockHash()) {
+                    connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, *a_recent_compact_block));
                 } else {
-                    connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::BLOCK, *pblock));
+                    std::shared_ptr<const CBlockHeaderAndShortTxIDs> cmpctblock = std::make_shared<const CBlockHeaderAndShortTxIDs>(*pblock, fPeerWantsWitness);
+                    connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, *cmpctblock));
+                    if (fPeerWantsWitness) g_recent_blocks.AddCompact(cmpctblock);
                 }
+            } else {
+                connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::BLOCK, *pblock));
             }
         }
+    }
 
-        // Trigger the peer node to send a getblocks request for the next batch of inventory
-        if (inv.hash == pfrom->hashContinue)
-        {
-            // Bypass PushInventory, this must send even if redundant,
-            // and we want it right after the last block so they don't
-            // wait for other stuff first.
-            std::vector<CInv> vInv;
-            vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
-            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::INV, vInv));
-            pfrom->hashContinue.SetNull();
-        }
+    // Trigger the peer node to send a getblocks request for the next batch of inventory
+    if (inv.hash == pfrom->hashContinue)
+    {
+        // Bypass PushInventory, this must send even if redundant,
+        // and we want it right after the last block so they don't
+        // wait for other stuff first.
+        std::vector<CInv> vInv;
+        vInv.push_back(CInv(MSG_BLOCK, hashTip));
+        connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::INV, vInv));
+        pfrom->hashContinue.SetNull();
     }
 }
 
@@ -2123,11 +2340,11 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
             return true;
         }
 
-        CBlock block;
-        bool ret = ReadBlockFromDisk(block, pindex, chainparams.GetConsensus());
+        std::shared_ptr<const CBlock> block;
+        bool ret = ReadBlockCached(block, pindex, chainparams.GetConsensus());
         assert(ret);
 
-        SendBlockTransactions(block, req, pfrom, connman);
+        SendBlockTransactions(*block, req, pfrom, connman);
     }
 
 
@@ -2726,6 +2943,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
     else if (strCommand == NetMsgType::BLOCK && !fImporting && !fReindex) // Ignore blocks received while importing
     {
         std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+        const size_t nBlockSize = vRecv.size();
         vRecv >> *pblock;
 
         LogPrint(BCLog::NET, "received block %s peer=%d\n", pblock->GetHash().ToString(), pfrom->GetId());
@@ -2736,6 +2954,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
             LOCK(cs_main);
             // Also always process if we requested the block explicitly, as we may
             // need it even though it is not a candidate for a new best tip.
+            RecordBlockDownload(pfrom->GetId(), hash, nBlockSize, pfrom->nMinPingUsecTime);
             forceProcessing |= MarkBlockAsReceived(hash);
             // mapBlockSource is only used for sending reject messages and DoS scores,
             // so the race between here and cs_main in ProcessNewBlock is fine.
@@ -2772,7 +2991,10 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrSend);
+            pfrom->vAddrToSend.clear();
+        }
         std::vector<CAddress> vAddr = connman->GetAddresses();
         FastRandomContext insecure_rand;
         for (const CAddress &addr : vAddr)
@@ -3105,6 +3327,7 @@ bool PeerLogicValidation::ProcessMessages(CNode* pfrom, std::atomic<bool>& inter
     } catch (...) {
         PrintExceptionContinue(nullptr, "ProcessMessages()");
     }
+    pfrom->recvBufferPool.Put(vRecv);
 
     if (!fRet) {
         LogPrint(BCLog::NET, "%s(%s, %u bytes) FAILED peer=%d\n", __func__, SanitizeString(strCommand), nMessageSize, pfrom->GetId());
@@ -3250,25 +3473,6 @@ void PeerLogicValidation::CheckForStaleTipAndEvictPeers(const Consensus::Params
     }
 }
 
-namespace {
-class CompareInvMempoolOrder
-{
-    CTxMemPool *mp;
-public:
-    explicit CompareInvMempoolOrder(CTxMemPool *_mempool)
-    {
-        mp = _mempool;
-    }
-
-    bool operator()(std::set<uint256>::iterator a, std::set<uint256>::iterator b)
-    {
-        /* As std::make_heap produces a max-heap, we want the entries with the
-         * fewest ancestors/highest fee to sort later. */
-        return mp->CompareDepthAndScore(*b, *a);
-    }
-};
-}
-
 bool PeerLogicValidation::SendMessages(CNode* pto)
 {
     const Consensus::Params& consensusParams = Params().GetConsensus();
@@ -3329,6 +3533,7 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
         //
         if (pto->nNextAddrSend < nNow) {
             pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
+            LOCK(pto->cs_addrSend);
             std::vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             for (const CAddress& addr : pto->vAddrToSend)
@@ -3465,12 +3670,7 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
                     {
                         LOCK(cs_most_recent_block);
                         if (most_recent_block_hash == pBestIndex->GetBlockHash()) {
-                            if (state.fWantsCmpctWitness || !fWitnessesPresentInMostRecentCompactBlock)
-                                connman->PushMessage(pto, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, *most_recent_compact_block));
-                            else {
-                                CBlockHeaderAndShortTxIDs cmpctblock(*most_recent_block, state.fWantsCmpctWitness);
-                                connman->PushMessage(pto, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock));
-                            }
+                            connman->PushMessage(pto, MostRecentCompactBlockMsg(state.fWantsCmpctWitness));
                             fGotBlockFromCache = true;
                         }
                     }
@@ -3528,6 +3728,15 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
         //
         // Message: inventory
         //
+        // Queue the transactions relayed since the last batch at every peer, with their mempool order.
+        // GetTime() is used so that batching can be driven with mocktime
+        std::vector<CTxRelayInv> vRelayBatch;
+        if (txRelayScheduler.GetBatch(mempool, GetTime(), vRelayBatch)) {
+            connman->ForEachNode([&vRelayBatch](CNode* pnode) {
+                pnode->PushTxInventory(vRelayBatch);
+            });
+        }
+
         std::vector<CInv> vInv;
         {
             LOCK(pto->cs_inventory);
@@ -3558,7 +3767,7 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
             // Time to send but the peer has requested we not relay transactions.
             if (fSendTrickle) {
                 LOCK(pto->cs_filter);
-                if (!pto->fRelayTxes) pto->setInventoryTxToSend.clear();
+                if (!pto->fRelayTxes) pto->ClearInventoryTx();
             }
 
             // Respond to BIP35 mempool requests
@@ -3596,33 +3805,19 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
 
             // Determine transactions to relay
             if (fSendTrickle) {
-                // Produce a vector with all candidates for sending
-                std::vector<std::set<uint256>::iterator> vInvTx;
-                vInvTx.reserve(pto->setInventoryTxToSend.size());
-                for (std::set<uint256>::iterator it = pto->setInventoryTxToSend.begin(); it != pto->setInventoryTxToSend.end(); it++) {
-                    vInvTx.push_back(it);
-                }
                 CAmount filterrate = 0;
                 {
                     LOCK(pto->cs_feeFilter);
                     filterrate = pto->minFeeFilter;
                 }
-                // Topologically and fee-rate sort the inventory we send for privacy and priority reasons.
-                // A heap is used so that not all items need sorting if only a few are being sent.
-                CompareInvMempoolOrder compareInvMempoolOrder(&mempool);
-                std::make_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
+                // The queue is a heap in topological and fee-rate order for privacy and priority reasons,
+                // so the inventory is sent in the order it is popped.
                 // No reason to drain out at many times the network's capacity,
                 // especially since we have many peers and some will draw much shorter delays.
                 unsigned int nRelayedTransactions = 0;
                 LOCK(pto->cs_filter);
-                while (!vInvTx.empty() && nRelayedTransactions < INVENTORY_BROADCAST_MAX) {
-                    // Fetch the top element from the heap
-                    std::pop_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
-                    std::set<uint256>::iterator it = vInvTx.back();
-                    vInvTx.pop_back();
-                    uint256 hash = *it;
-                    // Remove it from the to-be-sent set
-                    pto->setInventoryTxToSend.erase(it);
+                uint256 hash;
+                while (nRelayedTransactions < INVENTORY_BROADCAST_MAX && pto->PopInventoryTx(hash)) {
                     // Check if not in the filter already
                     if (pto->filterInventoryKnown.contains(hash)) {
                         continue;
@@ -3728,10 +3923,11 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
         // Message: getdata (blocks)
         //
         std::vector<CInv> vGetData;
-        if (!pto->fClient && ((fFetch && !pto->m_limited_node) || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        if (!pto->fClient && ((fFetch && !pto->m_limited_node) || !IsInitialBlockDownload()) && state.nBlocksInFlight < state.nBlockDownloadWindow) {
             std::vector<const CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller, consensusParams);
+            const CBlockIndex* pindexStalled = nullptr;
+            FindNextBlocksToDownload(pto->GetId(), state.nBlockDownloadWindow - state.nBlocksInFlight, vToDownload, staller, pindexStalled, consensusParams);
             for (const CBlockIndex *pindex : vToDownload) {
                 uint32_t nFetchFlags = GetFetchFlags(pto);
                 vGetData.push_back(CInv(MSG_BLOCK | nFetchFlags, pindex->GetBlockHash()));
@@ -3740,9 +3936,27 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
                     pindex->nHeight, pto->GetId());
             }
             if (state.nBlocksInFlight == 0 && staller != -1) {
-                if (State(staller)->nStallingSince == 0) {
-                    State(staller)->nStallingSince = nNow;
+                CNodeState* stallerState = State(staller);
+                if (stallerState->nStallingSince == 0) {
+                    stallerState->nStallingSince = nNow;
                     LogPrint(BCLog::NET, "Stall started peer=%d\n", staller);
+                } else if (pindexStalled && nNow - stallerState->nStallingSince > BlockStallingReassignTimeout(stallerState->nBlockTime)) {
+                    // Rather than waiting for the staller to be disconnected, ask this idle peer for the
+                    // block that holds up the window, and let the staller keep fewer blocks in flight.
+                    stallerState->nBlocksReassigned++;
+                    stallerState->nBlockTime *= 2;
+                    stallerState->nBlockDownloadWindow = StalledBlockDownloadWindow(stallerState->nBlockDownloadWindow);
+                    uint32_t nFetchFlags = GetFetchFlags(pto);
+                    vGetData.push_back(CInv(MSG_BLOCK | nFetchFlags, pindexStalled->GetBlockHash()));
+                    // Taking the block over resets the staller's stall and download timers. Keep them, so
+                    // that a staller which does not deliver the rest of its blocks is still disconnected.
+                    const int64_t nStallingSince = stallerState->nStallingSince;
+                    const int64_t nDownloadingSince = stallerState->nDownloadingSince;
+                    MarkBlockAsInFlight(pto->GetId(), pindexStalled->GetBlockHash(), pindexStalled);
+                    stallerState->nStallingSince = nStallingSince;
+                    stallerState->nDownloadingSince = nDownloadingSince;
+                    LogPrint(BCLog::NET, "Requesting block %s (%d) peer=%d, stalled by peer=%d\n", pindexStalled->GetBlockHash().ToString(),
+                        pindexStalled->nHeight, pto->GetId(), staller);
                 }
             }
         }
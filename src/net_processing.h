@@ -79,9 +79,28 @@ struct CNodeStateStats {
     int nSyncHeight = -1;
     int nCommonHeight = -1;
     std::vector<int> vHeightInFlight;
+    int nBlockDownloadWindow = 0;
+    uint64_t nBlocksDownloaded = 0;
+    uint64_t nBlockBytesDownloaded = 0;
+    int64_t nBlockTime = 0;
+    int64_t nBlockBytesPerSecond = 0;
+    uint64_t nBlocksReassigned = 0;
 };
 
 /** Get statistics from node state */
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
+/** Announce a transaction to all peers with the next batch (see CTxRelayScheduler). */
+void RelayTransaction(const CTransaction& tx, CConnman* connman);
+
+/**
+ * The block download window of a peer after it delivered a block, from its current window,
+ * its average time per block and its ping time (max if unknown), in microseconds. The window
+ * grows by at most one block per block delivered, so a window cut after a stall stays cut.
+ */
+int NextBlockDownloadWindow(int nWindow, int64_t nBlockTime, int64_t nPingTime);
+/** The block download window of a peer after a block it stalled on was reassigned. */
+int StalledBlockDownloadWindow(int nWindow);
+/** Time in microseconds a peer may stall before the block it stalls on is reassigned. */
+int64_t BlockStallingReassignTimeout(int64_t nBlockTime);
 
 #endif // BITCOIN_NET_PROCESSING_H
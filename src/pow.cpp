@@ -9,10 +9,14 @@
 #include <chain.h>
 #include <primitives/block.h>
 #include <uint256.h>
+#include <sync.h>
 #include <util/system.h>
 
 #include <consensus/consensus.h>
 
+#include <memory>
+#include <vector>
+
 unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock, const Consensus::Params& params)
 {
     assert(pindexLast != nullptr);
@@ -129,51 +133,181 @@ unsigned int LwmaGetNextWorkRequired(const CBlockIndex* pindexLast, const CBlock
     return LwmaCalculateNextWorkRequired(pindexLast, params);
 }
 
-unsigned int LwmaCalculateNextWorkRequired(const CBlockIndex* pindexLast, const Consensus::Params& params)
+namespace {
+
+/** Rolling LWMA sums over the last N blocks, advanced one block at a time.
+ *  Each block contributes its (optionally limited) solvetime and its target
+ *  divided by k*N^2, exactly as in the full window walk, so the result is
+ *  bit-identical: the target sum is updated with exact 256-bit adds and
+ *  subtracts and the weighted solvetime sum is truncated to int the same way.
+ */
+class LwmaWindow
 {
-    const int height = pindexLast->nHeight + 1;
-    const int64_t T = params.nPowTargetSpacing;
-    const int64_t N = params.nZawyLwmaAveragingWindow;
-    const int64_t k = params.nZawyLwmaAdjustedWeight;
-    const int64_t dnorm = params.nZawyLwmaMinDenominator;
-    const bool limit_st = params.bZawyLwmaSolvetimeLimitation;
-    assert(height > N);
+public:
+    explicit LwmaWindow(const Consensus::Params& params) :
+        T(params.nPowTargetSpacing), N(params.nZawyLwmaAveragingWindow), k(params.nZawyLwmaAdjustedWeight),
+        dnorm(params.nZawyLwmaMinDenominator), limit_st(params.bZawyLwmaSolvetimeLimitation) {}
 
-    arith_uint256 sum_target;
-    int t = 0, j = 0;
+    bool HasSameParams(const Consensus::Params& params) const
+    {
+        return T == params.nPowTargetSpacing && N == params.nZawyLwmaAveragingWindow && k == params.nZawyLwmaAdjustedWeight &&
+            dnorm == params.nZawyLwmaMinDenominator && limit_st == params.bZawyLwmaSolvetimeLimitation;
+    }
 
-    // Loop through N most recent blocks.
-    for (int i = height - N; i < height; i++) {
-        const CBlockIndex* block = pindexLast->GetAncestor(i);
-        const CBlockIndex* block_Prev = block->GetAncestor(i - 1);
-        int64_t solvetime = block->GetBlockTime() - block_Prev->GetBlockTime();
+    /** Rebuild the window ending at pindexLast, walking pprev once. */
+    void Reset(const CBlockIndex* pindexLast)
+    {
+        assert(pindexLast->nHeight + 1 > N);
+        std::vector<const CBlockIndex*> blocks(N + 1);
+        const CBlockIndex* pindex = pindexLast;
+        for (int64_t i = N; i >= 0; --i) {
+            blocks[i] = pindex;
+            pindex = pindex->pprev;
+        }
+
+        entries.assign(N, Entry());
+        oldest = 0;
+        sum_solvetime = 0;
+        weighted_solvetime = 0;
+        sum_target = 0;
+        last_time = blocks[0]->GetBlockTime();
+        for (int64_t i = 1; i <= N; ++i) {
+            Push(blocks[i]);
+        }
+        assert(oldest == 0);
+    }
 
+    /** Slide the window forward by one block, the child of the last block pushed. */
+    void Push(const CBlockIndex* pindex)
+    {
+        int64_t solvetime = pindex->GetBlockTime() - last_time;
         if (limit_st && solvetime > 6 * T) {
             solvetime = 6 * T;
         }
+        arith_uint256 target;
+        target.SetCompact(pindex->nBits);
+
+        Entry& entry = entries[oldest];
+        weighted_solvetime += N * solvetime - sum_solvetime;
+        sum_solvetime += solvetime - entry.solvetime;
+        sum_target -= entry.target;
+        entry.solvetime = solvetime;
+        entry.target = target / (k * N * N);
+        sum_target += entry.target;
+        oldest = (oldest + 1) % N;
+        last_time = pindex->GetBlockTime();
+    }
+
+    /** The target for the block after the last one pushed. */
+    unsigned int GetNextWorkRequired(const Consensus::Params& params) const
+    {
+        int t = weighted_solvetime;
+        // Keep t reasonable in case strange solvetimes occurred.
+        if (t < N * k / dnorm) {
+            t = N * k / dnorm;
+        }
 
-        j++;
-        t += solvetime * j;  // Weighted solvetime sum.
+        const arith_uint256 pow_limit = UintToArith256(params.BCDBeginPowLimit);
+        arith_uint256 next_target = t * sum_target;
+        if (next_target > pow_limit) {
+            next_target = pow_limit;
+        }
 
-        // Target sum divided by a factor, (k N^2).
-        // The factor is a part of the final equation. However we divide sum_target here to avoid
-        // potential overflow.
-        arith_uint256 target;
-        target.SetCompact(block->nBits);
-        sum_target += target / (k * N * N);
+        return next_target.GetCompact();
     }
-    // Keep t reasonable in case strange solvetimes occurred.
-    if (t < N * k / dnorm) {
-        t = N * k / dnorm;
+
+private:
+    struct Entry {
+        int64_t solvetime = 0;
+        arith_uint256 target; //!< target / (k N^2), the block's share of sum_target
+    };
+
+    const int64_t T;
+    const int64_t N;
+    const int64_t k;
+    const int64_t dnorm;
+    const bool limit_st;
+
+    std::vector<Entry> entries; //!< ring buffer of the N blocks in the window
+    int64_t oldest = 0;
+    int64_t sum_solvetime = 0;
+    int64_t weighted_solvetime = 0; //!< sum of solvetime * j, j = 1 for the oldest block
+    arith_uint256 sum_target;
+    int64_t last_time = 0;
+};
+
+/** Window for the most recent tip difficulty was asked for, keyed by its hash. */
+CCriticalSection cs_lwma;
+std::unique_ptr<LwmaWindow> g_lwma_window GUARDED_BY(cs_lwma);
+uint256 g_lwma_tip GUARDED_BY(cs_lwma);
+
+} // namespace
+
+unsigned int LwmaCalculateNextWorkRequired(const CBlockIndex* pindexLast, const Consensus::Params& params)
+{
+    assert(pindexLast->nHeight + 1 > params.nZawyLwmaAveragingWindow);
+
+    // Index entries without a hash (e.g. in unit tests) cannot be cached.
+    if (pindexLast->phashBlock == nullptr) {
+        LwmaWindow window(params);
+        window.Reset(pindexLast);
+        return window.GetNextWorkRequired(params);
     }
 
-    const arith_uint256 pow_limit = UintToArith256(params.BCDBeginPowLimit);
-    arith_uint256 next_target = t * sum_target;
-    if (next_target > pow_limit) {
-        next_target = pow_limit;
+    LOCK(cs_lwma);
+    if (!g_lwma_window || !g_lwma_window->HasSameParams(params)) {
+        g_lwma_window.reset(new LwmaWindow(params));
+        g_lwma_window->Reset(pindexLast);
+    } else if (g_lwma_tip != pindexLast->GetBlockHash()) {
+        // Extending the cached tip by one block is the common case, both
+        // while syncing headers and when connecting or mining on the tip.
+        if (pindexLast->pprev->phashBlock != nullptr && g_lwma_tip == pindexLast->pprev->GetBlockHash()) {
+            g_lwma_window->Push(pindexLast);
+        } else {
+            g_lwma_window->Reset(pindexLast);
+        }
     }
+    g_lwma_tip = pindexLast->GetBlockHash();
+    return g_lwma_window->GetNextWorkRequired(params);
+}
 
-    return next_target.GetCompact();
+std::vector<unsigned int> GetNextWorkRequiredBatch(const CBlockIndex* pindexLast, const std::vector<CBlockHeader>& headers, const Consensus::Params& params)
+{
+    std::vector<unsigned int> ret;
+    ret.reserve(headers.size());
+    if (headers.empty()) return ret;
+
+    // Chain temporary index entries onto pindexLast, so every retarget rule
+    // sees the headers before it. Hashes are set so the LWMA window slides
+    // along the run instead of being rebuilt for each header.
+    std::vector<uint256> hashes(headers.size() - 1);
+    std::vector<CBlockIndex> run;
+    run.reserve(headers.size() - 1);
+    const CBlockIndex* pindexPrev = pindexLast;
+    for (size_t i = 0; i < headers.size(); ++i) {
+        ret.push_back(GetNextWorkRequired(pindexPrev, &headers[i], params));
+        if (i + 1 == headers.size()) break;
+
+        hashes[i] = headers[i].GetHash();
+        run.emplace_back(headers[i]);
+        CBlockIndex& index = run.back();
+        index.phashBlock = &hashes[i];
+        index.pprev = const_cast<CBlockIndex*>(pindexPrev);
+        index.nHeight = pindexPrev->nHeight + 1;
+        index.BuildSkip();
+        pindexPrev = &index;
+    }
+    return ret;
+}
+
+bool CheckProofOfWorkTarget(unsigned int nBits, const Consensus::Params& params)
+{
+    bool fNegative;
+    bool fOverflow;
+    arith_uint256 bnTarget;
+
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
+    return !fNegative && bnTarget != 0 && !fOverflow && bnTarget <= UintToArith256(params.powLimit);
 }
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits, const Consensus::Params& params)
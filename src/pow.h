@@ -9,6 +9,7 @@
 #include <consensus/params.h>
 
 #include <stdint.h>
+#include <vector>
 
 class CBlockHeader;
 class CBlockIndex;
@@ -19,8 +20,16 @@ unsigned int BCDGetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockH
 unsigned int CalculateNextWorkRequired(const CBlockIndex* pindexLast, int64_t nFirstBlockTime, const Consensus::Params&);
 
 unsigned int LwmaGetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock, const Consensus::Params& params);
+/** LWMA target for the block after pindexLast. The window for the last tip asked for is cached, so
+ *  extending it by one block costs O(1) and switching to another tip costs one O(N) walk over pprev. */
 unsigned int LwmaCalculateNextWorkRequired(const CBlockIndex* pindexLast, const Consensus::Params& params);
 
+/** Compute the nBits required for each of a run of headers, headers[0] building on pindexLast and
+ *  every later header on the one before it. Results match GetNextWorkRequired() header by header. */
+std::vector<unsigned int> GetNextWorkRequiredBatch(const CBlockIndex* pindexLast, const std::vector<CBlockHeader>& headers, const Consensus::Params& params);
+
+/** Check whether nBits specifies a target within the proof-of-work limit, which needs no hashing */
+bool CheckProofOfWorkTarget(unsigned int nBits, const Consensus::Params&);
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
 bool CheckProofOfWork(uint256 hash, unsigned int nBits, const Consensus::Params&);
 
@@ -9,6 +9,7 @@
 #include <tinyformat.h>
 #include <util/strencodings.h>
 #include <crypto/common.h>
+#include <crypto/x13sm3.h>
 #include "versionbits.h"
 
 uint256 CBlockHeader::GetHash() const
@@ -19,11 +20,40 @@ uint256 CBlockHeader::GetHash() const
 uint256 CBlockHeader::GetPoWHash(bool isBCDBlock) const
 {
 	if ((nVersion & VERSIONBITS_FORK_BCD)  && isBCDBlock)
-		return HashX13sm3(BEGIN(nVersion), END(nNonce));
+	{
+		uint256 hash;
+		X13SM3_80(hash.begin(), (const unsigned char*)BEGIN(nVersion), 1);
+		return hash;
+	}
 	else
 		return GetHash();
 }
 
+void GetPoWHashes(const std::vector<CBlockHeader>& headers, const std::vector<bool>& vBCDBlock, std::vector<uint256>& vHash)
+{
+    assert(headers.size() == vBCDBlock.size());
+    vHash.resize(headers.size());
+    std::vector<unsigned char> vInput;
+    std::vector<size_t> vX13;
+    for (size_t i = 0; i < headers.size(); i++) {
+        if ((headers[i].nVersion & VERSIONBITS_FORK_BCD) && vBCDBlock[i]) {
+            const unsigned char* pbegin = (const unsigned char*)BEGIN(headers[i].nVersion);
+            vInput.insert(vInput.end(), pbegin, pbegin + 80);
+            vX13.push_back(i);
+        } else {
+            vHash[i] = headers[i].GetHash();
+        }
+    }
+    if (vX13.empty())
+        return;
+
+    std::vector<unsigned char> vOutput(32 * vX13.size());
+    X13SM3_80(vOutput.data(), vInput.data(), vX13.size());
+    for (size_t j = 0; j < vX13.size(); j++) {
+        memcpy(vHash[vX13[j]].begin(), vOutput.data() + 32 * j, 32);
+    }
+}
+
 std::string CBlock::ToString() const
 {
     std::stringstream s;
@@ -71,6 +71,13 @@ public:
 };
 
 
+/**
+ * Compute the proof-of-work hashes of a run of headers, as GetPoWHash with the
+ * matching isBCDBlock. The X13-SM3 hashes are computed together.
+ */
+void GetPoWHashes(const std::vector<CBlockHeader>& headers, const std::vector<bool>& vBCDBlock, std::vector<uint256>& vHash);
+
+
 class CBlock : public CBlockHeader
 {
 public:
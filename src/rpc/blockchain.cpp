@@ -7,6 +7,7 @@
 
 #include <amount.h>
 #include <base58.h>
+#include <blockcache.h>
 #include <chain.h>
 #include <chainparams.h>
 #include <checkpoints.h>
@@ -40,6 +41,7 @@
 #include <boost/thread/thread.hpp> // boost::thread::interrupt
 
 #include <memory>
+#include <unordered_map>
 #include <mutex>
 #include <condition_variable>
 
@@ -116,7 +118,7 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
     AssertLockHeld(cs_main);
     UniValue result(UniValue::VOBJ);
     result.pushKV("hash", blockindex->GetBlockHash().GetHex());
-    result.push_back(Pair("powhash", block.GetPoWHash(blockindex->nHeight >= Params().GetConsensus().BCDHeight).GetHex()));
+    result.push_back(Pair("powhash", blockindex->GetBlockPoWHash(blockindex->nHeight >= Params().GetConsensus().BCDHeight).GetHex()));
     int confirmations = -1;
     // Only report confirmations if the block is on the main chain
     if (chainActive.Contains(blockindex))
@@ -741,12 +743,12 @@ static UniValue getblockheader(const JSONRPCRequest& request)
 
 static CBlock GetBlockChecked(const CBlockIndex* pblockindex)
 {
-    CBlock block;
+    std::shared_ptr<const CBlock> block;
     if (IsBlockPruned(pblockindex)) {
         throw JSONRPCError(RPC_MISC_ERROR, "Block not available (pruned data)");
     }
 
-    if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus())) {
+    if (!ReadBlockCached(block, pblockindex, Params().GetConsensus())) {
         // Block not found on disk. This could be because we have the block
         // header in our index but don't have the block (for example if a
         // non-whitelisted node sends us an unrequested long chain of valid
@@ -755,7 +757,7 @@ static CBlock GetBlockChecked(const CBlockIndex* pblockindex)
         throw JSONRPCError(RPC_MISC_ERROR, "Block not found on disk");
     }
 
-    return block;
+    return *block;
 }
 
 static UniValue getblock(const JSONRPCRequest& request)
@@ -1817,6 +1819,26 @@ static UniValue getblockstats(const JSONRPCRequest& request)
     std::vector<std::pair<CAmount, int64_t>> feerate_array;
     std::vector<int64_t> txsize_array;
 
+    // Look all spent outputs' transactions up in the index at once.
+    std::unordered_map<uint256, CTransactionRef, SaltedTxidHasher> prev_txs;
+    if (loop_inputs) {
+        std::vector<uint256> prev_hashes;
+        for (const auto& tx : block.vtx) {
+            if (tx->IsCoinBase()) continue;
+            for (const CTxIn& in : tx->vin) {
+                prev_hashes.push_back(in.prevout.hash);
+            }
+        }
+        std::sort(prev_hashes.begin(), prev_hashes.end());
+        prev_hashes.erase(std::unique(prev_hashes.begin(), prev_hashes.end()), prev_hashes.end());
+        std::vector<uint256> block_hashes;
+        std::vector<CTransactionRef> txs;
+        g_txindex->FindTxs(prev_hashes, block_hashes, txs);
+        for (size_t i = 0; i < prev_hashes.size(); i++) {
+            if (txs[i]) prev_txs.emplace(prev_hashes[i], std::move(txs[i]));
+        }
+    }
+
     for (const auto& tx : block.vtx) {
         outputs += tx->vout.size();
 
@@ -1864,7 +1886,10 @@ static UniValue getblockstats(const JSONRPCRequest& request)
             for (const CTxIn& in : tx->vin) {
                 CTransactionRef tx_in;
                 uint256 hashBlock;
-                if (!GetTransaction(in.prevout.hash, tx_in, Params().GetConsensus(), hashBlock, false)) {
+                auto prev_tx = prev_txs.find(in.prevout.hash);
+                if (prev_tx != prev_txs.end()) {
+                    tx_in = prev_tx->second;
+                } else if (!GetTransaction(in.prevout.hash, tx_in, Params().GetConsensus(), hashBlock, false)) {
                     throw JSONRPCError(RPC_INTERNAL_ERROR, std::string("Unexpected internal error (tx index seems corrupt)"));
                 }
 
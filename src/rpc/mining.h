@@ -9,8 +9,12 @@
 
 #include <univalue.h>
 
-/** Generate blocks (mine) */
-UniValue generateBlocks(std::shared_ptr<CReserveScript> coinbaseScript, int nGenerate, uint64_t nMaxTries, bool keepScript);
+/** Parse the optional generate thread count: null means one thread, 0 means all cores.
+ *  More threads than cores are clamped to the number of cores. */
+int ParseGenerateThreads(const UniValue& value);
+
+/** Generate blocks (mine), searching nonces with nThreads threads */
+UniValue generateBlocks(std::shared_ptr<CReserveScript> coinbaseScript, int nGenerate, uint64_t nMaxTries, bool keepScript, int nThreads = 1);
 
 /** Check bounds on a command line confirm target */
 unsigned int ParseConfirmTarget(const UniValue& value);
@@ -4,6 +4,7 @@
 
 #include <rpc/server.h>
 
+#include <blockcache.h>
 #include <chainparams.h>
 #include <clientversion.h>
 #include <core_io.h>
@@ -84,11 +85,14 @@ static UniValue getpeerinfo(const JSONRPCRequest& request)
             "    \"lastrecv\": ttt,           (numeric) The time in seconds since epoch (Jan 1 1970 GMT) of the last receive\n"
             "    \"bytessent\": n,            (numeric) The total bytes sent\n"
             "    \"bytesrecv\": n,            (numeric) The total bytes received\n"
+            "    \"recvbufallocs\": n,        (numeric) The number of receive buffers allocated for messages\n"
+            "    \"recvbufreuses\": n,        (numeric) The number of messages received into a recycled buffer\n"
             "    \"conntime\": ttt,           (numeric) The connection time in seconds since epoch (Jan 1 1970 GMT)\n"
             "    \"timeoffset\": ttt,         (numeric) The time offset in seconds\n"
             "    \"pingtime\": n,             (numeric) ping time (if available)\n"
             "    \"minping\": n,              (numeric) minimum observed ping time (if any at all)\n"
             "    \"pingwait\": n,             (numeric) ping wait (if non-zero)\n"
+            "    \"announcelatency\": n,      (numeric) seconds from the last block announced as a compact block being found valid to its announcement being sent (if any)\n"
             "    \"version\": v,              (numeric) The peer version, such as 70001\n"
             "    \"subver\": \"/Satoshi:0.8.5/\",  (string) The string version\n"
             "    \"inbound\": true|false,     (boolean) Inbound (true) or Outbound (false)\n"
@@ -101,6 +105,14 @@ static UniValue getpeerinfo(const JSONRPCRequest& request)
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
             "    ],\n"
+            "    \"blockdownload\": {\n"
+            "       \"window\": n,            (numeric) The number of blocks we allow in flight from this peer\n"
+            "       \"blocks\": n,            (numeric) The number of requested blocks received from this peer\n"
+            "       \"bytes\": n,             (numeric) The total size of those blocks\n"
+            "       \"blocktime\": n,         (numeric) The average time the peer takes to send a block, in seconds\n"
+            "       \"bytespersec\": n,       (numeric) The average rate at which the peer sends blocks\n"
+            "       \"reassigned\": n         (numeric) The number of stalled blocks requested from other peers instead\n"
+            "    },\n"
             "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"
             "    \"bytessent_per_msg\": {\n"
             "       \"addr\": n,              (numeric) The total bytes sent aggregated by message type\n"
@@ -142,6 +154,8 @@ static UniValue getpeerinfo(const JSONRPCRequest& request)
         obj.pushKV("lastrecv", stats.nLastRecv);
         obj.pushKV("bytessent", stats.nSendBytes);
         obj.pushKV("bytesrecv", stats.nRecvBytes);
+        obj.pushKV("recvbufallocs", stats.nRecvBufferAllocs);
+        obj.pushKV("recvbufreuses", stats.nRecvBufferReuses);
         obj.pushKV("conntime", stats.nTimeConnected);
         obj.pushKV("timeoffset", stats.nTimeOffset);
         if (stats.dPingTime > 0.0)
@@ -150,6 +164,8 @@ static UniValue getpeerinfo(const JSONRPCRequest& request)
             obj.pushKV("minping", stats.dMinPing);
         if (stats.dPingWait > 0.0)
             obj.pushKV("pingwait", stats.dPingWait);
+        if (stats.nLastAnnounceLatency >= 0)
+            obj.pushKV("announcelatency", ((double)stats.nLastAnnounceLatency) / 1e6);
         obj.pushKV("version", stats.nVersion);
         // Use the sanitized form of subver here, to avoid tricksy remote peers from
         // corrupting or modifying the JSON output by putting special characters in
@@ -167,6 +183,14 @@ static UniValue getpeerinfo(const JSONRPCRequest& request)
                 heights.push_back(height);
             }
             obj.pushKV("inflight", heights);
+            UniValue download(UniValue::VOBJ);
+            download.pushKV("window", statestats.nBlockDownloadWindow);
+            download.pushKV("blocks", statestats.nBlocksDownloaded);
+            download.pushKV("bytes", statestats.nBlockBytesDownloaded);
+            download.pushKV("blocktime", ((double)statestats.nBlockTime) / 1e6);
+            download.pushKV("bytespersec", statestats.nBlockBytesPerSecond);
+            download.pushKV("reassigned", statestats.nBlocksReassigned);
+            obj.pushKV("blockdownload", download);
         }
         obj.pushKV("whitelisted", stats.fWhitelisted);
 
@@ -359,6 +383,8 @@ static UniValue getnettotals(const JSONRPCRequest& request)
             "  \"totalbytesrecv\": n,   (numeric) Total bytes received\n"
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
             "  \"timemillis\": t,       (numeric) Current UNIX time in milliseconds\n"
+            "  \"recvbufallocs\": n,    (numeric) Total receive buffers allocated for messages\n"
+            "  \"recvbufreuses\": n,    (numeric) Total messages received into a recycled buffer\n"
             "  \"uploadtarget\":\n"
             "  {\n"
             "    \"timeframe\": n,                         (numeric) Length of the measuring timeframe in seconds\n"
@@ -380,6 +406,8 @@ static UniValue getnettotals(const JSONRPCRequest& request)
     obj.pushKV("totalbytesrecv", g_connman->GetTotalBytesRecv());
     obj.pushKV("totalbytessent", g_connman->GetTotalBytesSent());
     obj.pushKV("timemillis", GetTimeMillis());
+    obj.pushKV("recvbufallocs", CNetMessageBufferPool::GetTotalAllocs());
+    obj.pushKV("recvbufreuses", CNetMessageBufferPool::GetTotalReuses());
 
     UniValue outboundLimit(UniValue::VOBJ);
     outboundLimit.pushKV("timeframe", g_connman->GetMaxOutboundTimeframe());
@@ -449,6 +477,12 @@ static UniValue getnetworkinfo(const JSONRPCRequest& request)
             "  }\n"
             "  ,...\n"
             "  ]\n"
+            "  \"recentblockcache\": {                 (json object) cache of recently relayed or served blocks\n"
+            "    \"blocks\": xxx,                      (numeric) number of cached blocks\n"
+            "    \"bytes\": xxx,                       (numeric) estimated memory usage in bytes\n"
+            "    \"hits\": xxx,                        (numeric) lookups served from the cache\n"
+            "    \"misses\": xxx                       (numeric) lookups that went to disk\n"
+            "  }\n"
             "  \"warnings\": \"...\"                    (string) any network and blockchain warnings\n"
             "}\n"
             "\nExamples:\n"
@@ -485,6 +519,13 @@ static UniValue getnetworkinfo(const JSONRPCRequest& request)
         }
     }
     obj.pushKV("localaddresses", localAddresses);
+    const CRecentBlockCache::Stats cache_stats = g_recent_blocks.GetStats();
+    UniValue recentBlockCache(UniValue::VOBJ);
+    recentBlockCache.pushKV("blocks", (uint64_t)cache_stats.blocks);
+    recentBlockCache.pushKV("bytes", (uint64_t)cache_stats.bytes);
+    recentBlockCache.pushKV("hits", cache_stats.hits);
+    recentBlockCache.pushKV("misses", cache_stats.misses);
+    obj.pushKV("recentblockcache", recentBlockCache);
     obj.pushKV("warnings",       GetWarnings("statusbar"));
     return obj;
 }
@@ -0,0 +1,168 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <blockcache.h>
+#include <blockencodings.h>
+#include <chain.h>
+#include <chainparams.h>
+#include <primitives/block.h>
+#include <random.h>
+#include <streams.h>
+#include <version.h>
+
+#include <test/test_bitcoin.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockcache_tests, BasicTestingSetup)
+
+static std::shared_ptr<const CBlock> BuildBlock(size_t num_txs, bool witness)
+{
+    std::shared_ptr<CBlock> block = std::make_shared<CBlock>();
+    block->hashPrevBlock = InsecureRand256();
+    for (size_t i = 0; i < num_txs; ++i) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = InsecureRand256();
+        tx.vin[0].scriptSig.resize(10);
+        if (witness) tx.vin[0].scriptWitness.stack.push_back(std::vector<unsigned char>(72));
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 42;
+        block->vtx.push_back(MakeTransactionRef(std::move(tx)));
+    }
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_lru)
+{
+    CRecentBlockCache cache(2, 1 << 20);
+    std::shared_ptr<const CBlock> a = BuildBlock(2, false);
+    std::shared_ptr<const CBlock> b = BuildBlock(2, true);
+    std::shared_ptr<const CBlock> c = BuildBlock(2, false);
+
+    CRecentBlockCache::Entry entry;
+    BOOST_CHECK(!cache.Get(a->GetHash(), entry));
+    cache.AddBlock(a);
+    cache.AddBlock(b);
+    BOOST_CHECK(cache.Get(a->GetHash(), entry));
+    BOOST_CHECK(entry.block == a);
+    BOOST_CHECK(!entry.has_witness);
+    BOOST_CHECK(cache.Get(b->GetHash(), entry));
+    BOOST_CHECK(entry.has_witness);
+
+    // a is now the least recently used block and makes room for c
+    BOOST_CHECK(cache.Get(b->GetHash(), entry));
+    cache.AddBlock(c);
+    BOOST_CHECK(!cache.Get(a->GetHash(), entry));
+    BOOST_CHECK(cache.Get(b->GetHash(), entry));
+    BOOST_CHECK(cache.Get(c->GetHash(), entry));
+
+    // Adding the serialization of b makes it the most recently used block
+    cache.AddSerialized(b->GetHash(), SerializeBlock(*b), true);
+    cache.AddBlock(a);
+    BOOST_CHECK(!cache.Get(c->GetHash(), entry));
+    BOOST_CHECK(cache.Get(b->GetHash(), entry));
+    BOOST_CHECK(entry.serialized);
+
+    CRecentBlockCache::Stats stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.blocks, 2U);
+    BOOST_CHECK_EQUAL(stats.hits, 6U);
+    BOOST_CHECK_EQUAL(stats.misses, 3U);
+
+    cache.Clear();
+    stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.blocks, 0U);
+    BOOST_CHECK_EQUAL(stats.bytes, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_representations)
+{
+    CRecentBlockCache cache(4, 1 << 20);
+    std::shared_ptr<const CBlock> block = BuildBlock(3, true);
+    const uint256 hash = block->GetHash();
+
+    // The serialization alone makes an entry, as when serving raw bytes from disk
+    std::shared_ptr<const std::vector<uint8_t>> serialized = SerializeBlock(*block);
+    cache.AddSerialized(hash, serialized, true);
+    CRecentBlockCache::Entry entry;
+    BOOST_CHECK(cache.Get(hash, entry));
+    BOOST_CHECK(!entry.block);
+    BOOST_CHECK(entry.serialized == serialized);
+    const size_t serialized_usage = cache.GetStats().bytes;
+    BOOST_CHECK(serialized_usage >= serialized->size());
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << *block;
+    BOOST_CHECK(std::vector<uint8_t>(stream.begin(), stream.end()) == *serialized);
+
+    // Adding the block and its compact block keeps the serialization
+    std::shared_ptr<const CBlockHeaderAndShortTxIDs> compact = std::make_shared<const CBlockHeaderAndShortTxIDs>(*block, true);
+    cache.AddBlock(block);
+    cache.AddCompact(compact);
+    BOOST_CHECK(cache.Get(hash, entry));
+    BOOST_CHECK(entry.block == block);
+    BOOST_CHECK(entry.serialized == serialized);
+    BOOST_CHECK(entry.compact == compact);
+    BOOST_CHECK(entry.has_witness);
+    BOOST_CHECK(cache.GetStats().bytes > serialized_usage);
+
+    // Compact blocks are only attached to cached blocks
+    std::shared_ptr<const CBlock> other = BuildBlock(1, false);
+    cache.AddCompact(std::make_shared<const CBlockHeaderAndShortTxIDs>(*other, true));
+    BOOST_CHECK(!cache.Get(other->GetHash(), entry));
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_limits)
+{
+    std::shared_ptr<const CBlock> block = BuildBlock(50, false);
+    CRecentBlockCache cache(16, 1 << 20);
+    cache.AddBlock(block);
+    const size_t usage = cache.GetStats().bytes;
+    BOOST_CHECK(usage > 0);
+
+    // The memory limit evicts entries even below the block count limit
+    cache.SetLimits(16, 3 * usage - 1);
+    for (int i = 0; i < 4; ++i) {
+        cache.AddBlock(BuildBlock(50, false));
+    }
+    CRecentBlockCache::Stats stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.blocks, 2U);
+    BOOST_CHECK(stats.bytes <= 3 * usage - 1);
+
+    // A limit of zero disables the cache
+    cache.SetLimits(0, 1 << 20);
+    BOOST_CHECK_EQUAL(cache.GetStats().blocks, 0U);
+    cache.AddBlock(block);
+    CRecentBlockCache::Entry entry;
+    BOOST_CHECK(!cache.Get(block->GetHash(), entry));
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_read_from_entry)
+{
+    std::shared_ptr<const CBlock> block = BuildBlock(3, true);
+    const uint256 hash = block->GetHash();
+    CBlockIndex index;
+    index.phashBlock = &hash;
+    g_recent_blocks.Clear();
+    g_recent_blocks.AddSerialized(hash, SerializeBlock(*block), true);
+
+    // The entry of an earlier lookup is used without looking the block up again
+    CRecentBlockCache::Entry entry;
+    BOOST_CHECK(g_recent_blocks.Get(hash, entry));
+    const CRecentBlockCache::Stats stats = g_recent_blocks.GetStats();
+    std::shared_ptr<const CBlock> read;
+    BOOST_CHECK(ReadBlockCached(read, &index, Params().GetConsensus(), entry));
+    BOOST_CHECK(read && read->GetHash() == hash);
+    BOOST_CHECK_EQUAL(read->vtx.size(), 3U);
+    BOOST_CHECK_EQUAL(g_recent_blocks.GetStats().hits, stats.hits);
+    BOOST_CHECK_EQUAL(g_recent_blocks.GetStats().misses, stats.misses);
+
+    // The parsed block is cached with the serialization
+    BOOST_CHECK(g_recent_blocks.Get(hash, entry));
+    BOOST_CHECK(entry.block == read);
+    BOOST_CHECK(entry.serialized);
+    g_recent_blocks.Clear();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,170 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <blockpipeline.h>
+#include <chainparams.h>
+#include <coins.h>
+#include <primitives/block.h>
+#include <random.h>
+#include <streams.h>
+#include <validation.h>
+
+#include <test/test_bitcoin.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockpipeline_tests, BasicTestingSetup)
+
+static std::shared_ptr<const CBlock> BuildBlock(size_t num_txs)
+{
+    std::shared_ptr<CBlock> block = std::make_shared<CBlock>();
+    block->hashPrevBlock = InsecureRand256();
+    for (size_t i = 0; i < num_txs; ++i) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = InsecureRand256();
+        tx.vin[0].scriptSig.resize(10);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 42;
+        block->vtx.push_back(MakeTransactionRef(std::move(tx)));
+    }
+    return block;
+}
+
+/** Positions of blocks stored one after another in block file nFile. */
+static std::vector<CDiskBlockPos> BlockPositions(int nFile, const std::vector<std::shared_ptr<const CBlock>>& blocks)
+{
+    std::vector<CDiskBlockPos> positions;
+    unsigned int nPos = 0;
+    for (const auto& block : blocks) {
+        // Each block data follows its 8 byte record header
+        positions.emplace_back(nFile, nPos + 8);
+        nPos += 8 + ::GetSerializeSize(*block, SER_DISK, CLIENT_VERSION);
+    }
+    return positions;
+}
+
+static bool SameBlock(const CBlock& a, const CBlock& b)
+{
+    CDataStream ssA(SER_DISK, CLIENT_VERSION), ssB(SER_DISK, CLIENT_VERSION);
+    ssA << a;
+    ssB << b;
+    return ssA.str() == ssB.str();
+}
+
+BOOST_AUTO_TEST_CASE(blockfilewriter_read_through)
+{
+    SetDataDir("blockfilewriter_read_through");
+    ClearDatadirCache();
+    const CChainParams& chainparams = Params();
+    std::vector<std::shared_ptr<const CBlock>> blocks;
+    for (int i = 0; i < 20; ++i) {
+        blocks.push_back(BuildBlock(10));
+    }
+    const std::vector<CDiskBlockPos> positions = BlockPositions(0, blocks);
+
+    // Queued blocks are read whether or not they are written yet
+    g_block_writer.Start();
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        BOOST_CHECK(g_block_writer.Write(blocks[i], positions[i], chainparams.MessageStart()));
+        CBlock block;
+        BOOST_CHECK(ReadBlockFromDisk(block, positions[i], chainparams.GetConsensus(), false));
+        BOOST_CHECK(SameBlock(block, *blocks[i]));
+    }
+
+    // After a flush they are all on disk
+    BOOST_CHECK(g_block_writer.Flush());
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        BOOST_CHECK(!g_block_writer.Get(positions[i]));
+        CBlock block;
+        BOOST_CHECK(ReadBlockFromDisk(block, positions[i], chainparams.GetConsensus(), false));
+        BOOST_CHECK(SameBlock(block, *blocks[i]));
+    }
+    g_block_writer.Stop();
+}
+
+BOOST_AUTO_TEST_CASE(blockfilewriter_stop_drains)
+{
+    SetDataDir("blockfilewriter_stop_drains");
+    ClearDatadirCache();
+    const CChainParams& chainparams = Params();
+    std::vector<std::shared_ptr<const CBlock>> blocks;
+    for (unsigned int i = 0; i < 2 * MAX_BLOCK_WRITE_QUEUE; ++i) {
+        blocks.push_back(BuildBlock(10));
+    }
+    const std::vector<CDiskBlockPos> positions = BlockPositions(0, blocks);
+
+    CBlockFileWriter writer;
+    writer.Start();
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        BOOST_CHECK(writer.Write(blocks[i], positions[i], chainparams.MessageStart()));
+    }
+    writer.Stop();
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        BOOST_CHECK(!writer.Get(positions[i]));
+        CBlock block;
+        BOOST_CHECK(ReadBlockFromDisk(block, positions[i], chainparams.GetConsensus(), false));
+        BOOST_CHECK(SameBlock(block, *blocks[i]));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(blockfilewriter_failure)
+{
+    SetDataDir("blockfilewriter_failure");
+    ClearDatadirCache();
+    const CChainParams& chainparams = Params();
+    const std::vector<std::shared_ptr<const CBlock>> blocks{BuildBlock(1)};
+    const CDiskBlockPos bad_pos = BlockPositions(99999, blocks)[0];
+    const CDiskBlockPos good_pos = BlockPositions(0, blocks)[0];
+
+    // The block file cannot be opened when a directory is in its place
+    fs::create_directories(GetBlockPosFilename(bad_pos, "blk"));
+
+    CBlockFileWriter writer;
+    writer.Start();
+    BOOST_CHECK(writer.Write(blocks[0], bad_pos, chainparams.MessageStart()));
+    BOOST_CHECK(!writer.Flush());
+    // The failure sticks, later writes report it too
+    BOOST_CHECK(!writer.Write(blocks[0], good_pos, chainparams.MessageStart()));
+    BOOST_CHECK(!writer.Flush());
+    writer.Stop();
+}
+
+BOOST_AUTO_TEST_CASE(blockprefetcher)
+{
+    SetDataDir("blockprefetcher");
+    ClearDatadirCache();
+    const CChainParams& chainparams = Params();
+    std::vector<std::shared_ptr<const CBlock>> blocks{BuildBlock(10), BuildBlock(10)};
+    const std::vector<CDiskBlockPos> positions = BlockPositions(0, blocks);
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        CDiskBlockPos pos(positions[i].nFile, positions[i].nPos - 8);
+        BOOST_CHECK(WriteBlockToDisk(*blocks[i], pos, chainparams.MessageStart()));
+    }
+    CCoinsView view;
+
+    CBlockPrefetcher prefetcher;
+    // Nothing is read ahead while the thread is not running
+    prefetcher.Prefetch(blocks[0]->GetHash(), positions[0], &view, chainparams.GetConsensus());
+    BOOST_CHECK(!prefetcher.Get(blocks[0]->GetHash()));
+
+    prefetcher.Start();
+    prefetcher.Prefetch(blocks[0]->GetHash(), positions[0], &view, chainparams.GetConsensus());
+    std::shared_ptr<const CBlock> block = prefetcher.Get(blocks[0]->GetHash());
+    BOOST_CHECK(block && SameBlock(*block, *blocks[0]));
+    BOOST_CHECK(!prefetcher.Get(blocks[1]->GetHash()));
+
+    // A new request replaces the previous one
+    prefetcher.Prefetch(blocks[1]->GetHash(), positions[1], &view, chainparams.GetConsensus());
+    BOOST_CHECK(!prefetcher.Get(blocks[0]->GetHash()));
+    block = prefetcher.Get(blocks[1]->GetHash());
+    BOOST_CHECK(block && SameBlock(*block, *blocks[1]));
+
+    // A block that is not at the position is not returned
+    prefetcher.Prefetch(blocks[0]->GetHash(), positions[1], &view, chainparams.GetConsensus());
+    BOOST_CHECK(!prefetcher.Get(blocks[0]->GetHash()));
+    prefetcher.Stop();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -2,6 +2,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <blockpipeline.h>
 #include <coins.h>
 #include <script/standard.h>
 #include <uint256.h>
@@ -11,8 +12,15 @@
 #include <validation.h>
 #include <consensus/validation.h>
 
+#include <limits>
 #include <vector>
 #include <map>
+#include <set>
+#include <unordered_map>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
 
 #include <boost/test/unit_test.hpp>
 
@@ -52,7 +60,7 @@ public:
 
     uint256 GetBestBlock() const override { return hashBestBlock_; }
 
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) override
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool erase = true) override
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
             if (it->second.flags & CCoinsCacheEntry::DIRTY) {
@@ -63,7 +71,11 @@ public:
                     map_.erase(it->first);
                 }
             }
-            mapCoins.erase(it++);
+            if (erase) {
+                mapCoins.erase(it++);
+            } else {
+                ++it;
+            }
         }
         if (!hashBlock.IsNull())
             hashBestBlock_ = hashBlock;
@@ -79,7 +91,7 @@ public:
     void SelfTest() const
     {
         // Manually recompute the dynamic usage of the whole data, and compare it.
-        size_t ret = memusage::DynamicUsage(cacheCoins);
+        size_t ret = cacheCoins.DynamicMemoryUsage();
         size_t count = 0;
         for (const auto& entry : cacheCoins) {
             ret += entry.second.coin.DynamicMemoryUsage();
@@ -562,7 +574,7 @@ static size_t InsertCoinsMapEntry(CCoinsMap& map, CAmount value, char flags)
     CCoinsCacheEntry entry;
     entry.flags = flags;
     SetCoinsValue(value, entry.coin);
-    auto inserted = map.emplace(OUTPOINT, std::move(entry));
+    auto inserted = map.try_emplace(OUTPOINT, std::move(entry));
     assert(inserted.second);
     return inserted.first->second.coin.DynamicMemoryUsage();
 }
@@ -855,4 +867,390 @@ BOOST_AUTO_TEST_CASE(ccoins_write)
                     CheckWriteCoins(parent_value, child_value, parent_value, parent_flags, child_flags, parent_flags);
 }
 
+BOOST_AUTO_TEST_CASE(ccoins_sync_trim)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+
+    // One coin added per block, the first one spent by the last block
+    std::vector<COutPoint> outpoints;
+    for (int i = 0; i < 10; ++i) {
+        CCoinsViewCacheTest block(&cache);
+        outpoints.emplace_back(InsecureRand256(), 0);
+        block.AddCoin(outpoints.back(), Coin(CTxOut(1, CScript() << OP_TRUE), 1, false), false);
+        if (i == 9) {
+            BOOST_CHECK(block.SpendCoin(outpoints[0]));
+        }
+        BOOST_CHECK(block.Flush());
+    }
+
+    // Syncing writes everything but keeps the unspent coins cached, unmodified
+    BOOST_CHECK(cache.Sync());
+    cache.SelfTest();
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 9U);
+    for (const auto& entry : cache.map()) {
+        BOOST_CHECK_EQUAL(entry.second.flags, 0);
+    }
+    Coin coin;
+    BOOST_CHECK(!base.GetCoin(outpoints[0], coin) || coin.IsSpent());
+    for (int i = 1; i < 10; ++i) {
+        BOOST_CHECK(base.GetCoin(outpoints[i], coin));
+    }
+
+    // Trimming evicts the least recently used coins first
+    cache.AccessCoin(outpoints[1]);
+    const size_t entry_usage = CCoinsMap::ENTRY_USAGE;
+    cache.Trim(cache.DynamicMemoryUsage() - 6 * entry_usage);
+    cache.SelfTest();
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 3U);
+    BOOST_CHECK(cache.HaveCoinInCache(outpoints[1]));
+    BOOST_CHECK(cache.HaveCoinInCache(outpoints[8]));
+    BOOST_CHECK(cache.HaveCoinInCache(outpoints[9]));
+
+    // but never modified ones
+    const COutPoint dirty(InsecureRand256(), 0);
+    cache.AddCoin(dirty, Coin(CTxOut(1, CScript() << OP_TRUE), 1, false), false);
+    cache.Trim(0);
+    cache.SelfTest();
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 1U);
+    BOOST_CHECK(cache.HaveCoinInCache(dirty));
+}
+
+BOOST_AUTO_TEST_CASE(ccoins_cache_coin)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+
+    // A coin read ahead from the base is cached unmodified
+    const COutPoint outpoint(InsecureRand256(), 0);
+    cache.CacheCoin(outpoint, Coin(CTxOut(1, CScript() << OP_TRUE), 1, false));
+    cache.SelfTest();
+    BOOST_CHECK(cache.HaveCoinInCache(outpoint));
+    BOOST_CHECK_EQUAL(cache.map().find(outpoint)->second.flags, 0);
+
+    // and does not replace what the cache has already
+    BOOST_CHECK(cache.SpendCoin(outpoint));
+    cache.CacheCoin(outpoint, Coin(CTxOut(1, CScript() << OP_TRUE), 1, false));
+    cache.SelfTest();
+    BOOST_CHECK(!cache.HaveCoin(outpoint));
+}
+
+BOOST_AUTO_TEST_CASE(ccoins_writer)
+{
+    CCoinsViewTest base;
+    CCoinsViewWriter writer(&base);
+    writer.Start();
+    CCoinsViewCacheTest cache(&writer);
+
+    const COutPoint kept(InsecureRand256(), 0);
+    const COutPoint spent(InsecureRand256(), 0);
+    cache.AddCoin(kept, Coin(CTxOut(1, CScript() << OP_TRUE), 1, false), false);
+    cache.AddCoin(spent, Coin(CTxOut(2, CScript() << OP_TRUE), 1, false), false);
+    cache.SetBestBlock(InsecureRand256());
+    BOOST_CHECK(cache.Sync());
+    BOOST_CHECK(writer.Wait());
+    BOOST_CHECK(base.HaveCoin(spent));
+
+    // The writer serves the pending batch, whether or not it is written yet
+    BOOST_CHECK(cache.SpendCoin(spent));
+    cache.SetBestBlock(InsecureRand256());
+    BOOST_CHECK(cache.Sync());
+    BOOST_CHECK(!writer.HaveCoin(spent));
+    BOOST_CHECK(writer.HaveCoin(kept));
+    BOOST_CHECK(writer.GetBestBlock() == cache.GetBestBlock());
+
+    BOOST_CHECK(writer.Wait());
+    BOOST_CHECK(!writer.IsPending(spent));
+    BOOST_CHECK_EQUAL(writer.DynamicMemoryUsage(), 0U);
+    Coin coin;
+    BOOST_CHECK(!base.GetCoin(spent, coin) || coin.IsSpent());
+    BOOST_CHECK(base.GetCoin(kept, coin));
+    BOOST_CHECK(base.GetBestBlock() == cache.GetBestBlock());
+}
+
+
+/** Distinct outpoints to fill a CCoinsMap with, numbered by their index. */
+static std::vector<COutPoint> MapKeys(size_t n)
+{
+    std::vector<COutPoint> keys;
+    for (size_t i = 0; i < n; ++i) {
+        keys.emplace_back(InsecureRand256(), i);
+    }
+    return keys;
+}
+
+BOOST_AUTO_TEST_CASE(coinsmap_erase_iterating)
+{
+    CCoinsMap map;
+    const std::vector<COutPoint> keys = MapKeys(1000);
+    for (const COutPoint& key : keys) {
+        map[key].nLastUsed = key.n;
+    }
+
+    // Erasing while iterating visits every entry once and leaves the others findable
+    std::set<COutPoint> visited;
+    for (CCoinsMap::iterator it = map.begin(); it != map.end(); ) {
+        BOOST_CHECK(visited.insert(it->first).second);
+        BOOST_CHECK_EQUAL(it->second.nLastUsed, it->first.n);
+        if (it->first.n % 2) {
+            it = map.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    BOOST_CHECK_EQUAL(visited.size(), keys.size());
+    BOOST_CHECK_EQUAL(map.size(), keys.size() / 2);
+    for (const COutPoint& key : keys) {
+        CCoinsMap::iterator it = map.find(key);
+        if (key.n % 2) {
+            BOOST_CHECK(it == map.end());
+        } else {
+            BOOST_CHECK(it != map.end() && it->first == key && it->second.nLastUsed == key.n);
+        }
+    }
+
+    for (CCoinsMap::iterator it = map.begin(); it != map.end(); ) {
+        it = map.erase(it);
+    }
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(map.begin() == map.end());
+}
+
+BOOST_AUTO_TEST_CASE(coinsmap_reuse)
+{
+    CCoinsMap map;
+    std::vector<COutPoint> keys = MapKeys(1000);
+    for (const COutPoint& key : keys) {
+        map[key].nLastUsed = 1;
+    }
+    const size_t usage = map.DynamicMemoryUsage();
+
+    // An erased key is gone, and inserting it again makes a new entry
+    map.erase(map.find(keys[0]));
+    BOOST_CHECK(map.find(keys[0]) == map.end());
+    std::pair<CCoinsMap::iterator, bool> inserted = map.try_emplace(keys[0]);
+    BOOST_CHECK(inserted.second);
+    BOOST_CHECK(inserted.first->first == keys[0]);
+    BOOST_CHECK_EQUAL(inserted.first->second.nLastUsed, 0U);
+    BOOST_CHECK(map.find(keys[0]) == inserted.first);
+    BOOST_CHECK(!map.try_emplace(keys[0]).second);
+
+    // Replacing entries, by the same key or another one, reuses the slots and
+    // the memory of the erased ones: the map never grows
+    for (uint32_t i = 0; i < 20000; ++i) {
+        COutPoint& key = keys[InsecureRandRange(keys.size())];
+        CCoinsMap::iterator it = map.find(key);
+        BOOST_CHECK(it != map.end());
+        map.erase(it);
+        if (InsecureRandBool()) key = COutPoint(InsecureRand256(), i);
+        BOOST_CHECK(map.try_emplace(key, Coin(CTxOut(i, CScript()), 1, false)).second);
+        if (map.DynamicMemoryUsage() != usage) {
+            BOOST_CHECK_EQUAL(map.DynamicMemoryUsage(), usage);
+            break;
+        }
+    }
+    BOOST_CHECK_EQUAL(map.size(), keys.size());
+    for (const COutPoint& key : keys) {
+        BOOST_CHECK(map.find(key) != map.end());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(coinsmap_rehash)
+{
+    // The table starts at 16 slots and doubles when an entry would fill more
+    // than 3/4 of them; entries are allocated 256 at a time
+    CCoinsMap map;
+    const std::vector<COutPoint> keys = MapKeys(5000);
+    BOOST_CHECK_EQUAL(map.DynamicMemoryUsage(), 0U);
+    size_t slots = 0;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        const bool grows = (i + 1) * 4 > slots * 3;
+        if (grows) slots = std::max<size_t>(16, slots * 2);
+        const size_t usage = map.DynamicMemoryUsage();
+        map[keys[i]].nLastUsed = i;
+        BOOST_CHECK_EQUAL(map.DynamicMemoryUsage() != usage, grows || i % 256 == 0);
+
+        // Nothing is lost on the way
+        if (grows) {
+            BOOST_CHECK_EQUAL(map.size(), i + 1);
+            for (size_t j = 0; j <= i; ++j) {
+                CCoinsMap::iterator it = map.find(keys[j]);
+                BOOST_CHECK(it != map.end() && it->second.nLastUsed == j);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(coinsmap_compact)
+{
+    CCoinsMap map;
+    map.Compact();
+    BOOST_CHECK_EQUAL(map.DynamicMemoryUsage(), 0U);
+
+    const std::vector<COutPoint> keys = MapKeys(10000);
+    auto coin = [](const COutPoint& key) {
+        // Large enough a script to live on the heap, so that entries are moved rather than copied
+        return Coin(CTxOut(key.n, CScript() << std::vector<unsigned char>(40, key.n & 0xff)), key.n, false);
+    };
+    for (const COutPoint& key : keys) {
+        CCoinsCacheEntry& entry = map[key];
+        entry.coin = coin(key);
+        entry.flags = CCoinsCacheEntry::DIRTY;
+        entry.nLastUsed = key.n;
+    }
+    for (const COutPoint& key : keys) {
+        if (key.n % 10) map.erase(map.find(key));
+    }
+    const size_t usage = map.DynamicMemoryUsage();
+
+    // Compacting keeps every entry as it was
+    map.Compact();
+    BOOST_CHECK_EQUAL(map.size(), keys.size() / 10);
+    size_t count = 0;
+    for (const auto& entry : map) {
+        BOOST_CHECK_EQUAL(entry.first.n % 10, 0U);
+        ++count;
+    }
+    BOOST_CHECK_EQUAL(count, map.size());
+    CCoinsMap fresh;
+    for (const COutPoint& key : keys) {
+        if (key.n % 10) continue;
+        CCoinsMap::iterator it = map.find(key);
+        BOOST_CHECK(it != map.end());
+        BOOST_CHECK(it->second.coin == coin(key));
+        BOOST_CHECK_EQUAL(it->second.flags, CCoinsCacheEntry::DIRTY);
+        BOOST_CHECK_EQUAL(it->second.nLastUsed, key.n);
+        fresh[key];
+    }
+
+    // in as little memory as a map the entries were inserted into
+    BOOST_CHECK(map.DynamicMemoryUsage() < usage);
+    BOOST_CHECK_EQUAL(map.DynamicMemoryUsage(), fresh.DynamicMemoryUsage());
+
+    // which can grow again
+    for (const COutPoint& key : keys) {
+        map[key].nLastUsed = key.n;
+    }
+    BOOST_CHECK_EQUAL(map.size(), keys.size());
+}
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+/** Bytes malloc has handed out, the way memusage counts them. */
+static size_t MallocInUse()
+{
+    const struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(coinsmap_memory_usage)
+{
+    // ENTRY_USAGE is what an entry takes on average, between the table just
+    // having doubled and being about to
+    CCoinsMap map;
+    const std::vector<COutPoint> keys = MapKeys(200000);
+    double min_usage = std::numeric_limits<double>::max();
+    double max_usage = 0;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        map[keys[i]];
+        if (i >= 20000) {
+            const double usage = (double)map.DynamicMemoryUsage() / map.size();
+            min_usage = std::min(min_usage, usage);
+            max_usage = std::max(max_usage, usage);
+        }
+    }
+    BOOST_CHECK(min_usage >= sizeof(CCoinsMap::value_type));
+    BOOST_CHECK(min_usage <= CCoinsMap::ENTRY_USAGE);
+    BOOST_CHECK(max_usage >= CCoinsMap::ENTRY_USAGE);
+    BOOST_CHECK(max_usage <= 2 * CCoinsMap::ENTRY_USAGE);
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    // DynamicMemoryUsage() is what the map actually allocated, to within malloc's rounding
+    map.clear();
+    const size_t before = MallocInUse();
+    for (const COutPoint& key : keys) {
+        map[key];
+    }
+    const size_t filled = MallocInUse() - before;
+    const size_t filled_usage = map.DynamicMemoryUsage();
+    for (const COutPoint& key : keys) {
+        if (key.n % 4) map.erase(map.find(key));
+    }
+    const size_t erased = MallocInUse() - before;
+    const size_t erased_usage = map.DynamicMemoryUsage();
+    map.Compact();
+    const size_t compacted = MallocInUse() - before;
+    const size_t compacted_usage = map.DynamicMemoryUsage();
+
+    BOOST_CHECK_CLOSE((double)filled, (double)filled_usage, 1);
+    // Erased entries keep their memory for reuse
+    BOOST_CHECK_EQUAL(erased, filled);
+    BOOST_CHECK_EQUAL(erased_usage, filled_usage);
+    BOOST_CHECK_CLOSE((double)compacted, (double)compacted_usage, 1);
+    BOOST_CHECK(compacted_usage < filled_usage / 2);
+#endif
+}
+
+BOOST_AUTO_TEST_CASE(coinsmap_random)
+{
+    // Random operations on a CCoinsMap and on a std::unordered_map, whose
+    // contents must stay the same. The map is driven between empty and full a
+    // few times, to go through growing, reusing erased slots and compacting.
+    CCoinsMap map;
+    std::unordered_map<COutPoint, uint32_t, SaltedOutpointHasher> expected;
+    const std::vector<COutPoint> keys = MapKeys(3000);
+    bool filling = true;
+    for (uint32_t i = 0; i < 300000; ++i) {
+        if (expected.size() >= 2000) filling = false;
+        if (expected.size() <= 10) filling = true;
+        const COutPoint& key = keys[InsecureRandRange(keys.size())];
+        const uint64_t op = InsecureRandRange(100);
+        if (op < (filling ? 40U : 20U)) {
+            std::pair<CCoinsMap::iterator, bool> inserted = map.try_emplace(key);
+            BOOST_CHECK_EQUAL(inserted.second, expected.count(key) == 0);
+            BOOST_CHECK(inserted.first->first == key);
+            if (inserted.second) {
+                inserted.first->second.nLastUsed = i;
+                expected[key] = i;
+            } else {
+                BOOST_CHECK_EQUAL(inserted.first->second.nLastUsed, expected[key]);
+            }
+        } else if (op < (filling ? 60U : 40U)) {
+            map[key].nLastUsed = i;
+            expected[key] = i;
+        } else if (op < 98) {
+            CCoinsMap::iterator it = map.find(key);
+            auto expected_it = expected.find(key);
+            BOOST_CHECK_EQUAL(it != map.end(), expected_it != expected.end());
+            if (it == map.end()) continue;
+            BOOST_CHECK(it->first == key);
+            BOOST_CHECK_EQUAL(it->second.nLastUsed, expected_it->second);
+            if (!filling || op < 70) {
+                map.erase(it);
+                expected.erase(expected_it);
+            }
+        } else if (op == 98) {
+            // Erase a random part while iterating
+            for (CCoinsMap::iterator it = map.begin(); it != map.end(); ) {
+                if (InsecureRandBits(3) == 0) {
+                    expected.erase(it->first);
+                    it = map.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        } else {
+            if (InsecureRandBits(3) == 0) map.Compact();
+            size_t count = 0;
+            for (const auto& entry : map) {
+                auto expected_it = expected.find(entry.first);
+                BOOST_CHECK(expected_it != expected.end() && expected_it->second == entry.second.nLastUsed);
+                ++count;
+            }
+            BOOST_CHECK_EQUAL(count, expected.size());
+        }
+        BOOST_CHECK_EQUAL(map.size(), expected.size());
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
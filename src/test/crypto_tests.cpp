@@ -10,8 +10,12 @@
 #include <crypto/sha512.h>
 #include <crypto/hmac_sha256.h>
 #include <crypto/hmac_sha512.h>
+#include <crypto/x13sm3.h>
+#include <hash.h>
+#include <primitives/block.h>
 #include <random.h>
 #include <util/strencodings.h>
+#include <versionbits.h>
 #include <test/test_bitcoin.h>
 
 #include <vector>
@@ -55,6 +59,7 @@ static void TestSHA1(const std::string &in, const std::string &hexout) { TestVec
 static void TestSHA256(const std::string &in, const std::string &hexout) { TestVector(CSHA256(), in, ParseHex(hexout));}
 static void TestSHA512(const std::string &in, const std::string &hexout) { TestVector(CSHA512(), in, ParseHex(hexout));}
 static void TestRIPEMD160(const std::string &in, const std::string &hexout) { TestVector(CRIPEMD160(), in, ParseHex(hexout));}
+static void TestX13SM3(const std::string &in, const std::string &hexout) { TestVector(CX13SM3(), in, ParseHex(hexout));}
 
 static void TestHMACSHA256(const std::string &hexkey, const std::string &hexin, const std::string &hexout) {
     std::vector<unsigned char> key = ParseHex(hexkey);
@@ -562,4 +567,66 @@ BOOST_AUTO_TEST_CASE(sha256d64)
     }
 }
 
+BOOST_AUTO_TEST_CASE(x13sm3_testvectors) {
+    TestX13SM3("", "e8ea077754e43691946680ad12195624d424f6632c9aedd7e515aec03aaf4951");
+    TestX13SM3("abc", "26e09c1b0fb8f421f18bb6dc7f4e1515c554be32069221be4390f74c36147019");
+    TestX13SM3(std::string(80, '\0'), "c793005e60ac9b66e77631e8cd9745c38028a867d3b9ef4cbf7c33d38bbebb85");
+    std::string bytes;
+    for (int i = 0; i < 200; ++i) {
+        bytes.push_back((char)i);
+    }
+    TestX13SM3(bytes, "42ba9717311c9d1eb3f3023d65410b4b39a8fbfb7c1bc5be9079cc9c19d40690");
+    TestX13SM3(std::string(1000000, 'a'), "61ed337a62dde598cf85868e9b5f7056d931feec2cff22333d3ba12074897523");
+}
+
+BOOST_AUTO_TEST_CASE(x13sm3_80)
+{
+    // Headers of zeros, of 0..79 and of 0xff bytes, hashed by the sphlib chain
+    // HashX13sm3 was built on before X13SM3_80 was written.
+    const std::vector<unsigned char> expected[3] = {
+        ParseHex("c793005e60ac9b66e77631e8cd9745c38028a867d3b9ef4cbf7c33d38bbebb85"),
+        ParseHex("72ea2759742c8467a673ad1c605198c18a274628314eda440aaad321137b8973"),
+        ParseHex("e62ba323efe6b8f26ed0c4b3140d217cc965c43a87185ee82bb0b815ae26b864"),
+    };
+    // Every header lands in each position of the batches.
+    for (int i = 0; i <= 20; ++i) {
+        unsigned char in[80 * 20];
+        unsigned char out[32 * 20];
+        for (int j = 0; j < i; ++j) {
+            const int v = (i + j) % 3;
+            for (int k = 0; k < 80; ++k) {
+                in[80 * j + k] = v == 0 ? 0 : v == 1 ? k : 0xff;
+            }
+        }
+        X13SM3_80(out, in, i);
+        for (int j = 0; j < i; ++j) {
+            BOOST_CHECK(memcmp(out + 32 * j, expected[(i + j) % 3].data(), 32) == 0);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(pow_hashes)
+{
+    // A run mixing X13-SM3 and SHA256d headers hashes each like GetPoWHash
+    std::vector<CBlockHeader> headers;
+    std::vector<bool> vBCDBlock;
+    for (int i = 0; i < 11; ++i) {
+        CBlockHeader header;
+        header.nVersion = i % 3 ? VERSIONBITS_TOP_BITS | VERSIONBITS_FORK_BCD : VERSIONBITS_TOP_BITS;
+        header.hashPrevBlock = InsecureRand256();
+        header.hashMerkleRoot = InsecureRand256();
+        header.nTime = InsecureRand32();
+        header.nBits = InsecureRand32();
+        header.nNonce = InsecureRand32();
+        headers.push_back(header);
+        vBCDBlock.push_back(i % 4 != 0);
+    }
+    std::vector<uint256> vHash;
+    GetPoWHashes(headers, vBCDBlock, vHash);
+    BOOST_CHECK_EQUAL(vHash.size(), headers.size());
+    for (size_t i = 0; i < headers.size(); ++i) {
+        BOOST_CHECK_EQUAL(vHash[i], headers[i].GetPoWHash(vBCDBlock[i]));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
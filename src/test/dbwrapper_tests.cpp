@@ -79,6 +79,46 @@ BOOST_AUTO_TEST_CASE(dbwrapper_batch)
     }
 }
 
+BOOST_AUTO_TEST_CASE(dbwrapper_multiread)
+{
+    // Perform tests both obfuscated and non-obfuscated.
+    for (bool obfuscate : {false, true}) {
+        fs::path ph = SetDataDir(std::string("dbwrapper_multiread").append(obfuscate ? "_true" : "_false"));
+        CDBWrapper dbw(ph, (1 << 20), true, false, obfuscate);
+
+        // Every other key is present, the keys are not in order
+        std::vector<uint32_t> keys;
+        std::vector<uint256> in;
+        for (uint32_t i = 0; i < 20; i++) {
+            keys.push_back((i * 7) % 20);
+            in.push_back(InsecureRand256());
+            if (i % 2 == 0) {
+                BOOST_CHECK(dbw.Write(std::make_pair('m', keys[i]), in[i]));
+            }
+        }
+        std::vector<std::pair<char, uint32_t>> db_keys;
+        for (uint32_t key : keys) {
+            db_keys.emplace_back('m', key);
+        }
+
+        CDBSnapshot snapshot(dbw);
+        BOOST_CHECK(dbw.Write(std::make_pair('m', keys[1]), in[1]));
+
+        std::vector<uint256> res;
+        std::vector<bool> found;
+        BOOST_CHECK_EQUAL(dbw.MultiRead(db_keys, res, found), 11U);
+        BOOST_CHECK_EQUAL(res.size(), 20U);
+        for (uint32_t i = 0; i < 20; i++) {
+            BOOST_CHECK_EQUAL(found[i], i % 2 == 0 || i == 1);
+            if (found[i]) BOOST_CHECK_EQUAL(res[i].ToString(), in[i].ToString());
+        }
+
+        // The snapshot does not see the later write
+        BOOST_CHECK_EQUAL(dbw.MultiRead(db_keys, res, found, &snapshot), 10U);
+        BOOST_CHECK(!found[1]);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(dbwrapper_iterator)
 {
     // Perform tests both obfuscated and non-obfuscated.
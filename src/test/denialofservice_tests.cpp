@@ -4,7 +4,9 @@
 
 // Unit tests for denial-of-service detection/prevention code
 
+#include <arith_uint256.h>
 #include <chainparams.h>
+#include <consensus/validation.h>
 #include <keystore.h>
 #include <net.h>
 #include <net_processing.h>
@@ -12,7 +14,9 @@
 #include <script/sign.h>
 #include <serialize.h>
 #include <util/system.h>
+#include <util/time.h>
 #include <validation.h>
+#include <versionbits.h>
 
 #include <test/test_bitcoin.h>
 
@@ -43,6 +47,11 @@ static CService ip(uint32_t i)
 static NodeId id = 0;
 
 void UpdateLastBlockAnnounceTime(NodeId node, int64_t time_in_seconds);
+void UpdateBestKnownBlock(NodeId node, const uint256& hash, bool have_witness);
+
+struct RegtestingSetup : public TestingSetup {
+    RegtestingSetup() : TestingSetup(CBaseChainParams::REGTEST) {}
+};
 
 BOOST_FIXTURE_TEST_SUITE(denialofservice_tests, TestingSetup)
 
@@ -191,6 +200,138 @@ BOOST_AUTO_TEST_CASE(stale_tip_peer_management)
     CConnmanTest::ClearNodes();
 }
 
+BOOST_AUTO_TEST_CASE(block_download_window)
+{
+    const int64_t no_ping = std::numeric_limits<int64_t>::max();
+    // Until the ping time is known the window stays at its minimum
+    BOOST_CHECK_EQUAL(NextBlockDownloadWindow(MAX_BLOCKS_IN_TRANSIT_PER_PEER, 1000, no_ping), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // A fast peer's window grows one block at a time up to the adaptive limit
+    int window = MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    for (int i = 1; i <= MAX_BLOCKS_IN_TRANSIT_PER_PEER_ADAPTIVE; ++i) {
+        window = NextBlockDownloadWindow(window, 1000, 100000);
+        BOOST_CHECK_EQUAL(window, std::min(MAX_BLOCKS_IN_TRANSIT_PER_PEER + i, MAX_BLOCKS_IN_TRANSIT_PER_PEER_ADAPTIVE));
+    }
+
+    // A window larger than the peer's rate needs shrinks at once, down to the minimum
+    BOOST_CHECK_EQUAL(NextBlockDownloadWindow(MAX_BLOCKS_IN_TRANSIT_PER_PEER_ADAPTIVE, 10000, 100000), 22);
+    BOOST_CHECK_EQUAL(NextBlockDownloadWindow(MAX_BLOCKS_IN_TRANSIT_PER_PEER_ADAPTIVE, 100000, 100000), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // A stall halves the window, and the next block delivered does not undo it
+    window = StalledBlockDownloadWindow(MAX_BLOCKS_IN_TRANSIT_PER_PEER_ADAPTIVE);
+    BOOST_CHECK_EQUAL(window, MAX_BLOCKS_IN_TRANSIT_PER_PEER_ADAPTIVE / 2);
+    BOOST_CHECK_EQUAL(NextBlockDownloadWindow(window, 1000, 100000), MAX_BLOCKS_IN_TRANSIT_PER_PEER_ADAPTIVE / 2 + 1);
+    BOOST_CHECK_EQUAL(StalledBlockDownloadWindow(MAX_BLOCKS_IN_TRANSIT_PER_PEER + 4), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // Slow peers get longer to deliver the block they stall on
+    BOOST_CHECK_EQUAL(BlockStallingReassignTimeout(0), BLOCK_STALLING_REASSIGN_TIMEOUT_MIN);
+    BOOST_CHECK_EQUAL(BlockStallingReassignTimeout(BLOCK_STALLING_REASSIGN_TIMEOUT_MIN / 4), BLOCK_STALLING_REASSIGN_TIMEOUT_MIN);
+    BOOST_CHECK_EQUAL(BlockStallingReassignTimeout(100000), 400000);
+    // but never so long that the staller is disconnected first
+    BOOST_CHECK_EQUAL(BlockStallingReassignTimeout(1000000), BLOCK_STALLING_REASSIGN_TIMEOUT_MAX);
+    BOOST_CHECK(BLOCK_STALLING_REASSIGN_TIMEOUT_MAX < 1000000 * BLOCK_STALLING_TIMEOUT);
+}
+
+BOOST_FIXTURE_TEST_CASE(block_stall_reassignment, RegtestingSetup)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+
+    // Headers for one block past the download window
+    std::vector<CBlockHeader> headers;
+    {
+        LOCK(cs_main);
+        const CBlockIndex* genesis = chainActive.Genesis();
+        for (int i = 0; i <= (int)BLOCK_DOWNLOAD_WINDOW; i++) {
+            CBlockHeader header;
+            header.nVersion = VERSIONBITS_TOP_BITS | VERSIONBITS_FORK_BCD;
+            header.hashPrevBlock = i ? headers.back().GetHash() : genesis->GetBlockHash();
+            header.hashMerkleRoot = InsecureRand256();
+            header.nTime = genesis->nTime + i + 1;
+            header.nBits = UintToArith256(params.powLimit).GetCompact();
+            while (!CheckProofOfWork(header.GetPoWHash(true), header.nBits, params)) {
+                ++header.nNonce;
+            }
+            headers.push_back(header);
+        }
+    }
+    CValidationState state;
+    BOOST_CHECK(ProcessNewBlockHeaders(headers, state, Params()));
+
+    // Two outbound peers which have all of them
+    CAddress addr1(ip(0xa0b0c001), NODE_NONE);
+    CAddress addr2(ip(0xa0b0c002), NODE_NONE);
+    CNode staller(id++, ServiceFlags(NODE_NETWORK|NODE_WITNESS), 0, INVALID_SOCKET, addr1, 0, 0, CAddress(), "", /*fInboundIn=*/ false);
+    CNode idle(id++, ServiceFlags(NODE_NETWORK|NODE_WITNESS), 0, INVALID_SOCKET, addr2, 1, 1, CAddress(), "", /*fInboundIn=*/ false);
+    for (CNode* node : {&staller, &idle}) {
+        node->SetSendVersion(PROTOCOL_VERSION);
+        peerLogic->InitializeNode(node);
+        node->nVersion = 1;
+        node->fSuccessfullyConnected = true;
+        UpdateBestKnownBlock(node->GetId(), headers.back().GetHash(), /*have_witness=*/ true);
+    }
+
+    // The first peer takes the start of the window, and we have every other block in it
+    {
+        LOCK2(cs_main, staller.cs_sendProcessing);
+        peerLogic->SendMessages(&staller);
+    }
+    CNodeStateStats stats;
+    BOOST_CHECK(GetNodeStateStats(staller.GetId(), stats));
+    BOOST_CHECK_EQUAL(stats.vHeightInFlight.size(), (size_t)MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    {
+        LOCK(cs_main);
+        for (size_t i = MAX_BLOCKS_IN_TRANSIT_PER_PEER; i < BLOCK_DOWNLOAD_WINDOW; i++) {
+            mapBlockIndex[headers[i].GetHash()]->nStatus |= BLOCK_HAVE_DATA;
+        }
+    }
+
+    // The second peer can only fetch past the window, so the first one stalls it
+    {
+        LOCK2(cs_main, idle.cs_sendProcessing);
+        peerLogic->SendMessages(&idle);
+    }
+    stats = CNodeStateStats();
+    BOOST_CHECK(GetNodeStateStats(idle.GetId(), stats));
+    BOOST_CHECK(stats.vHeightInFlight.empty());
+
+    // After the reassign timeout the second peer is asked for the block the first one stalls on
+    MilliSleep(BlockStallingReassignTimeout(0) / 1000 + 50);
+    {
+        LOCK2(cs_main, idle.cs_sendProcessing);
+        peerLogic->SendMessages(&idle);
+    }
+    stats = CNodeStateStats();
+    BOOST_CHECK(GetNodeStateStats(idle.GetId(), stats));
+    BOOST_CHECK(stats.vHeightInFlight == std::vector<int>{1});
+    stats = CNodeStateStats();
+    BOOST_CHECK(GetNodeStateStats(staller.GetId(), stats));
+    BOOST_CHECK_EQUAL(stats.vHeightInFlight.size(), (size_t)MAX_BLOCKS_IN_TRANSIT_PER_PEER - 1);
+    BOOST_CHECK_EQUAL(stats.nBlocksReassigned, 1U);
+    {
+        LOCK2(cs_main, staller.cs_sendProcessing);
+        peerLogic->SendMessages(&staller);
+    }
+    BOOST_CHECK(!staller.fDisconnect);
+
+    // The staller still gets disconnected if it delivers nothing
+    MilliSleep(1000 * BLOCK_STALLING_TIMEOUT);
+    {
+        LOCK2(cs_main, staller.cs_sendProcessing);
+        peerLogic->SendMessages(&staller);
+    }
+    BOOST_CHECK(staller.fDisconnect);
+
+    {
+        LOCK(cs_main);
+        for (size_t i = MAX_BLOCKS_IN_TRANSIT_PER_PEER; i < BLOCK_DOWNLOAD_WINDOW; i++) {
+            mapBlockIndex[headers[i].GetHash()]->nStatus &= ~BLOCK_HAVE_DATA;
+        }
+    }
+    bool dummy;
+    peerLogic->FinalizeNode(staller.GetId(), dummy);
+    peerLogic->FinalizeNode(idle.GetId(), dummy);
+}
+
 BOOST_AUTO_TEST_CASE(DoS_banning)
 {
 
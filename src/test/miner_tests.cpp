@@ -11,6 +11,7 @@
 #include <validation.h>
 #include <miner.h>
 #include <policy/policy.h>
+#include <pow.h>
 #include <pubkey.h>
 #include <script/standard.h>
 #include <txmempool.h>
@@ -521,4 +522,51 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     fCheckpointsEnabled = true;
 }
 
+BOOST_AUTO_TEST_CASE(scan_nonces)
+{
+    const auto chainParams = CreateChainParams(CBaseChainParams::REGTEST);
+    const Consensus::Params& params = chainParams->GetConsensus();
+    CBlockHeader header;
+    header.nVersion = VERSIONBITS_TOP_BITS | VERSIONBITS_FORK_BCD;
+    header.hashPrevBlock = InsecureRand256();
+    header.hashMerkleRoot = InsecureRand256();
+    header.nTime = 1500000000;
+    header.nBits = 0x2001ffff; // roughly one solution in 128 nonces
+
+    // The first solution in nonce order, found serially.
+    uint32_t expected = 0;
+    while (!CheckProofOfWork(header.GetPoWHash(true), header.nBits, params)) {
+        header.nNonce = ++expected;
+    }
+
+    for (int threads : {1, 2, 4}) {
+        header.nNonce = 0;
+        uint64_t tries = 1000000;
+        BOOST_CHECK(ScanNonces(&header, 0x10000, threads, tries, true, params));
+        BOOST_CHECK_EQUAL(header.nNonce, expected);
+        BOOST_CHECK(tries < 1000000);
+
+        // Running out of tries before reaching the solution fails and uses them all up.
+        header.nNonce = 0;
+        tries = expected;
+        BOOST_CHECK(!ScanNonces(&header, 0x10000, threads, tries, true, params));
+        BOOST_CHECK_EQUAL(tries, 0U);
+        BOOST_CHECK_EQUAL(header.nNonce, 0U);
+    }
+
+    // Blocks from before the fork, or without the fork version bit, are mined with SHA256d.
+    for (bool isBCDBlock : {false, true}) {
+        if (isBCDBlock) header.nVersion = VERSIONBITS_TOP_BITS;
+        header.nNonce = 0;
+        expected = 0;
+        while (!CheckProofOfWork(header.GetHash(), header.nBits, params)) {
+            header.nNonce = ++expected;
+        }
+        header.nNonce = 0;
+        uint64_t tries = 1000000;
+        BOOST_CHECK(ScanNonces(&header, 0x10000, 2, tries, isBCDBlock, params));
+        BOOST_CHECK_EQUAL(header.nNonce, expected);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
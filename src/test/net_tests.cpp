@@ -10,6 +10,7 @@
 #include <streams.h>
 #include <net.h>
 #include <netbase.h>
+#include <protocol.h>
 #include <chainparams.h>
 #include <util/system.h>
 
@@ -189,6 +190,123 @@ BOOST_AUTO_TEST_CASE(cnode_simple_test)
     BOOST_CHECK(pnode2->fFeeler == false);
 }
 
+BOOST_AUTO_TEST_CASE(cnetmessage_read_header)
+{
+    CMessageHeader hdr(Params().MessageStart(), NetMsgType::PING, 8);
+    memset(hdr.pchChecksum, 0xab, CMessageHeader::CHECKSUM_SIZE);
+    CDataStream stream(SER_NETWORK, INIT_PROTO_VERSION);
+    stream << hdr;
+    BOOST_CHECK_EQUAL(stream.size(), (size_t)CMessageHeader::HEADER_SIZE);
+
+    // In one piece, parsed in place, and split across reads
+    for (unsigned int split : {(unsigned int)CMessageHeader::HEADER_SIZE, 1U, 10U}) {
+        CNetMessage msg(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION);
+        BOOST_CHECK_EQUAL(msg.readHeader(stream.data(), split), (int)split);
+        BOOST_CHECK_EQUAL(msg.in_data, split == CMessageHeader::HEADER_SIZE);
+        if (split < CMessageHeader::HEADER_SIZE) {
+            BOOST_CHECK_EQUAL(msg.readHeader(stream.data() + split, stream.size() - split), (int)(stream.size() - split));
+        }
+        BOOST_CHECK(msg.in_data);
+        BOOST_CHECK(memcmp(msg.hdr.pchMessageStart, Params().MessageStart(), CMessageHeader::MESSAGE_START_SIZE) == 0);
+        BOOST_CHECK_EQUAL(msg.hdr.GetCommand(), NetMsgType::PING);
+        BOOST_CHECK_EQUAL(msg.hdr.nMessageSize, 8U);
+        BOOST_CHECK(memcmp(msg.hdr.pchChecksum, hdr.pchChecksum, CMessageHeader::CHECKSUM_SIZE) == 0);
+    }
+}
+
+static size_t StreamCapacity(CDataStream& stream)
+{
+    CSerializeData buf;
+    stream.swap(buf);
+    size_t capacity = buf.capacity();
+    stream.swap(buf);
+    return capacity;
+}
+
+BOOST_AUTO_TEST_CASE(cnetmessage_buffer_pool)
+{
+    CNetMessageBufferPool pool;
+    CDataStream stream(SER_NETWORK, INIT_PROTO_VERSION);
+
+    pool.Get(stream, 1000);
+    BOOST_CHECK_EQUAL(StreamCapacity(stream), 1024U);
+    stream.resize(1000);
+    pool.Put(stream);
+    BOOST_CHECK(stream.empty());
+    BOOST_CHECK_EQUAL(StreamCapacity(stream), 0U);
+
+    // A message of the same size class reuses the buffer, a smaller one does not
+    pool.Get(stream, 513);
+    BOOST_CHECK_EQUAL(StreamCapacity(stream), 1024U);
+    BOOST_CHECK(stream.empty());
+    pool.Put(stream);
+    pool.Get(stream, 100);
+    BOOST_CHECK_EQUAL(StreamCapacity(stream), 256U);
+    pool.Put(stream);
+    BOOST_CHECK_EQUAL(pool.GetAllocs(), 2U);
+    BOOST_CHECK_EQUAL(pool.GetReuses(), 1U);
+
+    // Messages above the largest size class are not pooled
+    const size_t large = ((size_t)1 << CNetMessageBufferPool::MAX_SIZE_CLASS) + 1;
+    pool.Get(stream, large);
+    BOOST_CHECK_EQUAL(StreamCapacity(stream), 0U);
+    stream.resize(large);
+    pool.Put(stream);
+    pool.Get(stream, large);
+    BOOST_CHECK_EQUAL(pool.GetAllocs(), 4U);
+    BOOST_CHECK_EQUAL(pool.GetReuses(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(shared_message_push)
+{
+    CConnman connman(0x1337, 0x1337);
+    std::unique_ptr<CNode> pnode1(new CNode(0, NODE_NETWORK, 0, INVALID_SOCKET, CAddress(), 0, 0, CAddress(), "", false));
+    std::unique_ptr<CNode> pnode2(new CNode(1, NODE_NETWORK, 0, INVALID_SOCKET, CAddress(), 1, 1, CAddress(), "", false));
+
+    const std::vector<unsigned char> payload{1, 2, 3, 4, 5};
+    CSerializedNetMsg msg;
+    msg.command = NetMsgType::PING;
+    msg.data = payload;
+    connman.PushMessage(pnode1.get(), std::move(msg));
+
+    // The shared message holds the same bytes in one buffer, queued without copying
+    msg.command = NetMsgType::PING;
+    msg.data = payload;
+    const CSharedNetMsg shared = CConnman::MakeSharedMessage(std::move(msg), 1);
+    connman.PushMessage(pnode2.get(), shared);
+    connman.PushMessage(pnode2.get(), shared);
+
+    LOCK2(pnode1->cs_vSend, pnode2->cs_vSend);
+    BOOST_REQUIRE_EQUAL(pnode1->vSendMsg.size(), 2U);
+    std::vector<unsigned char> bytes;
+    for (const CSendBuffer& buffer : pnode1->vSendMsg) {
+        bytes.insert(bytes.end(), buffer.data(), buffer.data() + buffer.size());
+    }
+    BOOST_CHECK(bytes == *shared.data);
+    BOOST_REQUIRE_EQUAL(pnode2->vSendMsg.size(), 2U);
+    for (const CSendBuffer& buffer : pnode2->vSendMsg) {
+        BOOST_CHECK(buffer.data() == shared.data->data());
+        BOOST_CHECK_EQUAL(buffer.nTimeStart, 1);
+    }
+    BOOST_CHECK_EQUAL(pnode2->nSendSize, 2 * bytes.size());
+
+    // An already shared payload is queued after its header, as it is
+    std::unique_ptr<CNode> pnode3(new CNode(2, NODE_NETWORK, 0, INVALID_SOCKET, CAddress(), 2, 2, CAddress(), "", false));
+    const std::shared_ptr<const std::vector<unsigned char>> shared_payload = std::make_shared<const std::vector<unsigned char>>(payload);
+    connman.PushMessage(pnode3.get(), CConnman::MakeSharedMessage(NetMsgType::PING, shared_payload, 1));
+    LOCK(pnode3->cs_vSend);
+    BOOST_REQUIRE_EQUAL(pnode3->vSendMsg.size(), 2U);
+    BOOST_CHECK(pnode3->vSendMsg.back().data() == shared_payload->data());
+    BOOST_CHECK_EQUAL(pnode3->vSendMsg.front().nTimeStart, 0);
+    BOOST_CHECK_EQUAL(pnode3->vSendMsg.back().nTimeStart, 1);
+    std::vector<unsigned char> bytes3;
+    for (const CSendBuffer& buffer : pnode3->vSendMsg) {
+        bytes3.insert(bytes3.end(), buffer.data(), buffer.data() + buffer.size());
+    }
+    BOOST_CHECK(bytes3 == bytes);
+    BOOST_CHECK_EQUAL(pnode3->nSendSize, bytes.size());
+}
+
 // prior to PR #14728, this test triggers an undefined behavior
 BOOST_AUTO_TEST_CASE(ipv4_peer_with_ipv6_addrMe_test)
 {
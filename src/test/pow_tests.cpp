@@ -2,11 +2,13 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <arith_uint256.h>
 #include <chain.h>
 #include <chainparams.h>
 #include <pow.h>
 #include <random.h>
 #include <util/system.h>
+#include <versionbits.h>
 #include <test/test_bitcoin.h>
 
 #include <boost/test/unit_test.hpp>
@@ -83,4 +85,133 @@ BOOST_AUTO_TEST_CASE(GetBlockProofEquivalentTime_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(block_index_pow_hash)
+{
+    std::vector<CBlockIndex> blocks(100);
+    std::vector<uint256> hashes(blocks.size());
+    for (size_t i = 0; i < blocks.size(); i++) {
+        blocks[i].pprev = i ? &blocks[i - 1] : nullptr;
+        blocks[i].nHeight = i;
+        blocks[i].nVersion = VERSIONBITS_TOP_BITS | (i % 2 ? VERSIONBITS_FORK_BCD : 0);
+        blocks[i].hashMerkleRoot = InsecureRand256();
+        blocks[i].nTime = 1500000000 + i;
+        blocks[i].nBits = 0x1d00ffff;
+        blocks[i].nNonce = InsecureRand32();
+        hashes[i] = blocks[i].GetBlockHeader().GetHash();
+        blocks[i].phashBlock = &hashes[i];
+    }
+
+    // Ask twice, so the second round is answered from the cache.
+    for (int round = 0; round < 2; round++) {
+        for (const CBlockIndex& block : blocks) {
+            const CBlockHeader header = block.GetBlockHeader();
+            BOOST_CHECK(block.GetBlockPoWHash(true) == header.GetPoWHash(true));
+            BOOST_CHECK(block.GetBlockPoWHash(false) == header.GetHash());
+        }
+    }
+}
+
+/* Straightforward LWMA window walk, as the cached implementation must match it bit for bit */
+static unsigned int LwmaReference(const CBlockIndex* pindexLast, const Consensus::Params& params)
+{
+    const int height = pindexLast->nHeight + 1;
+    const int64_t T = params.nPowTargetSpacing;
+    const int64_t N = params.nZawyLwmaAveragingWindow;
+    const int64_t k = params.nZawyLwmaAdjustedWeight;
+    const int64_t dnorm = params.nZawyLwmaMinDenominator;
+
+    arith_uint256 sum_target;
+    int t = 0, j = 0;
+    for (int i = height - N; i < height; i++) {
+        const CBlockIndex* block = pindexLast->GetAncestor(i);
+        int64_t solvetime = block->GetBlockTime() - block->GetAncestor(i - 1)->GetBlockTime();
+        if (params.bZawyLwmaSolvetimeLimitation && solvetime > 6 * T) {
+            solvetime = 6 * T;
+        }
+        j++;
+        t += solvetime * j;
+        arith_uint256 target;
+        target.SetCompact(block->nBits);
+        sum_target += target / (k * N * N);
+    }
+    if (t < N * k / dnorm) {
+        t = N * k / dnorm;
+    }
+    arith_uint256 next_target = t * sum_target;
+    if (next_target > UintToArith256(params.BCDBeginPowLimit)) {
+        next_target = UintToArith256(params.BCDBeginPowLimit);
+    }
+    return next_target.GetCompact();
+}
+
+/* Build a chain with erratic (including negative) solvetimes and varying targets */
+static void BuildLwmaChain(std::vector<CBlockIndex>& blocks, std::vector<uint256>& hashes, const Consensus::Params& params)
+{
+    for (size_t i = 0; i < blocks.size(); i++) {
+        hashes[i] = InsecureRand256();
+        blocks[i].phashBlock = &hashes[i];
+        blocks[i].pprev = i ? &blocks[i - 1] : nullptr;
+        blocks[i].nHeight = i;
+        blocks[i].nTime = 1500000000 + i * params.nPowTargetSpacing + InsecureRandRange(8 * params.nPowTargetSpacing) - 2 * params.nPowTargetSpacing;
+        blocks[i].nBits = 0x1c000000 | (0x8000 + InsecureRandRange(0x7f8000));
+        blocks[i].BuildSkip();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(lwma_incremental)
+{
+    const auto chainParams = CreateChainParams(CBaseChainParams::MAIN);
+    const Consensus::Params& params = chainParams->GetConsensus();
+    std::vector<CBlockIndex> blocks(1000);
+    std::vector<uint256> hashes(blocks.size());
+    BuildLwmaChain(blocks, hashes, params);
+
+    // Walking the chain forward slides the cached window one block at a time.
+    for (size_t i = params.nZawyLwmaAveragingWindow; i < blocks.size(); i++) {
+        BOOST_CHECK_EQUAL(LwmaCalculateNextWorkRequired(&blocks[i], params), LwmaReference(&blocks[i], params));
+    }
+    // Jumping between tips rebuilds it, as does an index entry without a hash.
+    for (int j = 0; j < 200; j++) {
+        const CBlockIndex* tip = &blocks[params.nZawyLwmaAveragingWindow + InsecureRandRange(blocks.size() - params.nZawyLwmaAveragingWindow)];
+        BOOST_CHECK_EQUAL(LwmaCalculateNextWorkRequired(tip, params), LwmaReference(tip, params));
+    }
+    CBlockIndex unhashed = blocks.back();
+    unhashed.phashBlock = nullptr;
+    BOOST_CHECK_EQUAL(LwmaCalculateNextWorkRequired(&unhashed, params), LwmaReference(&blocks.back(), params));
+
+    // Without the solvetime limit the weighted sum can go far out of range.
+    Consensus::Params unlimited = params;
+    unlimited.bZawyLwmaSolvetimeLimitation = false;
+    for (size_t i = blocks.size() - 100; i < blocks.size(); i++) {
+        blocks[i].nTime += InsecureRandBool() ? 100000000 : -100000000;
+    }
+    for (size_t i = blocks.size() - 100; i < blocks.size(); i++) {
+        BOOST_CHECK_EQUAL(LwmaCalculateNextWorkRequired(&blocks[i], unlimited), LwmaReference(&blocks[i], unlimited));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(get_next_work_batch)
+{
+    const auto chainParams = CreateChainParams(CBaseChainParams::MAIN);
+    Consensus::Params params = chainParams->GetConsensus();
+    // Cover the fork heights, the pre-LWMA retarget and LWMA within one run.
+    params.BCDHeight = 50;
+    params.ZawyLWMAHeight = 300;
+    std::vector<CBlockIndex> blocks(600);
+    std::vector<uint256> hashes(blocks.size());
+    BuildLwmaChain(blocks, hashes, params);
+
+    for (size_t start : {10, 49, 60, 250, 299, 450}) {
+        std::vector<CBlockHeader> headers;
+        for (size_t i = start + 1; i < blocks.size(); i++) {
+            headers.push_back(blocks[i].GetBlockHeader());
+        }
+        std::vector<unsigned int> batch = GetNextWorkRequiredBatch(&blocks[start], headers, params);
+        BOOST_CHECK_EQUAL(batch.size(), headers.size());
+        for (size_t i = 0; i < headers.size(); i++) {
+            BOOST_CHECK_EQUAL(batch[i], GetNextWorkRequired(&blocks[start + i], &headers[i], params));
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,169 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <net.h>
+#include <txmempool.h>
+#include <txrelay.h>
+
+#include <test/test_bitcoin.h>
+
+#include <algorithm>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(txrelay_tests, BasicTestingSetup)
+
+/** Add a transaction spending prevout to the pool, with the given fee. */
+static CTransactionRef AddTx(CTxMemPool& pool, const COutPoint& prevout, CAmount fee)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = 10 * COIN;
+    CTransactionRef ptx = MakeTransactionRef(tx);
+    LOCK(pool.cs);
+    pool.addUnchecked(ptx->GetHash(), TestMemPoolEntryHelper().Fee(fee).FromTx(ptx));
+    return ptx;
+}
+
+/** Txids of a batch, in the order a peer queueing it announces them. */
+static std::vector<uint256> Announced(const std::vector<CTxRelayInv>& batch)
+{
+    CNode node(0, NODE_NETWORK, 0, INVALID_SOCKET, CAddress(), 0, 0, CAddress(), "", false);
+    node.PushTxInventory(batch);
+    std::vector<uint256> order;
+    LOCK(node.cs_inventory);
+    uint256 hash;
+    while (node.PopInventoryTx(hash)) {
+        order.push_back(hash);
+    }
+    return order;
+}
+
+BOOST_AUTO_TEST_CASE(txrelay_batch_order)
+{
+    CTxMemPool pool;
+    CTransactionRef low = AddTx(pool, COutPoint(InsecureRand256(), 0), 1000);
+    CTransactionRef parent = AddTx(pool, COutPoint(InsecureRand256(), 0), 5000);
+    CTransactionRef child = AddTx(pool, COutPoint(parent->GetHash(), 0), 20000);
+    CTransactionRef high = AddTx(pool, COutPoint(InsecureRand256(), 0), 10000);
+
+    CTxRelayScheduler scheduler;
+    std::vector<CTxRelayInv> batch;
+    BOOST_CHECK(!scheduler.GetBatch(pool, 1000, batch));
+    scheduler.Relay(low->GetHash());
+    scheduler.Relay(parent->GetHash());
+    scheduler.Relay(child->GetHash());
+    scheduler.Relay(InsecureRand256()); // not in the mempool
+    scheduler.Relay(high->GetHash());
+
+    // The batch carries the mempool order of the transactions still in the mempool
+    BOOST_CHECK(scheduler.GetBatch(pool, 1000, batch));
+    BOOST_CHECK_EQUAL(batch.size(), 4U);
+    BOOST_CHECK(batch[2].txid == child->GetHash());
+    BOOST_CHECK_EQUAL(batch[2].nCountWithAncestors, 2U);
+    BOOST_CHECK_EQUAL(batch[2].nFee, 20000);
+
+    // Fewest ancestors first, then highest fee rate
+    const std::vector<uint256> expected{high->GetHash(), parent->GetHash(), low->GetHash(), child->GetHash()};
+    BOOST_CHECK(Announced(batch) == expected);
+
+    // The next batch is only formed once the interval has passed
+    scheduler.Relay(low->GetHash());
+    BOOST_CHECK(!scheduler.GetBatch(pool, 1000 + TX_RELAY_BATCH_INTERVAL - 1, batch));
+    BOOST_CHECK(batch.empty());
+    BOOST_CHECK(scheduler.GetBatch(pool, 1000 + TX_RELAY_BATCH_INTERVAL, batch));
+    BOOST_CHECK_EQUAL(batch.size(), 1U);
+    BOOST_CHECK(batch[0].txid == low->GetHash());
+    BOOST_CHECK(!scheduler.GetBatch(pool, 1000 + 2 * TX_RELAY_BATCH_INTERVAL, batch));
+}
+
+BOOST_AUTO_TEST_CASE(txrelay_backlog_order)
+{
+    CTxMemPool pool;
+    CTransactionRef low = AddTx(pool, COutPoint(InsecureRand256(), 0), 1000);
+    CTransactionRef parent = AddTx(pool, COutPoint(InsecureRand256(), 0), 2000);
+    CTransactionRef high = AddTx(pool, COutPoint(InsecureRand256(), 0), 10000);
+    CTransactionRef child = AddTx(pool, COutPoint(parent->GetHash(), 0), 50000);
+
+    CTxRelayScheduler scheduler;
+    std::vector<CTxRelayInv> first, second;
+    scheduler.Relay(low->GetHash());
+    scheduler.Relay(parent->GetHash());
+    BOOST_CHECK(scheduler.GetBatch(pool, 0, first));
+    scheduler.Relay(child->GetHash());
+    scheduler.Relay(high->GetHash());
+    BOOST_CHECK(scheduler.GetBatch(pool, TX_RELAY_BATCH_INTERVAL, second));
+
+    // A peer with both batches in its backlog announces in mempool order across them
+    CNode node(0, NODE_NETWORK, 0, INVALID_SOCKET, CAddress(), 0, 0, CAddress(), "", false);
+    node.PushTxInventory(first);
+    node.PushTxInventory(second);
+    LOCK(node.cs_inventory);
+    uint256 hash;
+    BOOST_CHECK(node.PopInventoryTx(hash));
+    BOOST_CHECK(hash == high->GetHash());
+    BOOST_CHECK(node.PopInventoryTx(hash));
+    BOOST_CHECK(hash == parent->GetHash());
+    BOOST_CHECK(node.PopInventoryTx(hash));
+    BOOST_CHECK(hash == low->GetHash());
+    BOOST_CHECK(node.PopInventoryTx(hash));
+    BOOST_CHECK(hash == child->GetHash());
+    BOOST_CHECK(!node.PopInventoryTx(hash));
+}
+
+BOOST_AUTO_TEST_CASE(txrelay_node_queue)
+{
+    std::unique_ptr<CNode> pnode(new CNode(0, NODE_NETWORK, 0, INVALID_SOCKET, CAddress(), 0, 0, CAddress(), "", false));
+    // Equal fee rates, so the hashes decide the order: a is announced first, e last
+    std::vector<uint256> hashes;
+    for (int i = 0; i < 5; ++i) {
+        hashes.push_back(InsecureRand256());
+    }
+    std::sort(hashes.rbegin(), hashes.rend());
+    const uint256 a = hashes[0], b = hashes[1], c = hashes[2], d = hashes[3], e = hashes[4];
+    const uint256 known = InsecureRand256();
+    auto inv = [](const uint256& txid) { return CTxRelayInv(txid, 1, 1000, 100); };
+    pnode->filterInventoryKnown.insert(known);
+
+    // Duplicates and transactions the peer already knows are not queued
+    pnode->PushTxInventory({inv(a), inv(b), inv(known), inv(a)});
+    LOCK(pnode->cs_inventory);
+    uint256 hash;
+    BOOST_CHECK(pnode->PopInventoryTx(hash));
+    BOOST_CHECK(hash == a);
+    BOOST_CHECK_EQUAL(pnode->setInventoryTxToSend.size(), 1U);
+
+    // A transaction still queued is not queued twice, one already sent may be again
+    pnode->PushTxInventory({inv(b), inv(c), inv(a)});
+    BOOST_CHECK(pnode->PopInventoryTx(hash));
+    BOOST_CHECK(hash == a);
+    BOOST_CHECK(pnode->PopInventoryTx(hash));
+    BOOST_CHECK(hash == b);
+    BOOST_CHECK(pnode->PopInventoryTx(hash));
+    BOOST_CHECK(hash == c);
+    BOOST_CHECK(!pnode->PopInventoryTx(hash));
+
+    // Transactions no longer to send, e.g. answered by a mempool request, are skipped
+    pnode->PushTxInventory({inv(d), inv(e)});
+    pnode->setInventoryTxToSend.erase(d);
+    BOOST_CHECK(pnode->PopInventoryTx(hash));
+    BOOST_CHECK(hash == e);
+    BOOST_CHECK(!pnode->PopInventoryTx(hash));
+
+    // Transactions pushed one by one are of unknown order and go first
+    pnode->PushTxInventory({inv(a)});
+    pnode->PushInventory(CInv(MSG_TX, e));
+    BOOST_CHECK(pnode->PopInventoryTx(hash));
+    BOOST_CHECK(hash == e);
+
+    pnode->PushTxInventory({inv(a), inv(b)});
+    pnode->ClearInventoryTx();
+    BOOST_CHECK(!pnode->PopInventoryTx(hash));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -13,6 +13,7 @@
 #include <test/test_bitcoin.h>
 #include <validation.h>
 #include <validationinterface.h>
+#include <versionbits.h>
 
 struct RegtestingSetup : public TestingSetup {
     RegtestingSetup() : TestingSetup(CBaseChainParams::REGTEST) {}
@@ -119,6 +120,77 @@ void BuildChain(const uint256& root, int height, const unsigned int invalid_rate
     }
 }
 
+/** Headers building on the genesis block, with the required bits and mined unless bad_pow. */
+static std::vector<CBlockHeader> HeaderChain(size_t count, bool bad_pow)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+    const CBlockIndex* genesis = chainActive.Genesis();
+    std::vector<CBlockHeader> headers;
+    for (size_t i = 0; i < count; i++) {
+        CBlockHeader header;
+        header.nVersion = VERSIONBITS_TOP_BITS | VERSIONBITS_FORK_BCD;
+        header.hashPrevBlock = i ? headers.back().GetHash() : genesis->GetBlockHash();
+        header.hashMerkleRoot = InsecureRand256();
+        header.nTime = genesis->nTime + i + 1;
+        headers.push_back(header);
+        headers.back().nBits = GetNextWorkRequiredBatch(genesis, headers, params).back();
+        while (CheckProofOfWork(headers.back().GetPoWHash(true), headers.back().nBits, params) == bad_pow) {
+            ++headers.back().nNonce;
+        }
+    }
+    return headers;
+}
+
+BOOST_AUTO_TEST_CASE(processnewblockheaders_pow)
+{
+    CValidationState state;
+    CBlockHeader first_invalid;
+
+    // A batch of junk is rejected at its first header
+    const std::vector<CBlockHeader> junk = HeaderChain(50, true);
+    BOOST_CHECK(!ProcessNewBlockHeaders(junk, state, Params(), nullptr, &first_invalid));
+    BOOST_CHECK_EQUAL(first_invalid.GetHash(), junk[0].GetHash());
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(!mapBlockIndex.count(junk[0].GetHash()));
+    }
+
+    // Headers before the first one with bad proof of work are accepted
+    std::vector<CBlockHeader> headers = HeaderChain(40, false);
+    while (CheckProofOfWork(headers[30].GetPoWHash(true), headers[30].nBits, Params().GetConsensus())) {
+        ++headers[30].nNonce;
+    }
+    state = CValidationState();
+    BOOST_CHECK(!ProcessNewBlockHeaders(headers, state, Params(), nullptr, &first_invalid));
+    BOOST_CHECK_EQUAL(first_invalid.GetHash(), headers[30].GetHash());
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(mapBlockIndex.count(headers[29].GetHash()));
+        BOOST_CHECK(!mapBlockIndex.count(headers[30].GetHash()));
+    }
+
+    // Headers before the first one with wrong bits are accepted too
+    headers = HeaderChain(40, false);
+    headers[20].nBits = headers[19].nBits - 1;
+    state = CValidationState();
+    BOOST_CHECK(!ProcessNewBlockHeaders(headers, state, Params(), nullptr, &first_invalid));
+    BOOST_CHECK_EQUAL(first_invalid.GetHash(), headers[20].GetHash());
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(mapBlockIndex.count(headers[19].GetHash()));
+        BOOST_CHECK(!mapBlockIndex.count(headers[20].GetHash()));
+    }
+
+    // A valid batch is accepted whole, including the headers already known
+    headers = HeaderChain(40, false);
+    const CBlockIndex* pindex = nullptr;
+    state = CValidationState();
+    BOOST_CHECK(ProcessNewBlockHeaders(headers, state, Params(), &pindex));
+    BOOST_CHECK(pindex && pindex->GetBlockHash() == headers.back().GetHash());
+    BOOST_CHECK(ProcessNewBlockHeaders(headers, state, Params(), &pindex));
+    BOOST_CHECK(pindex && pindex->GetBlockHash() == headers.back().GetHash());
+}
+
 BOOST_AUTO_TEST_CASE(processnewblock_signals_ordering)
 {
     // build a large-ish chain that's likely to have some forks
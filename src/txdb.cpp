@@ -61,6 +61,15 @@ bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, Coin &coin) const {
     return db.Read(CoinEntry(&outpoint), coin);
 }
 
+size_t CCoinsViewDB::GetCoins(const std::vector<COutPoint>& outpoints, std::vector<Coin>& coins, std::vector<bool>& found) const {
+    std::vector<CoinEntry> entries;
+    entries.reserve(outpoints.size());
+    for (const COutPoint& outpoint : outpoints) {
+        entries.emplace_back(&outpoint);
+    }
+    return db.MultiRead(entries, coins, found);
+}
+
 bool CCoinsViewDB::HaveCoin(const COutPoint &outpoint) const {
     return db.Exists(CoinEntry(&outpoint));
 }
@@ -80,7 +89,7 @@ std::vector<uint256> CCoinsViewDB::GetHeadBlocks() const {
     return vhashHeadBlocks;
 }
 
-bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool erase) {
     CDBBatch batch(db);
     size_t count = 0;
     size_t changed = 0;
@@ -116,7 +125,8 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
         }
         count++;
         CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+        if (erase)
+            mapCoins.erase(itOld);
         if (batch.SizeEstimate() > batch_size) {
             LogPrint(BCLog::COINDB, "Writing partial batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
             db.WriteBatch(batch);
@@ -246,7 +256,7 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
-bool CBlockTreeDB::LoadBlockIndexGuts(const Consensus::Params& consensusParams, std::function<CBlockIndex*(const uint256&)> insertBlockIndex)
+bool CBlockTreeDB::LoadBlockIndexGuts(const Consensus::Params& consensusParams, std::function<CBlockIndex*(const uint256&)> insertBlockIndex, bool fCheckAllPoW, std::vector<CBlockIndex*>& vPoWUnchecked)
 {
     std::unique_ptr<CDBIterator> pcursor(NewIterator());
 
@@ -274,8 +284,10 @@ bool CBlockTreeDB::LoadBlockIndexGuts(const Consensus::Params& consensusParams,
                 pindexNew->nStatus        = diskindex.nStatus;
                 pindexNew->nTx            = diskindex.nTx;
 
-                if (!CheckProofOfWork(pindexNew->GetBlockPoWHash(pindexNew->nHeight >= Params().GetConsensus().BCDHeight), pindexNew->nBits, consensusParams))
-                    return error("%s: CheckProofOfWork failed: %s", __func__, pindexNew->ToString());
+                // Headers accepted by AcceptBlockHeader carry BLOCK_POW_VALID; only
+                // entries written without it (or everything, in paranoid mode) are rehashed.
+                if (fCheckAllPoW || !(pindexNew->nStatus & BLOCK_POW_VALID))
+                    vPoWUnchecked.push_back(pindexNew);
 
                 pcursor->Next();
             } else {
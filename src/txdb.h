@@ -23,6 +23,8 @@ class uint256;
 
 //! No need to periodic flush if at least this much space still available.
 static constexpr int MAX_BLOCK_COINSDB_USAGE = 10;
+//! Percentage of the space for the coins cache it is trimmed to after a flush made because it was full.
+static constexpr int COINS_CACHE_TRIM_PERCENT = 50;
 //! -dbcache default (MiB)
 static const int64_t nDefaultDbCache = 450;
 //! -dbbatchsize default (bytes)
@@ -50,9 +52,11 @@ public:
 
     bool GetCoin(const COutPoint &outpoint, Coin &coin) const override;
     bool HaveCoin(const COutPoint &outpoint) const override;
+    /** Read several coins in one pass, see CDBWrapper::MultiRead. Returns the number found. */
+    size_t GetCoins(const std::vector<COutPoint>& outpoints, std::vector<Coin>& coins, std::vector<bool>& found) const;
     uint256 GetBestBlock() const override;
     std::vector<uint256> GetHeadBlocks() const override;
-    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) override;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, bool erase = true) override;
     CCoinsViewCursor *Cursor() const override;
 
     //! Attempt to update from an older database format. Returns whether an error occurred.
@@ -95,7 +99,12 @@ public:
     void ReadReindexing(bool &fReindexing);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
-    bool LoadBlockIndexGuts(const Consensus::Params& consensusParams, std::function<CBlockIndex*(const uint256&)> insertBlockIndex);
+    /**
+     * Load all block index entries. Entries whose proof of work still has to be
+     * checked (those without BLOCK_POW_VALID, or all of them if fCheckAllPoW) are
+     * not hashed here but appended to vPoWUnchecked for the caller to verify.
+     */
+    bool LoadBlockIndexGuts(const Consensus::Params& consensusParams, std::function<CBlockIndex*(const uint256&)> insertBlockIndex, bool fCheckAllPoW, std::vector<CBlockIndex*>& vPoWUnchecked);
 };
 
 #endif // BITCOIN_TXDB_H
@@ -0,0 +1,36 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <txrelay.h>
+
+#include <txmempool.h>
+
+void CTxRelayScheduler::Relay(const uint256& txid)
+{
+    LOCK(cs);
+    vQueued.push_back(txid);
+}
+
+bool CTxRelayScheduler::GetBatch(CTxMemPool& pool, int64_t nNow, std::vector<CTxRelayInv>& vBatch)
+{
+    vBatch.clear();
+    std::vector<uint256> vTxid;
+    {
+        LOCK(cs);
+        if (nNow < nNextBatch || vQueued.empty())
+            return false;
+        nNextBatch = nNow + TX_RELAY_BATCH_INTERVAL;
+        vTxid.swap(vQueued);
+    }
+
+    vBatch.reserve(vTxid.size());
+    LOCK(pool.cs);
+    for (const uint256& hash : vTxid) {
+        auto it = pool.mapTx.find(hash);
+        if (it != pool.mapTx.end()) {
+            vBatch.emplace_back(hash, it->GetCountWithAncestors(), it->GetFee(), it->GetTxSize());
+        }
+    }
+    return !vBatch.empty();
+}
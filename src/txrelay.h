@@ -0,0 +1,87 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXRELAY_H
+#define BITCOIN_TXRELAY_H
+
+#include <amount.h>
+#include <sync.h>
+#include <uint256.h>
+
+#include <stdint.h>
+#include <vector>
+
+class CTxMemPool;
+
+/** Time between batches of transaction announcements, in seconds. */
+static const int64_t TX_RELAY_BATCH_INTERVAL = 1;
+
+/**
+ * A transaction to announce, with what it had in the mempool when it was
+ * batched: its number of in-mempool ancestors, fee and size.
+ */
+struct CTxRelayInv
+{
+    uint256 txid;
+    uint64_t nCountWithAncestors;
+    CAmount nFee;
+    size_t nTxSize;
+
+    /** A transaction of unknown order, announced ahead of all others. */
+    explicit CTxRelayInv(const uint256& txidIn) : txid(txidIn), nCountWithAncestors(0), nFee(0), nTxSize(1) {}
+    CTxRelayInv(const uint256& txidIn, uint64_t nCountWithAncestorsIn, CAmount nFeeIn, size_t nTxSizeIn) :
+        txid(txidIn), nCountWithAncestors(nCountWithAncestorsIn), nFee(nFeeIn), nTxSize(nTxSizeIn) {}
+};
+
+/**
+ * Heap order of transactions to announce: as CTxMemPool::CompareDepthAndScore,
+ * fewest ancestors first, then highest fee rate. As std::make_heap produces
+ * a max-heap, the transactions to announce first sort later.
+ */
+class CompareTxRelayInv
+{
+public:
+    bool operator()(const CTxRelayInv& a, const CTxRelayInv& b) const
+    {
+        if (a.nCountWithAncestors == b.nCountWithAncestors) {
+            double f1 = (double)a.nFee * b.nTxSize;
+            double f2 = (double)b.nFee * a.nTxSize;
+            if (f1 == f2) {
+                return a.txid < b.txid;
+            }
+            return f1 < f2;
+        }
+        return a.nCountWithAncestors > b.nCountWithAncestors;
+    }
+};
+
+/**
+ * Collects accepted transactions and hands them to the peers in batches.
+ *
+ * Rather than each peer comparing the transactions it still has to
+ * announce under the mempool lock every time it trickles, the mempool
+ * order of every transaction of a batch is looked up once, and every peer
+ * keeps its backlog in a heap ordered by it (see CompareTxRelayInv). A
+ * batch is formed at most once per TX_RELAY_BATCH_INTERVAL.
+ */
+class CTxRelayScheduler
+{
+public:
+    /** Queue a transaction to be announced to all peers. */
+    void Relay(const uint256& txid);
+
+    /**
+     * Take the queued transactions if a batch is due at nNow, with their
+     * mempool order. Transactions that left the mempool in the meantime are
+     * dropped. Returns whether vBatch holds any transaction.
+     */
+    bool GetBatch(CTxMemPool& pool, int64_t nNow, std::vector<CTxRelayInv>& vBatch);
+
+private:
+    CCriticalSection cs;
+    std::vector<uint256> vQueued GUARDED_BY(cs);
+    int64_t nNextBatch GUARDED_BY(cs) = 0;
+};
+
+#endif // BITCOIN_TXRELAY_H
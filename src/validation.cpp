@@ -6,6 +6,7 @@
 #include <validation.h>
 
 #include <arith_uint256.h>
+#include <blockpipeline.h>
 #include <chain.h>
 #include <chainparams.h>
 #include <checkpoints.h>
@@ -24,7 +25,6 @@
 #include <primitives/block.h>
 #include <primitives/transaction.h>
 #include <random.h>
-#include <reverse_iterator.h>
 #include <script/script.h>
 #include <script/sigcache.h>
 #include <script/standard.h>
@@ -43,6 +43,7 @@
 
 #include <future>
 #include <sstream>
+#include <unordered_set>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/thread.hpp>
@@ -163,8 +164,10 @@ public:
     /**
      * If a block header hasn't already been seen, call CheckBlockHeader on it, ensure
      * that it doesn't descend from an invalid block, and then add it to mapBlockIndex.
+     * fCheckPOW may only be false if the caller already verified the header's proof of work,
+     * both its hash and that nBits is the required one.
      */
-    bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+    bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fCheckPOW = true) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
     bool AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const CDiskBlockPos* dbp, bool* fNewBlock) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
     // Block (dis)connection on a given view:
@@ -229,6 +232,7 @@ bool fPruneMode = false;
 bool fIsBareMultisigStd = DEFAULT_PERMIT_BAREMULTISIG;
 bool fRequireStandard = true;
 bool fCheckBlockIndex = false;
+bool fCheckIndexPoW = DEFAULT_CHECKINDEXPOW;
 bool fCheckpointsEnabled = DEFAULT_CHECKPOINTS_ENABLED;
 size_t nCoinCacheUsage = 5000 * 300;
 uint64_t nPruneTarget = 0;
@@ -295,6 +299,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 std::unique_ptr<CCoinsViewDB> pcoinsdbview;
+std::unique_ptr<CCoinsViewWriter> pcoinswriter;
 std::unique_ptr<CCoinsViewCache> pcoinsTip;
 std::unique_ptr<CBlockTreeDB> pblocktree;
 
@@ -1053,7 +1058,7 @@ bool GetTransaction(const uint256& hash, CTransactionRef& txOut, const Consensus
 // CBlock and CBlockIndex
 //
 
-static bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart)
+bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart)
 {
     // Open history file to append
     CAutoFile fileout(OpenBlockFile(pos), SER_DISK, CLIENT_VERSION);
@@ -1074,23 +1079,31 @@ static bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMes
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams, bool fCheckPOW)
 {
     block.SetNull();
     bool isBCDBlock = false;
     CBlockIndex* pindexPrev = nullptr;
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+    // A block still queued for writing is only in memory
+    if (std::shared_ptr<const CBlock> pending = g_block_writer.Get(pos)) {
+        block = *pending;
+    } else {
+        // Open history file to read
+        CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
 
-    // Read block
-    try {
-        filein >> block;
-    }
-    catch (const std::exception& e) {
-        return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+        // Read block
+        try {
+            filein >> block;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+        }
     }
+    if (!fCheckPOW)
+        return true;
+
     if (!block.hashPrevBlock.IsNull()){
         BlockMap::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
         if (mi == mapBlockIndex.end())
@@ -1107,24 +1120,37 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus:
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
+bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams, bool fCheckPOW)
 {
     CDiskBlockPos blockPos;
     {
         LOCK(cs_main);
         blockPos = pindex->GetBlockPos();
+        // Headers at BLOCK_VALID_TREE or better had their PoW verified on acceptance;
+        // matching the stored hash below is enough to know we read that same header.
+        if (!pindex->IsValid(BLOCK_VALID_TREE))
+            fCheckPOW = true;
     }
 
-    if (!ReadBlockFromDisk(block, blockPos, consensusParams))
+    if (!ReadBlockFromDisk(block, blockPos, consensusParams, false))
         return false;
     if (block.GetHash() != pindex->GetBlockHash())
         return error("ReadBlockFromDisk(CBlock&, CBlockIndex*): GetHash() doesn't match index for %s at %s",
                 pindex->ToString(), pindex->GetBlockPos().ToString());
+    if (fCheckPOW && !CheckProofOfWork(block.GetPoWHash(pindex->nHeight >= consensusParams.BCDHeight), block.nBits, consensusParams))
+        return error("ReadBlockFromDisk(CBlock&, CBlockIndex*): Errors in block header of %s at %s",
+                pindex->GetBlockHash().ToString(), blockPos.ToString());
     return true;
 }
 
 bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& message_start)
 {
+    if (std::shared_ptr<const CBlock> pending = g_block_writer.Get(pos)) {
+        block.clear();
+        CVectorWriter(SER_DISK, CLIENT_VERSION, block, 0) << *pending;
+        return true;
+    }
+
     CDiskBlockPos hpos = pos;
     hpos.nPos -= 8; // Seek back 8 bytes for meta header
     CAutoFile filein(OpenBlockFile(hpos, true), SER_DISK, CLIENT_VERSION);
@@ -1654,7 +1680,8 @@ void static FlushBlockFile(bool fFinalize = false)
     LOCK(cs_LastBlockFile);
 
     CDiskBlockPos posOld(nLastBlockFile, 0);
-    bool status = true;
+    // Blocks must be written before the files are truncated and committed.
+    bool status = g_block_writer.Flush();
 
     FILE *fileOld = OpenBlockFile(posOld);
     if (fileOld) {
@@ -1705,6 +1732,147 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+bool CPoWCheck::operator()() {
+    std::vector<uint256> vHash;
+    GetPoWHashes(headers, vBCDBlock, vHash);
+    bool fAllValid = true;
+    for (size_t i = 0; i < headers.size(); i++) {
+        const bool fValid = CheckProofOfWork(vHash[i], headers[i].nBits, *params);
+        if (pResults)
+            pResults[i] = fValid ? 1 : -1;
+        fAllValid &= fValid;
+    }
+    return fAllValid;
+}
+
+static CCheckQueue<CPoWCheck> powcheckqueue(16);
+
+void ThreadPoWCheck() {
+    RenameThread("bitcoin-powch");
+    powcheckqueue.Thread();
+}
+
+/** Run a batch of header PoW checks, on the PoW check threads when they are running. */
+static bool RunPoWChecks(std::vector<CPoWCheck>& vChecks)
+{
+    if (nScriptCheckThreads) {
+        CCheckQueueControl<CPoWCheck> control(&powcheckqueue);
+        control.Add(vChecks);
+        return control.Wait();
+    }
+    for (CPoWCheck& check : vChecks) {
+        if (!check())
+            return false;
+    }
+    return true;
+}
+
+bool CCoinFetch::operator()() {
+    try {
+        std::vector<Coin> vCoins;
+        std::vector<bool> vFound;
+        view->GetCoins(outpoints, vCoins, vFound);
+        for (size_t i = 0; i < outpoints.size(); i++) {
+            if (vFound[i]) coins[i] = std::move(vCoins[i]);
+        }
+        return true;
+    } catch (const std::exception&) {
+        // Leave it to the connecting thread, which reports database errors.
+        return false;
+    }
+}
+
+static CCheckQueue<CCoinFetch> coinfetchqueue(128);
+
+void ThreadCoinFetch() {
+    RenameThread("bitcoin-coinfetch");
+    coinfetchqueue.Thread();
+}
+
+/** Number of block inputs read from the coins database by one fetch. */
+static const size_t COINFETCH_CHUNK = 16;
+
+/**
+ * Read the inputs of a block that are neither in the coins cache nor
+ * created by the block itself from the coins database on the coin fetch
+ * threads, and add them to the cache, so that connecting the block does not
+ * wait for each read in turn.
+ */
+static void PrefetchBlockInputs(const CBlock& block)
+{
+    AssertLockHeld(cs_main);
+    if (!nScriptCheckThreads) return;
+
+    std::unordered_set<uint256, SaltedTxidHasher> setBlockTxids;
+    std::vector<COutPoint> vOutPoints;
+    for (const CTransactionRef& tx : block.vtx) {
+        if (!tx->IsCoinBase()) {
+            for (const CTxIn& txin : tx->vin) {
+                // Outputs of earlier transactions in the block are created by connecting it,
+                // and the database may not have the coins still being written yet.
+                if (setBlockTxids.count(txin.prevout.hash) || pcoinsTip->HaveCoinInCache(txin.prevout) ||
+                    (pcoinswriter && pcoinswriter->IsPending(txin.prevout))) continue;
+                vOutPoints.push_back(txin.prevout);
+            }
+        }
+        setBlockTxids.insert(tx->GetHash());
+    }
+    if (vOutPoints.empty()) return;
+
+    // Each fetch reads a run of neighbouring keys.
+    std::sort(vOutPoints.begin(), vOutPoints.end());
+    vOutPoints.erase(std::unique(vOutPoints.begin(), vOutPoints.end()), vOutPoints.end());
+    std::vector<Coin> vCoins(vOutPoints.size());
+    std::vector<CCoinFetch> vFetches;
+    for (size_t nStart = 0; nStart < vOutPoints.size(); nStart += COINFETCH_CHUNK) {
+        const size_t nEnd = std::min(vOutPoints.size(), nStart + COINFETCH_CHUNK);
+        std::vector<COutPoint> vChunk(vOutPoints.begin() + nStart, vOutPoints.begin() + nEnd);
+        vFetches.emplace_back(*pcoinsdbview, std::move(vChunk), &vCoins[nStart]);
+    }
+    CCheckQueueControl<CCoinFetch> control(&coinfetchqueue);
+    control.Add(vFetches);
+    control.Wait();
+
+    for (size_t i = 0; i < vOutPoints.size(); i++) {
+        if (!vCoins[i].IsSpent()) {
+            pcoinsTip->CacheCoin(vOutPoints[i], std::move(vCoins[i]));
+        }
+    }
+}
+
+/** Maximum number of headers whose PoW checks are handed to the check queue at once, bounding memory use. */
+static const size_t MAX_POWCHECK_CHUNK = 4096;
+
+/**
+ * Verify the proof of work of a set of block index entries, spreading the
+ * hashing over the PoW check threads when they are running.
+ * pprev must be set on every entry. On failure the offending entry is logged.
+ */
+static bool CheckBlockIndexProofOfWork(const std::vector<CBlockIndex*>& vIndex, const Consensus::Params& consensusParams)
+{
+    for (size_t nStart = 0; nStart < vIndex.size(); nStart += MAX_POWCHECK_CHUNK) {
+        boost::this_thread::interruption_point();
+        const size_t nEnd = std::min(vIndex.size(), nStart + MAX_POWCHECK_CHUNK);
+        std::vector<int8_t> vResults(nEnd - nStart, 0);
+        std::vector<CPoWCheck> vChecks;
+        vChecks.reserve((nEnd - nStart + MAX_POWCHECK_HEADERS - 1) / MAX_POWCHECK_HEADERS);
+        for (size_t i = nStart; i < nEnd; i++) {
+            const CBlockIndex* pindex = vIndex[i];
+            if ((i - nStart) % MAX_POWCHECK_HEADERS == 0)
+                vChecks.emplace_back(consensusParams, &vResults[i - nStart]);
+            vChecks.back().Add(pindex->GetBlockHeader(), pindex->nHeight >= consensusParams.BCDHeight);
+        }
+        if (!RunPoWChecks(vChecks)) {
+            for (size_t i = nStart; i < nEnd; i++) {
+                if (vResults[i - nStart] < 0)
+                    return error("%s: CheckProofOfWork failed: %s", __func__, vIndex[i]->ToString());
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
 // Protected by cs_main
 VersionBitsCache versionbitscache;
 
@@ -1810,6 +1978,7 @@ static unsigned int GetBlockScriptFlags(const CBlockIndex* pindex, const Consens
 
 static int64_t nTimeCheck = 0;
 static int64_t nTimeForks = 0;
+static int64_t nTimePrefetch = 0;
 static int64_t nTimeVerify = 0;
 static int64_t nTimeConnect = 0;
 static int64_t nTimeIndex = 0;
@@ -1996,6 +2165,10 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
     int64_t nTime2 = GetTimeMicros(); nTimeForks += nTime2 - nTime1;
     LogPrint(BCLog::BENCH, "    - Fork checks: %.2fms [%.2fs (%.2fms/blk)]\n", MILLI * (nTime2 - nTime1), nTimeForks * MICRO, nTimeForks * MILLI / nBlocksTotal);
 
+    PrefetchBlockInputs(block);
+    int64_t nTime2a = GetTimeMicros(); nTimePrefetch += nTime2a - nTime2;
+    LogPrint(BCLog::BENCH, "    - Prefetch inputs: %.2fms [%.2fs (%.2fms/blk)]\n", MILLI * (nTime2a - nTime2), nTimePrefetch * MICRO, nTimePrefetch * MILLI / nBlocksTotal);
+
     CBlockUndo blockundo;
 
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : nullptr);
@@ -2065,8 +2238,8 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
         }
         UpdateCoins(tx, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
     }
-    int64_t nTime3 = GetTimeMicros(); nTimeConnect += nTime3 - nTime2;
-    LogPrint(BCLog::BENCH, "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs (%.2fms/blk)]\n", (unsigned)block.vtx.size(), MILLI * (nTime3 - nTime2), MILLI * (nTime3 - nTime2) / block.vtx.size(), nInputs <= 1 ? 0 : MILLI * (nTime3 - nTime2) / (nInputs-1), nTimeConnect * MICRO, nTimeConnect * MILLI / nBlocksTotal);
+    int64_t nTime3 = GetTimeMicros(); nTimeConnect += nTime3 - nTime2a;
+    LogPrint(BCLog::BENCH, "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs (%.2fms/blk)]\n", (unsigned)block.vtx.size(), MILLI * (nTime3 - nTime2a), MILLI * (nTime3 - nTime2a) / block.vtx.size(), nInputs <= 1 ? 0 : MILLI * (nTime3 - nTime2a) / (nInputs-1), nTimeConnect * MICRO, nTimeConnect * MILLI / nBlocksTotal);
 
     CAmount blockReward = nFees + GetBlockSubsidy(pindex->nHeight, chainparams.GetConsensus());
     if (block.vtx[0]->GetValueOut() > blockReward)
@@ -2149,7 +2322,9 @@ bool static FlushStateToDisk(const CChainParams& chainparams, CValidationState &
             nLastFlush = nNow;
         }
         int64_t nMempoolSizeMax = gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
-        int64_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+        // Coins still being written in the background count against the cache size.
+        const int64_t nPendingUsage = pcoinswriter ? pcoinswriter->DynamicMemoryUsage() : 0;
+        int64_t cacheSize = pcoinsTip->DynamicMemoryUsage() + nPendingUsage;
         int64_t nTotalSpace = nCoinCacheUsage + std::max<int64_t>(nMempoolSizeMax - nMempoolUsage, 0);
         // The cache is large and we're within 10% and 10 MiB of the limit, but we have time now (not in the middle of a block processing).
         bool fCacheLarge = mode == FlushStateMode::PERIODIC && cacheSize > std::max((9 * nTotalSpace) / 10, nTotalSpace - MAX_BLOCK_COINSDB_USAGE * 1024 * 1024);
@@ -2200,9 +2375,23 @@ bool static FlushStateToDisk(const CChainParams& chainparams, CValidationState &
             // overwrite one. Still, use a conservative safety factor of 2.
             if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
                 return state.Error("out of disk space");
-            // Flush the chainstate (which may refer to block index entries).
-            if (!pcoinsTip->Flush())
+            // Flush the chainstate (which may refer to block index entries),
+            // keeping the coins cached so the next blocks still find them.
+            // This hands the changes to the background writer, after waiting
+            // for it to finish the previous flush.
+            if (!pcoinsTip->Sync())
+                return AbortNode(state, "Failed to write to coin database");
+            // Callers of an explicit flush expect the database to be up to
+            // date, and pruned block files can no longer be replayed.
+            if ((mode == FlushStateMode::ALWAYS || fFlushForPrune) && pcoinswriter && !pcoinswriter->Wait())
                 return AbortNode(state, "Failed to write to coin database");
+            // Make room for new coins by evicting those not used for longest,
+            // leaving room for the coins being written. Those are still
+            // served from memory by the writer.
+            if (fCacheLarge || fCacheCritical) {
+                const int64_t nPendingUsage = pcoinswriter ? pcoinswriter->DynamicMemoryUsage() : 0;
+                pcoinsTip->Trim(std::max<int64_t>(nTotalSpace * COINS_CACHE_TRIM_PERCENT / 100 - nPendingUsage, 0));
+            }
             nLastFlush = nNow;
             full_flush_completed = true;
         }
@@ -2601,8 +2790,16 @@ bool CChainState::ActivateBestChainStep(CValidationState& state, const CChainPar
         nHeight = nTargetHeight;
 
         // Connect new blocks.
-        for (CBlockIndex *pindexConnect : reverse_iterate(vpindexToConnect)) {
-            if (!ConnectTip(state, chainparams, pindexConnect, pindexConnect == pindexMostWork ? pblock : std::shared_ptr<const CBlock>(), connectTrace, disconnectpool)) {
+        for (auto it = vpindexToConnect.rbegin(); it != vpindexToConnect.rend(); ++it) {
+            CBlockIndex *pindexConnect = *it;
+            std::shared_ptr<const CBlock> pblockConnect = pindexConnect == pindexMostWork ? pblock : g_block_prefetcher.Get(pindexConnect->GetBlockHash());
+            // Read the next block and warm up its inputs while this one connects.
+            if (std::next(it) != vpindexToConnect.rend()) {
+                const CBlockIndex* pindexNext = *std::next(it);
+                if ((pindexNext != pindexMostWork || !pblock) && (pindexNext->nStatus & BLOCK_HAVE_DATA))
+                    g_block_prefetcher.Prefetch(pindexNext->GetBlockHash(), pindexNext->GetBlockPos(), pcoinsdbview.get(), chainparams.GetConsensus());
+            }
+            if (!ConnectTip(state, chainparams, pindexConnect, pblockConnect, connectTrace, disconnectpool)) {
                 if (state.IsInvalid()) {
                     // The block violates a consensus rule.
                     if (!state.CorruptionPossible()) {
@@ -3259,14 +3456,14 @@ std::vector<unsigned char> GenerateCoinbaseCommitment(CBlock& block, const CBloc
  *  in ConnectBlock().
  *  Note that -reindex-chainstate skips the validation that happens here!
  */
-static bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& params, const CBlockIndex* pindexPrev, int64_t nAdjustedTime)
+static bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& params, const CBlockIndex* pindexPrev, int64_t nAdjustedTime, bool fCheckBits = true)
 {
     assert(pindexPrev != nullptr);
     const int nHeight = pindexPrev->nHeight + 1;
 
     // Check proof of work
     const Consensus::Params& consensusParams = params.GetConsensus();
-    if (block.nBits != GetNextWorkRequired(pindexPrev, &block, consensusParams))
+    if (fCheckBits && block.nBits != GetNextWorkRequired(pindexPrev, &block, consensusParams))
         return state.DoS(100, false, REJECT_INVALID, "bad-diffbits", false, "incorrect proof of work");
 
     // Check against checkpoints
@@ -3386,7 +3583,7 @@ static bool ContextualCheckBlock(const CBlock& block, CValidationState& state, c
     return true;
 }
 
-bool CChainState::AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex)
+bool CChainState::AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fCheckPOW)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
@@ -3417,13 +3614,13 @@ bool CChainState::AcceptBlockHeader(const CBlockHeader& block, CValidationState&
 		
         if ((block.nVersion & VERSIONBITS_FORK_BCD) && pindexPrev->nHeight + 1 >= chainparams.GetConsensus().BCDHeight)
             isBCDBlock = true;
-        if (!CheckBlockHeader(block, state, chainparams.GetConsensus(), true, isBCDBlock))
+        if (!CheckBlockHeader(block, state, chainparams.GetConsensus(), fCheckPOW, isBCDBlock))
             return error("%s: Consensus::CheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
 
 
         if (pindexPrev->nStatus & BLOCK_FAILED_MASK)
             return state.DoS(100, error("%s: prev block invalid", __func__), REJECT_INVALID, "bad-prevblk");
-        if (!ContextualCheckBlockHeader(block, state, chainparams, pindexPrev, GetAdjustedTime()))
+        if (!ContextualCheckBlockHeader(block, state, chainparams, pindexPrev, GetAdjustedTime(), fCheckPOW))
             return error("%s: Consensus::ContextualCheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
 
         // If the previous block index isn't valid, determine if it descends from any block which
@@ -3444,8 +3641,11 @@ bool CChainState::AcceptBlockHeader(const CBlockHeader& block, CValidationState&
             }
         }
     }
-    if (pindex == nullptr)
+    if (pindex == nullptr) {
         pindex = AddToBlockIndex(block);
+        // The header's PoW was verified above or by the caller; remember that so it is not rehashed on the next startup.
+        pindex->nStatus |= BLOCK_POW_VALID;
+    }
 
     if (ppindex)
         *ppindex = pindex;
@@ -3455,15 +3655,79 @@ bool CChainState::AcceptBlockHeader(const CBlockHeader& block, CValidationState&
     return true;
 }
 
+/**
+ * Verify the proof of work of a batch of headers without holding cs_main during
+ * the hashing. Only the leading run of headers that connects to a known block,
+ * and whose nBits are the required ones, is considered; headers already in
+ * mapBlockIndex are skipped. The required nBits of the whole run are computed
+ * together, sliding the difficulty window along it. The headers are hashed
+ * MAX_POWCHECK_HEADERS at a time; the first run is hashed on this thread so a
+ * junk batch is rejected before the rest is spread over the PoW check threads. Returns, per header, whether its PoW was verified here.
+ * Everything else (including any header with bad PoW) is left for
+ * AcceptBlockHeader to check and report.
+ */
+static std::vector<bool> CheckHeadersProofOfWork(const std::vector<CBlockHeader>& headers, const Consensus::Params& consensusParams) LOCKS_EXCLUDED(cs_main)
+{
+    std::vector<bool> vChecked(headers.size(), false);
+    if (headers.empty())
+        return vChecked;
+
+    std::vector<uint256> vHash;
+    vHash.reserve(headers.size());
+    for (const CBlockHeader& header : headers)
+        vHash.push_back(header.GetHash());
+
+    std::vector<size_t> vPos;
+    std::vector<int8_t> vResults(headers.size(), 0);
+    std::vector<CPoWCheck> vChecks;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(headers[0].hashPrevBlock);
+        if (mi == mapBlockIndex.end())
+            return vChecked;
+        // Past the leading run the required bits are meaningless, but they are cheap
+        // to compute and never looked at.
+        const std::vector<unsigned int> vBits = GetNextWorkRequiredBatch(mi->second, headers, consensusParams);
+        int nHeight = mi->second->nHeight;
+        for (size_t i = 0; i < headers.size(); i++) {
+            if (i > 0 && headers[i].hashPrevBlock != vHash[i - 1])
+                break;
+            if (headers[i].nBits != vBits[i] || !CheckProofOfWorkTarget(headers[i].nBits, consensusParams))
+                break;
+            nHeight++;
+            if (mapBlockIndex.count(vHash[i]))
+                continue;
+            bool isBCDBlock = (headers[i].nVersion & VERSIONBITS_FORK_BCD) && nHeight >= consensusParams.BCDHeight;
+            if (vPos.size() % MAX_POWCHECK_HEADERS == 0)
+                vChecks.emplace_back(consensusParams, &vResults[vPos.size()]);
+            vChecks.back().Add(headers[i], isBCDBlock);
+            vPos.push_back(i);
+        }
+    }
+
+    if (!vChecks.empty() && vChecks.front()()) {
+        vChecks.erase(vChecks.begin());
+        if (!vChecks.empty())
+            RunPoWChecks(vChecks);
+    }
+
+    // Checks skipped after a failure stay unverified, like the one that failed.
+    for (size_t j = 0; j < vPos.size(); j++)
+        vChecked[vPos[j]] = vResults[j] > 0;
+    return vChecked;
+}
+
 // Exposed wrapper for AcceptBlockHeader
 bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& headers, CValidationState& state, const CChainParams& chainparams, const CBlockIndex** ppindex, CBlockHeader *first_invalid)
 {
     if (first_invalid != nullptr) first_invalid->SetNull();
+    const std::vector<bool> vPoWChecked = CheckHeadersProofOfWork(headers, chainparams.GetConsensus());
     {
         LOCK(cs_main);
-        for (const CBlockHeader& header : headers) {
+        for (size_t i = 0; i < headers.size(); i++) {
+            const CBlockHeader& header = headers[i];
             CBlockIndex *pindex = nullptr; // Use a temp pindex instead of ppindex to avoid a const_cast
-            if (!g_chainstate.AcceptBlockHeader(header, state, chainparams, &pindex)) {
+            if (!g_chainstate.AcceptBlockHeader(header, state, chainparams, &pindex, !vPoWChecked[i])) {
                 if (first_invalid) *first_invalid = header;
                 return false;
             }
@@ -3477,7 +3741,8 @@ bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& headers, CValidatio
 }
 
 /** Store block on disk. If dbp is non-nullptr, the file is known to already reside on disk */
-static CDiskBlockPos SaveBlockToDisk(const CBlock& block, int nHeight, const CChainParams& chainparams, const CDiskBlockPos* dbp) {
+static CDiskBlockPos SaveBlockToDisk(const std::shared_ptr<const CBlock>& pblock, int nHeight, const CChainParams& chainparams, const CDiskBlockPos* dbp) {
+    const CBlock& block = *pblock;
     unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
     CDiskBlockPos blockPos;
     if (dbp != nullptr)
@@ -3487,7 +3752,10 @@ static CDiskBlockPos SaveBlockToDisk(const CBlock& block, int nHeight, const CCh
         return CDiskBlockPos();
     }
     if (dbp == nullptr) {
-        if (!WriteBlockToDisk(block, blockPos, chainparams.MessageStart())) {
+        // The writer thread fills in the record at the position found above, the
+        // block data starts after its 8 byte header.
+        blockPos.nPos += 8;
+        if (!g_block_writer.Write(pblock, blockPos, chainparams.MessageStart())) {
             AbortNode("Failed to write block");
             return CDiskBlockPos();
         }
@@ -3558,7 +3826,7 @@ bool CChainState::AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CVali
     // Write block to history file
     if (fNewBlock) *fNewBlock = true;
     try {
-        CDiskBlockPos blockPos = SaveBlockToDisk(block, pindex->nHeight, chainparams, dbp);
+        CDiskBlockPos blockPos = SaveBlockToDisk(pblock, pindex->nHeight, chainparams, dbp);
         if (blockPos.IsNull()) {
             state.Error(strprintf("%s: Failed to find position to write new block to disk", __func__));
             return false;
@@ -3867,11 +4135,26 @@ CBlockIndex * CChainState::InsertBlockIndex(const uint256& hash)
 
 bool CChainState::LoadBlockIndex(const Consensus::Params& consensus_params, CBlockTreeDB& blocktree)
 {
-    if (!blocktree.LoadBlockIndexGuts(consensus_params, [this](const uint256& hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main) { return this->InsertBlockIndex(hash); }))
+    std::vector<CBlockIndex*> vPoWUnchecked;
+    if (!blocktree.LoadBlockIndexGuts(consensus_params, [this](const uint256& hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main) { return this->InsertBlockIndex(hash); }, fCheckIndexPoW, vPoWUnchecked))
         return false;
 
     boost::this_thread::interruption_point();
 
+    if (!vPoWUnchecked.empty()) {
+        LogPrintf("%s: verifying proof of work of %u block index entries\n", __func__, vPoWUnchecked.size());
+        int64_t nStart = GetTimeMillis();
+        if (!CheckBlockIndexProofOfWork(vPoWUnchecked, consensus_params))
+            return false;
+        for (CBlockIndex* pindex : vPoWUnchecked) {
+            if (!(pindex->nStatus & BLOCK_POW_VALID)) {
+                pindex->nStatus |= BLOCK_POW_VALID;
+                setDirtyBlockIndex.insert(pindex);
+            }
+        }
+        LogPrintf("%s: proof of work verified in %dms\n", __func__, GetTimeMillis() - nStart);
+    }
+
     // Calculate nChainWork
     std::vector<std::pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
@@ -4413,8 +4696,9 @@ bool CChainState::LoadGenesisBlock(const CChainParams& chainparams)
         return true;
 
     try {
-        const CBlock& block = chainparams.GenesisBlock();
-        CDiskBlockPos blockPos = SaveBlockToDisk(block, 0, chainparams, nullptr);
+        std::shared_ptr<const CBlock> pblock = std::make_shared<const CBlock>(chainparams.GenesisBlock());
+        const CBlock& block = *pblock;
+        CDiskBlockPos blockPos = SaveBlockToDisk(pblock, 0, chainparams, nullptr);
         if (blockPos.IsNull())
             return error("%s: writing genesis block to disk failed", __func__);
         CBlockIndex *pindex = AddToBlockIndex(block);
@@ -35,6 +35,7 @@ class CBlockIndex;
 class CBlockTreeDB;
 class CChainParams;
 class CCoinsViewDB;
+class CCoinsViewWriter;
 class CInv;
 class CConnman;
 class CScriptCheck;
@@ -81,10 +82,19 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
+/** Number of blocks that can be requested at any given time from a single peer, until
+ *  its throughput is known. This is also the smallest per-peer download window. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Largest per-peer download window, for peers that deliver blocks much faster than their ping time. */
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER_ADAPTIVE = 128;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
+/** Minimum time in microseconds a peer must stall block download progress before the block it
+ *  stalls on is requested from another peer. The actual timeout depends on the staller's speed. */
+static const int64_t BLOCK_STALLING_REASSIGN_TIMEOUT_MIN = 250000;
+/** Maximum time in microseconds before the block a peer stalls on is requested from another peer.
+ *  Kept below BLOCK_STALLING_TIMEOUT so the block is reassigned before the staller is disconnected. */
+static const int64_t BLOCK_STALLING_REASSIGN_TIMEOUT_MAX = 1000000 * BLOCK_STALLING_TIMEOUT / 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
  *  less than this number, we reached its tip. Changing this value is a protocol upgrade. */
 static const unsigned int MAX_HEADERS_RESULTS = 2000;
@@ -95,9 +105,10 @@ static const int MAX_CMPCTBLOCK_DEPTH = 5;
 static const int MAX_BLOCKTXN_DEPTH = 10;
 /** Size of the "block download window": how far ahead of our current height do we fetch?
  *  Larger windows tolerate larger download speed differences between peer, but increase the potential
- *  degree of disordering of blocks on disk (which make reindexing and pruning harder). We'll probably
- *  want to make this a per-peer adaptive value at some point. */
+ *  degree of disordering of blocks on disk (which make reindexing and pruning harder). Unless pruning,
+ *  the window of a peer grows with its in-flight window, up to MAX_BLOCK_DOWNLOAD_WINDOW. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+static const unsigned int MAX_BLOCK_DOWNLOAD_WINDOW = 4096;
 /** Time to wait (in seconds) between writing blocks/block index to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
@@ -160,6 +171,7 @@ extern int nScriptCheckThreads;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
 extern bool fCheckBlockIndex;
+extern bool fCheckIndexPoW;
 extern bool fCheckpointsEnabled;
 extern size_t nCoinCacheUsage;
 /** A fee rate smaller than this is considered zero fee (for relaying, mining and transaction creation) */
@@ -196,6 +208,8 @@ static const unsigned int NODE_NETWORK_LIMITED_MIN_BLOCKS = 288;
 
 static const signed int DEFAULT_CHECKBLOCKS = 6;
 static const unsigned int DEFAULT_CHECKLEVEL = 3;
+/** Default for -checkindexpow, rehash every block index entry at startup */
+static const bool DEFAULT_CHECKINDEXPOW = false;
 
 // Require that user allocate at least 550MB for block & undo files (blk???.dat and rev???.dat)
 // At 1MB per block, 288 blocks = 288MB.
@@ -262,6 +276,10 @@ bool LoadChainTip(const CChainParams& chainparams) EXCLUSIVE_LOCKS_REQUIRED(cs_m
 void UnloadBlockIndex();
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the header proof-of-work checking thread */
+void ThreadPoWCheck();
+/** Run an instance of the block input prefetching thread */
+void ThreadCoinFetch();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
@@ -384,13 +402,87 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+/** Number of headers whose proof of work one CPoWCheck verifies, hashing them together. */
+static const size_t MAX_POWCHECK_HEADERS = 8;
+
+/**
+ * Closure representing the proof-of-work verification of a run of headers,
+ * hashed together so the multi-way X13-SM3 implementations are used.
+ * The headers are stored by value so checks can outlive the caller's buffers.
+ * The result for the i-th header is stored in pResults[i], if set: 1 if its
+ * proof of work is valid and -1 if not. A check skipped by the queue after
+ * another one failed leaves them unchanged.
+ */
+class CPoWCheck
+{
+private:
+    std::vector<CBlockHeader> headers;
+    std::vector<bool> vBCDBlock;
+    const Consensus::Params *params;
+    int8_t *pResults;
+
+public:
+    CPoWCheck(): params(nullptr), pResults(nullptr) {}
+    explicit CPoWCheck(const Consensus::Params& paramsIn, int8_t* pResultsIn = nullptr) :
+        params(&paramsIn), pResults(pResultsIn) { headers.reserve(MAX_POWCHECK_HEADERS); vBCDBlock.reserve(MAX_POWCHECK_HEADERS); }
+
+    void Add(const CBlockHeader& header, bool isBCDBlock)
+    {
+        headers.push_back(header);
+        vBCDBlock.push_back(isBCDBlock);
+    }
+
+    size_t size() const { return headers.size(); }
+
+    bool operator()();
+
+    void swap(CPoWCheck &check) {
+        headers.swap(check.headers);
+        vBCDBlock.swap(check.vBCDBlock);
+        std::swap(params, check.params);
+        std::swap(pResults, check.pResults);
+    }
+};
+
+/**
+ * Closure representing the read of some block inputs from the coins database.
+ * The coins not found, or all of them if the read fails, are left spent.
+ */
+class CCoinFetch
+{
+private:
+    const CCoinsViewDB *view;
+    std::vector<COutPoint> outpoints;
+    Coin *coins;
+
+public:
+    CCoinFetch(): view(nullptr), coins(nullptr) {}
+    CCoinFetch(const CCoinsViewDB& viewIn, std::vector<COutPoint>&& outpointsIn, Coin* coinsIn) :
+        view(&viewIn), outpoints(std::move(outpointsIn)), coins(coinsIn) { }
+
+    bool operator()();
+
+    void swap(CCoinFetch &check) {
+        std::swap(view, check.view);
+        outpoints.swap(check.outpoints);
+        std::swap(coins, check.coins);
+    }
+};
+
 /** Initializes the script-execution cache */
 void InitScriptExecutionCache();
 
 
 /** Functions for disk access for blocks */
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
-bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/** Write a block record at pos, which is updated to where the block data starts. */
+bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams, bool fCheckPOW = true);
+/**
+ * Read the block of an index entry and check it hashes to the indexed block hash.
+ * The X13-SM3 proof of work is only recomputed if fCheckPOW is set or the entry is
+ * not yet BLOCK_VALID_TREE.
+ */
+bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams, bool fCheckPOW = false);
 bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& message_start);
 bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& message_start);
 
@@ -457,6 +549,9 @@ extern CChain& chainActive;
 /** Global variable that points to the coins database (protected by cs_main) */
 extern std::unique_ptr<CCoinsViewDB> pcoinsdbview;
 
+/** Global variable that points to the background writer in front of the coins database (protected by cs_main) */
+extern std::unique_ptr<CCoinsViewWriter> pcoinswriter;
+
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern std::unique_ptr<CCoinsViewCache> pcoinsTip;
 